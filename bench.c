@@ -0,0 +1,589 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+
+#include "protocol.h"
+#include "checksum.h"
+#include "histogram.h"
+
+// Load generator for the file sharing server. Every simulated client is a thread with
+// its own persistent v2 connection that issues one request after another (a closed loop)
+// against a fixed set of files, picking downloads or uploads in a configurable mix and the
+// file from a Zipf distribution, so a few files are hot. Latencies are recorded per
+// request from sending the header to reading the response, in histogram.h histograms.
+// The results go to stdout (or -o) as JSON; a summary goes to stderr.
+
+#define MAX_CLIENTS 4096
+#define MAX_FILES (1 << 20)
+
+enum { OP_DOWNLOAD, OP_UPLOAD, OP_KINDS };
+static const char* const op_names[OP_KINDS] = { "download", "upload" };
+
+typedef struct {
+    FssHistogram latency;        // Nanoseconds
+    uint64_t bytes;              // File bytes moved
+    uint64_t errors;             // Failed requests, broken connections included
+    uint64_t busy;               // Requests the server turned away with FSS_STATUS_BUSY
+} OpStats;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    uint64_t rng;
+    int socket;
+    uint32_t frame_size;
+    bool checksum;               // Server granted FSS_FLAG_CHECKSUM
+    uint32_t next_request_id;
+    char *buff;                  // frame_size bytes (+ trailer) for receiving
+    OpStats stats[OP_KINDS];
+    uint64_t reconnects;
+} BenchClient;
+
+// Set from the command line
+const char* g_host = "127.0.0.1";
+int g_port = 8080;
+int g_clients = 16;
+int g_duration = 10;             // Seconds measured
+int g_warmup = 1;                // Seconds run before measuring starts
+int g_download_percent = 90;
+int g_files = 100;
+uint64_t g_size_min = 64 << 10;
+uint64_t g_size_max = 4 << 20;
+double g_zipf = 0.99;
+uint32_t g_requested_frame_size = FSS_DEFAULT_FRAME_SIZE;
+bool g_use_checksum = false;
+bool g_populate = true;
+const char* g_prefix = "bench";
+const char* g_output = NULL;
+int g_stalled = 0;               // Connections that start a request and then stall (-S)
+
+uint64_t *g_file_sizes;          // Size of every file, fixed when it is first uploaded
+double *g_zipf_cdf;              // Cumulative popularity of files 0..i
+char *g_payload;                 // Upload data, FSS_MAX_FRAME_SIZE random bytes
+
+atomic_bool g_measuring;
+atomic_bool g_stop;
+
+static double next_uniform(uint64_t* state) {
+    return (fss_bench_random(state) >> 11) * (1.0 / 9007199254740992.0); // [0, 1)
+}
+
+// --- Workload ---
+
+// Sizes are drawn log-uniformly between g_size_min and g_size_max, so small and large
+// files are equally common by order of magnitude.
+static uint64_t pick_file_size(uint64_t* rng) {
+    if (g_size_min == g_size_max) return g_size_min;
+    double low = log((double) g_size_min), high = log((double) g_size_max);
+    return (uint64_t) exp(low + next_uniform(rng) * (high - low));
+}
+
+// Popularity of file i is proportional to 1 / (i + 1)^g_zipf; 0 makes every file equally hot.
+static int build_zipf_table(void) {
+    g_zipf_cdf = malloc(sizeof(double) * g_files);
+    if (g_zipf_cdf == NULL) return -1;
+    double sum = 0;
+    for (int i = 0; i < g_files; i++) {
+        sum += 1.0 / pow(i + 1, g_zipf);
+        g_zipf_cdf[i] = sum;
+    }
+    for (int i = 0; i < g_files; i++) g_zipf_cdf[i] /= sum;
+    return 0;
+}
+
+static int pick_file(uint64_t* rng) {
+    double u = next_uniform(rng);
+    int lo = 0, hi = g_files - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (g_zipf_cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static void file_name(int index, char* out, size_t out_size) {
+    snprintf(out, out_size, "%s-%d.dat", g_prefix, index);
+}
+
+// --- Wire protocol ---
+
+// A zero-length MSG_WAITALL recv would wait for data, so it is not issued at all
+static int recv_all(int socket, void* buf, size_t len) {
+    return len == 0 || recv(socket, buf, len, MSG_WAITALL) == (ssize_t) len ? 0 : -1;
+}
+
+// Opens the client's connection and runs the handshake. Returns 0 on success, -1 on failure.
+static int bench_connect(BenchClient* client) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(g_port);
+    if (inet_pton(AF_INET, g_host, &addr.sin_addr) != 1 ||
+        connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    FssHandshake hello;
+    hello.magic = htonl(FSS_V2_MAGIC);
+    hello.version = htonl(FSS_PROTOCOL_VERSION);
+    hello.frame_size = htonl(fss_clamp_frame_size(g_requested_frame_size));
+    hello.flags = htonl(FSS_FLAG_PERSISTENT | (g_use_checksum ? FSS_FLAG_CHECKSUM : 0));
+    FssHandshake reply;
+    if (send(sock, &hello, sizeof(hello), 0) != sizeof(hello) || recv_all(sock, &reply, sizeof(reply)) < 0 ||
+        ntohl(reply.magic) != FSS_V2_MAGIC || !(ntohl(reply.flags) & FSS_FLAG_PERSISTENT) ||
+        ntohl(reply.frame_size) < FSS_MIN_FRAME_SIZE || ntohl(reply.frame_size) > FSS_MAX_FRAME_SIZE) {
+        close(sock);
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (g_stalled > 0) {
+        // Requests starved by the stalled connections fail instead of hanging the run
+        struct timeval timeout = { .tv_sec = g_duration, .tv_usec = 0 };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+    client->socket = sock;
+    client->frame_size = ntohl(reply.frame_size);
+    client->checksum = (ntohl(reply.flags) & FSS_FLAG_CHECKSUM) != 0;
+    client->next_request_id = 1;
+    return 0;
+}
+
+static int send_request(BenchClient* client, const char* command, const char* filename) {
+    int command_len = strlen(command) + 1;
+    int filename_len = strlen(filename) + 1;
+    int command_len_n = htonl(command_len);
+    int filename_len_n = htonl(filename_len);
+    struct iovec iov[4] = {
+        { &command_len_n, sizeof(int) }, { (void*) command, command_len },
+        { &filename_len_n, sizeof(int) }, { (void*) filename, filename_len },
+    };
+    ssize_t total = sizeof(int) * 2 + command_len + filename_len;
+    return writev(client->socket, iov, 4) == total ? 0 : -1;
+}
+
+// Reads the response of the request just sent. Returns the status, or -1 if the
+// connection broke or answered out of order.
+static int64_t recv_response(BenchClient* client) {
+    FssResponse response;
+    if (recv_all(client->socket, &response, sizeof(response)) < 0 ||
+        ntohl(response.request_id) != client->next_request_id) {
+        return -1;
+    }
+    client->next_request_id++;
+    return ntohl(response.status);
+}
+
+// Sends one upload of size bytes. Returns the response status, or -1 if the connection broke.
+static int64_t do_upload(BenchClient* client, const char* filename, uint64_t size) {
+    if (send_request(client, "upload", filename) < 0) return -1;
+    uint64_t sent = 0;
+    uint32_t file_crc = 0;
+    while (sent < size) {
+        uint32_t len = size - sent < client->frame_size ? (uint32_t)(size - sent) : client->frame_size;
+        int rc;
+        if (client->checksum) {
+            uint32_t crc = fss_crc32c(0, g_payload, len);
+            file_crc = fss_crc32c_combine(file_crc, crc, len);
+            rc = fss_send_frame_crc(client->socket, g_payload, len, 0, crc);
+        } else {
+            rc = fss_send_frame(client->socket, g_payload, len);
+        }
+        if (rc < 0) return -1;
+        sent += len;
+    }
+    if ((client->checksum ? fss_send_frame_crc(client->socket, NULL, 0, 0, file_crc)
+                          : fss_send_frame(client->socket, NULL, 0)) < 0) {
+        return -1;
+    }
+    return recv_response(client);
+}
+
+// Fetches one file and drops the data. Returns the response status (FSS_STATUS_CORRUPT
+// for data that failed its checksums), or -1 if the connection broke. *bytes gets the
+// file size.
+static int64_t do_download(BenchClient* client, const char* filename, uint64_t* bytes) {
+    *bytes = 0;
+    if (send_request(client, "download", filename) < 0) return -1;
+    int64_t status = recv_response(client);
+    if (status != FSS_STATUS_OK) return status;
+
+    size_t trailer = client->checksum ? sizeof(uint32_t) : 0;
+    uint32_t file_crc = 0;
+    bool corrupt = false;
+    while (true) {
+        uint32_t len_n;
+        if (recv_all(client->socket, &len_n, sizeof(len_n)) < 0) return -1;
+        uint32_t len = ntohl(len_n);
+        if (len > client->frame_size || recv_all(client->socket, client->buff, len + trailer) < 0) return -1;
+        if (client->checksum) {
+            uint32_t crc_n;
+            memcpy(&crc_n, client->buff + len, sizeof(crc_n));
+            uint32_t crc = len > 0 ? fss_crc32c(0, client->buff, len) : file_crc;
+            if (crc != ntohl(crc_n)) corrupt = true;
+            file_crc = fss_crc32c_combine(file_crc, crc, len);
+        }
+        if (len == 0) break;
+        *bytes += len;
+    }
+    return corrupt ? FSS_STATUS_CORRUPT : FSS_STATUS_OK;
+}
+
+static void bench_disconnect(BenchClient* client) {
+    if (client->socket >= 0) close(client->socket);
+    client->socket = -1;
+}
+
+// --- Clients ---
+
+// Uploads the files this client is responsible for (every g_clients-th), so every
+// download finds its file. Returns 0 on success, -1 on failure.
+static int populate_files(BenchClient* client) {
+    char filename[256];
+    for (int i = client->id; i < g_files; i += g_clients) {
+        file_name(i, filename, sizeof(filename));
+        if (do_upload(client, filename, g_file_sizes[i]) != FSS_STATUS_OK) {
+            fprintf(stderr, "bench: uploading %s failed\n", filename);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void* ClientThread(void* arg) {
+    BenchClient *client = (BenchClient*) arg;
+    char filename[256];
+
+    while (!atomic_load(&g_stop)) {
+        if (client->socket < 0) {
+            if (bench_connect(client) < 0) {
+                usleep(10000); // Server overloaded or gone; do not spin
+                continue;
+            }
+            client->reconnects++;
+        }
+
+        int op = (int)(fss_bench_random(&client->rng) % 100) < g_download_percent ? OP_DOWNLOAD : OP_UPLOAD;
+        int file = pick_file(&client->rng);
+        file_name(file, filename, sizeof(filename));
+
+        uint64_t start = fss_bench_now_ns();
+        uint64_t bytes = g_file_sizes[file];
+        int64_t status = op == OP_DOWNLOAD ? do_download(client, filename, &bytes) : do_upload(client, filename, bytes);
+        uint64_t latency = fss_bench_now_ns() - start;
+
+        if (status < 0) bench_disconnect(client);
+        if (!atomic_load(&g_measuring) || atomic_load(&g_stop)) continue;
+
+        OpStats *stats = &client->stats[op];
+        if (status == FSS_STATUS_OK) {
+            fss_hist_record(&stats->latency, latency);
+            stats->bytes += bytes;
+        } else if (status == FSS_STATUS_BUSY) {
+            stats->busy++;
+        } else {
+            stats->errors++;
+        }
+    }
+    bench_disconnect(client);
+    return NULL;
+}
+
+// --- Stalled connections ---
+
+// Opens a connection that starts a request and then stops, as a stuck or hostile client
+// would. Even ones announce an upload frame and never send its payload; odd ones pipeline
+// downloads of the largest file and never read them. Each holds a server worker until the
+// server gives up on it. Returns the socket, or -1.
+static int open_stalled(int index, int largest) {
+    BenchClient client;
+    memset(&client, 0, sizeof(client));
+    if (bench_connect(&client) < 0) return -1;
+
+    char filename[256];
+    int rc = 0;
+    if (index % 2 == 0) {
+        snprintf(filename, sizeof(filename), "%s-stalled-%d.dat", g_prefix, index);
+        uint32_t len_n = htonl(client.frame_size);
+        rc = send_request(&client, "upload", filename);
+        if (rc == 0 && send(client.socket, &len_n, sizeof(len_n), 0) != sizeof(len_n)) rc = -1;
+        if (rc == 0 && send(client.socket, g_payload, 1024, 0) != 1024) rc = -1;
+    } else {
+        // Enough data that the socket buffers fill up and the server's sends block
+        file_name(largest, filename, sizeof(filename));
+        uint64_t queued = 0;
+        for (int i = 0; i < 1024 && queued < (256ULL << 20) && rc == 0; i++) {
+            rc = send_request(&client, "download", filename);
+            queued += g_file_sizes[largest] + 1;
+        }
+    }
+    if (rc < 0) {
+        bench_disconnect(&client);
+        return -1;
+    }
+    return client.socket;
+}
+
+// Whether the server has closed a stalled connection. Reads (and drops) whatever it sent.
+static bool stalled_was_dropped(int socket, char* buff) {
+    while (true) {
+        ssize_t n = recv(socket, buff, FSS_MAX_FRAME_SIZE, MSG_DONTWAIT);
+        if (n == 0) return true;
+        if (n < 0) return errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+    }
+}
+
+// --- Results ---
+
+static void merge_stats(OpStats* into, const OpStats* from) {
+    fss_hist_merge(&into->latency, &from->latency);
+    into->bytes += from->bytes;
+    into->errors += from->errors;
+    into->busy += from->busy;
+}
+
+static void print_op_json(FILE* out, const char* name, const OpStats* stats, double seconds, bool last) {
+    const FssHistogram *h = &stats->latency;
+    fprintf(out,
+            "    \"%s\": {\"requests\": %llu, \"errors\": %llu, \"busy\": %llu, \"bytes\": %llu, "
+            "\"requests_per_sec\": %.1f, \"mib_per_sec\": %.2f, \"latency_us\": {\"mean\": %.1f, "
+            "\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}%s\n",
+            name, (unsigned long long) h->total, (unsigned long long) stats->errors,
+            (unsigned long long) stats->busy, (unsigned long long) stats->bytes,
+            h->total / seconds, stats->bytes / seconds / (1 << 20),
+            fss_hist_mean(h) / 1000,
+            fss_hist_percentile(h, 0.50) / 1000.0, fss_hist_percentile(h, 0.90) / 1000.0,
+            fss_hist_percentile(h, 0.99) / 1000.0, fss_hist_percentile(h, 0.999) / 1000.0, h->max / 1000.0,
+            last ? "" : ",");
+}
+
+static void print_results(FILE* out, BenchClient* clients, double seconds) {
+    OpStats *totals = calloc(OP_KINDS + 1, sizeof(OpStats)); // Per kind, then all together
+    if (totals == NULL) return;
+    for (int i = 0; i < g_clients; i++) {
+        for (int op = 0; op < OP_KINDS; op++) {
+            merge_stats(&totals[op], &clients[i].stats[op]);
+            merge_stats(&totals[OP_KINDS], &clients[i].stats[op]);
+        }
+    }
+
+    fprintf(out, "{\n  \"config\": {\"host\": \"%s\", \"port\": %d, \"clients\": %d, \"duration_sec\": %d, "
+                 "\"warmup_sec\": %d, \"download_percent\": %d, \"files\": %d, \"size_min\": %llu, "
+                 "\"size_max\": %llu, \"zipf\": %.3f, \"frame_size\": %u, \"checksum\": %s, \"stalled\": %d},\n",
+            g_host, g_port, g_clients, g_duration, g_warmup, g_download_percent, g_files,
+            (unsigned long long) g_size_min, (unsigned long long) g_size_max, g_zipf, clients[0].frame_size,
+            clients[0].checksum ? "true" : "false", g_stalled);
+    fprintf(out, "  \"elapsed_sec\": %.3f,\n  \"results\": {\n", seconds);
+    for (int op = 0; op < OP_KINDS; op++) print_op_json(out, op_names[op], &totals[op], seconds, false);
+    print_op_json(out, "all", &totals[OP_KINDS], seconds, true);
+    fprintf(out, "  }\n}\n");
+
+    const FssHistogram *all = &totals[OP_KINDS].latency;
+    fprintf(stderr, "%llu requests in %.1f s: %.0f req/s, %.1f MiB/s, p50 %.0f us, p99 %.0f us, p99.9 %.0f us, "
+                    "%llu errors, %llu busy\n",
+            (unsigned long long) all->total, seconds, all->total / seconds, totals[OP_KINDS].bytes / seconds / (1 << 20),
+            fss_hist_percentile(all, 0.50) / 1000.0, fss_hist_percentile(all, 0.99) / 1000.0,
+            fss_hist_percentile(all, 0.999) / 1000.0, (unsigned long long) totals[OP_KINDS].errors,
+            (unsigned long long) totals[OP_KINDS].busy);
+    free(totals);
+}
+
+// --- Setup ---
+
+// Parses a byte count with an optional K, M or G suffix. Returns 0 on error.
+static uint64_t parse_size(const char* text) {
+    char *end;
+    double value = strtod(text, &end);
+    switch (*end) {
+    case 'k': case 'K': value *= 1 << 10; end++; break;
+    case 'm': case 'M': value *= 1 << 20; end++; break;
+    case 'g': case 'G': value *= 1 << 30; end++; break;
+    }
+    return *end == '\0' && value >= 0 ? (uint64_t) value : 0;
+}
+
+static void print_usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [-h host] [-p port] [-c clients] [-t seconds] [-w seconds] [-m download_percent]\n"
+            "          [-n files] [-s size|min:max] [-z zipf] [-f frame_size] [-P prefix] [-k] [-x] [-S stalled] [-o file]\n"
+            "  -h host        Server address (default 127.0.0.1)\n"
+            "  -p port        Server port (default 8080)\n"
+            "  -c clients     Concurrent clients, one connection each, 1-%d (default 16)\n"
+            "  -t seconds     How long to measure (default 10)\n"
+            "  -w seconds     Run this long before measuring starts (default 1)\n"
+            "  -m percent     Share of requests that are downloads, the rest are uploads (default 90)\n"
+            "  -n files       Number of distinct files (default 100)\n"
+            "  -s size        File size, or min:max for sizes spread log-uniformly (default 64K:4M)\n"
+            "  -z zipf        Skew of file popularity, 0 = uniform (default 0.99)\n"
+            "  -f frame_size  Frame size to request, 64KiB-4MiB (default 1MiB)\n"
+            "  -P prefix      Files are named <prefix>-<n>.dat (default bench)\n"
+            "  -k             Ask for CRC32C checksums on every frame\n"
+            "  -x             Do not upload the files first; they exist from an earlier run\n"
+            "  -S stalled     Also open this many connections that start a request and then stall; the run\n"
+            "                 fails if they starve every other request\n"
+            "  -o file        Write the JSON results to file instead of stdout\n",
+            prog, MAX_CLIENTS);
+}
+
+int main(int argc, char* argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "h:p:c:t:w:m:n:s:z:f:P:kxS:o:")) != -1) {
+        switch (c) {
+        case 'h': g_host = optarg; break;
+        case 'p': g_port = atoi(optarg); break;
+        case 'c': g_clients = atoi(optarg); break;
+        case 't': g_duration = atoi(optarg); break;
+        case 'w': g_warmup = atoi(optarg); break;
+        case 'm': g_download_percent = atoi(optarg); break;
+        case 'n': g_files = atoi(optarg); break;
+        case 's': {
+            char *colon = strchr(optarg, ':');
+            if (colon != NULL) *colon = '\0';
+            g_size_min = parse_size(optarg);
+            g_size_max = colon != NULL ? parse_size(colon + 1) : g_size_min;
+            break;
+        }
+        case 'z': g_zipf = atof(optarg); break;
+        case 'f': g_requested_frame_size = strtoul(optarg, NULL, 10); break;
+        case 'P': g_prefix = optarg; break;
+        case 'k': g_use_checksum = true; break;
+        case 'x': g_populate = false; break;
+        case 'S': g_stalled = atoi(optarg); break;
+        case 'o': g_output = optarg; break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (g_clients < 1 || g_clients > MAX_CLIENTS || g_duration < 1 || g_warmup < 0 || g_download_percent < 0 ||
+        g_download_percent > 100 || g_files < 1 || g_files > MAX_FILES || g_size_max < g_size_min ||
+        (g_size_min == 0 && g_size_max != 0) || g_zipf < 0 || g_stalled < 0 || g_stalled > MAX_CLIENTS) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // A connection the server drops must surface as an error, not kill the benchmark
+    signal(SIGPIPE, SIG_IGN);
+    fss_crc32c_init();
+
+    FILE *out = stdout;
+    if (g_output != NULL && (out = fopen(g_output, "w")) == NULL) {
+        perror("bench: cannot open output file");
+        exit(EXIT_FAILURE);
+    }
+
+    // Random upload data and fixed file sizes; the same seed gives the same workload
+    uint64_t rng = 0x46535342454e4348ULL; // "FSSBENCH"
+    g_payload = malloc(FSS_MAX_FRAME_SIZE);
+    g_file_sizes = malloc(sizeof(uint64_t) * g_files);
+    BenchClient *clients = calloc(g_clients, sizeof(BenchClient));
+    if (g_payload == NULL || g_file_sizes == NULL || clients == NULL || build_zipf_table() < 0) {
+        perror("bench: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < FSS_MAX_FRAME_SIZE; i += sizeof(uint64_t)) {
+        uint64_t word = fss_bench_random(&rng);
+        memcpy(g_payload + i, &word, sizeof(word));
+    }
+    for (int i = 0; i < g_files; i++) g_file_sizes[i] = pick_file_size(&rng);
+
+    for (int i = 0; i < g_clients; i++) {
+        BenchClient *client = &clients[i];
+        client->id = i;
+        client->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        client->buff = malloc(FSS_MAX_FRAME_SIZE + sizeof(uint32_t));
+        if (client->buff == NULL || bench_connect(client) < 0) {
+            fprintf(stderr, "bench: cannot connect client %d to %s:%d\n", i, g_host, g_port);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (g_populate) {
+        fprintf(stderr, "Uploading %d files...\n", g_files);
+        for (int i = 0; i < g_clients; i++) {
+            if (populate_files(&clients[i]) < 0) exit(EXIT_FAILURE);
+        }
+    }
+
+    int *stalled = calloc(g_stalled > 0 ? g_stalled : 1, sizeof(int));
+    if (stalled == NULL) {
+        perror("bench: malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    if (g_stalled > 0) {
+        int largest = 0;
+        for (int i = 1; i < g_files; i++) {
+            if (g_file_sizes[i] > g_file_sizes[largest]) largest = i;
+        }
+        for (int i = 0; i < g_stalled; i++) {
+            if ((stalled[i] = open_stalled(i, largest)) < 0) {
+                fprintf(stderr, "bench: cannot open stalled connection %d to %s:%d\n", i, g_host, g_port);
+                exit(EXIT_FAILURE);
+            }
+        }
+        fprintf(stderr, "Holding %d stalled connections...\n", g_stalled);
+    }
+
+    for (int i = 0; i < g_clients; i++) {
+        if (pthread_create(&clients[i].thread, NULL, ClientThread, &clients[i]) != 0) {
+            perror("bench: pthread_create failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    fprintf(stderr, "Running %d clients for %d s after %d s of warmup...\n", g_clients, g_duration, g_warmup);
+    sleep(g_warmup);
+    atomic_store(&g_measuring, true);
+    uint64_t start = fss_bench_now_ns();
+    sleep(g_duration);
+    atomic_store(&g_stop, true);
+    double seconds = (fss_bench_now_ns() - start) / 1e9;
+    for (int i = 0; i < g_clients; i++) pthread_join(clients[i].thread, NULL);
+
+    print_results(out, clients, seconds);
+    if (out != stdout) fclose(out);
+
+    // Stalled connections must not have starved the others
+    int rc = EXIT_SUCCESS;
+    if (g_stalled > 0) {
+        int dropped = 0;
+        for (int i = 0; i < g_stalled; i++) {
+            if (stalled_was_dropped(stalled[i], clients[0].buff)) dropped++;
+            close(stalled[i]);
+        }
+        uint64_t completed = 0;
+        for (int i = 0; i < g_clients; i++) {
+            for (int op = 0; op < OP_KINDS; op++) completed += clients[i].stats[op].latency.total;
+        }
+        fprintf(stderr, "%d of %d stalled connections dropped by the server\n", dropped, g_stalled);
+        if (completed == 0) {
+            fprintf(stderr, "bench: stalled connections starved every other request\n");
+            rc = EXIT_FAILURE;
+        }
+    }
+    free(stalled);
+    return rc;
+}
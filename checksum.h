@@ -0,0 +1,172 @@
+#ifndef FSS_CHECKSUM_H
+#define FSS_CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+// CRC32C (Castagnoli) shared by server.c and client.c, for frame and file checksums.
+//
+// With SSE4.2 the crc32 instruction does 8 bytes per step. One chain of it is bound by
+// the instruction's latency, so long buffers run three independent chains over adjacent
+// blocks and merge them with table-driven "append n zero bytes" shifts, which keeps the
+// unit busy every cycle. Without SSE4.2 a slicing-by-8 table does the work.
+//
+// fss_crc32c_combine() computes the CRC of two concatenated buffers from their CRCs, so a
+// file digest can be assembled from per-frame CRCs without reading the data again.
+
+#define FSS_CRC32C_POLY         0x82f63b78u      // Reflected Castagnoli polynomial
+#define FSS_CRC32C_LONG         8192             // Block per chain, long buffers
+#define FSS_CRC32C_SHORT        256              // Block per chain, the tail
+
+static uint32_t fss_crc32c_table[8][256];
+static uint32_t fss_crc32c_long[4][256];         // Appends FSS_CRC32C_LONG zero bytes
+static uint32_t fss_crc32c_short[4][256];        // Appends FSS_CRC32C_SHORT zero bytes
+static bool fss_crc32c_hw;
+
+// Multiplies a and b modulo the polynomial; bit 31 is x^0, as in the reflected CRC.
+static inline uint32_t fss_crc32c_multmodp(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t m = 1u << 31; m != 0; m >>= 1) {
+        if (a & m) {
+            product ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        b = b & 1 ? (b >> 1) ^ FSS_CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+static uint32_t fss_crc32c_x2n[32];              // x^(2^n) modulo the polynomial
+
+// x^(n * 2^k) modulo the polynomial: appending n zero bytes is a multiplication by
+// x^(8n), so fss_crc32c_x2nmodp(n, 3) is the operator for n zero bytes.
+static inline uint32_t fss_crc32c_x2nmodp(uint64_t n, unsigned k) {
+    uint32_t p = 1u << 31;
+    for (; n != 0; n >>= 1, k++) {
+        if (n & 1) p = fss_crc32c_multmodp(fss_crc32c_x2n[k & 31], p);
+    }
+    return p;
+}
+
+// Builds a byte-wise table applying the operator that appends len zero bytes to a CRC.
+static inline void fss_crc32c_zeros(uint32_t zeros[4][256], size_t len) {
+    uint32_t op = fss_crc32c_x2nmodp(len, 3);
+    for (uint32_t n = 0; n < 256; n++) {
+        zeros[0][n] = fss_crc32c_multmodp(op, n);
+        zeros[1][n] = fss_crc32c_multmodp(op, n << 8);
+        zeros[2][n] = fss_crc32c_multmodp(op, n << 16);
+        zeros[3][n] = fss_crc32c_multmodp(op, n << 24);
+    }
+}
+
+static inline uint32_t fss_crc32c_shift(uint32_t zeros[4][256], uint32_t crc) {
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+// Fills the tables and checks for SSE4.2. Call once at startup.
+static inline void fss_crc32c_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) crc = crc & 1 ? (crc >> 1) ^ FSS_CRC32C_POLY : crc >> 1;
+        fss_crc32c_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = fss_crc32c_table[0][n];
+        for (int k = 1; k < 8; k++) {
+            crc = fss_crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            fss_crc32c_table[k][n] = crc;
+        }
+    }
+    uint32_t p = 1u << 30;                   // x^1
+    for (int n = 0; n < 32; n++) {
+        fss_crc32c_x2n[n] = p;
+        p = fss_crc32c_multmodp(p, p);
+    }
+    fss_crc32c_zeros(fss_crc32c_long, FSS_CRC32C_LONG);
+    fss_crc32c_zeros(fss_crc32c_short, FSS_CRC32C_SHORT);
+#if defined(__x86_64__)
+    unsigned int eax, ebx, ecx, edx;
+    fss_crc32c_hw = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2);
+#endif
+}
+
+static inline uint32_t fss_crc32c_sw(uint32_t crc, const uint8_t* p, size_t len) {
+    crc = ~crc;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        word ^= crc;
+        crc = fss_crc32c_table[7][word & 0xff] ^ fss_crc32c_table[6][(word >> 8) & 0xff] ^
+              fss_crc32c_table[5][(word >> 16) & 0xff] ^ fss_crc32c_table[4][(word >> 24) & 0xff] ^
+              fss_crc32c_table[3][(word >> 32) & 0xff] ^ fss_crc32c_table[2][(word >> 40) & 0xff] ^
+              fss_crc32c_table[1][(word >> 48) & 0xff] ^ fss_crc32c_table[0][word >> 56];
+    }
+#endif
+    for (; len > 0; len--, p++) crc = fss_crc32c_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+// Runs three chains over adjacent blocks of block bytes while at least three are left.
+__attribute__((target("sse4.2")))
+static inline uint64_t fss_crc32c_hw_lanes(uint64_t crc0, const uint8_t** next, size_t* len, size_t block,
+                                           uint32_t zeros[4][256]) {
+    const uint8_t *p = *next;
+    while (*len >= 3 * block) {
+        uint64_t crc1 = 0, crc2 = 0;
+        const uint8_t *end = p + block;
+        for (; p < end; p += 8) {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, p, 8);
+            memcpy(&w1, p + block, 8);
+            memcpy(&w2, p + 2 * block, 8);
+            crc0 = _mm_crc32_u64(crc0, w0);
+            crc1 = _mm_crc32_u64(crc1, w1);
+            crc2 = _mm_crc32_u64(crc2, w2);
+        }
+        crc0 = fss_crc32c_shift(zeros, (uint32_t) crc0) ^ crc1;
+        crc0 = fss_crc32c_shift(zeros, (uint32_t) crc0) ^ crc2;
+        p += 2 * block;
+        *len -= 3 * block;
+    }
+    *next = p;
+    return crc0;
+}
+
+__attribute__((target("sse4.2")))
+static inline uint32_t fss_crc32c_hw_update(uint32_t crc, const uint8_t* p, size_t len) {
+    uint64_t crc0 = ~crc;
+    for (; len > 0 && ((uintptr_t) p & 7) != 0; len--, p++) crc0 = _mm_crc32_u8((uint32_t) crc0, *p);
+    crc0 = fss_crc32c_hw_lanes(crc0, &p, &len, FSS_CRC32C_LONG, fss_crc32c_long);
+    crc0 = fss_crc32c_hw_lanes(crc0, &p, &len, FSS_CRC32C_SHORT, fss_crc32c_short);
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc0 = _mm_crc32_u64(crc0, word);
+    }
+    for (; len > 0; len--, p++) crc0 = _mm_crc32_u8((uint32_t) crc0, *p);
+    return ~(uint32_t) crc0;
+}
+#endif
+
+// Extends crc (0 to start) with len bytes of data.
+static inline uint32_t fss_crc32c(uint32_t crc, const void* data, size_t len) {
+#if defined(__x86_64__)
+    if (fss_crc32c_hw) return fss_crc32c_hw_update(crc, (const uint8_t*) data, len);
+#endif
+    return fss_crc32c_sw(crc, (const uint8_t*) data, len);
+}
+
+// CRC of A followed by B, given crc1 of A, crc2 of B and B's length.
+static inline uint32_t fss_crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    return fss_crc32c_multmodp(fss_crc32c_x2nmodp(len2, 3), crc1) ^ crc2;
+}
+
+#endif // FSS_CHECKSUM_H
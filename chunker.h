@@ -0,0 +1,243 @@
+#ifndef FSS_CHUNKER_H
+#define FSS_CHUNKER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+// Content-defined chunking and chunk hashing shared by server.c and client.c.
+//
+// Both sides must cut a file at exactly the same places, so a chunk boundary depends
+// only on the bytes around it: an edit moves the boundaries near it and leaves the
+// chunks elsewhere (and their hashes) unchanged. Boundaries come from a gear rolling
+// hash (FastCDC): one shift, one add and one table lookup per byte, with normalized
+// chunking to keep sizes close to the average. Chunks are identified by SHA-256, using
+// the SHA extensions when the CPU has them.
+
+#define FSS_CHUNK_MIN           (16 * 1024)
+#define FSS_CHUNK_AVG           (64 * 1024)
+#define FSS_CHUNK_MAX           (256 * 1024)
+#define FSS_CHUNK_HASH_SIZE     32
+
+// Masks on the top bits of the gear hash, where it depends on the last 64 bytes: harder
+// to hit than 1/FSS_CHUNK_AVG before the average size, easier after it
+#define FSS_CHUNK_MASK_SMALL    0xFFFFC00000000000ULL   // 18 bits
+#define FSS_CHUNK_MASK_LARGE    0xFFFC000000000000ULL   // 14 bits
+
+static uint64_t fss_gear_table[256];
+
+// Fills the gear table from a fixed seed; identical on every build. Call once at startup.
+static inline void fss_chunker_init(void) {
+    uint64_t x = 0x46535343444331ULL; // "FSSCDC1"
+    for (int i = 0; i < 256; i++) {
+        // splitmix64
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        fss_gear_table[i] = z ^ (z >> 31);
+    }
+}
+
+// Returns the length of the chunk starting at data. len is what is available: at least
+// FSS_CHUNK_MAX bytes, or everything up to the end of the file.
+static inline size_t fss_chunk_cut(const uint8_t* data, size_t len) {
+    if (len <= FSS_CHUNK_MIN) return len;
+    size_t normal = len < FSS_CHUNK_AVG ? len : FSS_CHUNK_AVG;
+    size_t end = len < FSS_CHUNK_MAX ? len : FSS_CHUNK_MAX;
+    uint64_t hash = 0;
+    size_t i = FSS_CHUNK_MIN;
+
+    for (; i < normal; i++) {
+        hash = (hash << 1) + fss_gear_table[data[i]];
+        if ((hash & FSS_CHUNK_MASK_SMALL) == 0) return i + 1;
+    }
+    for (; i < end; i++) {
+        hash = (hash << 1) + fss_gear_table[data[i]];
+        if ((hash & FSS_CHUNK_MASK_LARGE) == 0) return i + 1;
+    }
+    return end;
+}
+
+// --- SHA-256 ---
+
+static const uint32_t fss_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define FSS_ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void fss_sha256_blocks_generic(uint32_t state[8], const uint8_t* data, size_t blocks) {
+    for (; blocks > 0; blocks--, data += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t) data[4 * i] << 24 | (uint32_t) data[4 * i + 1] << 16 |
+                   (uint32_t) data[4 * i + 2] << 8 | data[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = FSS_ROTR32(w[i - 15], 7) ^ FSS_ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = FSS_ROTR32(w[i - 2], 17) ^ FSS_ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (FSS_ROTR32(e, 6) ^ FSS_ROTR32(e, 11) ^ FSS_ROTR32(e, 25)) +
+                          ((e & f) ^ (~e & g)) + fss_sha256_k[i] + w[i];
+            uint32_t t2 = (FSS_ROTR32(a, 2) ^ FSS_ROTR32(a, 13) ^ FSS_ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#if defined(__x86_64__)
+// Four rounds per sha256rnds2 pair; the state lives in two registers as ABEF/CDGH.
+__attribute__((target("sha,sse4.1")))
+static void fss_sha256_blocks_shani(uint32_t state[8], const uint8_t* data, size_t blocks) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[0]), 0xB1); // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[4]), 0x1B); // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);   // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);        // CDGH
+
+    for (; blocks > 0; blocks--, data += 64) {
+        __m128i abef = state0, cdgh = state1;
+        __m128i w[4];
+        for (int g = 0; g < 16; g++) {
+            __m128i words;
+            if (g < 4) {
+                words = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) (data + 16 * g)), byte_swap);
+            } else {
+                // w[g & 3] .. w[(g + 3) & 3] hold the four previous groups, oldest first
+                words = _mm_sha256msg1_epu32(w[g & 3], w[(g + 1) & 3]);
+                words = _mm_add_epi32(words, _mm_alignr_epi8(w[(g + 3) & 3], w[(g + 2) & 3], 4));
+                words = _mm_sha256msg2_epu32(words, w[(g + 3) & 3]);
+            }
+            w[g & 3] = words;
+            __m128i msg = _mm_add_epi32(words, _mm_loadu_si128((const __m128i*) &fss_sha256_k[4 * g]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);              // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);           // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);        // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);           // HGFE
+    _mm_storeu_si128((__m128i*) &state[0], state0);
+    _mm_storeu_si128((__m128i*) &state[4], state1);
+}
+#endif
+
+typedef void (*fss_sha256_blocks_fn)(uint32_t state[8], const uint8_t* data, size_t blocks);
+
+// Picks the SHA extensions when the CPU has them (checked once).
+static inline fss_sha256_blocks_fn fss_sha256_blocks(void) {
+    static fss_sha256_blocks_fn impl = NULL;
+    if (impl == NULL) {
+        fss_sha256_blocks_fn chosen = fss_sha256_blocks_generic;
+#if defined(__x86_64__)
+        unsigned int eax, ebx, ecx, edx;
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1) && (ecx & bit_SSSE3) &&
+            __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA)) {
+            chosen = fss_sha256_blocks_shani;
+        }
+#endif
+        impl = chosen; // Every thread computes the same value, so the race is benign
+    }
+    return impl;
+}
+
+// SHA-256 of one buffer.
+static inline void fss_chunk_hash(const void* data, size_t len, uint8_t out[FSS_CHUNK_HASH_SIZE]) {
+    uint32_t state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    fss_sha256_blocks_fn blocks = fss_sha256_blocks();
+    const uint8_t *p = (const uint8_t*) data;
+
+    size_t whole = len / 64;
+    blocks(state, p, whole);
+
+    // Padding: 0x80, zeros, then the length in bits, filling one or two final blocks
+    uint8_t tail[128];
+    size_t rest = len - whole * 64;
+    memcpy(tail, p + whole * 64, rest);
+    tail[rest] = 0x80;
+    size_t tail_len = rest + 1 + 8 <= 64 ? 64 : 128;
+    memset(tail + rest + 1, 0, tail_len - rest - 1);
+    uint64_t bits = (uint64_t) len * 8;
+    for (int i = 0; i < 8; i++) tail[tail_len - 1 - i] = (uint8_t) (bits >> (8 * i));
+    blocks(state, tail, tail_len / 64);
+
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = state[i] >> 24;
+        out[4 * i + 1] = state[i] >> 16;
+        out[4 * i + 2] = state[i] >> 8;
+        out[4 * i + 3] = state[i];
+    }
+}
+
+// Reads fd from its current offset to the end, cutting it into chunks and calling emit
+// with each chunk's length and hash. Returns 0, or -1 if reading failed (errno set) or
+// emit returned nonzero.
+static inline int fss_chunk_file(int fd, int (*emit)(void* ctx, size_t len, const uint8_t* hash), void* ctx) {
+    const size_t capacity = 4 * FSS_CHUNK_MAX;
+    uint8_t *buff = malloc(capacity);
+    if (buff == NULL) return -1;
+
+    size_t start = 0, filled = 0;
+    bool eof = false;
+    int rc = 0;
+    while (rc == 0) {
+        // fss_chunk_cut() needs a whole FSS_CHUNK_MAX in view unless the file ends sooner
+        if (!eof && filled - start < FSS_CHUNK_MAX) {
+            memmove(buff, buff + start, filled - start);
+            filled -= start;
+            start = 0;
+            while (!eof && filled < capacity) {
+                ssize_t n = read(fd, buff + filled, capacity - filled);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) {
+                    rc = -1;
+                    break;
+                }
+                if (n == 0) eof = true;
+                filled += n;
+            }
+            if (rc != 0) break;
+        }
+        if (start == filled) break;
+
+        size_t len = fss_chunk_cut(buff + start, filled - start);
+        uint8_t hash[FSS_CHUNK_HASH_SIZE];
+        fss_chunk_hash(buff + start, len, hash);
+        if (emit(ctx, len, hash) != 0) rc = -1;
+        start += len;
+    }
+
+    free(buff);
+    return rc;
+}
+
+#endif // FSS_CHUNKER_H
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // copy_file_range()
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -8,32 +9,263 @@
 #include <sys/fcntl.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <signal.h>
 #include <errno.h> // For error checking
+#include <time.h>
 
-#define CHUNK_SIZE 128 // Assuming this matches the server
+#include "protocol.h"
+#include "chunker.h"
+#include "delta.h"
+#include "compress.h"
+#include "checksum.h"
+
+#define CHUNK_SIZE FSS_V1_FRAME_SIZE // Frame size for protocol v1 servers
+#define MAX_PIPELINE 32              // Requests that may be in flight on one connection
+#define MAX_STREAMS 32               // Connections one ranged download may use
+#define RANGE_MIN_SIZE (1 << 20)     // Smallest piece worth its own connection
+#define RANGE_RETRIES 5              // Reconnects per piece before giving up
+#define RANGE_SAVE_INTERVAL (32 << 20) // Bytes fetched between resume state saves
+#define DELTA_MIN_SIZE (64 << 10)    // Smaller files are cheaper to send whole than to diff
+
+// Negotiated by PerformHandshake() for the calling thread's connection; stays at
+// v1 / CHUNK_SIZE against a legacy server
+__thread int g_protocol_version = 1;
+__thread uint32_t g_frame_size = CHUNK_SIZE;
+__thread bool g_persistent = false;  // Server granted FSS_FLAG_PERSISTENT
+__thread bool g_dedup = false;       // Server granted FSS_FLAG_DEDUP
+__thread bool g_delta = false;       // Server granted FSS_FLAG_DELTA
+__thread bool g_compress = false;    // Server granted FSS_FLAG_COMPRESS
+__thread bool g_checksum = false;    // Server granted FSS_FLAG_CHECKSUM
+
+// Request numbering on the current connection (see FssResponse)
+__thread uint32_t g_next_request_id = 1;
+__thread uint32_t g_next_response_id = 1;
+
+// Where to connect; set from the command line
+const char* g_host = "172.31.153.78";
+int g_port = 8080;
+uint32_t g_requested_frame_size = FSS_DEFAULT_FRAME_SIZE;
+bool g_legacy = false;
+int g_streams = 1;                   // Connections per download (-j)
+bool g_use_delta = false;            // Update existing files with delta transfers (-d)
+uint32_t g_compression = FSS_COMPRESS_NONE; // Frame compression for downloads and uploads (-z)
+bool g_use_checksum = true;          // CRC32C on every frame and file (off with -C)
+
+// A request that was sent but whose response has not been read yet
+typedef struct {
+    bool is_upload;
+    char local_filename[256];
+    char remote_filename[256];
+} PendingRequest;
 
 // Function prototypes
-void DownloadFileFromServer(int socket, const char* local_filename);
-void UploadFileToServer(int socket, const char* local_filename);
-void RequestGenerator(int socket);
+int PerformHandshake(int socket, uint32_t requested_frame_size);
+int ConnectToServer(void);
+int SendRequest(int socket, const char* command, const char* remote_filename, const void* body, size_t body_len);
+int ReceiveResponse(int socket, uint32_t* status);
+int DownloadFileFromServer(int socket, const char* local_filename);
+int UploadFileToServer(int socket, int fd, const char* local_filename);
+void RequestGenerator(void);
+
+// Opens a protocol v2 session: proposes a frame size and adopts what the server agrees to.
+// Returns 0 on success, -1 on failure.
+int PerformHandshake(int socket, uint32_t requested_frame_size) {
+    FssHandshake hello;
+    hello.magic = htonl(FSS_V2_MAGIC);
+    hello.version = htonl(FSS_PROTOCOL_VERSION);
+    hello.frame_size = htonl(fss_clamp_frame_size(requested_frame_size));
+    hello.flags = htonl(FSS_FLAG_PERSISTENT | FSS_FLAG_DEDUP | (g_use_delta ? FSS_FLAG_DELTA : 0) |
+                        (g_compression != FSS_COMPRESS_NONE ? FSS_FLAG_COMPRESS : 0) |
+                        (g_use_checksum ? FSS_FLAG_CHECKSUM : 0));
+
+    if (send(socket, &hello, sizeof(hello), 0) != sizeof(hello)) {
+        perror("Handshake: send failed");
+        return -1;
+    }
+
+    FssHandshake reply;
+    if (recv(socket, &reply, sizeof(reply), MSG_WAITALL) != sizeof(reply)) {
+        fprintf(stderr, "Handshake: server did not answer (v1-only server?)\n");
+        return -1;
+    }
+    if (ntohl(reply.magic) != FSS_V2_MAGIC || ntohl(reply.version) < FSS_PROTOCOL_VERSION) {
+        fprintf(stderr, "Handshake: unexpected reply from server\n");
+        return -1;
+    }
+
+    uint32_t frame_size = ntohl(reply.frame_size);
+    if (frame_size < FSS_MIN_FRAME_SIZE || frame_size > FSS_MAX_FRAME_SIZE) {
+        fprintf(stderr, "Handshake: server chose invalid frame size %u\n", frame_size);
+        return -1;
+    }
+
+    g_protocol_version = FSS_PROTOCOL_VERSION;
+    g_frame_size = frame_size;
+    g_persistent = (ntohl(reply.flags) & FSS_FLAG_PERSISTENT) != 0;
+    g_dedup = g_persistent && (ntohl(reply.flags) & FSS_FLAG_DEDUP) != 0;
+    g_delta = g_persistent && (ntohl(reply.flags) & FSS_FLAG_DELTA) != 0;
+    g_compress = (ntohl(reply.flags) & FSS_FLAG_COMPRESS) != 0;
+    g_checksum = (ntohl(reply.flags) & FSS_FLAG_CHECKSUM) != 0;
+
+    int one = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    printf("Handshake: protocol v%d, frame size %u bytes%s%s%s%s%s\n", g_protocol_version, g_frame_size,
+           g_persistent ? ", persistent connection" : "", g_dedup ? ", deduplicated uploads" : "",
+           g_delta ? ", delta transfers" : "", g_compress ? ", compression" : "", g_checksum ? ", checksums" : "");
+    return 0;
+}
+
+// Opens a connection to g_host:g_port and runs the handshake unless -1 was given.
+// Returns the socket, or -1 on failure.
+int ConnectToServer(void) {
+    int sck_d = socket(AF_INET, SOCK_STREAM, 0);
+    if (sck_d == -1){
+        perror("Socket creation for the main socket failed");
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+
+    addr.sin_family = AF_INET;//ipv4
+    addr.sin_port = htons(g_port);
+    if (inet_pton(AF_INET , g_host , &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid server address: %s\n", g_host);
+        close(sck_d);
+        return -1;
+    }
+
+    if (connect(sck_d , (struct sockaddr *)&addr , sizeof(addr)) < 0) {
+        perror("Error Connecting to the Server");
+        close(sck_d);
+        return -1;
+    }
+
+    g_protocol_version = 1;
+    g_frame_size = CHUNK_SIZE;
+    g_persistent = false;
+    g_dedup = false;
+    g_delta = false;
+    g_compress = false;
+    g_checksum = false;
+    g_next_request_id = 1;
+    g_next_response_id = 1;
+    if (!g_legacy && PerformHandshake(sck_d, g_requested_frame_size) != 0) {
+        close(sck_d);
+        return -1;
+    }
+    return sck_d;
+}
+
+// Sends a request header (CommandLen, Command, FilenameLen, Filename) and an optional
+// command-specific body in one writev.
+// Returns 0 on success, -1 on failure.
+int SendRequest(int socket, const char* command, const char* remote_filename, const void* body, size_t body_len) {
+    int command_len = strlen(command) + 1; // Include null terminator
+    int command_len_n = htonl(command_len);
+    int filename_len = strlen(remote_filename) + 1; // Include null terminator
+    int filename_len_n = htonl(filename_len);
+
+    struct iovec iov[5];
+    iov[0].iov_base = &command_len_n;
+    iov[0].iov_len = sizeof(command_len_n);
+    iov[1].iov_base = (void*) command;
+    iov[1].iov_len = command_len;
+    iov[2].iov_base = &filename_len_n;
+    iov[2].iov_len = sizeof(filename_len_n);
+    iov[3].iov_base = (void*) remote_filename;
+    iov[3].iov_len = filename_len;
+    iov[4].iov_base = (void*) body;
+    iov[4].iov_len = body_len;
+
+    // A header is a few hundred bytes at most, a short write only happens on a dying connection
+    ssize_t total = sizeof(int) * 2 + command_len + filename_len + body_len;
+    if (writev(socket, iov, body_len > 0 ? 5 : 4) != total) {
+        perror("send request failed");
+        return -1;
+    }
+    g_next_request_id++;
+    return 0;
+}
+
+// Reads the FssResponse of the oldest outstanding request on a persistent connection.
+// Returns 0 with *status set, or -1 if the connection broke or answered out of order.
+int ReceiveResponse(int socket, uint32_t* status) {
+    FssResponse response;
+    if (recv(socket, &response, sizeof(response), MSG_WAITALL) != sizeof(response)) {
+        fprintf(stderr, "Server closed the connection before responding\n");
+        return -1;
+    }
+    uint32_t request_id = ntohl(response.request_id);
+    if (request_id != g_next_response_id) {
+        fprintf(stderr, "Response for request %u, expected %u\n", request_id, g_next_response_id);
+        return -1;
+    }
+    g_next_response_id++;
+    *status = ntohl(response.status);
+    return 0;
+}
+
+static const char* StatusString(uint32_t status) {
+    switch (status) {
+    case FSS_STATUS_OK: return "ok";
+    case FSS_STATUS_NOT_FOUND: return "file not found";
+    case FSS_STATUS_BAD_REQUEST: return "bad request";
+    case FSS_STATUS_BUSY: return "server busy, try again";
+    case FSS_STATUS_IO_ERROR: return "server I/O error";
+    case FSS_STATUS_BAD_RANGE: return "range beyond the end of the file";
+    case FSS_STATUS_INCOMPLETE: return "upload incomplete";
+    case FSS_STATUS_CORRUPT: return "data corrupted in transit, upload discarded";
+    default: return "unknown status";
+    }
+}
 
 // Renamed and corrected function to download a file from the server
-void DownloadFileFromServer(int socket, const char* local_filename) {
+// Returns 0 if the response was read completely (even if the server refused the request),
+// -1 if the connection can no longer be used.
+int DownloadFileFromServer(int socket, const char* local_filename) {
+    if (g_persistent) {
+        uint32_t status;
+        if (ReceiveResponse(socket, &status) < 0) return -1;
+        if (status != FSS_STATUS_OK) {
+            printf("Download to %s failed: %s\n", local_filename, StatusString(status));
+            return 0; // No frames follow
+        }
+    }
+
     printf("Attempting to download to: %s\n", local_filename);
     int fd = open(local_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
     if (fd < 0) {
         perror("Failed to open local file for writing");
-        // We should probably close the socket or signal an error,
-        // but for now, just return. The server will likely timeout or error.
-        return;
+        // Keep reading the frames and drop them, so the next response is found in the stream
     }
 
-    char buff[CHUNK_SIZE];
+    // Compressed frames are received into buff and expanded into expanded
+    char *buff = malloc(g_frame_size);
+    char *expanded = g_compress ? malloc(g_frame_size) : NULL;
+    FssDecompressor decompressor;
+    if (buff == NULL || (g_compress && (expanded == NULL || fss_decompressor_init(&decompressor) != 0))) {
+        perror("Download: malloc failed");
+        free(buff);
+        free(expanded);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    uint64_t wire_bytes = 0;
+    uint64_t file_bytes = 0;
+    uint32_t crc_n;
+    uint32_t file_crc = 0;      // With checksums: CRC32C of everything received so far
+    bool corrupt = false;
     int chunk_size_n;
     ssize_t chunk_size; // Use ssize_t for sizes
     ssize_t bytes_received_data;
     ssize_t bytes_written_total;
     ssize_t bytes_written_now;
+    int rc = -1;
 
     while (true) {
         // 1. Receive chunk size from server
@@ -47,16 +279,25 @@ void DownloadFileFromServer(int socket, const char* local_filename) {
             break; // Error or disconnect
         }
 
-        chunk_size = ntohl(chunk_size_n);
+        uint32_t header = ntohl(chunk_size_n);
+        chunk_size = header & ~FSS_FRAME_COMPRESSED;
 
-        // Check for end-of-download signal (size 0)
+        // Check for end-of-download signal (size 0); with checksums the file's digest follows
         if (chunk_size == 0) {
+            if (g_checksum) {
+                if (recv(socket, &crc_n, sizeof(crc_n), MSG_WAITALL) != sizeof(crc_n)) {
+                    printf("Download: Server disconnected before the file digest.\n");
+                    break;
+                }
+                if (ntohl(crc_n) != file_crc) corrupt = true;
+            }
             printf("Download: Received end-of-download signal.\n");
+            rc = 0;
             break; // Normal end of download
         }
 
         // Validate chunk size (optional but good practice)
-        if (chunk_size < 0 || chunk_size > CHUNK_SIZE) {
+        if (chunk_size < 0 || chunk_size > g_frame_size) {
             fprintf(stderr, "Download: Invalid chunk size received: %zd\n", chunk_size);
             break; // Invalid size
         }
@@ -78,17 +319,55 @@ void DownloadFileFromServer(int socket, const char* local_filename) {
              // Continue trying to write what was received, or break? For simplicity, break.
              break;
          }
+        wire_bytes += sizeof(int) + chunk_size;
+
+        uint32_t frame_crc = 0;
+        if (g_checksum) {
+            if (recv(socket, &crc_n, sizeof(crc_n), MSG_WAITALL) != sizeof(crc_n)) {
+                printf("Download: Server disconnected before the frame checksum.\n");
+                break;
+            }
+            frame_crc = fss_crc32c(0, buff, chunk_size);
+            if (ntohl(crc_n) != frame_crc) {
+                // Keep reading to the end frame so the connection stays usable
+                corrupt = true;
+                if (fd >= 0) close(fd);
+                fd = -1;
+            }
+            wire_bytes += sizeof(crc_n);
+        }
+        if (corrupt) continue;
+
+        const char *data = buff;
+        if (header & FSS_FRAME_COMPRESSED) {
+            if (!g_compress) {
+                fprintf(stderr, "Download: compressed frame on a connection without compression\n");
+                break;
+            }
+            bytes_received_data = fss_decompress_frame(&decompressor, (uint8_t*) buff, chunk_size,
+                                                       (uint8_t*) expanded, g_frame_size);
+            if (bytes_received_data < 0) {
+                fprintf(stderr, "Download: corrupt compressed frame\n");
+                break; // The frames that follow cannot be trusted either
+            }
+            data = expanded;
+            if (g_checksum) frame_crc = fss_crc32c(0, expanded, bytes_received_data);
+        }
+        file_bytes += bytes_received_data;
+        file_crc = fss_crc32c_combine(file_crc, frame_crc, bytes_received_data);
 
+        if (fd < 0) continue; // Local file unavailable, frame dropped
 
         // 3. Write received data to local file (fd)
         bytes_written_total = 0;
         while (bytes_written_total < bytes_received_data) {
-            bytes_written_now = write(fd, buff + bytes_written_total, bytes_received_data - bytes_written_total);
+            bytes_written_now = write(fd, data + bytes_written_total, bytes_received_data - bytes_written_total);
             if (bytes_written_now < 0) {
                 perror("Download: write to local file failed");
-                // Error during write, cleanup and exit loop
+                // Stop writing but keep consuming the stream
                 close(fd);
-                return; // Exit function on write error
+                fd = -1;
+                break;
             }
             bytes_written_total += bytes_written_now;
         }
@@ -96,116 +375,1269 @@ void DownloadFileFromServer(int socket, const char* local_filename) {
 
     } // End while loop
 
-    close(fd);
+    free(buff);
+    if (g_compress) {
+        fss_decompressor_end(&decompressor);
+        free(expanded);
+        printf("Download: %llu bytes on the wire for %llu bytes of file\n",
+               (unsigned long long) wire_bytes, (unsigned long long) file_bytes);
+    }
+    if (fd >= 0) close(fd);
+    if (corrupt) {
+        // Whatever was written cannot be trusted
+        fprintf(stderr, "Download of %s failed: checksum mismatch, data corrupted\n", local_filename);
+        unlink(local_filename);
+        return rc;
+    }
     printf("Download finished for %s.\n", local_filename);
+    return rc;
 }
 
 
 // Implementation for Upload function
-void UploadFileToServer(int socket, const char* local_filename) {
+// Sends the frames of an already opened local file; the caller sent the request header.
+// Returns 0 on success, -1 if the connection can no longer be used.
+int UploadFileToServer(int socket, int fd, const char* local_filename) {
     printf("Attempting to upload file: %s\n", local_filename);
 
-    int fd = open(local_filename, O_RDONLY);
-    if (fd < 0) {
-        perror("Upload: Failed to open local file for reading");
-        // Cannot proceed, maybe send an error signal to server?
-        // For now, just return. Server might timeout or handle missing data.
-        // Sending a 0-size chunk might be interpreted as success by the server.
-        // It's better if the server expects data after UPLOAD command.
-        return;
+    char *buff = malloc(g_frame_size);
+    ssize_t bytes_read;
+    ssize_t bytes_read_now;
+
+    // With compression granted, each frame is deflated into packed before it is sent
+    uint8_t *packed = g_compress ? malloc(g_frame_size) : NULL;
+    FssCompressor compressor;
+    if (buff == NULL || (g_compress && (packed == NULL || fss_compressor_init(&compressor) != 0))) {
+        perror("Upload: malloc failed");
+        free(buff);
+        free(packed);
+        return -1;
     }
+    uint64_t wire_bytes = 0;
+    uint64_t file_bytes = 0;
+    uint32_t file_crc = 0;      // With checksums: CRC32C of everything sent so far
 
-    char buff[CHUNK_SIZE];
-    ssize_t bytes_read;
-    ssize_t bytes_sent_total;
-    ssize_t bytes_sent_now;
-    int chunk_size_n;
+    while (true) {
+        // 1. Fill a whole frame from the local file (short reads only at EOF or on error)
+        bytes_read = 0;
+        while (bytes_read < g_frame_size) {
+            bytes_read_now = read(fd, buff + bytes_read, g_frame_size - bytes_read);
+            if (bytes_read_now < 0) {
+                if (errno == EINTR) continue;
+                perror("Upload: Failed to read from local file");
+                // Stop after what we have; the zero-size frame below terminates the server side cleanly.
+                break;
+            }
+            if (bytes_read_now == 0) break;
+            bytes_read += bytes_read_now;
+        }
+
+        // 2. Send chunk size and data (network byte order) in one writev
+        size_t packed_len = g_compress ? fss_compress_frame(&compressor, g_compression, buff, bytes_read, packed) : 0;
+        uint32_t flags = packed_len > 0 ? FSS_FRAME_COMPRESSED : 0;
+        const void *payload = flags ? (const void*) packed : buff;
+        uint32_t payload_len = flags ? packed_len : (size_t) bytes_read;
+        int sent = 0;
+        if (g_checksum && bytes_read > 0) {
+            uint32_t crc = fss_crc32c(0, buff, bytes_read);
+            file_crc = fss_crc32c_combine(file_crc, crc, bytes_read);
+            sent = fss_send_frame_crc(socket, payload, payload_len, flags, flags ? fss_crc32c(0, packed, packed_len) : crc);
+            wire_bytes += sizeof(crc);
+        } else if (bytes_read > 0) {
+            sent = fss_send_frame_flagged(socket, payload, payload_len, flags);
+        }
+        if (sent < 0) {
+            perror("Upload: send chunk failed");
+            goto upload_failed; // Cannot continue
+        }
+        wire_bytes += sizeof(int) + payload_len;
+        file_bytes += bytes_read;
+
+        // 3. A short frame means EOF or error; finish with a zero-size frame, which carries
+        // the file's digest when checksums are on
+        if (bytes_read < g_frame_size) {
+            if ((g_checksum ? fss_send_frame_crc(socket, NULL, 0, 0, file_crc) : fss_send_frame(socket, NULL, 0)) < 0) {
+                perror("Upload: send end signal failed");
+                goto upload_failed;
+            }
+            printf("Upload: Reached end of file or read error for %s.\n", local_filename);
+            break;
+        }
+        printf("Upload: Sent %zd bytes from %s\n", bytes_read, local_filename);
+
+    } // End while loop
+
+    free(buff);
+    if (g_compress) {
+        fss_compressor_end(&compressor);
+        free(packed);
+        printf("Upload: %llu bytes on the wire for %llu bytes of file\n",
+               (unsigned long long) wire_bytes, (unsigned long long) file_bytes);
+    }
+    printf("Upload finished for %s.\n", local_filename);
+    return 0;
+
+upload_failed:
+    free(buff);
+    if (g_compress) {
+        fss_compressor_end(&compressor);
+        free(packed);
+    }
+    return -1;
+}
+
+// --- Ranged downloads ---
+// A download with -j N > 1 splits the file into up to N pieces and fetches each over its
+// own connection with "range" requests, writing with pwrite into <local>.part. Progress
+// is recorded in <local>.part.state; a later download of the same file to the same local
+// name picks up from there, as long as the server still has the same version. The .part
+// file only becomes <local> once every piece is complete.
+
+// One piece of the file and how much of it is already in the .part file
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+    uint64_t done;
+} RangeState;
+
+// Splits total_size bytes into up to g_streams pieces of at least RANGE_MIN_SIZE.
+// Returns the number of pieces (at least 1).
+static int SplitIntoRanges(uint64_t total_size, RangeState* ranges) {
+    uint64_t count = total_size / RANGE_MIN_SIZE;
+    if (count > (uint64_t) g_streams) count = g_streams;
+    if (count < 1) count = 1;
+    uint64_t piece = total_size / count;
+    for (uint64_t i = 0; i < count; i++) {
+        ranges[i].offset = i * piece;
+        ranges[i].length = i == count - 1 ? total_size - i * piece : piece;
+        ranges[i].done = 0;
+    }
+    return count;
+}
+
+typedef struct {
+    const char* remote_filename;
+    char part_filename[280];
+    char state_filename[288];
+    int fd;                         // The .part file
+    uint64_t total_size;
+    uint64_t version;               // FssRangeInfo.version every piece must match
+    int range_count;
+    RangeState ranges[MAX_STREAMS];
+    pthread_mutex_t lock;           // Guards ranges[].done and the state file
+} RangedDownload;
 
+// One thread per piece, for ranged downloads and chunked uploads alike
+typedef struct {
+    void* job;                      // RangedDownload or ChunkedUpload
+    int index;
+    pthread_t thread;
+} RangeWorkerArgs;
+
+// Writes the progress of every piece to the state file, replacing it atomically.
+// Called with download->lock held. Data already written to the .part file is only in the
+// page cache, so this survives a killed client or a broken connection, not a power cut.
+static int SaveRangeState(RangedDownload* download) {
+    char temp_filename[300];
+    snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", download->state_filename);
+    FILE* f = fopen(temp_filename, "w");
+    if (f == NULL) {
+        perror("Ranged download: cannot write state file");
+        return -1;
+    }
+    fprintf(f, "fss-resume 1\n%s\n%llu %llu %d\n", download->remote_filename,
+            (unsigned long long) download->version, (unsigned long long) download->total_size,
+            download->range_count);
+    for (int i = 0; i < download->range_count; i++) {
+        RangeState* range = &download->ranges[i];
+        fprintf(f, "%llu %llu %llu\n", (unsigned long long) range->offset,
+                (unsigned long long) range->length, (unsigned long long) range->done);
+    }
+    if (fclose(f) != 0 || rename(temp_filename, download->state_filename) != 0) {
+        perror("Ranged download: cannot write state file");
+        unlink(temp_filename);
+        return -1;
+    }
+    return 0;
+}
+
+// Loads the state left by an interrupted download of the same remote file.
+// Returns 0 if it describes the same file version and a consistent set of pieces.
+static int LoadRangeState(RangedDownload* download) {
+    FILE* f = fopen(download->state_filename, "r");
+    if (f == NULL) return -1;
+
+    char remote[256];
+    unsigned long long version, total_size;
+    int range_count;
+    int rc = -1;
+    if (fscanf(f, "fss-resume 1 %255s %llu %llu %d", remote, &version, &total_size, &range_count) != 4 ||
+        strcmp(remote, download->remote_filename) != 0 || version != download->version ||
+        total_size != download->total_size || range_count < 1 || range_count > MAX_STREAMS) {
+        goto out;
+    }
+
+    uint64_t expected_offset = 0;
+    for (int i = 0; i < range_count; i++) {
+        unsigned long long offset, length, done;
+        if (fscanf(f, "%llu %llu %llu", &offset, &length, &done) != 3 || offset != expected_offset ||
+            done > length) {
+            goto out;
+        }
+        download->ranges[i].offset = offset;
+        download->ranges[i].length = length;
+        download->ranges[i].done = done;
+        expected_offset += length;
+    }
+    if (expected_offset != total_size) goto out;
+    download->range_count = range_count;
+    rc = 0;
+
+out:
+    fclose(f);
+    return rc;
+}
+
+// Asks for the size and version of a file with an empty range request.
+// Returns 0 with *info filled in, 1 if the server refused, -1 if the connection broke.
+static int ProbeRange(int socket, const char* remote_filename, FssRangeInfo* info) {
+    FssRangeRequest request = { htobe64(0), htobe64(0) };
+    if (SendRequest(socket, "range", remote_filename, &request, sizeof(request)) < 0) return -1;
+
+    uint32_t status;
+    if (ReceiveResponse(socket, &status) < 0) return -1;
+    if (status != FSS_STATUS_OK) {
+        printf("Download of %s failed: %s\n", remote_filename, StatusString(status));
+        return 1;
+    }
+
+    int end_frame;
+    if (recv(socket, info, sizeof(*info), MSG_WAITALL) != sizeof(*info) ||
+        recv(socket, &end_frame, sizeof(end_frame), MSG_WAITALL) != sizeof(end_frame) || end_frame != 0) {
+        fprintf(stderr, "Ranged download: malformed range reply\n");
+        return -1;
+    }
+    info->total_size = be64toh(info->total_size);
+    info->version = be64toh(info->version);
+    return 0;
+}
+
+// Fetches what is missing of one piece over an open connection.
+// Returns 0 when the piece is complete, 1 if retrying cannot help, -1 if the connection broke.
+static int FetchRange(int socket, RangedDownload* download, RangeState* range, char* buff) {
+    uint64_t position = range->offset + range->done;
+    uint64_t remaining = range->length - range->done;
+    FssRangeRequest request = { htobe64(position), htobe64(remaining) };
+    if (SendRequest(socket, "range", download->remote_filename, &request, sizeof(request)) < 0) return -1;
+
+    uint32_t status;
+    if (ReceiveResponse(socket, &status) < 0) return -1;
+    if (status == FSS_STATUS_BUSY) return -1; // Worth another try
+    if (status != FSS_STATUS_OK) {
+        fprintf(stderr, "Ranged download of %s: %s\n", download->remote_filename, StatusString(status));
+        return 1;
+    }
+
+    FssRangeInfo info;
+    if (recv(socket, &info, sizeof(info), MSG_WAITALL) != sizeof(info)) return -1;
+    if (be64toh(info.version) != download->version || be64toh(info.total_size) != download->total_size ||
+        be64toh(info.length) != remaining) {
+        fprintf(stderr, "Ranged download: %s changed on the server, start the download over\n",
+                download->remote_filename);
+        return 1;
+    }
+
+    uint64_t unsaved = 0;
     while (true) {
-        // 1. Read a chunk from the local file
-        bytes_read = read(fd, buff, CHUNK_SIZE);
-
-        if (bytes_read < 0) {
-            perror("Upload: Failed to read from local file");
-            // Error reading file, break loop and send 0 size? Or just close?
-            // Let's break and proceed to send 0 size to terminate server side cleanly.
-            bytes_read = 0; // Ensure we send 0 size below
+        int chunk_size_n;
+        if (recv(socket, &chunk_size_n, sizeof(chunk_size_n), MSG_WAITALL) != sizeof(chunk_size_n)) return -1;
+        uint32_t chunk_size = ntohl(chunk_size_n);
+        if (chunk_size == 0) break;
+        if (chunk_size > g_frame_size || chunk_size > remaining) {
+            fprintf(stderr, "Ranged download: invalid chunk size %u\n", chunk_size);
+            return -1;
+        }
+        if (recv(socket, buff, chunk_size, MSG_WAITALL) != (ssize_t) chunk_size) return -1;
+
+        for (uint32_t written = 0; written < chunk_size; ) {
+            ssize_t n = pwrite(download->fd, buff + written, chunk_size - written, position + written);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("Ranged download: pwrite failed");
+                return 1;
+            }
+            written += n;
+        }
+        position += chunk_size;
+        remaining -= chunk_size;
+        unsaved += chunk_size;
+
+        pthread_mutex_lock(&download->lock);
+        range->done += chunk_size;
+        if (unsaved >= RANGE_SAVE_INTERVAL) {
+            SaveRangeState(download);
+            unsaved = 0;
+        }
+        pthread_mutex_unlock(&download->lock);
+    }
+    return remaining == 0 ? 0 : -1;
+}
+
+// Thread function: fetches one piece over its own connection, reconnecting after failures.
+static void* RangeWorker(void* arg) {
+    RangeWorkerArgs* args = arg;
+    RangedDownload* download = args->job;
+    RangeState* range = &download->ranges[args->index];
+    char* buff = NULL;
+
+    for (int attempt = 0; attempt < RANGE_RETRIES && range->done < range->length; attempt++) {
+        if (attempt > 0) sleep(attempt); // Back off before reconnecting
+        int socket = ConnectToServer();
+        if (socket < 0) continue;
+        if (!g_persistent) {
+            fprintf(stderr, "Ranged download: server stopped offering persistent connections\n");
+            close(socket);
             break;
         }
 
-        // 2. Send chunk size (network byte order)
-        chunk_size_n = htonl(bytes_read); // bytes_read will be 0 on EOF or error now
-        bytes_sent_total = 0;
-        while (bytes_sent_total < sizeof(int)) {
-             bytes_sent_now = send(socket, ((char*)&chunk_size_n) + bytes_sent_total, sizeof(int) - bytes_sent_total, 0);
-             if (bytes_sent_now < 0) {
-                 perror("Upload: send chunk size failed");
-                 close(fd);
-                 return; // Cannot continue
-             }
-             bytes_sent_total += bytes_sent_now;
+        // Each connection may negotiate its own frame size
+        char* resized = realloc(buff, g_frame_size);
+        if (resized == NULL) {
+            perror("Ranged download: malloc failed");
+            close(socket);
+            break;
         }
+        buff = resized;
 
+        int rc = FetchRange(socket, download, range, buff);
+        close(socket);
+        if (rc >= 0) break; // Done, or retrying cannot help
+        fprintf(stderr, "Ranged download: piece %d interrupted at %llu/%llu bytes, retrying\n", args->index,
+                (unsigned long long) range->done, (unsigned long long) range->length);
+    }
 
-        // 3. If chunk size was 0 (EOF or error), break loop *after* sending 0 size
-        if (bytes_read == 0) {
-            printf("Upload: Reached end of file or read error for %s.\n", local_filename);
+    free(buff);
+    return NULL;
+}
+
+// Downloads remote_filename to local_filename over up to g_streams parallel connections,
+// resuming an earlier attempt if its state file matches. The probe runs on the caller's
+// connection, which must have no requests in flight.
+// Returns 0 if the connection is still usable (whether or not the download completed),
+// -1 if it broke.
+static int DownloadFileInRanges(int socket, const char* remote_filename, const char* local_filename) {
+    FssRangeInfo info;
+    int rc = ProbeRange(socket, remote_filename, &info);
+    if (rc != 0) return rc < 0 ? -1 : 0;
+
+    RangedDownload* download = calloc(1, sizeof(RangedDownload));
+    if (download == NULL) {
+        perror("Ranged download: malloc failed");
+        return 0;
+    }
+    download->remote_filename = remote_filename;
+    download->total_size = info.total_size;
+    download->version = info.version;
+    pthread_mutex_init(&download->lock, NULL);
+    snprintf(download->part_filename, sizeof(download->part_filename), "%s.part", local_filename);
+    snprintf(download->state_filename, sizeof(download->state_filename), "%s.part.state", local_filename);
+
+    uint64_t resumed = 0;
+    bool resuming = LoadRangeState(download) == 0 && access(download->part_filename, F_OK) == 0;
+    if (resuming) {
+        for (int i = 0; i < download->range_count; i++) resumed += download->ranges[i].done;
+    } else {
+        download->range_count = SplitIntoRanges(download->total_size, download->ranges);
+    }
+
+    download->fd = open(download->part_filename, O_RDWR | O_CREAT | (resuming ? 0 : O_TRUNC), 0666);
+    if (download->fd < 0 || ftruncate(download->fd, download->total_size) < 0) {
+        perror("Ranged download: cannot prepare the local file");
+        goto out;
+    }
+    pthread_mutex_lock(&download->lock);
+    SaveRangeState(download);
+    pthread_mutex_unlock(&download->lock);
+
+    printf("Ranged download of %s: %llu bytes over %d connection(s)", remote_filename,
+           (unsigned long long) download->total_size, download->range_count);
+    if (resuming) printf(", resuming with %llu bytes present", (unsigned long long) resumed);
+    printf("\n");
+
+    RangeWorkerArgs workers[MAX_STREAMS];
+    int started = 0;
+    for (int i = 0; i < download->range_count; i++) {
+        workers[i].job = download;
+        workers[i].index = i;
+        if (pthread_create(&workers[i].thread, NULL, RangeWorker, &workers[i]) != 0) {
+            perror("Ranged download: pthread_create failed");
             break;
         }
+        started++;
+    }
+    for (int i = 0; i < started; i++) pthread_join(workers[i].thread, NULL);
 
-        // 4. Send chunk data
-        bytes_sent_total = 0;
-        while (bytes_sent_total < bytes_read) {
-            bytes_sent_now = send(socket, buff + bytes_sent_total, bytes_read - bytes_sent_total, 0);
-             if (bytes_sent_now < 0) {
-                 perror("Upload: send chunk data failed");
-                 close(fd);
-                 return; // Cannot continue
-             }
-             bytes_sent_total += bytes_sent_now;
+    uint64_t received = 0;
+    for (int i = 0; i < download->range_count; i++) received += download->ranges[i].done;
+    if (received == download->total_size) {
+        if (close(download->fd) < 0 || rename(download->part_filename, local_filename) < 0) {
+            perror("Ranged download: cannot finish the local file");
+            download->fd = -1;
+            goto out;
         }
-         printf("Upload: Sent %zd bytes from %s\n", bytes_sent_total, local_filename);
+        download->fd = -1;
+        unlink(download->state_filename);
+        printf("Download finished for %s (%llu bytes).\n", local_filename, (unsigned long long) received);
+    } else {
+        pthread_mutex_lock(&download->lock);
+        SaveRangeState(download);
+        pthread_mutex_unlock(&download->lock);
+        printf("Download of %s incomplete (%llu of %llu bytes); download it again to resume.\n", local_filename,
+               (unsigned long long) received, (unsigned long long) download->total_size);
+    }
 
-    } // End while loop
+out:
+    if (download->fd >= 0) close(download->fd);
+    pthread_mutex_destroy(&download->lock);
+    free(download);
+    return 0;
+}
 
-    close(fd);
-    printf("Upload finished for %s.\n", local_filename);
+// --- Chunked uploads ---
+// Uploads that go through an upload session: with -j N > 1 a file of at least
+// 2 * RANGE_MIN_SIZE is sent in up to N pieces over parallel connections, and against a
+// server that grants FSS_FLAG_DEDUP every upload first sends its chunk list
+// (upload-dedup) and then only the bytes the server does not have. The session is opened
+// and committed on the caller's connection; the pieces go over connections of their own.
+
+typedef struct {
+    const char* remote_filename;
+    int fd;                         // Local file, read with pread by every worker
+    uint64_t session_id;
+    RangeState* pieces;             // done is set to length once the server stored the piece
+    int piece_count;
+    pthread_mutex_t lock;           // Guards next_piece and failed
+    int next_piece;                 // Next piece a worker takes
+    bool failed;                    // A piece failed for good; workers stop
+} ChunkedUpload;
+
+// Splits the byte ranges still to send into pieces for up to g_streams workers.
+// Returns the pieces (host byte order) with *piece_count set, or NULL if out of memory.
+static RangeState* SplitUploadPieces(const RangeState* ranges, int range_count, int* piece_count) {
+    uint64_t total = 0;
+    for (int i = 0; i < range_count; i++) total += ranges[i].length;
+    uint64_t piece_size = (total + g_streams - 1) / g_streams;
+    if (piece_size < RANGE_MIN_SIZE) piece_size = RANGE_MIN_SIZE;
+
+    int count = 0;
+    for (int i = 0; i < range_count; i++) count += (ranges[i].length + piece_size - 1) / piece_size;
+    RangeState* pieces = malloc((count ? count : 1) * sizeof(RangeState));
+    if (pieces == NULL) return NULL;
+
+    *piece_count = 0;
+    for (int i = 0; i < range_count; i++) {
+        for (uint64_t done = 0; done < ranges[i].length; done += piece_size) {
+            RangeState* piece = &pieces[(*piece_count)++];
+            piece->offset = ranges[i].offset + done;
+            piece->length = ranges[i].length - done < piece_size ? ranges[i].length - done : piece_size;
+            piece->done = 0;
+        }
+    }
+    return pieces;
 }
 
+// Sends one piece as an "upload-part" over an open connection.
+// Returns 0 once the server stored it, 1 if retrying cannot help, -1 if the connection broke.
+static int SendUploadPart(int socket, ChunkedUpload* upload, RangeState* range, char* buff) {
+    FssUploadPart part = { htobe64(upload->session_id), htobe64(range->offset), htobe64(range->length) };
+    if (SendRequest(socket, "upload-part", upload->remote_filename, &part, sizeof(part)) < 0) return -1;
 
-// Refactored function to handle user input and initiate requests
-void RequestGenerator(int socket) {
-    char command[32];
-    char filename[256];
-    char input_buffer[300]; // Buffer for combined input
+    for (uint64_t sent = 0; sent < range->length; ) {
+        size_t want = range->length - sent < g_frame_size ? range->length - sent : g_frame_size;
+        ssize_t n = pread(upload->fd, buff, want, range->offset + sent);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            perror("Chunked upload: read from local file failed");
+            return -1; // The server drops the connection on the unfinished part
+        }
+        if (fss_send_frame(socket, buff, n) < 0) return -1;
+        sent += n;
+    }
+    if (fss_send_frame(socket, NULL, 0) < 0) return -1;
 
-    printf("Commands:\n");
-    printf("  upload <local_filename> <remote_filename>\n");
-    printf("  download <remote_filename> <local_filename>\n");
-    printf("Enter command: ");
+    uint32_t status;
+    if (ReceiveResponse(socket, &status) < 0) return -1;
+    if (status == FSS_STATUS_OK) {
+        range->done = range->length;
+        return 0;
+    }
+    if (status == FSS_STATUS_BUSY) return -1; // Worth another try
+    fprintf(stderr, "Chunked upload of %s: %s\n", upload->remote_filename, StatusString(status));
+    return 1;
+}
+
+// Hands out the next piece to send, -1 when there is none left or the upload failed.
+static int TakeUploadPiece(ChunkedUpload* upload) {
+    pthread_mutex_lock(&upload->lock);
+    int index = upload->failed || upload->next_piece == upload->piece_count ? -1 : upload->next_piece++;
+    pthread_mutex_unlock(&upload->lock);
+    return index;
+}
+
+// Thread function: sends pieces over its own connection until none are left,
+// reconnecting after failures.
+static void* UploadPartWorker(void* arg) {
+    RangeWorkerArgs* args = arg;
+    ChunkedUpload* upload = args->job;
+    char* buff = NULL;
+    int socket = -1;
+    int failures = 0;
+    int index;
+
+    while ((index = TakeUploadPiece(upload)) >= 0) {
+        int rc = -1;
+        while (rc < 0 && failures < RANGE_RETRIES) {
+            if (socket < 0) {
+                if (failures > 0) sleep(failures); // Back off before reconnecting
+                socket = ConnectToServer();
+                if (socket < 0) {
+                    failures++;
+                    continue;
+                }
+                char* resized = g_persistent ? realloc(buff, g_frame_size) : NULL;
+                if (resized == NULL) {
+                    fprintf(stderr, "Chunked upload: cannot use this connection\n");
+                    break;
+                }
+                buff = resized;
+            }
+            rc = SendUploadPart(socket, upload, &upload->pieces[index], buff);
+            if (rc < 0) {
+                close(socket);
+                socket = -1;
+                failures++;
+                fprintf(stderr, "Chunked upload: piece at %llu interrupted, retrying\n",
+                        (unsigned long long) upload->pieces[index].offset);
+            }
+        }
+        if (rc != 0) {
+            pthread_mutex_lock(&upload->lock);
+            upload->failed = true;
+            pthread_mutex_unlock(&upload->lock);
+            break;
+        }
+    }
+
+    if (socket >= 0) close(socket);
+    free(buff);
+    return NULL;
+}
+
+// Sends upload-commit (or upload-abort) for the session and reads the answer.
+// Returns 0 with *status set, -1 if the connection broke.
+static int FinishUploadSession(int socket, ChunkedUpload* upload, bool commit, uint32_t* status) {
+    FssUploadSession session = { htobe64(upload->session_id) };
+    if (SendRequest(socket, commit ? "upload-commit" : "upload-abort", upload->remote_filename, &session,
+                    sizeof(session)) < 0) {
+        return -1;
+    }
+    return ReceiveResponse(socket, status);
+}
 
-    // Read the whole line
-    if (fgets(input_buffer, sizeof(input_buffer), stdin) == NULL) {
-        printf("Error reading input.\n");
-        return;
+// Sends the pieces of an open session over up to g_streams connections, then commits the
+// session on the caller's connection (or aborts it if a piece could not be sent).
+// Returns 0 if that connection is still usable, -1 if it broke.
+static int SendPiecesAndCommit(int socket, ChunkedUpload* upload, const char* local_filename) {
+    int workers_wanted = upload->piece_count < g_streams ? upload->piece_count : g_streams;
+    RangeWorkerArgs workers[MAX_STREAMS];
+    int started = 0;
+    pthread_mutex_init(&upload->lock, NULL);
+    upload->next_piece = 0;
+    upload->failed = false;
+    if (workers_wanted == 1) {
+        // A single stream needs no connection of its own
+        char* buff = malloc(g_frame_size);
+        for (int i = 0; buff != NULL && i < upload->piece_count; i++) {
+            int rc = SendUploadPart(socket, upload, &upload->pieces[i], buff);
+            if (rc < 0) {
+                free(buff);
+                return -1;
+            }
+            if (rc > 0) break;
+        }
+        free(buff);
+        workers_wanted = 0;
+    }
+    for (int i = 0; i < workers_wanted; i++) {
+        workers[i].job = upload;
+        workers[i].index = i;
+        if (pthread_create(&workers[i].thread, NULL, UploadPartWorker, &workers[i]) != 0) {
+            perror("Chunked upload: pthread_create failed");
+            break;
+        }
+        started++;
     }
+    for (int i = 0; i < started; i++) pthread_join(workers[i].thread, NULL);
+    pthread_mutex_destroy(&upload->lock);
+
+    bool complete = true;
+    for (int i = 0; i < upload->piece_count; i++) complete = complete && upload->pieces[i].done == upload->pieces[i].length;
 
-    // Remove trailing newline if present
-    input_buffer[strcspn(input_buffer, "\n")] = 0;
+    // Commit publishes the file; after a failed piece, abort so the server drops the staging file
+    uint32_t status;
+    if (FinishUploadSession(socket, upload, complete, &status) < 0) return -1;
+    if (complete) {
+        printf("Upload of %s to %s: %s\n", local_filename, upload->remote_filename, StatusString(status));
+    } else {
+        printf("Upload of %s to %s failed: a piece could not be sent\n", local_filename, upload->remote_filename);
+    }
+    return 0;
+}
+
+// Uploads the open local file fd of total_size bytes in parallel pieces.
+// Returns 0 if the caller's connection is still usable, -1 if it broke.
+static int UploadFileInParts(int socket, int fd, uint64_t total_size, const char* local_filename,
+                             const char* remote_filename) {
+    FssUploadOpen open_request = { htobe64(total_size) };
+    if (SendRequest(socket, "upload-open", remote_filename, &open_request, sizeof(open_request)) < 0) return -1;
+    uint32_t status;
+    if (ReceiveResponse(socket, &status) < 0) return -1;
+    if (status != FSS_STATUS_OK) {
+        printf("Upload of %s to %s: %s\n", local_filename, remote_filename, StatusString(status));
+        return 0;
+    }
+    FssUploadSession session;
+    if (recv(socket, &session, sizeof(session), MSG_WAITALL) != sizeof(session)) return -1;
+
+    ChunkedUpload upload;
+    upload.remote_filename = remote_filename;
+    upload.fd = fd;
+    upload.session_id = be64toh(session.session_id);
+    RangeState whole = { 0, total_size, 0 };
+    upload.pieces = SplitUploadPieces(&whole, 1, &upload.piece_count);
+    if (upload.pieces == NULL) {
+        perror("Chunked upload: malloc failed");
+        return FinishUploadSession(socket, &upload, false, &status);
+    }
+    printf("Chunked upload of %s: %llu bytes in %d piece(s)\n", local_filename,
+           (unsigned long long) total_size, upload.piece_count);
+
+    int rc = SendPiecesAndCommit(socket, &upload, local_filename);
+    free(upload.pieces);
+    return rc;
+}
+
+typedef struct {
+    FssChunkRef* chunks;
+    size_t count;
+    size_t capacity;
+} ChunkList;
+
+static int AppendChunk(void* ctx, size_t len, const uint8_t* hash) {
+    ChunkList* list = ctx;
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 256;
+        FssChunkRef* grown = realloc(list->chunks, capacity * sizeof(FssChunkRef));
+        if (grown == NULL) return -1;
+        list->chunks = grown;
+        list->capacity = capacity;
+    }
+    memcpy(list->chunks[list->count].hash, hash, FSS_CHUNK_HASH_SIZE);
+    list->chunks[list->count].length = htonl(len);
+    list->count++;
+    return 0;
+}
+
+// Reads frames up to the end frame into one malloc'd buffer. Returns it with *len set,
+// or NULL if the connection broke (or memory ran out).
+static char* ReceiveFrames(int socket, size_t* len) {
+    char* data = NULL;
+    *len = 0;
+    while (true) {
+        int chunk_size_n;
+        if (recv(socket, &chunk_size_n, sizeof(chunk_size_n), MSG_WAITALL) != sizeof(chunk_size_n)) break;
+        uint32_t chunk_size = ntohl(chunk_size_n);
+        if (chunk_size == 0) return data != NULL ? data : malloc(1);
+        if (chunk_size > g_frame_size) break;
+        char* grown = realloc(data, *len + chunk_size);
+        if (grown == NULL) break;
+        data = grown;
+        if (recv(socket, data + *len, chunk_size, MSG_WAITALL) != (ssize_t) chunk_size) break;
+        *len += chunk_size;
+    }
+    free(data);
+    return NULL;
+}
+
+// Uploads the open local file fd of total_size bytes to a server with a chunk store,
+// sending only the bytes it does not already have.
+// Returns 0 if the caller's connection is still usable, -1 if it broke.
+static int UploadFileDeduplicated(int socket, int fd, uint64_t total_size, const char* local_filename,
+                                  const char* remote_filename) {
+    ChunkList list = { NULL, 0, 0 };
+    if (fss_chunk_file(fd, AppendChunk, &list) != 0) {
+        perror("Dedup upload: chunking the local file failed");
+        free(list.chunks);
+        return 0;
+    }
+
+    // Request, then the chunk list as frames
+    FssUploadOpen open_request = { htobe64(total_size) };
+    size_t list_bytes = list.count * sizeof(FssChunkRef);
+    int rc = SendRequest(socket, "upload-dedup", remote_filename, &open_request, sizeof(open_request));
+    for (size_t sent = 0; rc == 0 && sent < list_bytes; sent += g_frame_size) {
+        size_t n = list_bytes - sent < g_frame_size ? list_bytes - sent : g_frame_size;
+        rc = fss_send_frame(socket, (char*) list.chunks + sent, n);
+    }
+    free(list.chunks);
+    if (rc < 0 || fss_send_frame(socket, NULL, 0) < 0) return -1;
+
+    uint32_t status;
+    if (ReceiveResponse(socket, &status) < 0) return -1;
+    if (status != FSS_STATUS_OK) {
+        printf("Upload of %s to %s: %s\n", local_filename, remote_filename, StatusString(status));
+        return 0;
+    }
+    FssUploadSession session;
+    size_t missing_bytes;
+    if (recv(socket, &session, sizeof(session), MSG_WAITALL) != sizeof(session)) return -1;
+    FssByteRange* missing = (FssByteRange*) ReceiveFrames(socket, &missing_bytes);
+    if (missing == NULL) return -1;
+
+    int range_count = missing_bytes / sizeof(FssByteRange);
+    RangeState* ranges = malloc((range_count ? range_count : 1) * sizeof(RangeState));
+    uint64_t to_send = 0;
+    for (int i = 0; ranges != NULL && i < range_count; i++) {
+        ranges[i].offset = be64toh(missing[i].offset);
+        ranges[i].length = be64toh(missing[i].length);
+        to_send += ranges[i].length;
+    }
+    free(missing);
+
+    ChunkedUpload upload;
+    upload.remote_filename = remote_filename;
+    upload.fd = fd;
+    upload.session_id = be64toh(session.session_id);
+    upload.pieces = ranges != NULL ? SplitUploadPieces(ranges, range_count, &upload.piece_count) : NULL;
+    free(ranges);
+    if (upload.pieces == NULL) {
+        perror("Dedup upload: malloc failed");
+        return FinishUploadSession(socket, &upload, false, &status);
+    }
+    printf("Dedup upload of %s: sending %llu of %llu bytes, the server has the rest\n", local_filename,
+           (unsigned long long) to_send, (unsigned long long) total_size);
+
+    rc = SendPiecesAndCommit(socket, &upload, local_filename);
+    free(upload.pieces);
+    return rc;
+}
+
+// --- Delta transfers ---
+// With -d, a download over an existing local file and an upload over an existing remote
+// one send only what changed (see delta.h): the side with the old copy sends its block
+// signatures, the other side answers with a delta.
+
+// Computes the signature of the first size bytes of fd. Returns it (NULL on failure, with
+// errno set) with *block_size and *count set.
+static FssBlockSig* ComputeSignature(int fd, uint64_t size, uint32_t* block_size, uint64_t* count) {
+    *block_size = fss_delta_block_size(size);
+    if (*block_size == 0) {
+        errno = EFBIG; // Too many blocks for a signature
+        return NULL;
+    }
+    *count = fss_delta_block_count(size, *block_size);
+    FssBlockSig* sigs = malloc((*count ? *count : 1) * sizeof(FssBlockSig));
+    if (sigs != NULL && fss_delta_signature(fd, size, *block_size, sigs) != 0) {
+        free(sigs);
+        return NULL;
+    }
+    return sigs;
+}
+
+// Downloads remote_filename over the existing local_filename, fetching only what changed.
+// Returns 0 if the connection is still usable, -1 if it broke.
+static int DownloadFileDelta(int socket, const char* remote_filename, const char* local_filename) {
+    int base_fd = open(local_filename, O_RDONLY);
+    struct stat st;
+    if (base_fd < 0 || fstat(base_fd, &st) < 0) {
+        perror("Delta download: cannot read the local copy");
+        if (base_fd >= 0) close(base_fd);
+        return 0;
+    }
+    uint32_t block_size;
+    uint64_t count;
+    FssBlockSig* sigs = ComputeSignature(base_fd, st.st_size, &block_size, &count);
+    if (sigs == NULL) {
+        perror("Delta download: computing the signature failed");
+        close(base_fd);
+        return 0;
+    }
+
+    // Request, then the signature as frames
+    FssDeltaSignature signature = { htobe64(st.st_size), htonl(block_size), 0 };
+    FssFrameWriter writer = { socket, malloc(g_frame_size), g_frame_size, 0 };
+    int rc = writer.buff != NULL &&
+             SendRequest(socket, "download-delta", remote_filename, &signature, sizeof(signature)) == 0 &&
+             fss_frame_put(&writer, sigs, count * sizeof(FssBlockSig)) == 0 &&
+             fss_frame_finish(&writer) == 0 ? 0 : -1;
+    free(writer.buff);
+    free(sigs);
+
+    uint32_t status;
+    if (rc < 0 || ReceiveResponse(socket, &status) < 0) {
+        close(base_fd);
+        return -1;
+    }
+    if (status != FSS_STATUS_OK) {
+        printf("Download to %s failed: %s\n", local_filename, StatusString(status));
+        close(base_fd);
+        return 0;
+    }
+    FssRangeInfo info;
+    if (recv(socket, &info, sizeof(info), MSG_WAITALL) != sizeof(info)) {
+        close(base_fd);
+        return -1;
+    }
+
+    // The new version is built next to the old one, which it copies from, and replaces it at the end
+    char temp_filename[300];
+    snprintf(temp_filename, sizeof(temp_filename), "%s.delta", local_filename);
+    int out_fd = open(temp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out_fd < 0) perror("Delta download: cannot create the new copy");
+
+    uint64_t total_size = be64toh(info.total_size);
+    uint64_t literal_bytes = 0;
+    // Without a file to write to, the delta is still read to its end so the connection stays in sync
+    int64_t written = fss_delta_receive(socket, g_frame_size, base_fd, st.st_size, out_fd, total_size, &literal_bytes);
+    close(base_fd);
+    if (out_fd >= 0) close(out_fd);
+
+    rc = 0;
+    if (written == FSS_DELTA_BROKEN) {
+        fprintf(stderr, "Delta download of %s: connection lost\n", remote_filename);
+        rc = -1;
+    } else if (out_fd >= 0 && written == (int64_t) total_size && rename(temp_filename, local_filename) == 0) {
+        printf("Delta download of %s to %s: received %llu of %llu bytes, reused the rest\n", remote_filename,
+               local_filename, (unsigned long long) literal_bytes, (unsigned long long) total_size);
+        return 0;
+    } else {
+        printf("Delta download of %s to %s failed%s\n", remote_filename, local_filename,
+               written == FSS_DELTA_MALFORMED ? ": invalid delta from the server" : "");
+    }
+    if (out_fd >= 0) unlink(temp_filename);
+    return rc;
+}
+
+typedef struct {
+    FssFrameWriter writer;
+    uint64_t literal_bytes;
+} DeltaUpload;
+
+static int SendDeltaOp(void* ctx, uint32_t kind, uint64_t offset, const uint8_t* data, uint32_t length) {
+    DeltaUpload* delta = ctx;
+    if (kind == FSS_DELTA_LITERAL) delta->literal_bytes += length;
+    return fss_delta_send_op(&delta->writer, kind, offset, data, length);
+}
+
+// Uploads the open local file fd of total_size bytes over the server's copy, sending only
+// what changed. Returns 0 if the caller's connection is still usable, -1 if it broke.
+static int UploadFileDelta(int socket, int fd, uint64_t total_size, const char* local_filename,
+                           const char* remote_filename) {
+    FssUploadOpen open_request = { htobe64(total_size) };
+    if (SendRequest(socket, "upload-delta", remote_filename, &open_request, sizeof(open_request)) < 0) return -1;
+    uint32_t status;
+    if (ReceiveResponse(socket, &status) < 0) return -1;
+    if (status != FSS_STATUS_OK) {
+        printf("Upload of %s to %s: %s\n", local_filename, remote_filename, StatusString(status));
+        return 0;
+    }
+    FssUploadSession session;
+    FssDeltaSignature signature;
+    size_t sig_bytes;
+    if (recv(socket, &session, sizeof(session), MSG_WAITALL) != sizeof(session) ||
+        recv(socket, &signature, sizeof(signature), MSG_WAITALL) != sizeof(signature)) {
+        return -1;
+    }
+    FssBlockSig* sigs = (FssBlockSig*) ReceiveFrames(socket, &sig_bytes);
+    if (sigs == NULL) return -1;
+
+    ChunkedUpload upload;
+    upload.remote_filename = remote_filename;
+    upload.fd = fd;
+    upload.session_id = be64toh(session.session_id);
+
+    uint64_t base_size = be64toh(signature.file_size);
+    uint32_t block_size = ntohl(signature.block_size);
+    FssDeltaIndex index;
+    if (block_size < FSS_DELTA_MIN_BLOCK || block_size > FSS_DELTA_MAX_BLOCK ||
+        sig_bytes != fss_delta_block_count(base_size, block_size) * sizeof(FssBlockSig) ||
+        fss_delta_index_init(&index, sigs, sig_bytes / sizeof(FssBlockSig), block_size, base_size) != 0) {
+        fprintf(stderr, "Delta upload of %s: unusable signature from the server\n", local_filename);
+        free(sigs);
+        return FinishUploadSession(socket, &upload, false, &status);
+    }
+
+    // Patch, then the delta as frames
+    DeltaUpload delta = { { socket, malloc(g_frame_size), g_frame_size, 0 }, 0 };
+    int rc = delta.writer.buff != NULL &&
+             SendRequest(socket, "upload-patch", remote_filename, &session, sizeof(session)) == 0 ? 0 : -1;
+    if (rc == 0 && fss_delta_generate(fd, &index, SendDeltaOp, &delta) != 0) {
+        // Nothing can be sent in place of the rest; breaking off makes the server drop the stream
+        perror("Delta upload: reading the local file failed");
+        rc = -1;
+    }
+    if (rc == 0) rc = fss_frame_finish(&delta.writer);
+    free(delta.writer.buff);
+    fss_delta_index_free(&index);
+    free(sigs);
+    if (rc < 0 || ReceiveResponse(socket, &status) < 0) return -1;
+
+    if (status == FSS_STATUS_INCOMPLETE) {
+        // The server's copy changed under the delta: send the whole file into the session instead
+        RangeState whole = { 0, total_size, 0 };
+        upload.pieces = SplitUploadPieces(&whole, 1, &upload.piece_count);
+        if (upload.pieces == NULL) return FinishUploadSession(socket, &upload, false, &status);
+        printf("Delta upload of %s: the server's copy changed, sending all %llu bytes\n", local_filename,
+               (unsigned long long) total_size);
+        rc = SendPiecesAndCommit(socket, &upload, local_filename);
+        free(upload.pieces);
+        return rc;
+    }
+    if (status != FSS_STATUS_OK) {
+        printf("Upload of %s to %s: %s\n", local_filename, remote_filename, StatusString(status));
+        return FinishUploadSession(socket, &upload, false, &status);
+    }
+
+    printf("Delta upload of %s: sent %llu of %llu bytes, the server had the rest\n", local_filename,
+           (unsigned long long) delta.literal_bytes, (unsigned long long) total_size);
+    if (FinishUploadSession(socket, &upload, true, &status) < 0) return -1;
+    printf("Upload of %s to %s: %s\n", local_filename, remote_filename, StatusString(status));
+    return 0;
+}
+
+// Reads the response of the oldest pipelined request.
+// Returns 0 on success, -1 if the connection can no longer be used.
+static int CompleteRequest(int socket, const PendingRequest* request) {
+    if (!request->is_upload) {
+        return DownloadFileFromServer(socket, request->local_filename);
+    }
+    if (!g_persistent) return 0; // Legacy servers do not confirm uploads
+
+    uint32_t status;
+    if (ReceiveResponse(socket, &status) < 0) return -1;
+    printf("Upload of %s to %s: %s\n", request->local_filename, request->remote_filename, StatusString(status));
+    return 0;
+}
+
+// Reads responses of the oldest pipelined requests until at most `keep` remain.
+// Returns 0 on success, -1 if the connection can no longer be used.
+static int CompleteOldestRequests(int socket, PendingRequest* pending, int* pending_count, int keep) {
+    while (*pending_count > keep) {
+        int rc = CompleteRequest(socket, &pending[0]);
+        memmove(&pending[0], &pending[1], (*pending_count - 1) * sizeof(PendingRequest));
+        (*pending_count)--;
+        if (rc < 0) return -1;
+    }
+    return 0;
+}
+
+// Sends a report request ("stats", or "locks" with the number of files) and prints the
+// JSON the server answers with. Returns 0 if the connection is still usable, -1 if it broke.
+static int ShowServerReport(int socket, const char* command, const char* argument) {
+    if (SendRequest(socket, command, argument, NULL, 0) < 0) return -1;
+    if (g_persistent) {
+        uint32_t status;
+        if (ReceiveResponse(socket, &status) < 0) return -1;
+        if (status != FSS_STATUS_OK) {
+            printf("%s failed: %s\n", command, StatusString(status));
+            return 0;
+        }
+    }
+    size_t len;
+    char* text = ReceiveFrames(socket, &len);
+    if (text == NULL) return -1;
+    fwrite(text, 1, len, stdout);
+    free(text);
+    return 0;
+}
+
+// Prints one file's metadata: size, modification time, CRC32C ("-" if the server has none), name.
+static void PrintFileInfo(const FssFileInfo* info, const char* name, int name_len) {
+    uint64_t mtime_ns = be64toh(info->mtime_ns);
+    time_t mtime = (time_t)(mtime_ns / 1000000000ULL);
+    char when[32], crc[16] = "-";
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&mtime));
+    if (ntohs(info->flags) & FSS_INFO_HAS_CRC) snprintf(crc, sizeof(crc), "%08x", ntohl(info->crc));
+    printf("%14llu  %s  %-8s  %.*s\n", (unsigned long long) be64toh(info->size), when, crc, name_len, name);
+}
+
+// Lists the server's files whose names start with prefix, a page per request.
+// Returns 0 if the connection is still usable, -1 if it broke.
+static int ListServerFiles(int socket, const char* prefix) {
+    FssListRequest request;
+    memset(&request, 0, sizeof(request));
+    unsigned long long listed = 0;
+    while (true) {
+        if (SendRequest(socket, "list", prefix, &request, sizeof(request)) < 0) return -1;
+        uint32_t status;
+        if (ReceiveResponse(socket, &status) < 0) return -1;
+        if (status != FSS_STATUS_OK) {
+            printf("List failed: %s\n", StatusString(status));
+            return 0;
+        }
+        FssListInfo info;
+        if (recv(socket, &info, sizeof(info), MSG_WAITALL) != sizeof(info)) return -1;
+        size_t len;
+        char* page = ReceiveFrames(socket, &len);
+        if (page == NULL) return -1;
+
+        size_t pos = 0;
+        for (uint32_t i = 0; i < ntohl(info.count); i++) {
+            FssFileInfo file;
+            if (len - pos < sizeof(file)) break;
+            memcpy(&file, page + pos, sizeof(file));
+            pos += sizeof(file);
+            size_t name_len = ntohs(file.name_len);
+            if (len - pos < name_len || name_len >= sizeof(request.after)) break;
+            PrintFileInfo(&file, page + pos, (int) name_len);
+            memcpy(request.after, page + pos, name_len);
+            request.after[name_len] = '\0';
+            pos += name_len;
+            listed++;
+        }
+        bool complete = pos == len;
+        free(page);
+        if (!complete) {
+            fprintf(stderr, "List: malformed reply\n");
+            return -1;
+        }
+        if (ntohl(info.more) == 0) break;
+    }
+    printf("%llu files\n", listed);
+    return 0;
+}
+
+// Prints the metadata of one file on the server. Returns 0 if the connection is still
+// usable, -1 if it broke.
+static int ShowFileInfo(int socket, const char* remote_filename) {
+    if (SendRequest(socket, "stat", remote_filename, NULL, 0) < 0) return -1;
+    uint32_t status;
+    if (ReceiveResponse(socket, &status) < 0) return -1;
+    if (status != FSS_STATUS_OK) {
+        printf("Stat of %s failed: %s\n", remote_filename, StatusString(status));
+        return 0;
+    }
+    FssFileInfo info;
+    if (recv(socket, &info, sizeof(info), MSG_WAITALL) != sizeof(info)) return -1;
+    PrintFileInfo(&info, remote_filename, (int) strlen(remote_filename));
+    printf("version %016llx\n", (unsigned long long) be64toh(info.version));
+    return 0;
+}
+
+// Whether a name from a batch can be unpacked under the local directory: relative, with no
+// empty, "." or ".." components.
+static bool BatchNameIsSafe(const char* name) {
+    for (const char *part = name; ; ) {
+        const char *slash = strchr(part, '/');
+        size_t len = slash ? (size_t)(slash - part) : strlen(part);
+        if (len == 0 || (len == 1 && part[0] == '.') || (len == 2 && part[0] == '.' && part[1] == '.')) return false;
+        if (slash == NULL) return true;
+        part = slash + 1;
+    }
+}
+
+// Creates the directories leading up to path, like mkdir -p on its dirname.
+// Returns 0 on success, -1 on failure.
+static int MakeParentDirectories(char* path) {
+    for (char *slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        int rc = mkdir(path, 0777);
+        *slash = '/';
+        if (rc != 0 && errno != EEXIST) return -1;
+    }
+    return 0;
+}
+
+// Receives the frames of one batch entry, exactly size bytes, and writes them to fd. A
+// failed write clears *write_ok; the rest of the frames is still read. *crc gets the
+// CRC32C of the data. Returns 0 on success, -1 if the connection broke.
+static int ReceiveBatchFile(int socket, int fd, uint64_t size, char* buff, uint32_t* crc, bool* write_ok) {
+    uint64_t received = 0;
+    *crc = 0;
+    while (true) {
+        uint32_t len_n;
+        if (recv(socket, &len_n, sizeof(len_n), MSG_WAITALL) != sizeof(len_n)) return -1;
+        uint32_t len = ntohl(len_n);
+        if (len == 0) return received == size ? 0 : -1;
+        if (len > g_frame_size || len > size - received) return -1;
+        if (recv(socket, buff, len, MSG_WAITALL) != (ssize_t) len) return -1;
+        if (g_use_checksum) *crc = fss_crc32c(*crc, buff, len);
+        for (uint32_t written = 0; *write_ok && written < len; ) {
+            ssize_t n = write(fd, buff + written, len - written);
+            if (n < 0) {
+                perror("Batch: write to local file failed");
+                *write_ok = false;
+            } else {
+                written += n;
+            }
+        }
+        received += len;
+    }
+}
+
+// Fetches several files with one "batch" request and unpacks them under local_dir: every
+// file under a prefix ending in '*', or the listed names.
+// Returns 0 if the connection is still usable, -1 if it broke.
+static int DownloadBatch(int socket, char** remotes, int remote_count, const char* local_dir) {
+    char *buff = malloc(g_frame_size);
+    if (buff == NULL) {
+        perror("Batch: malloc failed");
+        return 0;
+    }
+    FssBatchRequest request;
+    memset(&request, 0, sizeof(request));
+    int rc;
+    if (remote_count == 1 && remotes[0][strlen(remotes[0]) - 1] == '*') {
+        rc = SendRequest(socket, "batch", remotes[0], &request, sizeof(request));
+    } else {
+        // The names follow the request as frames
+        FssFrameWriter writer = { socket, buff, g_frame_size, 0 };
+        request.count = htonl(remote_count);
+        rc = SendRequest(socket, "batch", "-", &request, sizeof(request));
+        for (int i = 0; i < remote_count && rc == 0; i++) rc = fss_frame_put(&writer, remotes[i], strlen(remotes[i]) + 1);
+        if (rc == 0) rc = fss_frame_finish(&writer);
+    }
+
+    uint32_t status;
+    if (rc < 0 || ReceiveResponse(socket, &status) < 0) {
+        free(buff);
+        return -1;
+    }
+    if (status != FSS_STATUS_OK) {
+        printf("Batch failed: %s\n", StatusString(status));
+        free(buff);
+        return 0;
+    }
+
+    unsigned long long fetched = 0, failed = 0, unchecked = 0, bytes = 0;
+    rc = -1;
+    while (true) {
+        FssBatchEntry entry;
+        char name[256], path[4096];
+        if (recv(socket, &entry, sizeof(entry), MSG_WAITALL) != sizeof(entry)) break;
+        size_t name_len = ntohs(entry.name_len);
+        if (name_len == 0) {
+            rc = 0; // End of the batch
+            break;
+        }
+        if (name_len >= sizeof(name) || recv(socket, name, name_len, MSG_WAITALL) != (ssize_t) name_len) break;
+        name[name_len] = '\0';
+        status = ntohl(entry.status);
+        if (status != FSS_STATUS_OK) {
+            printf("  %s: %s\n", name, StatusString(status));
+            failed++;
+            continue;
+        }
+
+        // Frames of a file that cannot be written are still read, to keep the stream in step
+        int fd = -1;
+        if (!BatchNameIsSafe(name)) {
+            fprintf(stderr, "Batch: not unpacking %s, it would land outside %s\n", name, local_dir);
+        } else {
+            snprintf(path, sizeof(path), "%s/%s", local_dir, name);
+            if (MakeParentDirectories(path) == 0) fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd < 0) perror(path);
+        }
+        uint64_t size = be64toh(entry.size);
+        uint32_t crc;
+        bool write_ok = fd >= 0;
+        if (ReceiveBatchFile(socket, fd, size, buff, &crc, &write_ok) < 0) {
+            fprintf(stderr, "Batch: stream broke off in %s\n", name);
+            if (fd >= 0) close(fd);
+            break;
+        }
+        if (fd >= 0 && close(fd) != 0) write_ok = false;
+        // The server only knows the CRC32C of files whose digest it has stored; the rest are
+        // sent unchecked rather than read twice
+        bool has_crc = ntohs(entry.flags) & FSS_INFO_HAS_CRC;
+        bool corrupt = g_use_checksum && has_crc && crc != ntohl(entry.crc);
+        if (corrupt) fprintf(stderr, "  %s: checksum mismatch, data corrupted\n", name);
+        if (!write_ok || corrupt) {
+            if (fd >= 0) unlink(path); // Whatever was written cannot be trusted
+            failed++;
+            continue;
+        }
+        fetched++;
+        if (g_use_checksum && !has_crc) unchecked++;
+        bytes += size;
+    }
+    printf("Batch: %llu files (%llu bytes) unpacked into %s, %llu failed\n", fetched, bytes, local_dir, failed);
+    if (unchecked > 0) printf("Batch: %llu files had no stored CRC32C and were not checked\n", unchecked);
+    free(buff);
+    return rc;
+}
+
+// Parses and runs one "upload <local> <remote>" / "download <remote> <local>" command.
+// Downloads are only sent here; their responses are read later, so several requests can
+// be in flight at once. An upload first collects every outstanding response: the server
+// answers requests in order and is not reading while it sends, so pushing upload data
+// behind an unread download could fill both socket buffers and stall both ends.
+// Returns -1 if the connection broke.
+static int RunCommand(int socket, char* line, PendingRequest* pending, int* pending_count) {
+    char command[32];
 
     // --- Parse the input ---
     char* token;
-    char* rest = input_buffer;
-    char* args[3]; // command, arg1, arg2
+    char* rest = line;
+    char* args[64]; // command, then its arguments
     int arg_count = 0;
 
-    while ((token = strtok_r(rest, " ", &rest)) != NULL && arg_count < 3) {
+    while ((token = strtok_r(rest, " \t", &rest)) != NULL && arg_count < (int)(sizeof(args) / sizeof(args[0]))) {
         args[arg_count++] = token;
     }
+    if (arg_count == 0) return 0; // Empty command
+
+    if (strcasecmp(args[0], "STATS") == 0 || strcasecmp(args[0], "LOCKS") == 0) {
+        // Answered in order like any request, so everything pending is collected first
+        if (CompleteOldestRequests(socket, pending, pending_count, 0) < 0) return -1;
+        if (strcasecmp(args[0], "STATS") == 0) return ShowServerReport(socket, "stats", "-");
+        return ShowServerReport(socket, "locks", arg_count > 1 ? args[1] : "-");
+    }
+    if (strcasecmp(args[0], "LIST") == 0 || strcasecmp(args[0], "STAT") == 0) {
+        if (!g_persistent) {
+            printf("%s needs a persistent v2 connection\n", args[0]);
+            return 0;
+        }
+        if (CompleteOldestRequests(socket, pending, pending_count, 0) < 0) return -1;
+        if (strcasecmp(args[0], "LIST") == 0) return ListServerFiles(socket, arg_count > 1 ? args[1] : "*");
+        if (arg_count != 2) {
+            printf("STAT format: STAT <remote_filename>\n");
+            return 0;
+        }
+        return ShowFileInfo(socket, args[1]);
+    }
+    if (strcasecmp(args[0], "BATCH") == 0) {
+        if (!g_persistent) {
+            printf("%s needs a persistent v2 connection\n", args[0]);
+            return 0;
+        }
+        if (arg_count < 3) {
+            printf("BATCH format: BATCH <remote_prefix*|remote_filename...> <local_directory>\n");
+            return 0;
+        }
+        for (int i = 1; i < arg_count - 1; i++) {
+            if (strlen(args[i]) >= 256) {
+                printf("Filenames must be shorter than 256 characters.\n");
+                return 0;
+            }
+        }
+        if (CompleteOldestRequests(socket, pending, pending_count, 0) < 0) return -1;
+        return DownloadBatch(socket, args + 1, arg_count - 2, args[arg_count - 1]);
+    }
 
     if (arg_count < 2) {
         printf("Invalid command format.\n");
-        return;
+        return 0;
     }
 
     strncpy(command, args[0], sizeof(command) - 1);
@@ -213,95 +1645,250 @@ void RequestGenerator(int socket) {
 
     const char* remote_filename = NULL;
     const char* local_filename = NULL;
+    bool is_upload;
 
     // Determine filenames based on command
     if (strcasecmp(command, "UPLOAD") == 0) {
         if (arg_count != 3) {
              printf("UPLOAD format: UPLOAD <local_filename> <remote_filename>\n");
-             return;
+             return 0;
         }
         local_filename = args[1];
         remote_filename = args[2];
+        is_upload = true;
     } else if (strcasecmp(command, "DOWNLOAD") == 0) {
          if (arg_count != 3) {
              printf("DOWNLOAD format: DOWNLOAD <remote_filename> <local_filename>\n");
-             return;
+             return 0;
          }
         remote_filename = args[1];
         local_filename = args[2];
+        is_upload = false;
     } else {
         printf("Unknown command: %s\n", command);
-        return;
+        return 0;
     }
 
-     // Ensure filenames are not empty
+     // Ensure filenames are not empty or too long for the protocol
     if (strlen(local_filename) == 0 || strlen(remote_filename) == 0) {
         printf("Filenames cannot be empty.\n");
-        return;
+        return 0;
+    }
+    if (strlen(local_filename) >= sizeof(pending->local_filename) || strlen(remote_filename) >= sizeof(pending->remote_filename)) {
+        printf("Filenames must be shorter than %zu characters.\n", sizeof(pending->remote_filename));
+        return 0;
     }
 
     printf("Command: %s, Local: %s, Remote: %s\n", command, local_filename, remote_filename);
 
+    // Parallel downloads, and any download with a .part.state file left behind, go by ranges
+    char state_filename[300];
+    snprintf(state_filename, sizeof(state_filename), "%s.part.state", local_filename);
 
-    // --- Send request to server according to protocol ---
-    // 1. Send Command Length + Command
-    int command_len = strlen(command) + 1; // Include null terminator
-    int command_len_n = htonl(command_len);
-    if (send(socket, &command_len_n, sizeof(command_len_n), 0) < 0) {
-        perror("send command length failed"); return;
+    // With -d, a download over an existing local copy only fetches what changed
+    struct stat st;
+    if (!is_upload && g_delta && access(state_filename, F_OK) != 0 && stat(local_filename, &st) == 0 &&
+        S_ISREG(st.st_mode) && st.st_size >= DELTA_MIN_SIZE) {
+        // The signature goes out on this connection, so nothing may be pending on it
+        if (CompleteOldestRequests(socket, pending, pending_count, 0) < 0) return -1;
+        return DownloadFileDelta(socket, remote_filename, local_filename);
     }
-    if (send(socket, command, command_len, 0) < 0) {
-        perror("send command failed"); return;
+    if (!is_upload && (g_streams > 1 || access(state_filename, F_OK) == 0)) {
+        if (g_persistent) {
+            // The probe runs on this connection and needs it to itself
+            if (CompleteOldestRequests(socket, pending, pending_count, 0) < 0) return -1;
+            return DownloadFileInRanges(socket, remote_filename, local_filename);
+        }
+        printf("Ranged downloads need a persistent v2 connection, downloading over one stream\n");
     }
 
-    // 2. Send Filename Length + Filename (Use the *remote* filename for the server)
-    int filename_len = strlen(remote_filename) + 1; // Include null terminator
-    int filename_len_n = htonl(filename_len);
-     if (send(socket, &filename_len_n, sizeof(filename_len_n), 0) < 0) {
-        perror("send filename length failed"); return;
+    int fd = -1;
+    if (is_upload) {
+        // Open before sending anything: once the request is out, the server expects frames
+        fd = open(local_filename, O_RDONLY);
+        if (fd < 0) {
+            perror("Upload: Failed to open local file for reading");
+            return 0;
+        }
     }
-    if (send(socket, remote_filename, filename_len, 0) < 0) {
-        perror("send filename failed"); return;
+
+    // Make room in the pipeline; uploads drain it completely (see above)
+    if (CompleteOldestRequests(socket, pending, pending_count, is_upload ? 0 : MAX_PIPELINE - 1) < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
     }
 
-    printf("Sent request to server: %s %s\n", command, remote_filename);
+    // With -d, uploads only send what differs from the server's copy; with a chunk store on
+    // the server, what it does not have yet; otherwise large uploads with -j go through an
+    // upload session in parallel pieces
+    if (is_upload && g_delta && fstat(fd, &st) == 0 && st.st_size >= DELTA_MIN_SIZE) {
+        int rc = UploadFileDelta(socket, fd, st.st_size, local_filename, remote_filename);
+        close(fd);
+        return rc;
+    }
+    if (is_upload && g_dedup && fstat(fd, &st) == 0) {
+        int rc = UploadFileDeduplicated(socket, fd, st.st_size, local_filename, remote_filename);
+        close(fd);
+        return rc;
+    }
+    if (is_upload && g_streams > 1 && g_persistent && fstat(fd, &st) == 0 && st.st_size >= 2 * RANGE_MIN_SIZE) {
+        int rc = UploadFileInParts(socket, fd, st.st_size, local_filename, remote_filename);
+        close(fd);
+        return rc;
+    }
 
-    // --- Call appropriate handler based on command ---
-    if (strcasecmp(command, "UPLOAD") == 0) {
-        UploadFileToServer(socket, local_filename); // Pass local filename to upload
-    } else if (strcasecmp(command, "DOWNLOAD") == 0) {
-        DownloadFileFromServer(socket, local_filename); // Pass local filename to save to
+    // --- Send request to server according to protocol ---
+    // The server matches commands exactly, so send them in lower case
+    const char* wire_command = is_upload ? "upload" : "download";
+    FssTransferOptions options;
+    memset(&options, 0, sizeof(options));
+    options.compression = htonl(g_compression);
+    if (SendRequest(socket, wire_command, remote_filename, &options, g_compress ? sizeof(options) : 0) < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    printf("Sent request to server: %s %s\n", wire_command, remote_filename);
+
+    if (is_upload) {
+        int rc = UploadFileToServer(socket, fd, local_filename); // Pass local filename to upload
+        close(fd);
+        if (rc < 0) return -1;
     }
+
+    PendingRequest *request = &pending[(*pending_count)++];
+    request->is_upload = is_upload;
+    strcpy(request->local_filename, local_filename);
+    strcpy(request->remote_filename, remote_filename);
+    return 0;
 }
 
+// Refactored function to handle user input and initiate requests
+// Reads commands until EOF or "quit". Several commands on one line, separated by ';',
+// are pipelined over one connection; the connection is kept for the next line when the
+// server supports persistent connections and reopened per request when it does not.
+void RequestGenerator(void) {
+    char input_buffer[4096]; // Buffer for combined input
+    PendingRequest pending[MAX_PIPELINE];
+    int pending_count = 0;
+    int socket = -1;
+
+    printf("Commands (separate several with ';' to pipeline them):\n");
+    printf("  upload <local_filename> <remote_filename>\n");
+    printf("  download <remote_filename> <local_filename>\n");
+    printf("  stats\n");
+    printf("  locks [count]\n");
+    printf("  list [prefix]\n");
+    printf("  stat <remote_filename>\n");
+    printf("  batch <remote_prefix*|remote_filename...> <local_directory>\n");
+    printf("  quit\n");
+
+    while (true) {
+        printf("Enter command: ");
+        fflush(stdout);
 
-int main() {
-    int sck_d;
-    sck_d = socket(AF_INET, SOCK_STREAM, 0);
-    if (sck_d == -1){
-        printf("Socket creation for the main socket failed");
-        exit(EXIT_FAILURE);
+        // Read the whole line
+        if (fgets(input_buffer, sizeof(input_buffer), stdin) == NULL) {
+            break; // EOF
+        }
+
+        // Remove trailing newline if present
+        input_buffer[strcspn(input_buffer, "\n")] = 0;
+        if (strcasecmp(input_buffer, "quit") == 0 || strcasecmp(input_buffer, "exit") == 0) {
+            break;
+        }
+
+        char* command;
+        char* rest = input_buffer;
+        while ((command = strtok_r(rest, ";", &rest)) != NULL) {
+            if (socket < 0 && (socket = ConnectToServer()) < 0) {
+                break;
+            }
+
+            bool broken = RunCommand(socket, command, pending, &pending_count) < 0;
+
+            // Without keep-alive the server closes after one request
+            while (!broken && pending_count > 0 && !g_persistent) {
+                broken = CompleteRequest(socket, &pending[0]) < 0;
+                pending_count = 0;
+            }
+            if (broken) {
+                fprintf(stderr, "Connection lost, %d pipelined request(s) got no response\n", pending_count);
+                pending_count = 0;
+            }
+            if (broken || !g_persistent) {
+                close(socket);
+                socket = -1;
+            }
+        }
+
+        // Collect the responses of everything pipelined on this line
+        for (int i = 0; i < pending_count && socket >= 0; i++) {
+            if (CompleteRequest(socket, &pending[i]) < 0) {
+                fprintf(stderr, "Connection lost, %d pipelined request(s) got no response\n", pending_count - i - 1);
+                close(socket);
+                socket = -1;
+            }
+        }
+        pending_count = 0;
     }
-    
 
-    int port = 8080;
-    struct sockaddr_in addr;
-    
-    addr.sin_family = AF_INET;//ipv4
-    addr.sin_port = htons(port);
-    inet_pton(AF_INET , "172.31.153.78" , &addr.sin_addr);
+    if (socket >= 0) close(socket);
+}
 
-    int connected = connect(sck_d , (struct sockaddr *)&addr , sizeof(addr));
-    if (connected < 0)
-    {
-        printf("Error Connecting to the Server");
-        close(sck_d);
-        exit(EXIT_FAILURE);
+
+static void print_usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [-h host] [-p port] [-f frame_size] [-j streams] [-d] [-z mode] [-C] [-1]\n"
+            "  -h host        Server address (default 172.31.153.78)\n"
+            "  -p port        Server port (default 8080)\n"
+            "  -f frame_size  Frame size to request from a v2 server, 64KiB-4MiB (default 1MiB)\n"
+            "  -j streams     Send or fetch each large file over up to this many parallel connections, 1-%d (default 1)\n"
+            "  -d             Delta transfers: update existing files by sending only the blocks that changed\n"
+            "  -z mode        Compress downloads and uploads: none, deflate or auto (skips incompressible data) (default none)\n"
+            "  -C             Do not checksum frames and files (CRC32C, on by default)\n"
+            "  -1             Speak legacy protocol v1 (128-byte frames, no handshake, one request per connection)\n",
+            prog, MAX_STREAMS);
+}
+
+int main(int argc, char* argv[]) {
+    int c;
+
+    while ((c = getopt(argc, argv, "h:p:f:j:dz:C1")) != -1) {
+        switch (c) {
+        case 'h': g_host = optarg; break;
+        case 'p': g_port = atoi(optarg); break;
+        case 'f': g_requested_frame_size = strtoul(optarg, NULL, 10); break;
+        case 'j':
+            g_streams = atoi(optarg);
+            if (g_streams < 1 || g_streams > MAX_STREAMS) {
+                fprintf(stderr, "-j must be between 1 and %d\n", MAX_STREAMS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'd': g_use_delta = true; break;
+        case 'z':
+            if (strcmp(optarg, "none") == 0) g_compression = FSS_COMPRESS_NONE;
+            else if (strcmp(optarg, "deflate") == 0) g_compression = FSS_COMPRESS_DEFLATE;
+            else if (strcmp(optarg, "auto") == 0) g_compression = FSS_COMPRESS_AUTO;
+            else {
+                fprintf(stderr, "-z must be none, deflate or auto\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'C': g_use_checksum = false; break;
+        case '1': g_legacy = true; break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
     }
 
-    RequestGenerator(sck_d);
-    printf("Done");
-    
-    close(sck_d);
+    // A connection the server drops must surface as an error, not kill the client
+    signal(SIGPIPE, SIG_IGN);
+    fss_chunker_init();
+    fss_crc32c_init();
+
+    RequestGenerator();
+    printf("Done\n");
     return 0;
-}
\ No newline at end of file
+}
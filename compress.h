@@ -0,0 +1,102 @@
+#ifndef FSS_COMPRESS_H
+#define FSS_COMPRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "protocol.h"
+
+// Frame compression shared by server.c and client.c (link with -lz).
+//
+// Every frame is compressed on its own, as one complete zlib stream, so a pipeline stage
+// can work on any frame without the frames before it. A frame goes out compressed only if
+// that made it smaller, which also keeps compressed payloads within the frame size. In
+// auto mode a sample from the start of the frame is compressed first, and the frame is
+// sent raw unless the sample shrank by at least FSS_COMPRESS_MIN_SAVING percent: media,
+// archives and encrypted data then cost a small fraction of a frame's compression time.
+
+#define FSS_COMPRESS_LEVEL      1                // Z_BEST_SPEED: the stage must keep up with the link
+#define FSS_COMPRESS_SAMPLE     (64 * 1024)
+#define FSS_COMPRESS_MIN_SAVING 10
+#define FSS_COMPRESS_MIN_FRAME  256              // Smaller frames are not worth a zlib header
+
+typedef struct {
+    z_stream stream;
+} FssCompressor;
+
+typedef struct {
+    z_stream stream;
+} FssDecompressor;
+
+static inline int fss_compressor_init(FssCompressor* c) {
+    memset(c, 0, sizeof(*c));
+    return deflateInit(&c->stream, FSS_COMPRESS_LEVEL) == Z_OK ? 0 : -1;
+}
+
+static inline void fss_compressor_end(FssCompressor* c) {
+    deflateEnd(&c->stream);
+}
+
+static inline int fss_decompressor_init(FssDecompressor* d) {
+    memset(d, 0, sizeof(*d));
+    return inflateInit(&d->stream) == Z_OK ? 0 : -1;
+}
+
+static inline void fss_decompressor_end(FssDecompressor* d) {
+    inflateEnd(&d->stream);
+}
+
+// Deflates len bytes into at most cap bytes of out. Returns the compressed length, or 0 if
+// it did not fit; deflate stops as soon as out is full, so a failed try stays cheap.
+static inline size_t fss_deflate_bounded(FssCompressor* c, const void* data, size_t len, void* out, size_t cap) {
+    deflateReset(&c->stream);
+    c->stream.next_in = (Bytef*) data;
+    c->stream.avail_in = len;
+    c->stream.next_out = out;
+    c->stream.avail_out = cap;
+    return deflate(&c->stream, Z_FINISH) == Z_STREAM_END ? cap - c->stream.avail_out : 0;
+}
+
+// Compresses a frame of len bytes into out, which has room for len bytes. Returns the
+// length of the compressed payload (the original length, 4 bytes in network order, then
+// the zlib stream), or 0 if the frame should be sent as it is.
+static inline size_t fss_compress_frame(FssCompressor* c, uint32_t mode, const void* data, size_t len, uint8_t* out) {
+    if (mode == FSS_COMPRESS_NONE || len < FSS_COMPRESS_MIN_FRAME) return 0;
+
+    if (mode == FSS_COMPRESS_AUTO && len >= 2 * FSS_COMPRESS_SAMPLE) {
+        size_t sample = fss_deflate_bounded(c, data, FSS_COMPRESS_SAMPLE, out,
+                                            FSS_COMPRESS_SAMPLE * (100 - FSS_COMPRESS_MIN_SAVING) / 100);
+        if (sample == 0) return 0;
+    }
+
+    size_t packed = fss_deflate_bounded(c, data, len, out + 4, len - 5);
+    if (packed == 0) return 0;
+    uint32_t len_n = htonl(len);
+    memcpy(out, &len_n, sizeof(len_n));
+    return packed + 4;
+}
+
+// Expands the payload of a compressed frame into out (cap bytes). Returns the original
+// length, or -1 if the payload is corrupt or expands beyond cap.
+static inline ssize_t fss_decompress_frame(FssDecompressor* d, const uint8_t* payload, size_t len, uint8_t* out, size_t cap) {
+    uint32_t raw_n;
+    if (len < sizeof(raw_n)) return -1;
+    memcpy(&raw_n, payload, sizeof(raw_n));
+    size_t raw = ntohl(raw_n);
+    if (raw > cap) return -1;
+
+    inflateReset(&d->stream);
+    d->stream.next_in = (Bytef*) payload + sizeof(raw_n);
+    d->stream.avail_in = len - sizeof(raw_n);
+    d->stream.next_out = out;
+    d->stream.avail_out = raw;
+    if (inflate(&d->stream, Z_FINISH) != Z_STREAM_END || d->stream.avail_out != 0) return -1;
+    return raw;
+}
+
+#endif // FSS_COMPRESS_H
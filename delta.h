@@ -0,0 +1,443 @@
+#ifndef FSS_DELTA_H
+#define FSS_DELTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+#include "chunker.h"
+
+// rsync-style delta transfers shared by server.c and client.c (which need _GNU_SOURCE
+// for copy_file_range()).
+//
+// The side holding the old copy cuts it into fixed-size blocks and sends a signature of
+// each: a weak rolling checksum and a strong hash. The side holding the new version
+// slides a window over it one byte at a time; the weak checksum rolls in constant time,
+// and only a window whose weak checksum matches a block is hashed to confirm it. Matched
+// windows become FSS_DELTA_COPY ops (runs of consecutive blocks merge into one op), the
+// bytes in between FSS_DELTA_LITERAL ops. Inserts and deletions anywhere in the file cost
+// about one block of literal data each.
+
+#define FSS_DELTA_MIN_BLOCK     2048
+#define FSS_DELTA_TARGET_BLOCK  (64 * 1024)      // Largest block picked by size alone
+#define FSS_DELTA_MAX_BLOCK     (1024 * 1024)
+#define FSS_DELTA_MAX_BLOCKS    (1u << 22)       // Longest signature anybody accepts (80 MiB)
+
+// fss_delta_receive() results besides the number of bytes written
+#define FSS_DELTA_BROKEN        -1               // The stream broke off; the connection is lost
+#define FSS_DELTA_MALFORMED     -2               // Invalid op, read up to its end frame
+#define FSS_DELTA_IO_ERROR      -3               // Could not read the old copy or write the new one
+
+// Block size for a copy of size bytes: about sqrt(size), so the signature and the literal
+// data around each edit stay in balance. Returns 0 if the file is too large for a signature.
+static inline uint32_t fss_delta_block_size(uint64_t size) {
+    uint64_t block = FSS_DELTA_MIN_BLOCK;
+    while (block < FSS_DELTA_TARGET_BLOCK && block * block < size) block <<= 1;
+    while (block < FSS_DELTA_MAX_BLOCK && (size + block - 1) / block > FSS_DELTA_MAX_BLOCKS) block <<= 1;
+    return (size + block - 1) / block > FSS_DELTA_MAX_BLOCKS ? 0 : block;
+}
+
+static inline uint64_t fss_delta_block_count(uint64_t size, uint32_t block_size) {
+    return (size + block_size - 1) / block_size;
+}
+
+// Weak checksum of a window (rsync's): a is the byte sum, b the sum of the running a's.
+// Both roll: dropping byte out and taking byte in is a = a - out + in, b = b - len * out + a.
+static inline uint32_t fss_delta_weak(uint32_t a, uint32_t b) {
+    return (a & 0xFFFF) | (b << 16);
+}
+
+static inline void fss_delta_weak_init(const uint8_t* data, size_t len, uint32_t* a, uint32_t* b) {
+    uint32_t sa = 0, sb = 0;
+    for (size_t i = 0; i < len; i++) {
+        sa += data[i];
+        sb += sa;
+    }
+    *a = sa;
+    *b = sb;
+}
+
+static inline void fss_delta_strong(const uint8_t* data, size_t len, uint8_t out[16]) {
+    uint8_t hash[FSS_CHUNK_HASH_SIZE];
+    fss_chunk_hash(data, len, hash);
+    memcpy(out, hash, 16);
+}
+
+// Fills sigs (fss_delta_block_count() entries) with the signature of the first size bytes
+// of fd. Returns 0, or -1 with errno set if reading failed or the file ended early (EIO).
+static inline int fss_delta_signature(int fd, uint64_t size, uint32_t block_size, FssBlockSig* sigs) {
+    size_t capacity = block_size < (1 << 20) ? (1 << 20) : block_size;
+    uint8_t *buff = malloc(capacity);
+    if (buff == NULL) return -1;
+
+    uint64_t offset = 0;
+    size_t index = 0;
+    while (offset < size) {
+        size_t want = size - offset < capacity ? size - offset : capacity;
+        size_t filled = 0;
+        while (filled < want) {
+            ssize_t n = pread(fd, buff + filled, want - filled, offset + filled);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                if (n == 0) errno = EIO;
+                free(buff);
+                return -1;
+            }
+            filled += n;
+        }
+        for (size_t pos = 0; pos < filled; pos += block_size) {
+            size_t len = filled - pos < block_size ? filled - pos : block_size;
+            uint32_t a, b;
+            fss_delta_weak_init(buff + pos, len, &a, &b);
+            sigs[index].weak = htonl(fss_delta_weak(a, b));
+            fss_delta_strong(buff + pos, len, sigs[index].strong);
+            index++;
+        }
+        offset += filled;
+    }
+    free(buff);
+    return 0;
+}
+
+// Lookup structure over a received signature, chained by weak checksum.
+typedef struct {
+    const FssBlockSig* sigs;
+    uint32_t* weak;              // Host byte order copy of sigs[].weak
+    uint32_t* heads;             // Bucket -> first block + 1, 0 if empty
+    uint32_t* next;              // Block -> next block in its bucket + 1
+    int bucket_bits;
+    uint32_t block_size;
+    uint64_t base_size;
+    uint32_t full_blocks;        // Blocks of exactly block_size; a shorter last block is matched only at EOF
+    uint32_t tail_length;        // Length of that shorter last block, 0 if there is none
+} FssDeltaIndex;
+
+static inline uint32_t fss_delta_bucket(const FssDeltaIndex* index, uint32_t weak) {
+    return (weak * 0x9E3779B1u) >> (32 - index->bucket_bits);
+}
+
+// Builds the index over count signatures of a base_size-byte copy. Returns 0 or -1.
+static inline int fss_delta_index_init(FssDeltaIndex* index, const FssBlockSig* sigs, uint64_t count,
+                                       uint32_t block_size, uint64_t base_size) {
+    memset(index, 0, sizeof(*index));
+    index->sigs = sigs;
+    index->block_size = block_size;
+    index->base_size = base_size;
+    index->full_blocks = base_size / block_size;
+    index->tail_length = base_size % block_size;
+    index->bucket_bits = 10;
+    while (index->bucket_bits < 30 && (1ull << index->bucket_bits) < 2 * count) index->bucket_bits++;
+
+    index->weak = malloc((count ? count : 1) * sizeof(uint32_t));
+    index->heads = calloc(1ull << index->bucket_bits, sizeof(uint32_t));
+    index->next = malloc((count ? count : 1) * sizeof(uint32_t));
+    if (index->weak == NULL || index->heads == NULL || index->next == NULL) {
+        free(index->weak);
+        free(index->heads);
+        free(index->next);
+        return -1;
+    }
+    for (uint64_t i = 0; i < count; i++) index->weak[i] = ntohl(sigs[i].weak);
+    // Insert backwards so chains list blocks in file order
+    for (uint64_t i = index->full_blocks; i-- > 0; ) {
+        uint32_t bucket = fss_delta_bucket(index, index->weak[i]);
+        index->next[i] = index->heads[bucket];
+        index->heads[bucket] = i + 1;
+    }
+    return 0;
+}
+
+static inline void fss_delta_index_free(FssDeltaIndex* index) {
+    free(index->weak);
+    free(index->heads);
+    free(index->next);
+}
+
+// Receives the delta ops produced by fss_delta_generate().
+typedef int (*fss_delta_emit_fn)(void* ctx, uint32_t kind, uint64_t offset, const uint8_t* data, uint32_t length);
+
+// Finds a block of the index equal to the window at data. expected is tried first (the
+// block after the previous match), so runs of blocks keep matching in order even when
+// several blocks have the same contents. Returns the block, or -1.
+static inline int64_t fss_delta_find(const FssDeltaIndex* index, uint32_t weak, const uint8_t* data,
+                                     uint64_t expected) {
+    uint32_t link = index->heads[fss_delta_bucket(index, weak)];
+    if (link == 0) return -1;
+
+    uint8_t strong[16];
+    bool hashed = false;
+    if (expected < index->full_blocks && index->weak[expected] == weak) {
+        fss_delta_strong(data, index->block_size, strong);
+        hashed = true;
+        if (memcmp(strong, index->sigs[expected].strong, 16) == 0) return expected;
+    }
+    for (; link != 0; link = index->next[link - 1]) {
+        uint32_t block = link - 1;
+        if (index->weak[block] != weak || block == expected) continue;
+        if (!hashed) {
+            fss_delta_strong(data, index->block_size, strong);
+            hashed = true;
+        }
+        if (memcmp(strong, index->sigs[block].strong, 16) == 0) return block;
+    }
+    return -1;
+}
+
+// Pending output of fss_delta_generate(): a run of copied blocks not emitted yet.
+typedef struct {
+    fss_delta_emit_fn emit;
+    void* ctx;
+    uint64_t copy_offset;
+    uint64_t copy_length;
+} FssDeltaOutput;
+
+static inline int fss_delta_flush_copy(FssDeltaOutput* out) {
+    if (out->copy_length == 0) return 0;
+    int rc = out->emit(out->ctx, FSS_DELTA_COPY, out->copy_offset, NULL, out->copy_length);
+    out->copy_length = 0;
+    return rc;
+}
+
+static inline int fss_delta_literal(FssDeltaOutput* out, const uint8_t* data, size_t len) {
+    if (len == 0) return 0;
+    if (fss_delta_flush_copy(out) != 0) return -1;
+    return out->emit(out->ctx, FSS_DELTA_LITERAL, 0, data, len);
+}
+
+static inline int fss_delta_copy(FssDeltaOutput* out, uint64_t offset, uint64_t len) {
+    if (out->copy_length > 0 && out->copy_offset + out->copy_length == offset &&
+        out->copy_length + len <= UINT32_MAX) {
+        out->copy_length += len;
+        return 0;
+    }
+    if (fss_delta_flush_copy(out) != 0) return -1;
+    out->copy_offset = offset;
+    out->copy_length = len;
+    return 0;
+}
+
+// Reads fd from offset 0 to its end and describes it as a delta against the copy the
+// index was built from, calling emit for each op in order. Returns 0, or -1 if reading
+// failed or emit returned nonzero.
+static inline int fss_delta_generate(int fd, const FssDeltaIndex* index, fss_delta_emit_fn emit, void* ctx) {
+    const uint32_t block = index->block_size;
+    const size_t capacity = block < (256 << 10) ? (1 << 20) : 4 * (size_t) block;
+    uint8_t *buff = malloc(capacity);
+    if (buff == NULL) return -1;
+
+    FssDeltaOutput out = { emit, ctx, 0, 0 };
+    uint64_t file_offset = 0;
+    size_t filled = 0, pos = 0, literal = 0;
+    bool eof = false, rolling = false;
+    uint32_t a = 0, b = 0;
+    int rc = 0;
+
+    while (rc == 0) {
+        if (!eof && filled - pos < block) {
+            // Emit the literal bytes before the window and slide the rest to the front
+            if (fss_delta_literal(&out, buff + literal, pos - literal) != 0) {
+                rc = -1;
+                break;
+            }
+            memmove(buff, buff + pos, filled - pos);
+            filled -= pos;
+            pos = literal = 0;
+            while (!eof && filled < capacity) {
+                ssize_t n = pread(fd, buff + filled, capacity - filled, file_offset);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) {
+                    rc = -1;
+                    break;
+                }
+                if (n == 0) eof = true;
+                filled += n;
+                file_offset += n;
+            }
+            continue;
+        }
+
+        size_t available = filled - pos;
+        if (available < block) {
+            // The end of the file: only the old copy's short last block can still match
+            if (available > 0 && available == index->tail_length) {
+                uint32_t ta, tb;
+                uint8_t strong[16];
+                fss_delta_weak_init(buff + pos, available, &ta, &tb);
+                uint64_t tail = index->full_blocks;
+                if (index->weak[tail] == fss_delta_weak(ta, tb)) {
+                    fss_delta_strong(buff + pos, available, strong);
+                    if (memcmp(strong, index->sigs[tail].strong, 16) == 0) {
+                        if (fss_delta_literal(&out, buff + literal, pos - literal) != 0 ||
+                            fss_delta_copy(&out, tail * block, available) != 0) {
+                            rc = -1;
+                            break;
+                        }
+                        pos = literal = filled;
+                    }
+                }
+            }
+            pos = filled;
+            break;
+        }
+
+        if (!rolling) {
+            fss_delta_weak_init(buff + pos, block, &a, &b);
+            rolling = true;
+        }
+        uint64_t expected = out.copy_length > 0 ? (out.copy_offset + out.copy_length) / block : 0;
+        int64_t match = index->full_blocks > 0 ? fss_delta_find(index, fss_delta_weak(a, b), buff + pos, expected) : -1;
+        if (match >= 0) {
+            if (fss_delta_literal(&out, buff + literal, pos - literal) != 0 ||
+                fss_delta_copy(&out, (uint64_t) match * block, block) != 0) {
+                rc = -1;
+                break;
+            }
+            pos += block;
+            literal = pos;
+            rolling = false;
+            continue;
+        }
+
+        // Slide the window by one byte
+        if (pos + block < filled) {
+            uint8_t drop = buff[pos], take = buff[pos + block];
+            a += take - drop;
+            b += a - block * (uint32_t) drop;
+        } else {
+            rolling = false; // Next window needs data that is not read yet
+        }
+        pos++;
+    }
+
+    if (rc == 0 && (fss_delta_literal(&out, buff + literal, pos - literal) != 0 || fss_delta_flush_copy(&out) != 0)) {
+        rc = -1;
+    }
+    free(buff);
+    return rc;
+}
+
+// Copies length bytes between files, with copy_file_range() where the kernel supports it
+// (sharing blocks on file systems with reflinks) and pread/pwrite otherwise.
+// Returns 0, or -1 on error or if src ends early.
+static inline int fss_copy_file_bytes(int src_fd, uint64_t src_offset, int dst_fd, uint64_t dst_offset, uint64_t length) {
+    loff_t in = src_offset, out = dst_offset;
+    while (length > 0) {
+        ssize_t n = copy_file_range(src_fd, &in, dst_fd, &out, length, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) break;
+        if (n <= 0) return -1;
+        length -= n;
+    }
+
+    char buff[64 * 1024];
+    while (length > 0) {
+        ssize_t n = pread(src_fd, buff, length < sizeof(buff) ? length : sizeof(buff), in);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        for (ssize_t written = 0; written < n; ) {
+            ssize_t w = pwrite(dst_fd, buff + written, n - written, out + written);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0) return -1;
+            written += w;
+        }
+        in += n;
+        out += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Reads a delta stream from socket (frames of up to frame_size bytes and the end frame)
+// and writes the version it describes to out_fd from offset 0, copying from base_fd
+// (base_size bytes, -1 if there is no old copy). The result may not exceed max_size.
+// Returns the number of bytes written, with *literal_bytes counting those that came over
+// the wire, or one of the FSS_DELTA_* errors.
+static inline int64_t fss_delta_receive(int socket, uint32_t frame_size, int base_fd, uint64_t base_size,
+                                        int out_fd, uint64_t max_size, uint64_t* literal_bytes) {
+    uint8_t *buff = malloc(frame_size);
+    if (buff == NULL) return FSS_DELTA_BROKEN;
+
+    FssDeltaOp op;
+    size_t op_filled = 0;
+    uint64_t literal_left = 0;
+    uint64_t written = 0;
+    int64_t error = 0;          // First error; the rest of the stream is read and dropped
+    *literal_bytes = 0;
+
+    while (true) {
+        int chunk_size_n;
+        if (recv(socket, &chunk_size_n, sizeof(chunk_size_n), MSG_WAITALL) != sizeof(chunk_size_n)) break;
+        uint32_t chunk_size = ntohl(chunk_size_n);
+        if (chunk_size == 0) {
+            free(buff);
+            if (error == 0 && (op_filled != 0 || literal_left != 0)) error = FSS_DELTA_MALFORMED;
+            return error != 0 ? error : (int64_t) written;
+        }
+        if (chunk_size > frame_size) break;
+        if (recv(socket, buff, chunk_size, MSG_WAITALL) != (ssize_t) chunk_size) break;
+
+        size_t pos = 0;
+        while (pos < chunk_size && error == 0) {
+            if (literal_left > 0) {
+                size_t n = chunk_size - pos < literal_left ? chunk_size - pos : literal_left;
+                for (size_t done = 0; done < n; ) {
+                    ssize_t w = pwrite(out_fd, buff + pos + done, n - done, written + done);
+                    if (w < 0 && errno == EINTR) continue;
+                    if (w < 0) {
+                        error = FSS_DELTA_IO_ERROR;
+                        break;
+                    }
+                    done += w;
+                }
+                pos += n;
+                written += n;
+                literal_left -= n;
+                *literal_bytes += n;
+                continue;
+            }
+
+            size_t n = sizeof(op) - op_filled < chunk_size - pos ? sizeof(op) - op_filled : chunk_size - pos;
+            memcpy((char*) &op + op_filled, buff + pos, n);
+            op_filled += n;
+            pos += n;
+            if (op_filled < sizeof(op)) break;
+            op_filled = 0;
+
+            uint32_t kind = ntohl(op.kind);
+            uint64_t length = ntohl(op.length);
+            uint64_t offset = be64toh(op.offset);
+            if (length > max_size - written) {
+                error = FSS_DELTA_MALFORMED;
+            } else if (kind == FSS_DELTA_LITERAL) {
+                literal_left = length;
+            } else if (kind != FSS_DELTA_COPY || base_fd < 0 || offset > base_size || length > base_size - offset) {
+                error = FSS_DELTA_MALFORMED;
+            } else if (fss_copy_file_bytes(base_fd, offset, out_fd, written, length) != 0) {
+                error = FSS_DELTA_IO_ERROR;
+            } else {
+                written += length;
+            }
+        }
+    }
+    free(buff);
+    return FSS_DELTA_BROKEN;
+}
+
+// Writes each op of fss_delta_generate() to a frame stream; use with a FssFrameWriter as ctx.
+static inline int fss_delta_send_op(void* ctx, uint32_t kind, uint64_t offset, const uint8_t* data, uint32_t length) {
+    FssFrameWriter* writer = ctx;
+    FssDeltaOp op;
+    op.kind = htonl(kind);
+    op.length = htonl(length);
+    op.offset = htobe64(offset);
+    if (fss_frame_put(writer, &op, sizeof(op)) != 0) return -1;
+    return kind == FSS_DELTA_LITERAL ? fss_frame_put(writer, data, length) : 0;
+}
+
+#endif // FSS_DELTA_H
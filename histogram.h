@@ -0,0 +1,91 @@
+#ifndef FSS_HISTOGRAM_H
+#define FSS_HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// Log-linear latency histograms shared by the benchmark programs (bench.c, microbench.c).
+//
+// Values below 32 get a bucket each; above that every power of two is split into 32
+// buckets, so a bucket is at most ~3% wide and any uint64_t fits into 2048 counters.
+// Recording is a few instructions and no allocation; a thread keeps its own histogram
+// and the histograms are merged once the run is over. The clock and the random numbers
+// the benchmarks draw their workloads from live here too.
+
+#define FSS_HIST_SUB_BITS       5
+#define FSS_HIST_BUCKETS        (64 << FSS_HIST_SUB_BITS)
+
+typedef struct {
+    uint64_t counts[FSS_HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} FssHistogram;
+
+static inline int fss_hist_bucket(uint64_t value) {
+    if (value < (1u << FSS_HIST_SUB_BITS)) return (int) value;
+    int shift = 63 - __builtin_clzll(value) - FSS_HIST_SUB_BITS;
+    return ((shift + 1) << FSS_HIST_SUB_BITS) + (int)((value >> shift) & ((1u << FSS_HIST_SUB_BITS) - 1));
+}
+
+// Middle of the values that fall into bucket
+static inline uint64_t fss_hist_bucket_value(int bucket) {
+    if (bucket < (1 << FSS_HIST_SUB_BITS)) return bucket;
+    int shift = (bucket >> FSS_HIST_SUB_BITS) - 1;
+    uint64_t low = (uint64_t)((1 << FSS_HIST_SUB_BITS) + (bucket & ((1 << FSS_HIST_SUB_BITS) - 1))) << shift;
+    return low + ((1ULL << shift) >> 1);
+}
+
+static inline void fss_hist_reset(FssHistogram* h) {
+    memset(h, 0, sizeof(*h));
+}
+
+static inline void fss_hist_record(FssHistogram* h, uint64_t value) {
+    h->counts[fss_hist_bucket(value)]++;
+    h->total++;
+    h->sum += value;
+    if (value > h->max) h->max = value;
+}
+
+static inline void fss_hist_merge(FssHistogram* into, const FssHistogram* from) {
+    for (int i = 0; i < FSS_HIST_BUCKETS; i++) into->counts[i] += from->counts[i];
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->max > into->max) into->max = from->max;
+}
+
+static inline double fss_hist_mean(const FssHistogram* h) {
+    return h->total ? (double) h->sum / h->total : 0.0;
+}
+
+// Smallest recorded value that at least fraction q of the values do not exceed
+static inline uint64_t fss_hist_percentile(const FssHistogram* h, double q) {
+    if (h->total == 0) return 0;
+    uint64_t target = (uint64_t)(q * h->total);
+    if ((double) target < q * h->total || target == 0) target++;
+    uint64_t seen = 0;
+    for (int i = 0; i < FSS_HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) return fss_hist_bucket_value(i) < h->max ? fss_hist_bucket_value(i) : h->max;
+    }
+    return h->max;
+}
+
+static inline uint64_t fss_bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64*: fast, and good enough to pick files and operations
+static inline uint64_t fss_bench_random(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+#endif // FSS_HISTOGRAM_H
@@ -0,0 +1,323 @@
+// Microbenchmarks for the server's concurrency primitives, run in isolation from the
+// network and the disk:
+//   ring:     the thread_shared_data producer/consumer ring, as SendFileThroughPipeline
+//             drives it, streaming /dev/zero into /dev/null with one pipeline per thread.
+//             An op is one frame; latencies are per transfer of -l frames.
+//   lock:     acquire_read_lock/acquire_write_lock on a set of files, readers and writers
+//             mixed by -r. Latencies are the time spent acquiring the lock.
+//   registry: get_or_create_file_control + release_file_control on a set of file names.
+//             Latencies are for the pair.
+// Every combination of thread count, read share and file count runs for -d milliseconds and
+// prints one line: ops/s and the latency distribution in microseconds.
+//
+// The primitives are server.c's own: it is compiled into this program with its main()
+// renamed, so there is nothing to keep in sync.
+
+#define main fss_server_main
+#include "server.c"
+#undef main
+
+#include "histogram.h"
+
+#define MB_MAX_THREADS 1024
+#define MB_MAX_VALUES 16
+
+typedef enum {
+    MB_RING,
+    MB_LOCK,
+    MB_REGISTRY,
+} MicrobenchKind;
+
+static const char* const mb_kind_names[] = { "ring", "lock", "registry" };
+
+typedef struct {
+    MicrobenchKind kind;
+    int threads;
+    int read_percent;            // lock
+    int files;                   // lock, registry
+} MicrobenchCase;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    const MicrobenchCase *bench;
+    uint64_t rng;
+    uint64_t ops;
+    FssHistogram latency;        // Nanoseconds
+} MicrobenchThread;
+
+// Set from the command line
+int mb_threads[MB_MAX_VALUES] = { 1, 2, 4, 8, 16, 32 };
+int mb_thread_values = 6;
+int mb_read_percents[MB_MAX_VALUES] = { 100, 90, 50, 0 };
+int mb_read_values = 4;
+int mb_file_counts[MB_MAX_VALUES] = { 1, 16, 1024 };
+int mb_file_values = 3;
+bool mb_enabled[3] = { true, true, true };
+int mb_duration_ms = 1000;
+uint32_t mb_frame_size = 64 * 1024;
+int mb_transfer_frames = 64;
+int mb_hold_ns = 200;            // Work done while holding a file lock
+
+// Shared by the threads of the running case
+FileAccessControl **mb_controls; // lock: one per file, held open for the whole case
+char (*mb_names)[32];            // registry: the file names
+uint64_t *mb_hashes;
+int mb_null_fd = -1;
+int mb_zero_fd = -1;
+pthread_mutex_t mb_start_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t mb_start_cond = PTHREAD_COND_INITIALIZER;
+bool mb_started;                 // Set once every thread of the case exists
+atomic_bool mb_stop;
+
+// Busy work standing in for what a request does while it holds a lock
+static void mb_spin(int ns) {
+    if (ns <= 0) return;
+    uint64_t until = fss_bench_now_ns() + ns;
+    while (fss_bench_now_ns() < until) {
+    }
+}
+
+static void mb_run_ring(MicrobenchThread* t) {
+    off_t length = (off_t) mb_frame_size * mb_transfer_frames;
+    while (!atomic_load_explicit(&mb_stop, memory_order_relaxed)) {
+        uint64_t start = fss_bench_now_ns();
+        if (SendFileThroughPipeline(mb_null_fd, mb_zero_fd, 0, length, mb_frame_size, FSS_COMPRESS_NONE, NULL) < 0) {
+            fprintf(stderr, "microbench: ring transfer failed\n");
+            return;
+        }
+        fss_hist_record(&t->latency, fss_bench_now_ns() - start);
+        t->ops += mb_transfer_frames;
+    }
+}
+
+static void mb_run_lock(MicrobenchThread* t) {
+    const MicrobenchCase *bench = t->bench;
+    while (!atomic_load_explicit(&mb_stop, memory_order_relaxed)) {
+        uint64_t r = fss_bench_random(&t->rng);
+        FileAccessControl *control = mb_controls[(r >> 32) % bench->files];
+        bool read = (int)(r % 100) < bench->read_percent;
+
+        uint64_t start = fss_bench_now_ns();
+        if (read) acquire_read_lock(control);
+        else acquire_write_lock(control);
+        fss_hist_record(&t->latency, fss_bench_now_ns() - start);
+
+        mb_spin(mb_hold_ns);
+        if (read) release_read_lock(control);
+        else release_write_lock(control);
+        t->ops++;
+    }
+}
+
+static void mb_run_registry(MicrobenchThread* t) {
+    const MicrobenchCase *bench = t->bench;
+    while (!atomic_load_explicit(&mb_stop, memory_order_relaxed)) {
+        int file = fss_bench_random(&t->rng) % bench->files;
+
+        uint64_t start = fss_bench_now_ns();
+        FileAccessControl *control = get_or_create_file_control_hashed(mb_names[file], mb_hashes[file]);
+        if (control == NULL) {
+            fprintf(stderr, "microbench: get_or_create_file_control failed\n");
+            return;
+        }
+        release_file_control(control);
+        fss_hist_record(&t->latency, fss_bench_now_ns() - start);
+        t->ops++;
+    }
+}
+
+void* MicrobenchThreadMain(void* arg) {
+    MicrobenchThread *t = (MicrobenchThread*) arg;
+    pthread_mutex_lock(&mb_start_mutex);
+    while (!mb_started) pthread_cond_wait(&mb_start_cond, &mb_start_mutex);
+    pthread_mutex_unlock(&mb_start_mutex);
+    switch (t->bench->kind) {
+    case MB_RING: mb_run_ring(t); break;
+    case MB_LOCK: mb_run_lock(t); break;
+    case MB_REGISTRY: mb_run_registry(t); break;
+    }
+    return NULL;
+}
+
+// Runs one case and prints its line. Returns 0 on success, -1 on failure.
+static int mb_run_case(const MicrobenchCase* bench) {
+    int rc = -1;
+    int files = bench->kind == MB_RING ? 0 : bench->files;
+    MicrobenchThread *threads = calloc(bench->threads, sizeof(MicrobenchThread));
+    FssHistogram *total = calloc(1, sizeof(FssHistogram));
+    mb_controls = calloc(files, sizeof(FileAccessControl*));
+    mb_names = calloc(files, sizeof(*mb_names));
+    mb_hashes = calloc(files, sizeof(uint64_t));
+    if (threads == NULL || total == NULL || (files > 0 && (mb_controls == NULL || mb_names == NULL || mb_hashes == NULL))) {
+        perror("microbench: malloc failed");
+        goto cleanup;
+    }
+
+    for (int i = 0; i < files; i++) {
+        snprintf(mb_names[i], sizeof(mb_names[i]), "microbench-%d", i);
+        mb_hashes[i] = filename_hash(mb_names[i]);
+        if (bench->kind == MB_LOCK &&
+            (mb_controls[i] = get_or_create_file_control_hashed(mb_names[i], mb_hashes[i])) == NULL) {
+            goto cleanup;
+        }
+    }
+
+    atomic_store(&mb_stop, false);
+    mb_started = false;
+    int started = 0;
+    for (; started < bench->threads; started++) {
+        MicrobenchThread *t = &threads[started];
+        t->id = started;
+        t->bench = bench;
+        t->rng = 0x9E3779B97F4A7C15ULL * (started + 1);
+        if (pthread_create(&t->thread, NULL, MicrobenchThreadMain, t) != 0) {
+            perror("microbench: pthread_create failed");
+            break;
+        }
+    }
+    // Threads that did start find mb_stop set and return at once if the rest failed
+    if (started < bench->threads) atomic_store(&mb_stop, true);
+    pthread_mutex_lock(&mb_start_mutex);
+    mb_started = true;
+    pthread_cond_broadcast(&mb_start_cond);
+    pthread_mutex_unlock(&mb_start_mutex);
+    uint64_t start = fss_bench_now_ns();
+    usleep(mb_duration_ms * 1000);
+    atomic_store(&mb_stop, true);
+    uint64_t ops = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i].thread, NULL);
+        ops += threads[i].ops;
+        fss_hist_merge(total, &threads[i].latency);
+    }
+    double seconds = (fss_bench_now_ns() - start) / 1e9;
+    if (started < bench->threads) goto cleanup;
+
+    char read_col[8] = "-", files_col[12] = "-";
+    if (bench->kind == MB_LOCK) snprintf(read_col, sizeof(read_col), "%d", bench->read_percent);
+    if (bench->kind != MB_RING) snprintf(files_col, sizeof(files_col), "%d", bench->files);
+    printf("%-9s %7d %6s %7s %13.0f %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+           mb_kind_names[bench->kind], bench->threads, read_col, files_col, ops / seconds,
+           fss_hist_mean(total) / 1000, fss_hist_percentile(total, 0.50) / 1000.0,
+           fss_hist_percentile(total, 0.99) / 1000.0, fss_hist_percentile(total, 0.999) / 1000.0,
+           total->max / 1000.0);
+    fflush(stdout);
+    rc = 0;
+
+cleanup:
+    for (int i = 0; i < files && mb_controls != NULL; i++) {
+        if (mb_controls[i] != NULL) release_file_control(mb_controls[i]);
+    }
+    free(mb_controls);
+    free(mb_names);
+    free(mb_hashes);
+    free(total);
+    free(threads);
+    mb_controls = NULL;
+    mb_names = NULL;
+    mb_hashes = NULL;
+    return rc;
+}
+
+// Parses a comma-separated list of up to MB_MAX_VALUES integers in [min, max].
+// Returns the number of values, or -1 on error.
+static int mb_parse_list(const char* text, int* values, int min, int max) {
+    int count = 0;
+    char *copy = strdup(text);
+    if (copy == NULL) return -1;
+    char *saveptr = NULL;
+    for (char *item = strtok_r(copy, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+        char *end;
+        long value = strtol(item, &end, 10);
+        if (*end != '\0' || value < min || value > max || count == MB_MAX_VALUES) {
+            count = -1;
+            break;
+        }
+        values[count++] = (int) value;
+    }
+    free(copy);
+    return count > 0 ? count : -1;
+}
+
+static void mb_print_usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [-b ring,lock,registry] [-t threads] [-r read_percents] [-n files] [-d ms]\n"
+            "          [-f frame_size] [-l frames] [-H ns]\n"
+            "  -b list   Primitives to measure (default ring,lock,registry)\n"
+            "  -t list   Thread counts, 1-%d (default 1,2,4,8,16,32)\n"
+            "  -r list   lock: percent of acquisitions that are reads (default 100,90,50,0)\n"
+            "  -n list   lock, registry: number of distinct files (default 1,16,1024)\n"
+            "  -d ms     How long each combination runs (default 1000)\n"
+            "  -f bytes  ring: frame size, %d-%d (default 65536)\n"
+            "  -l frames ring: frames per transfer (default 64)\n"
+            "  -H ns     lock: time a lock is held (default 200)\n"
+            "Lists are comma-separated, up to %d values.\n",
+            prog, MB_MAX_THREADS, 1, FSS_MAX_FRAME_SIZE, MB_MAX_VALUES);
+}
+
+int main(int argc, char* argv[]) {
+    int c;
+    while ((c = getopt(argc, argv, "b:t:r:n:d:f:l:H:")) != -1) {
+        int ok = 1;
+        switch (c) {
+        case 'b': {
+            memset(mb_enabled, 0, sizeof(mb_enabled));
+            char *saveptr = NULL;
+            for (char *item = strtok_r(optarg, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+                int kind = 0;
+                while (kind < 3 && strcmp(item, mb_kind_names[kind]) != 0) kind++;
+                if (kind == 3) ok = 0;
+                else mb_enabled[kind] = true;
+            }
+            break;
+        }
+        case 't': ok = (mb_thread_values = mb_parse_list(optarg, mb_threads, 1, MB_MAX_THREADS)) > 0; break;
+        case 'r': ok = (mb_read_values = mb_parse_list(optarg, mb_read_percents, 0, 100)) > 0; break;
+        case 'n': ok = (mb_file_values = mb_parse_list(optarg, mb_file_counts, 1, 1 << 20)) > 0; break;
+        case 'd': ok = (mb_duration_ms = atoi(optarg)) > 0; break;
+        case 'f': mb_frame_size = strtoul(optarg, NULL, 10); ok = mb_frame_size >= 1 && mb_frame_size <= FSS_MAX_FRAME_SIZE; break;
+        case 'l': ok = (mb_transfer_frames = atoi(optarg)) > 0; break;
+        case 'H': ok = (mb_hold_ns = atoi(optarg)) >= 0; break;
+        default: ok = 0;
+        }
+        if (!ok) {
+            mb_print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The primitives log at debug level only; keep the output to the results
+    atomic_store(&g_log_level, LOG_LEVEL_WARN);
+    mb_null_fd = open("/dev/null", O_WRONLY);
+    mb_zero_fd = open("/dev/zero", O_RDONLY);
+    if (mb_null_fd < 0 || mb_zero_fd < 0) {
+        perror("microbench: cannot open /dev/null or /dev/zero");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%-9s %7s %6s %7s %13s %10s %10s %10s %10s %10s\n",
+           "bench", "threads", "read%", "files", "ops/s", "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+    for (int kind = 0; kind < 3; kind++) {
+        if (!mb_enabled[kind]) continue;
+        int reads = kind == MB_LOCK ? mb_read_values : 1;
+        int file_counts = kind == MB_RING ? 1 : mb_file_values;
+        for (int t = 0; t < mb_thread_values; t++) {
+            for (int r = 0; r < reads; r++) {
+                for (int f = 0; f < file_counts; f++) {
+                    MicrobenchCase bench = {
+                        .kind = kind,
+                        .threads = mb_threads[t],
+                        .read_percent = mb_read_percents[r],
+                        .files = mb_file_counts[f],
+                    };
+                    if (mb_run_case(&bench) < 0) exit(EXIT_FAILURE);
+                }
+            }
+        }
+    }
+
+    close(mb_null_fd);
+    close(mb_zero_fd);
+    return 0;
+}
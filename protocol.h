@@ -0,0 +1,365 @@
+#ifndef FSS_PROTOCOL_H
+#define FSS_PROTOCOL_H
+
+#include <stdint.h>
+#include <endian.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+// Wire protocol shared by server.c and client.c.
+//
+// Protocol v1 (legacy): the client sends CommandLen(int), Command, FilenameLen(int),
+// Filename, all lengths in network byte order. File data then flows as frames of a
+// 4-byte length followed by at most 128 bytes of payload; a zero length ends the stream.
+//
+// Protocol v2: before its first request the client sends a Handshake whose first field
+// is FSS_V2_MAGIC. A v1 server would read the magic as an absurd command length, and a
+// v1 client never sends it, so the server can tell the two apart from the first 4 bytes.
+// The server answers with its own Handshake carrying the agreed version and frame size.
+// Requests and frames keep the v1 layout, but payloads may be up to the agreed frame size.
+//
+// Persistent connections (FSS_FLAG_PERSISTENT granted in the handshake reply): the
+// connection carries any number of requests, and the client may send several before
+// reading the responses. Requests are served strictly in order. Every response starts
+// with an FssResponse naming the request it answers (requests are numbered from 1 in
+// the order they were sent):
+//   download: FssResponse, then (only if status is FSS_STATUS_OK) the file's frames
+//   upload:   the client sends its frames, then the server answers with an FssResponse
+//             once the new version is stored
+// A transfer that breaks off midway cannot be resynchronized, so the server closes the
+// connection instead of answering.
+//
+// Server metrics (command "stats", filename ignored): answered like a download whose
+// content is a JSON object with the server's counters and latency percentiles.
+//
+// Lock contention (command "locks", filename is the number of files to list, 10 if it is
+// not a number): answered like "stats", with the most contended files' lock profiles.
+//
+// Listings (command "list", persistent connections only): the filename is a name prefix,
+// optionally ending in '*' ("*" lists every file), and the body an FssListRequest. An OK
+// response is followed by an FssListInfo, then frames carrying its count entries in name
+// order, each an FssFileInfo followed by name_len bytes of name, and the end frame. A long
+// listing is read in pages: each request passes the last name of the page before as after.
+//
+// File metadata (command "stat", persistent connections only): an OK response is followed
+// by the file's FssFileInfo (name_len 0), FSS_STATUS_NOT_FOUND if there is no such file.
+// Listings and stat only cover regular files whose path has no component starting with '.'.
+//
+// Batch downloads (command "batch", persistent connections only): the body is an
+// FssBatchRequest. With count 0 the filename is a prefix as for "list" and the batch holds
+// every file it would list; otherwise the filename is ignored and the request is followed
+// by frames carrying count NUL-terminated names and the end frame. More than
+// FSS_BATCH_MAX_FILES files are refused with FSS_STATUS_BAD_REQUEST. An OK response is
+// followed, for each file in order, by an FssBatchEntry and name_len bytes of name; an
+// entry with status FSS_STATUS_OK is followed by the file's frames and the end frame. An
+// entry with name_len 0 ends the batch.
+//
+// Ranged downloads (command "range", persistent connections only): the request header is
+// followed by an FssRangeRequest. An OK response is followed by an FssRangeInfo giving
+// the file's total size and version, then by frames carrying exactly the granted bytes
+// and the end frame. A length of 0 only asks for the FssRangeInfo. Clients fetch pieces
+// of one file over several connections, or resume a broken transfer, and use the
+// version to detect that the file changed between requests.
+//
+// Upload sessions (persistent connections only) let one upload arrive in pieces over
+// several connections at once:
+//   upload-open:   body FssUploadOpen; an OK response is followed by an FssUploadSession
+//   upload-part:   body FssUploadPart, then frames carrying exactly its length and the end
+//                  frame; answered once the bytes are stored. Parts may come in any order.
+//   upload-commit: body FssUploadSession; publishes the file once every byte has arrived,
+//                  FSS_STATUS_INCOMPLETE otherwise (the session stays open)
+//   upload-abort:  body FssUploadSession; discards the session
+// Every request names the file the session was opened for.
+//
+// Deduplicated uploads (FSS_FLAG_DEDUP granted, see chunker.h for the chunking):
+//   upload-dedup:  body FssUploadOpen, then frames carrying the file's FssChunkRef list
+//                  in order, and the end frame. The server fills in every chunk it already
+//                  stores; an OK response is followed by an FssUploadSession and frames
+//                  carrying the FssByteRange list of bytes it still needs. The client sends
+//                  those with upload-part and finishes with upload-commit.
+//
+// Delta transfers (FSS_FLAG_DELTA granted, see delta.h) update a file the receiver already
+// has an older copy of. The receiver describes its copy with an FssDeltaSignature and a
+// list of FssBlockSig, one per block; the sender answers with a delta stream: a sequence
+// of FssDeltaOp, each FSS_DELTA_LITERAL op followed by its bytes, carried in frames that
+// need not line up with the ops, and the end frame.
+//   download-delta: body FssDeltaSignature of the client's copy, then frames carrying its
+//                   FssBlockSig list and the end frame. An OK response is followed by an
+//                   FssRangeInfo for the whole file and the delta stream.
+//   upload-delta:   body FssUploadOpen; opens an upload session. An OK response is followed
+//                   by an FssUploadSession, the FssDeltaSignature of the server's copy
+//                   (file_size 0 if it has none) and frames carrying its FssBlockSig list.
+//   upload-patch:   body FssUploadSession, then the delta stream producing the whole new
+//                   file; answered once it is stored, FSS_STATUS_INCOMPLETE if the server's
+//                   copy changed since it sent the signature. upload-commit publishes it.
+//
+// Compressed transfers (FSS_FLAG_COMPRESS granted, see compress.h): "download" and
+// "upload" requests carry an FssTransferOptions body choosing the compression for that
+// transfer; an unknown one is answered with FSS_STATUS_BAD_REQUEST (and an upload's
+// connection closed, as its frames are already on the way). The sender of the data may
+// then send any frame compressed; such a frame has FSS_FRAME_COMPRESSED set in its
+// length, and its payload (still at most the frame size) expands to at most the frame
+// size. Other commands keep their raw frames.
+//
+// Checksummed transfers (FSS_FLAG_CHECKSUM granted, see checksum.h): every frame of a
+// "download" or "upload", the end frame included, is followed by a 4-byte CRC32C in
+// network order. A data frame's CRC covers its payload as sent (compressed or not); the
+// end frame's is the CRC32C of the whole file. The server keeps that digest next to the
+// file, so a download can hand out the digest the uploader's data had. An upload whose
+// checksums do not match is discarded and answered with FSS_STATUS_CORRUPT.
+
+#define FSS_V2_MAGIC            0x46535632u  // "FSV2"
+#define FSS_PROTOCOL_VERSION    2
+
+#define FSS_V1_FRAME_SIZE       128
+#define FSS_MIN_FRAME_SIZE      (64 * 1024)
+#define FSS_MAX_FRAME_SIZE      (4 * 1024 * 1024)
+#define FSS_DEFAULT_FRAME_SIZE  (1024 * 1024)
+
+// All fields in network byte order on the wire.
+typedef struct {
+    uint32_t magic;       // FSS_V2_MAGIC
+    uint32_t version;     // Highest version the sender speaks / version agreed by the server
+    uint32_t frame_size;  // Requested / agreed maximum frame payload in bytes
+    uint32_t flags;       // FSS_FLAG_* requested by the client / granted by the server
+} FssHandshake;
+
+#define FSS_FLAG_PERSISTENT     0x1u         // Keep-alive, pipelining and per-response status
+#define FSS_FLAG_DEDUP          0x2u         // upload-dedup (server runs a chunk store); needs PERSISTENT
+#define FSS_FLAG_DELTA          0x4u         // download-delta, upload-delta, upload-patch; needs PERSISTENT
+#define FSS_FLAG_COMPRESS       0x8u         // download/upload carry FssTransferOptions
+#define FSS_FLAG_CHECKSUM       0x10u        // download/upload frames carry a CRC32C trailer
+
+#define FSS_FRAME_COMPRESSED    0x80000000u  // Frame length flag: the payload is compressed
+
+#define FSS_STATUS_OK           0
+#define FSS_STATUS_NOT_FOUND    1            // Download of a file that does not exist
+#define FSS_STATUS_BAD_REQUEST  2            // Unknown command
+#define FSS_STATUS_BUSY         3            // Server queue full, retry later
+#define FSS_STATUS_IO_ERROR     4            // Server could not read or store the file
+#define FSS_STATUS_BAD_RANGE    5            // Range starts beyond the end of the file
+#define FSS_STATUS_INCOMPLETE   6            // Upload session is still missing bytes
+#define FSS_STATUS_CORRUPT      7            // Upload failed its checksums and was discarded
+
+// All fields in network byte order on the wire.
+typedef struct {
+    uint32_t status;      // FSS_STATUS_*
+    uint32_t request_id;  // Which request of the connection this answers, from 1
+} FssResponse;
+
+#define FSS_RANGE_TO_END        UINT64_MAX   // FssRangeRequest.length: up to the end of the file
+
+// 64-bit fields in big-endian (network) byte order.
+typedef struct {
+    uint64_t offset;
+    uint64_t length;      // Clamped by the server to the end of the file
+} FssRangeRequest;
+
+typedef struct {
+    uint64_t total_size;  // Size of the whole file
+    uint64_t offset;      // First byte sent
+    uint64_t length;      // Bytes sent
+    uint64_t version;     // Changes whenever a new version of the file is stored
+} FssRangeInfo;
+
+typedef struct {
+    uint64_t total_size;  // Size of the file being uploaded
+} FssUploadOpen;
+
+typedef struct {
+    uint64_t session_id;
+} FssUploadSession;
+
+typedef struct {
+    uint64_t session_id;
+    uint64_t offset;
+    uint64_t length;      // offset + length may not exceed the session's total size
+} FssUploadPart;
+
+typedef struct {
+    uint8_t hash[32];     // SHA-256 of the chunk
+    uint32_t length;      // Network byte order
+} FssChunkRef;
+
+typedef struct {
+    uint64_t offset;      // Big-endian
+    uint64_t length;
+} FssByteRange;
+
+typedef struct {
+    uint64_t file_size;   // Big-endian; size of the copy the block list describes
+    uint32_t block_size;  // Network byte order; the last block may be shorter
+    uint32_t reserved;
+} FssDeltaSignature;
+
+typedef struct {
+    uint32_t weak;        // Rolling checksum of the block, network byte order
+    uint8_t strong[16];   // First 16 bytes of the block's SHA-256
+} FssBlockSig;
+
+#define FSS_DELTA_COPY          1            // Copy length bytes at offset of the receiver's copy
+#define FSS_DELTA_LITERAL       2            // length bytes of new data follow the op
+
+typedef struct {
+    uint32_t kind;        // FSS_DELTA_*, network byte order
+    uint32_t length;
+    uint64_t offset;      // Big-endian; FSS_DELTA_COPY only
+} FssDeltaOp;
+
+#define FSS_LIST_DEFAULT_LIMIT  1000         // FssListRequest.limit 0
+#define FSS_LIST_MAX_LIMIT      10000
+
+typedef struct {
+    uint32_t limit;       // Network byte order; most entries wanted, 0 for the default
+    uint32_t reserved;
+    char after[256];      // NUL-terminated; only names sorting after it are listed, "" for all
+} FssListRequest;
+
+typedef struct {
+    uint32_t count;       // Network byte order; entries that follow
+    uint32_t more;        // 1 if further names match, to be fetched with the next page
+} FssListInfo;
+
+#define FSS_INFO_HAS_CRC        0x1u         // FssFileInfo.crc is the file's stored CRC32C
+
+typedef struct {
+    uint64_t size;        // Big-endian
+    uint64_t mtime_ns;    // Last modification, nanoseconds since the epoch
+    uint64_t version;     // As in FssRangeInfo
+    uint32_t crc;         // Network byte order; valid with FSS_INFO_HAS_CRC
+    uint16_t flags;       // FSS_INFO_*
+    uint16_t name_len;    // Listings: bytes of name that follow
+} FssFileInfo;
+
+#define FSS_BATCH_MAX_FILES     10000        // Files one "batch" request may fetch
+
+typedef struct {
+    uint32_t count;       // Network byte order; names that follow, 0 to fetch the filename prefix
+    uint32_t reserved;
+} FssBatchRequest;
+
+typedef struct {
+    uint64_t size;        // Big-endian; bytes in the file's frames (status FSS_STATUS_OK only)
+    uint64_t version;     // As in FssRangeInfo
+    uint32_t crc;         // Network byte order; valid with FSS_INFO_HAS_CRC
+    uint16_t flags;       // FSS_INFO_*
+    uint16_t name_len;    // Bytes of name that follow, 0 in the entry that ends the batch
+    uint32_t status;      // Network byte order; FSS_STATUS_OK, NOT_FOUND or IO_ERROR
+    uint32_t reserved;
+} FssBatchEntry;
+
+#define FSS_COMPRESS_NONE       0
+#define FSS_COMPRESS_DEFLATE    1            // Every frame that shrinks
+#define FSS_COMPRESS_AUTO       2            // Frames whose sample shrinks enough
+
+typedef struct {
+    uint32_t compression; // FSS_COMPRESS_*, network byte order
+    uint32_t reserved;
+} FssTransferOptions;
+
+// Clamps a requested frame size into the range v2 allows.
+static inline uint32_t fss_clamp_frame_size(uint32_t requested) {
+    if (requested < FSS_MIN_FRAME_SIZE) return FSS_MIN_FRAME_SIZE;
+    if (requested > FSS_MAX_FRAME_SIZE) return FSS_MAX_FRAME_SIZE;
+    return requested;
+}
+
+// Sends one frame (4-byte length header + payload, then trailer_len bytes of trailer) with
+// a single writev() so the header never travels in a segment of its own. flags is 0 or
+// FSS_FRAME_COMPRESSED. Returns 0 on success, -1 on error.
+static inline int fss_send_frame_trailed(int socket, const void* payload, uint32_t len, uint32_t flags,
+                                         const void* trailer, uint32_t trailer_len) {
+    uint32_t len_n = htonl(len | flags);
+    struct iovec iov[3];
+    struct iovec *vec = iov;
+    int iovcnt = 1;
+
+    iov[0].iov_base = &len_n;
+    iov[0].iov_len = sizeof(len_n);
+    if (len > 0) {
+        iov[iovcnt].iov_base = (void*) payload;
+        iov[iovcnt++].iov_len = len;
+    }
+    if (trailer_len > 0) {
+        iov[iovcnt].iov_base = (void*) trailer;
+        iov[iovcnt++].iov_len = trailer_len;
+    }
+
+    while (iovcnt > 0) {
+        ssize_t sent = writev(socket, vec, iovcnt);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        // Skip the parts that went out completely, trim the one that went out partially
+        while (iovcnt > 0 && (size_t)sent >= vec->iov_len) {
+            sent -= vec->iov_len;
+            vec++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            vec->iov_base = (char*)vec->iov_base + sent;
+            vec->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+static inline int fss_send_frame_flagged(int socket, const void* payload, uint32_t len, uint32_t flags) {
+    return fss_send_frame_trailed(socket, payload, len, flags, NULL, 0);
+}
+
+static inline int fss_send_frame(int socket, const void* payload, uint32_t len) {
+    return fss_send_frame_flagged(socket, payload, len, 0);
+}
+
+// Sends a frame of a checksummed transfer: crc is the payload's CRC32C, or for the end
+// frame (len 0) the file's.
+static inline int fss_send_frame_crc(int socket, const void* payload, uint32_t len, uint32_t flags, uint32_t crc) {
+    uint32_t crc_n = htonl(crc);
+    return fss_send_frame_trailed(socket, payload, len, flags, &crc_n, sizeof(crc_n));
+}
+
+// Packs a byte stream into frames of up to size bytes, for streams whose pieces do not
+// line up with frames (lists, delta streams).
+typedef struct {
+    int socket;
+    char* buff;           // size bytes
+    uint32_t size;
+    uint32_t used;
+} FssFrameWriter;
+
+// Appends len bytes to the stream. Returns 0 on success, -1 on error.
+static inline int fss_frame_put(FssFrameWriter* writer, const void* data, size_t len) {
+    const char* p = data;
+    while (len > 0) {
+        if (writer->used == 0 && len >= writer->size) {
+            // A whole frame's worth with nothing buffered goes out without the copy
+            if (fss_send_frame(writer->socket, p, writer->size) < 0) return -1;
+            p += writer->size;
+            len -= writer->size;
+            continue;
+        }
+        size_t n = writer->size - writer->used < len ? writer->size - writer->used : len;
+        memcpy(writer->buff + writer->used, p, n);
+        writer->used += n;
+        p += n;
+        len -= n;
+        if (writer->used == writer->size) {
+            if (fss_send_frame(writer->socket, writer->buff, writer->used) < 0) return -1;
+            writer->used = 0;
+        }
+    }
+    return 0;
+}
+
+// Sends what is buffered and the end frame. Returns 0 on success, -1 on error.
+static inline int fss_frame_finish(FssFrameWriter* writer) {
+    if (writer->used > 0 && fss_send_frame(writer->socket, writer->buff, writer->used) < 0) return -1;
+    writer->used = 0;
+    return fss_send_frame(writer->socket, NULL, 0);
+}
+
+#endif // FSS_PROTOCOL_H
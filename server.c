@@ -1,41 +1,724 @@
+#define _GNU_SOURCE // accept4()
 #include<stdio.h>
 #include<stdlib.h>
 #include<unistd.h>
 #include<string.h>
 #include<stdbool.h>
+#include<stdatomic.h>
+#include<stdarg.h>
 #include <pthread.h>
+#include <stdint.h>
 
 
 #include<sys/types.h>
 #include<sys/fcntl.h>
+#include<sys/socket.h>
+#include<sys/epoll.h>
+#include<sys/eventfd.h>
+#include<sys/resource.h>
+#include<sys/sendfile.h>
+#include<sys/stat.h>
+#include<sys/mman.h>
+#include<sys/syscall.h>
+#include<ftw.h>
+#include<dirent.h>
+#include<sys/inotify.h>
+
+#include<linux/io_uring.h>
+#include<linux/futex.h>
+
+#include<errno.h>
+#include<signal.h>
+#include<setjmp.h>
+#include<time.h>
 
 #include<netinet/in.h>
 
 #include<arpa/inet.h>
+#include<linux/tcp.h>            // The kernel's struct tcp_info, with the byte counters
+#include<sys/uio.h>
 
-#define CHUNK_SIZE 128
+#include "protocol.h"
+#include "chunker.h"
+#include "delta.h"
+#include "compress.h"
+#include "checksum.h"
+#include "histogram.h"
+
+#define CHUNK_SIZE FSS_V1_FRAME_SIZE // Frame size for protocol v1 clients
 #define BUFFER_CAPACITY 8
 
+typedef enum {
+    DOWNLOAD_MODE_PIPELINE,     // read() into the thread_shared_data ring, send() from a consumer
+    DOWNLOAD_MODE_SENDFILE,     // sendfile() straight from the page cache
+    DOWNLOAD_MODE_MMAP,         // Map the file and send frames straight from the mapping
+} DownloadMode;
+
+typedef enum {
+    UPLOAD_MODE_COPY,           // recv() into a buffer, write() to the file
+    UPLOAD_MODE_SPLICE,         // splice() socket -> pipe -> file, payload never enters userspace
+} UploadMode;
+
+typedef enum {
+    STORAGE_MODE_SNAPSHOT,      // Uploads write a new version and rename() it into place; downloads take no lock
+    STORAGE_MODE_INPLACE,       // Uploads truncate the live file under the write lock; downloads take the read lock
+    STORAGE_MODE_CHUNKED,       // Snapshot mode plus a chunk index for deduplicated uploads
+} StorageMode;
+
+typedef enum {
+    IO_ENGINE_THREADS,          // Transfers run on the worker threads with blocking syscalls
+    IO_ENGINE_URING,            // Workers hand transfers to the io_uring engine thread
+} IoEngine;
+
+// Startup configuration, filled in from the command line in main()
+typedef struct {
+    int port;
+    int event_loops;            // Number of epoll event loop threads
+    int idle_timeout_sec;       // Close connections that sit in the header phase this long (0 = never)
+    int transfer_timeout_sec;   // Fail a transfer send or receive that makes no progress this long (0 = never)
+    int workers;                // Transfer worker threads in the pool
+    int queue_capacity;         // Max tasks waiting for a worker before requests are rejected
+    int stats_interval_sec;     // Print pool stats this often (0 = never)
+    DownloadMode download_mode;
+    UploadMode upload_mode;
+    IoEngine io_engine;
+    StorageMode storage_mode;
+    uint32_t max_frame_size;    // Largest frame a v2 client may negotiate
+    size_t cache_mb;            // Content cache budget in MiB (0 = disabled)
+    const char *metrics_file;   // Rewrite the metrics here periodically (NULL = never)
+} ServerConfig;
+
+ServerConfig g_config = {
+    .port = 8080,
+    .event_loops = 4,
+    .idle_timeout_sec = 300,
+    .transfer_timeout_sec = 60,
+    .workers = 16,
+    .queue_capacity = 1024,
+    .stats_interval_sec = 0,
+    .download_mode = DOWNLOAD_MODE_SENDFILE,
+    .upload_mode = UPLOAD_MODE_SPLICE,
+    .io_engine = IO_ENGINE_THREADS,
+    .storage_mode = STORAGE_MODE_SNAPSHOT,
+    .max_frame_size = FSS_MAX_FRAME_SIZE,
+    .cache_mb = 256,
+    .metrics_file = NULL,
+};
+
+// --- Logging ---
+//
+// Log calls format into a ring owned by the calling thread and return; a background
+// flusher thread drains all rings, merges them by timestamp and writes to stdout. The
+// hot path never takes a lock or touches stdio, and a disabled level costs one relaxed
+// load and a branch. If a thread logs faster than the flusher drains, its excess
+// messages are dropped and counted rather than blocking the caller.
+//
+// The level is set with -v and can be changed while running: SIGUSR1 raises it (more
+// output), SIGUSR2 lowers it.
+
+typedef enum {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+} LogLevel;
+
+#define LOG_RING_SLOTS 512          // Messages a thread may have pending (power of two)
+#define LOG_MSG_MAX 232             // Longer messages are truncated
+#define LOG_FLUSH_INTERVAL_MS 50
+
+typedef struct {
+    struct timespec ts;
+    LogLevel level;
+    char msg[LOG_MSG_MAX];
+} LogRecord;
+
+typedef struct LogRing {
+    LogRecord slots[LOG_RING_SLOTS];
+    atomic_uint head;               // Next slot the flusher reads
+    atomic_uint tail;               // Next slot the owning thread writes
+    atomic_ulong dropped;           // Messages lost to a full ring
+    atomic_bool orphaned;           // Owning thread exited; freed once drained
+    int thread_id;                  // Small sequential id printed with each message
+    struct LogRing *next;
+} LogRing;
+
+atomic_int g_log_level = LOG_LEVEL_INFO;
+
+static pthread_mutex_t g_log_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LogRing *g_log_rings = NULL;     // Protected by g_log_rings_mutex
+static int g_log_next_thread_id = 0;
+static pthread_key_t g_log_ring_key;
+static pthread_once_t g_log_key_once = PTHREAD_ONCE_INIT;
+static __thread LogRing *t_log_ring = NULL;
+
+#define LOG_ENABLED(level) ((int)(level) <= atomic_load_explicit(&g_log_level, memory_order_relaxed))
+#define log_at(level, ...) do { if (LOG_ENABLED(level)) log_write((level), __VA_ARGS__); } while (0)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+
+static const char* log_level_name(LogLevel level) {
+    switch (level) {
+    case LOG_LEVEL_ERROR: return "ERROR";
+    case LOG_LEVEL_WARN: return "WARN";
+    case LOG_LEVEL_INFO: return "INFO";
+    default: return "DEBUG";
+    }
+}
+
+// Thread exit: hand the ring to the flusher, which frees it after printing what is left.
+static void log_ring_release(void* arg) {
+    atomic_store_explicit(&((LogRing*) arg)->orphaned, true, memory_order_release);
+}
+
+static void log_key_init(void) {
+    pthread_key_create(&g_log_ring_key, log_ring_release);
+}
+
+// Returns the calling thread's ring, creating it on first use. NULL if out of memory.
+static LogRing* log_thread_ring(void) {
+    if (t_log_ring != NULL) return t_log_ring;
+
+    LogRing *ring = calloc(1, sizeof(LogRing));
+    if (ring == NULL) return NULL;
+    pthread_once(&g_log_key_once, log_key_init);
+    pthread_setspecific(g_log_ring_key, ring);
+
+    pthread_mutex_lock(&g_log_rings_mutex);
+    ring->thread_id = g_log_next_thread_id++;
+    ring->next = g_log_rings;
+    g_log_rings = ring;
+    pthread_mutex_unlock(&g_log_rings_mutex);
+
+    t_log_ring = ring;
+    return ring;
+}
+
+__attribute__((format(printf, 2, 3)))
+void log_write(LogLevel level, const char* fmt, ...) {
+    LogRing *ring = log_thread_ring();
+    if (ring == NULL) return;
+
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head >= LOG_RING_SLOTS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    LogRecord *record = &ring->slots[tail & (LOG_RING_SLOTS - 1)];
+    clock_gettime(CLOCK_REALTIME, &record->ts);
+    record->level = level;
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(record->msg, sizeof(record->msg), fmt, args);
+    va_end(args);
+
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+// Appends one formatted line for record to out. Returns the new length.
+static size_t log_format_record(char* out, size_t len, size_t cap, const LogRecord* record, int thread_id) {
+    static time_t cached_sec = -1;      // Only the flusher thread calls this
+    static char cached_stamp[32];
+
+    if (record->ts.tv_sec != cached_sec) {
+        struct tm tm;
+        localtime_r(&record->ts.tv_sec, &tm);
+        strftime(cached_stamp, sizeof(cached_stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        cached_sec = record->ts.tv_sec;
+    }
+    int n = snprintf(out + len, cap - len, "[%s.%06ld] %-5s T%d: %s\n", cached_stamp,
+                     record->ts.tv_nsec / 1000, log_level_name(record->level), thread_id, record->msg);
+    if (n < 0) return len;
+    return (size_t) n < cap - len ? len + n : cap - 1;
+}
+
+// Drains every ring, oldest message first, and writes the result to stdout.
+static void log_flush(void) {
+    static char out[64 * 1024];
+    size_t len = 0;
+
+    pthread_mutex_lock(&g_log_rings_mutex);
+    while (1) {
+        // Pick the ring whose oldest pending message is the oldest overall
+        LogRing *oldest = NULL;
+        LogRecord *oldest_record = NULL;
+        for (LogRing *ring = g_log_rings; ring != NULL; ring = ring->next) {
+            unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+            if (head == atomic_load_explicit(&ring->tail, memory_order_acquire)) continue;
+            LogRecord *record = &ring->slots[head & (LOG_RING_SLOTS - 1)];
+            if (oldest_record == NULL || record->ts.tv_sec < oldest_record->ts.tv_sec ||
+                (record->ts.tv_sec == oldest_record->ts.tv_sec && record->ts.tv_nsec < oldest_record->ts.tv_nsec)) {
+                oldest = ring;
+                oldest_record = record;
+            }
+        }
+        if (oldest == NULL) break;
+
+        if (sizeof(out) - len < LOG_MSG_MAX + 64) {
+            fwrite(out, 1, len, stdout);
+            len = 0;
+        }
+        len = log_format_record(out, len, sizeof(out), oldest_record, oldest->thread_id);
+        atomic_store_explicit(&oldest->head, atomic_load_explicit(&oldest->head, memory_order_relaxed) + 1,
+                              memory_order_release);
+    }
+
+    // Report drops and free the rings of threads that have exited
+    LogRing **link = &g_log_rings;
+    while (*link != NULL) {
+        LogRing *ring = *link;
+        unsigned long dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (dropped > 0) {
+            len += snprintf(out + len, sizeof(out) - len, "[log] T%d: %lu messages dropped, ring full\n",
+                            ring->thread_id, dropped);
+            if (len >= sizeof(out)) len = sizeof(out) - 1;
+        }
+        if (atomic_load_explicit(&ring->orphaned, memory_order_acquire) &&
+            atomic_load_explicit(&ring->head, memory_order_relaxed) == atomic_load_explicit(&ring->tail, memory_order_acquire)) {
+            *link = ring->next;
+            free(ring);
+            continue;
+        }
+        link = &ring->next;
+    }
+    pthread_mutex_unlock(&g_log_rings_mutex);
+
+    if (len > 0) {
+        fwrite(out, 1, len, stdout);
+        fflush(stdout);
+    }
+}
+
+void* LogFlusherThread(void* arg) {
+    (void) arg;
+    struct timespec interval = { 0, LOG_FLUSH_INTERVAL_MS * 1000000L };
+    while (1) {
+        nanosleep(&interval, NULL);
+        log_flush();
+    }
+    return NULL;
+}
+
+static void log_level_signal(int sig) {
+    int level = atomic_load(&g_log_level);
+    if (sig == SIGUSR1 && level < LOG_LEVEL_DEBUG) atomic_store(&g_log_level, level + 1);
+    if (sig == SIGUSR2 && level > LOG_LEVEL_ERROR) atomic_store(&g_log_level, level - 1);
+}
+
+// Parses a -v argument. Returns -1 if it names no level.
+static int log_parse_level(const char* name) {
+    if (strcmp(name, "error") == 0) return LOG_LEVEL_ERROR;
+    if (strcmp(name, "warn") == 0) return LOG_LEVEL_WARN;
+    if (strcmp(name, "info") == 0) return LOG_LEVEL_INFO;
+    if (strcmp(name, "debug") == 0) return LOG_LEVEL_DEBUG;
+    return -1;
+}
+
+// Starts the flusher and installs the level signals. Messages logged before this are
+// kept in their rings and printed by the first flush.
+static int log_init(void) {
+    pthread_t flusher;
+    if (pthread_create(&flusher, NULL, LogFlusherThread, NULL) != 0) {
+        perror("pthread_create for log flusher failed");
+        return -1;
+    }
+    pthread_detach(flusher);
+    signal(SIGUSR1, log_level_signal);
+    signal(SIGUSR2, log_level_signal);
+    return 0;
+}
+
+// --- End Logging ---
+
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// --- Metrics ---
+//
+// Every thread that records metrics owns a MetricsShard: plain counters and histograms
+// behind a mutex that only metrics_snapshot() ever competes for, so recording costs an
+// uncontended lock and no shared cache line. A snapshot adds all shards together. When a
+// thread exits its shard keeps its counts and goes to the next thread that needs one.
+
+typedef enum {
+    METRIC_CMD_DOWNLOAD,
+    METRIC_CMD_RANGE,
+    METRIC_CMD_DOWNLOAD_DELTA,
+    METRIC_CMD_UPLOAD,
+    METRIC_CMD_UPLOAD_OPEN,
+    METRIC_CMD_UPLOAD_PART,
+    METRIC_CMD_UPLOAD_COMMIT,
+    METRIC_CMD_UPLOAD_ABORT,
+    METRIC_CMD_UPLOAD_DEDUP,
+    METRIC_CMD_UPLOAD_DELTA,
+    METRIC_CMD_UPLOAD_PATCH,
+    METRIC_CMD_STATS,
+    METRIC_CMD_LOCKS,
+    METRIC_CMD_LIST,
+    METRIC_CMD_STAT,
+    METRIC_CMD_BATCH,
+    METRIC_CMD_OTHER,           // Unknown commands, answered FSS_STATUS_BAD_REQUEST
+    METRIC_COMMANDS,
+} MetricCommand;
+
+static const char* const metric_command_names[METRIC_COMMANDS] = {
+    "download", "range", "download-delta", "upload", "upload-open", "upload-part", "upload-commit",
+    "upload-abort", "upload-dedup", "upload-delta", "upload-patch", "stats", "locks", "list", "stat",
+    "batch", "other",
+};
+
+typedef enum {
+    METRIC_LAT_PARSE,           // First byte of a request header to its dispatch
+    METRIC_LAT_LOCK_WAIT,       // Acquiring a file's read or write lock
+    METRIC_LAT_FIRST_BYTE,      // Download dispatched to its response going out (persistent connections)
+    METRIC_LAT_TRANSFER,        // Request dispatched to its handler finishing, queue wait included
+    METRIC_LATENCIES,
+} MetricLatency;
+
+static const char* const metric_latency_names[METRIC_LATENCIES] = {
+    "parse", "lock_wait", "first_byte", "transfer",
+};
+
+typedef struct {
+    uint64_t connections_opened;
+    uint64_t connections_closed;
+    uint64_t bytes_in;          // Received from clients
+    uint64_t bytes_out;         // Sent to and acknowledged by clients
+    uint64_t requests[METRIC_COMMANDS];
+    uint64_t rejected;          // Turned away with FSS_STATUS_BUSY
+    FssHistogram latency[METRIC_LATENCIES]; // Nanoseconds
+} MetricsCounters;
+
+typedef struct MetricsShard {
+    pthread_mutex_t mutex;      // Taken by the owning thread to record, by snapshots to read
+    MetricsCounters counters;
+    bool in_use;                // Owned by a live thread; protected by g_metrics_mutex
+    struct MetricsShard *next;
+} MetricsShard;
+
+static pthread_mutex_t g_metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static MetricsShard *g_metrics_shards = NULL; // Protected by g_metrics_mutex; never shrinks
+static pthread_key_t g_metrics_key;
+static pthread_once_t g_metrics_key_once = PTHREAD_ONCE_INIT;
+static __thread MetricsShard *t_metrics_shard = NULL;
+static time_t g_metrics_start;
+
+// Thread exit: the shard's counts stay in the totals, the shard goes to the next new thread.
+static void metrics_shard_release(void* arg) {
+    pthread_mutex_lock(&g_metrics_mutex);
+    ((MetricsShard*) arg)->in_use = false;
+    pthread_mutex_unlock(&g_metrics_mutex);
+}
+
+static void metrics_key_init(void) {
+    pthread_key_create(&g_metrics_key, metrics_shard_release);
+}
+
+// Returns the calling thread's shard, locked, taking one on first use. NULL if out of memory.
+static MetricsCounters* metrics_lock(void) {
+    if (t_metrics_shard == NULL) {
+        pthread_once(&g_metrics_key_once, metrics_key_init);
+        pthread_mutex_lock(&g_metrics_mutex);
+        MetricsShard *shard = g_metrics_shards;
+        while (shard != NULL && shard->in_use) shard = shard->next;
+        if (shard == NULL && (shard = calloc(1, sizeof(MetricsShard))) != NULL) {
+            pthread_mutex_init(&shard->mutex, NULL);
+            shard->next = g_metrics_shards;
+            g_metrics_shards = shard;
+        }
+        if (shard != NULL) shard->in_use = true;
+        pthread_mutex_unlock(&g_metrics_mutex);
+        if (shard == NULL) return NULL;
+        pthread_setspecific(g_metrics_key, shard);
+        t_metrics_shard = shard;
+    }
+    pthread_mutex_lock(&t_metrics_shard->mutex);
+    return &t_metrics_shard->counters;
+}
+
+static void metrics_unlock(void) {
+    pthread_mutex_unlock(&t_metrics_shard->mutex);
+}
+
+static void metrics_record_latency(MetricLatency which, uint64_t ns) {
+    MetricsCounters *m = metrics_lock();
+    if (m == NULL) return;
+    fss_hist_record(&m->latency[which], ns);
+    metrics_unlock();
+}
+
+static void metrics_count_connection(bool opened) {
+    MetricsCounters *m = metrics_lock();
+    if (m == NULL) return;
+    if (opened) m->connections_opened++;
+    else m->connections_closed++;
+    metrics_unlock();
+}
+
+static void metrics_count_bytes(uint64_t in, uint64_t out) {
+    MetricsCounters *m = metrics_lock();
+    if (m == NULL) return;
+    m->bytes_in += in;
+    m->bytes_out += out;
+    metrics_unlock();
+}
+
+static void metrics_count_request(const char* command, bool rejected) {
+    int which = 0;
+    while (which < METRIC_CMD_OTHER && strcmp(command, metric_command_names[which]) != 0) which++;
+    MetricsCounters *m = metrics_lock();
+    if (m == NULL) return;
+    m->requests[which]++;
+    if (rejected) m->rejected++;
+    metrics_unlock();
+}
+
+// Adds every shard's counters into total, which the caller zeroed.
+static void metrics_snapshot(MetricsCounters* total) {
+    pthread_mutex_lock(&g_metrics_mutex);
+    for (MetricsShard *shard = g_metrics_shards; shard != NULL; shard = shard->next) {
+        pthread_mutex_lock(&shard->mutex);
+        const MetricsCounters *m = &shard->counters;
+        total->connections_opened += m->connections_opened;
+        total->connections_closed += m->connections_closed;
+        total->bytes_in += m->bytes_in;
+        total->bytes_out += m->bytes_out;
+        for (int i = 0; i < METRIC_COMMANDS; i++) total->requests[i] += m->requests[i];
+        total->rejected += m->rejected;
+        for (int i = 0; i < METRIC_LATENCIES; i++) fss_hist_merge(&total->latency[i], &m->latency[i]);
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    pthread_mutex_unlock(&g_metrics_mutex);
+}
+
+// --- End Metrics ---
+
+
+// Whole-file CRC32C of a checksummed transfer, plus the CRC32C of every FILE_DIGEST_BLOCK
+// of the file. With those a frame's CRC is combined from the blocks it covers, so a
+// download whose blocks are known never reads its data and can go out with sendfile().
+#define FILE_DIGEST_BLOCK (64 * 1024)       // Divides every frame size a client can negotiate
+
+typedef struct {
+    uint32_t computed;          // Assembled from the CRCs of the frames as they go out or come in
+    uint32_t stored;            // Downloads: the digest kept next to the file; uploads: the client's
+    bool has_stored;
+    bool frame_mismatch;        // Uploads: a frame did not match its CRC
+
+    uint64_t size;              // Downloads: size of the file the blocks describe
+    uint32_t *blocks;           // Block CRCs, loaded (has_blocks) or collected from the data
+    uint64_t block_count;
+    uint64_t block_capacity;
+    bool has_blocks;            // Downloads: blocks holds the stored CRCs of the whole file
+    bool collect_blocks;        // file_digest_add() records the block CRCs of what it is fed
+    bool blocks_lost;           // Collecting ran out of memory; the digest is stored without them
+    uint32_t open_crc;          // CRC32C of the block being collected
+    uint32_t open_len;
+} FileDigest;
+
+// Closes the block being collected.
+static void file_digest_close_block(FileDigest* digest) {
+    if (!digest->blocks_lost && digest->block_count == digest->block_capacity) {
+        uint64_t capacity = digest->block_capacity ? digest->block_capacity * 2 : 256;
+        uint32_t *grown = realloc(digest->blocks, capacity * sizeof(uint32_t));
+        if (grown == NULL) {
+            free(digest->blocks);
+            digest->blocks = NULL;
+            digest->blocks_lost = true;
+        } else {
+            digest->blocks = grown;
+            digest->block_capacity = capacity;
+        }
+    }
+    if (!digest->blocks_lost) digest->blocks[digest->block_count++] = digest->open_crc;
+    digest->open_crc = 0;
+    digest->open_len = 0;
+}
+
+// Feeds the next len bytes of the file into the digest and returns their CRC32C. Calls
+// must follow the file from its start, in order, when collect_blocks is set.
+static uint32_t file_digest_add(FileDigest* digest, const void* data, size_t len) {
+    uint32_t crc;
+    if (!digest->collect_blocks) {
+        crc = fss_crc32c(0, data, len);
+    } else {
+        // Hash block by block: each piece extends the open block and the frame alike
+        crc = 0;
+        for (size_t done = 0; done < len; ) {
+            size_t piece = FILE_DIGEST_BLOCK - digest->open_len;
+            if (piece > len - done) piece = len - done;
+            uint32_t piece_crc = fss_crc32c(0, (const char*) data + done, piece);
+            crc = fss_crc32c_combine(crc, piece_crc, piece);
+            digest->open_crc = fss_crc32c_combine(digest->open_crc, piece_crc, piece);
+            digest->open_len += piece;
+            done += piece;
+            if (digest->open_len == FILE_DIGEST_BLOCK) file_digest_close_block(digest);
+        }
+    }
+    digest->computed = fss_crc32c_combine(digest->computed, crc, len);
+    return crc;
+}
+
+// The CRC32C of len bytes at offset of a file of size bytes, from its block CRCs. offset
+// is a multiple of FILE_DIGEST_BLOCK and len one too, unless the range ends the file.
+static uint32_t file_blocks_crc(const uint32_t* blocks, uint64_t size, uint64_t offset, uint64_t len) {
+    uint32_t crc = 0;
+    for (uint64_t i = offset / FILE_DIGEST_BLOCK; len > 0; i++) {
+        uint64_t block_len = size - i * FILE_DIGEST_BLOCK < FILE_DIGEST_BLOCK ? size - i * FILE_DIGEST_BLOCK
+                                                                               : FILE_DIGEST_BLOCK;
+        crc = fss_crc32c_combine(crc, blocks[i], block_len);
+        len -= block_len;
+    }
+    return crc;
+}
+
+// Largest frame of at most frame_size bytes that covers whole blocks.
+static uint32_t file_blocks_frame_size(uint32_t frame_size) {
+    return frame_size / FILE_DIGEST_BLOCK * FILE_DIGEST_BLOCK;
+}
+
+static void file_digest_free(FileDigest* digest) {
+    if (digest == NULL) return;
+    free(digest->blocks);
+    digest->blocks = NULL;
+}
 
 typedef struct {
-    char data[CHUNK_SIZE];
+    _Alignas(64) char *data;    // frame_size bytes carved out of thread_shared_data.slab
     size_t bytes_read;
-    int is_last_chunk;
+    int is_last_chunk;          // The producer's final slot; the stages after it stop here
+    char *packed;               // Compressed downloads: frame_size bytes out of packed_slab
+    size_t packed_len;          // Length of the compressed frame in packed, 0 to send data raw
+    bool compressed;            // Compressed uploads: data holds a compressed frame
+    uint32_t crc;               // Checksummed transfers: CRC32C of the raw frame (uploads: as received)
+    uint32_t packed_crc;        // CRC32C of the compressed frame in packed
 } buffer_item;
 
+// --- Transfer Ring ---
+//
+// The download and upload pipelines pass frames between threads through a ring of
+// BUFFER_CAPACITY slots without taking a lock. Each stage owns one cursor, the number of
+// slots it is done with, and is the only thread that writes it: the producer fills slots,
+// the optional middle stage (compression) processes them, and the consumer empties them.
+// A stage may use slot i once the stage before it has moved past i; the producer may reuse
+// it once the consumer has. A stage reads the cursor it follows once and then works through
+// every slot that cursor allows, so frames are handed over in batches, and a stage only
+// parks (on a futex on that cursor) when the ring is empty or full. A producer that found
+// the ring full sleeps until half of it is free, so it is woken once per half ring rather
+// than once per frame. Only the sleeping stage clears its parked flag: the owner merely
+// wakes it, so a late wake-up can never cancel the next time it parks.
+
+#define RING_SPIN 64                // Polls of a cursor before parking on it
+
 typedef struct {
-    buffer_item buffer[BUFFER_CAPACITY];
-    int in, out, count;
+    _Alignas(64) atomic_uint value;  // Slots the owning stage is done with
+    _Alignas(64) atomic_bool parked; // The stage following this cursor sleeps, or is about to
+    atomic_uint wake_at;             // Value it sleeps until; written before parked is set
+} RingCursor;
 
-    pthread_mutex_t mutex;
-    pthread_cond_t not_empty;
-    pthread_cond_t not_full;
+static inline bool ring_reached(unsigned value, unsigned target) {
+    return (int)(value - target) >= 0;
+}
+
+// Waits until the cursor reaches target. Returns the value seen, which may be beyond it.
+static unsigned ring_wait(RingCursor* cursor, unsigned target) {
+    unsigned seen;
+    for (int spin = 0; spin < RING_SPIN; spin++) {
+        seen = atomic_load_explicit(&cursor->value, memory_order_acquire);
+        if (ring_reached(seen, target)) return seen;
+#if defined(__x86_64__)
+        __builtin_ia32_pause();
+#endif
+    }
+    while (true) {
+        atomic_store_explicit(&cursor->wake_at, target, memory_order_relaxed);
+        atomic_store(&cursor->parked, true);
+        // Pairs with ring_advance(): either it sees parked, or this load sees its value
+        seen = atomic_load(&cursor->value);
+        if (ring_reached(seen, target)) break;
+        syscall(SYS_futex, &cursor->value, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+    }
+    atomic_store_explicit(&cursor->parked, false, memory_order_relaxed);
+    return seen;
+}
+
+// Moves the owning stage's cursor to value, waking the stage that follows it if it sleeps
+// and value is what it waits for.
+static void ring_advance(RingCursor* cursor, unsigned value) {
+    atomic_store(&cursor->value, value);
+    if (atomic_load(&cursor->parked) &&
+        ring_reached(value, atomic_load_explicit(&cursor->wake_at, memory_order_relaxed))) {
+        syscall(SYS_futex, &cursor->value, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+typedef struct {
+    buffer_item buffer[BUFFER_CAPACITY];
+    RingCursor filled;          // Producer: slots filled
+    RingCursor packed;          // Compressed downloads: slots compressed by CompressFrames
+    RingCursor consumed;        // Consumer: slots sent or written, free for the producer again
 
     int  file;
+    off_t offset;               // Next file offset to read
+    off_t remaining;            // Bytes of the requested range not read yet
     int client_sock;
-    int eof_reached;
+    bool send_failed;           // Set by the consumer; the client got a broken stream
+    bool read_failed;           // Downloads: set by ReadFromFile; the file could not be read to the end
+    bool write_failed;          // Compressed uploads: set by WriteToFile; the file is incomplete
+    uint32_t compression;       // FSS_COMPRESS_* for downloads; slots then pass through CompressFrames
+    FileDigest *digest;         // Checksummed transfers, NULL otherwise
+
+    char *slab;                 // Backing storage for all buffer items, a page-aligned slot each
+    char *packed_slab;          // Compressed copies of the items, for compressed downloads
+    size_t frame_size;          // Negotiated frame size for this connection
 } thread_shared_data;
 
+// Producer side: returns the slot for the next frame, waiting while the ring is full.
+// *free_until is the first slot not known to be free yet, BUFFER_CAPACITY to start.
+static buffer_item* ring_slot_to_fill(thread_shared_data* sh_data, unsigned next, unsigned* free_until) {
+    if (next == *free_until) {
+        *free_until = ring_wait(&sh_data->consumed, next - BUFFER_CAPACITY / 2) + BUFFER_CAPACITY;
+    }
+    return &sh_data->buffer[next % BUFFER_CAPACITY];
+}
+
+// Later stages: returns slot next once the stage before (upstream) is done with it.
+// *available is the first slot upstream is not known to be done with, 0 to start.
+static buffer_item* ring_slot_to_take(thread_shared_data* sh_data, RingCursor* upstream, unsigned next,
+                                      unsigned* available) {
+    if (next == *available) *available = ring_wait(upstream, next + 1);
+    return &sh_data->buffer[next % BUFFER_CAPACITY];
+}
+
+// Allocates BUFFER_CAPACITY page-aligned slots of at least frame_size bytes and points the
+// items' data (or packed) at them. Returns the slab to free(), NULL if out of memory.
+// The slab comes from plain malloc(), aligned by hand: glibc serves aligned_alloc() of
+// this size with a fresh mapping every time, and each transfer would fault its pages in.
+static char* ring_alloc_slots(thread_shared_data* sh_data, size_t frame_size, bool packed) {
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    size_t stride = (frame_size + page_size - 1) / page_size * page_size;
+    char *slab = malloc(stride * BUFFER_CAPACITY + page_size);
+    if (slab == NULL) return NULL;
+    char *first = (char*) (((uintptr_t) slab + page_size - 1) & ~(uintptr_t) (page_size - 1));
+    for (int i = 0; i < BUFFER_CAPACITY; i++) {
+        if (packed) {
+            sh_data->buffer[i].packed = first + (size_t) i * stride;
+        } else {
+            sh_data->buffer[i].data = first + (size_t) i * stride;
+        }
+    }
+    return slab;
+}
+
+// --- End Transfer Ring ---
+
 typedef struct{
     char filename[20];
     int fd;
@@ -54,38 +737,259 @@ typedef struct{
 //     int socket;
 // };
 
+struct Connection;
+
+// Fixed-size body some commands carry after the filename, as received (big-endian)
+typedef union {
+    FssRangeRequest range;
+    FssUploadOpen upload_open;
+    FssUploadSession upload_session;
+    FssUploadPart upload_part;
+    FssDeltaSignature delta_signature;
+    FssTransferOptions transfer;
+    FssListRequest list;
+    FssBatchRequest batch;
+} RequestBody;
+
 // New struct to pass arguments to worker threads
 typedef struct {
     int client_socket;
     char filename[256]; // Ensure this matches FileAccessControl filename size
+    uint64_t filename_hash; // filename_hash(filename), computed once when the request is parsed
+    uint32_t frame_size; // Max frame payload negotiated on this connection
+    bool persistent; // FSS_FLAG_PERSISTENT connection: responses carry an FssResponse
+    uint32_t request_id; // Position of this request on its connection, from 1
+    bool is_range; // "range" request: send only range_offset/range_length, after an FssRangeInfo
+    uint64_t range_offset;
+    uint64_t range_length;
+    RequestBody body; // Body of upload session requests
+    uint32_t compression; // FSS_COMPRESS_* chosen in a download's or upload's FssTransferOptions
+    bool checksum; // FSS_FLAG_CHECKSUM download or upload: frames carry CRC32C trailers
+    bool keep_alive; // Cleared by the handler if the connection cannot carry another request
+    uint64_t dispatched_ns; // When the request header was complete, for the latency metrics
+    bool first_byte_pending; // Download whose response has not gone out yet (METRIC_LAT_FIRST_BYTE)
+    struct Connection *conn; // Owning connection, handed back to its event loop when the task ends
 } ClientTaskArgs;
 
+void finish_client_task(ClientTaskArgs* task_args);
+
+
+// --- Lock Contention Profile ---
+//
+// Every FileAccessControl profiles its own lock: wait and hold times for readers and
+// writers, how many acquisitions had to wait, how often waiters were woken, and the
+// high-water marks of the queues. The figures are updated under the control's mutex,
+// which the lock functions hold anyway, so profiling adds a clock read per acquire and
+// release and nothing else. When a file's last user leaves and its control is freed, a
+// profile that saw contention moves to a bounded archive, so "locks" can still rank it.
+
+#define LOCK_HIST_BUCKETS 40            // Powers of two of nanoseconds, up to ~18 minutes
+#define LOCK_PROFILE_ARCHIVE_MAX 4096   // Retired profiles kept; the least waited-on go first
+
+typedef struct {
+    uint32_t counts[LOCK_HIST_BUCKETS]; // Bucket b: values below 2^b ns (and at least 2^(b-1))
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+} LockHistogram;
+
+typedef struct {
+    uint64_t acquired;
+    uint64_t contended;                 // Acquisitions that had to wait
+    uint64_t wakeups;                   // Returns from pthread_cond_wait, including ones that waited again
+    LockHistogram wait;
+    LockHistogram hold;                 // Writers: each hold. Readers: each stretch the file stayed read-locked
+} LockSideProfile;
+
+typedef struct {
+    LockSideProfile read;
+    LockSideProfile write;
+    int max_waiting_writers;
+    int max_active_readers;
+} LockProfile;
+
+static void lock_hist_record(LockHistogram* h, uint64_t ns) {
+    int b = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    h->counts[b < LOCK_HIST_BUCKETS ? b : LOCK_HIST_BUCKETS - 1]++;
+    h->count++;
+    h->sum_ns += ns;
+    if (ns > h->max_ns) h->max_ns = ns;
+}
+
+static void lock_hist_merge(LockHistogram* into, const LockHistogram* from) {
+    for (int i = 0; i < LOCK_HIST_BUCKETS; i++) into->counts[i] += from->counts[i];
+    into->count += from->count;
+    into->sum_ns += from->sum_ns;
+    if (from->max_ns > into->max_ns) into->max_ns = from->max_ns;
+}
+
+// Upper bound of the bucket holding fraction q of the values, capped at the maximum
+static uint64_t lock_hist_percentile(const LockHistogram* h, double q) {
+    uint64_t target = (uint64_t)(q * h->count);
+    if ((double) target < q * h->count || target == 0) target++;
+    uint64_t seen = 0;
+    for (int i = 0; i < LOCK_HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) return i < 63 && (1ULL << i) < h->max_ns ? 1ULL << i : h->max_ns;
+    }
+    return h->max_ns;
+}
+
+static void lock_profile_merge(LockProfile* into, const LockProfile* from) {
+    LockSideProfile *sides[2] = { &into->read, &into->write };
+    const LockSideProfile *from_sides[2] = { &from->read, &from->write };
+    for (int i = 0; i < 2; i++) {
+        sides[i]->acquired += from_sides[i]->acquired;
+        sides[i]->contended += from_sides[i]->contended;
+        sides[i]->wakeups += from_sides[i]->wakeups;
+        lock_hist_merge(&sides[i]->wait, &from_sides[i]->wait);
+        lock_hist_merge(&sides[i]->hold, &from_sides[i]->hold);
+    }
+    if (from->max_waiting_writers > into->max_waiting_writers) into->max_waiting_writers = from->max_waiting_writers;
+    if (from->max_active_readers > into->max_active_readers) into->max_active_readers = from->max_active_readers;
+}
+
+static uint64_t lock_profile_wait_ns(const LockProfile* profile) {
+    return profile->read.wait.sum_ns + profile->write.wait.sum_ns;
+}
+
+typedef struct {
+    char filename[256];
+    uint64_t hash;
+    LockProfile profile;
+} LockProfileEntry;
+
+static pthread_mutex_t g_lock_archive_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LockProfileEntry *g_lock_archive[LOCK_PROFILE_ARCHIVE_MAX]; // Protected by g_lock_archive_mutex
+static int g_lock_archive_count = 0;
+
+// Keeps the profile of a control that is being freed, if its lock was ever contended.
+static void lock_profile_retire(const char* filename, uint64_t hash, const LockProfile* profile) {
+    if (profile->read.contended + profile->write.contended == 0) return;
+
+    pthread_mutex_lock(&g_lock_archive_mutex);
+    int found = -1, least = -1;
+    for (int i = 0; i < g_lock_archive_count && found < 0; i++) {
+        if (g_lock_archive[i]->hash == hash && strcmp(g_lock_archive[i]->filename, filename) == 0) found = i;
+        else if (least < 0 || lock_profile_wait_ns(&g_lock_archive[i]->profile) <
+                              lock_profile_wait_ns(&g_lock_archive[least]->profile)) least = i;
+    }
+    if (found < 0 && g_lock_archive_count < LOCK_PROFILE_ARCHIVE_MAX) {
+        LockProfileEntry *entry = calloc(1, sizeof(LockProfileEntry));
+        if (entry != NULL) {
+            snprintf(entry->filename, sizeof(entry->filename), "%s", filename);
+            entry->hash = hash;
+            found = g_lock_archive_count;
+            g_lock_archive[g_lock_archive_count++] = entry;
+        }
+    } else if (found < 0 && lock_profile_wait_ns(&g_lock_archive[least]->profile) < lock_profile_wait_ns(profile)) {
+        // Full: the new profile replaces the one that waited least
+        found = least;
+        snprintf(g_lock_archive[found]->filename, sizeof(g_lock_archive[found]->filename), "%s", filename);
+        g_lock_archive[found]->hash = hash;
+        memset(&g_lock_archive[found]->profile, 0, sizeof(LockProfile));
+    }
+    if (found >= 0) lock_profile_merge(&g_lock_archive[found]->profile, profile);
+    pthread_mutex_unlock(&g_lock_archive_mutex);
+}
+
+// --- End Lock Contention Profile ---
+
 
 // --- Reader/Writer Lock Implementation using Mutex/Cond Vars ---
 typedef struct FileAccessControl {
     char filename[256];           // Max filename length (adjust if needed)
+    uint64_t hash;                // filename_hash(filename), checked before strcmp
     pthread_mutex_t mutex;        // Mutex protecting this structure's fields
     pthread_cond_t can_read;     // Condition variable for readers to wait
     pthread_cond_t can_write;    // Condition variable for writers to wait
     int active_readers;         // How many threads are currently reading
     bool active_writer;         // Is a thread currently writing?
     int waiting_writers;        // How many threads are waiting to write
-    int users;                  // How many requests are currently associated (for cleanup)
+    atomic_int users;           // How many requests are currently associated (for cleanup)
 
-    struct FileAccessControl *next; // Pointer for implementing a linked list
+    LockProfile profile;        // Protected by mutex
+    uint64_t read_locked_ns;    // When active_readers last rose from 0
+    uint64_t write_locked_ns;   // When the active writer got the lock
+
+    struct FileAccessControl *next; // Next entry in the same registry bucket
 } FileAccessControl;
 
-// Global head of the linked list of file control structs
-FileAccessControl *g_file_list_head = NULL;
+// --- File Control Registry ---
+//
+// FileAccessControl structs live in a hash map split into independently locked shards,
+// so requests for different files rarely touch the same mutex and lookups are O(1).
+// The shard is picked from the high bits of the filename hash and the bucket from the
+// low bits; each shard doubles its bucket array when it averages two entries per bucket.
+
+#define FILE_REGISTRY_SHARDS 64         // Power of two
+#define FILE_REGISTRY_INITIAL_BUCKETS 64 // Per shard, power of two
 
-// Mutex to protect access to the global list (g_file_list_head)
-pthread_mutex_t g_file_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+typedef struct {
+    pthread_mutex_t mutex;
+    FileAccessControl **buckets;
+    size_t bucket_count;
+    size_t count;
+} FileRegistryShard;
+
+FileRegistryShard g_file_registry[FILE_REGISTRY_SHARDS];
+pthread_once_t g_file_registry_once = PTHREAD_ONCE_INIT;
+
+static void file_registry_init(void) {
+    for (int i = 0; i < FILE_REGISTRY_SHARDS; i++) {
+        pthread_mutex_init(&g_file_registry[i].mutex, NULL);
+        g_file_registry[i].buckets = calloc(FILE_REGISTRY_INITIAL_BUCKETS, sizeof(FileAccessControl*));
+        g_file_registry[i].bucket_count = g_file_registry[i].buckets ? FILE_REGISTRY_INITIAL_BUCKETS : 0;
+    }
+}
+
+// 64-bit FNV-1a. Computed once per request, when the request header is parsed.
+// The final avalanche step spreads every input byte over the high bits as well, which
+// plain FNV-1a leaves nearly identical for short, similar names ("file1", "file2", ...)
+// and which pick the registry and cache shards.
+uint64_t filename_hash(const char* filename) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char*) filename; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static inline FileRegistryShard* file_registry_shard(uint64_t hash) {
+    return &g_file_registry[hash >> 58 & (FILE_REGISTRY_SHARDS - 1)];
+}
+
+// Doubles a shard's bucket array. Called with the shard mutex held; on allocation
+// failure the shard simply keeps its longer chains.
+static void file_registry_grow(FileRegistryShard* shard) {
+    size_t new_count = shard->bucket_count * 2;
+    FileAccessControl **new_buckets = calloc(new_count, sizeof(FileAccessControl*));
+    if (new_buckets == NULL) return;
 
+    for (size_t i = 0; i < shard->bucket_count; i++) {
+        FileAccessControl *entry = shard->buckets[i];
+        while (entry != NULL) {
+            FileAccessControl *next = entry->next;
+            size_t b = entry->hash & (new_count - 1);
+            entry->next = new_buckets[b];
+            new_buckets[b] = entry;
+            entry = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = new_buckets;
+    shard->bucket_count = new_count;
+}
 
-// Finds or creates a FileAccessControl struct for a given filename.
+// Finds or creates a FileAccessControl struct for a given filename whose hash the
+// caller already computed with filename_hash().
 // Returns a pointer to the struct, or NULL on failure.
 // Increments the user count, caller must call release_file_control later.
-FileAccessControl* get_or_create_file_control(const char* filename) {
+FileAccessControl* get_or_create_file_control_hashed(const char* filename, uint64_t hash) {
     FileAccessControl *current = NULL;
     FileAccessControl *new_control = NULL;
 
@@ -94,15 +998,18 @@ FileAccessControl* get_or_create_file_control(const char* filename) {
         return NULL;
     }
 
-    pthread_mutex_lock(&g_file_list_mutex);
+    pthread_once(&g_file_registry_once, file_registry_init);
+    FileRegistryShard *shard = file_registry_shard(hash);
 
-    // 1. Search for existing control struct
-    current = g_file_list_head;
+    pthread_mutex_lock(&shard->mutex);
+
+    // 1. Search the bucket for an existing control struct
+    current = shard->buckets[hash & (shard->bucket_count - 1)];
     while (current != NULL) {
-        if (strcmp(current->filename, filename) == 0) {
-            current->users++; // Increment user count
-            pthread_mutex_unlock(&g_file_list_mutex);
-            printf("Found existing control for file: %s, users: %d\n", current->filename, current->users); // Debug print
+        if (current->hash == hash && strcmp(current->filename, filename) == 0) {
+            int users = atomic_fetch_add(&current->users, 1) + 1; // Increment user count
+            pthread_mutex_unlock(&shard->mutex);
+            log_debug("Found existing control for file: %s, users: %d", current->filename, users);
             return current; // Found existing one
         }
         current = current->next;
@@ -112,13 +1019,14 @@ FileAccessControl* get_or_create_file_control(const char* filename) {
     new_control = (FileAccessControl*)malloc(sizeof(FileAccessControl));
     if (new_control == NULL) {
         perror("malloc FileAccessControl failed");
-        pthread_mutex_unlock(&g_file_list_mutex);
+        pthread_mutex_unlock(&shard->mutex);
         return NULL; // Allocation failed
     }
 
     // Initialize the new struct
     strncpy(new_control->filename, filename, sizeof(new_control->filename) - 1);
     new_control->filename[sizeof(new_control->filename) - 1] = '\0'; // Ensure null termination
+    new_control->hash = hash;
 
     // Check for initialization errors
     if (pthread_mutex_init(&new_control->mutex, NULL) != 0 ||
@@ -126,66 +1034,73 @@ FileAccessControl* get_or_create_file_control(const char* filename) {
         pthread_cond_init(&new_control->can_write, NULL) != 0) {
         perror("Failed to initialize mutex/cond vars for FileAccessControl");
         free(new_control);
-        pthread_mutex_unlock(&g_file_list_mutex);
+        pthread_mutex_unlock(&shard->mutex);
         return NULL;
     }
 
     new_control->active_readers = 0;
     new_control->active_writer = false;
     new_control->waiting_writers = 0;
-    new_control->users = 1; // First user
+    memset(&new_control->profile, 0, sizeof(new_control->profile));
+    atomic_init(&new_control->users, 1); // First user
 
-    // Add to the head of the global list
-    new_control->next = g_file_list_head;
-    g_file_list_head = new_control;
+    // Add to the head of its bucket
+    size_t b = hash & (shard->bucket_count - 1);
+    new_control->next = shard->buckets[b];
+    shard->buckets[b] = new_control;
+    if (++shard->count > shard->bucket_count * 2) {
+        file_registry_grow(shard);
+    }
 
-    pthread_mutex_unlock(&g_file_list_mutex);
-    printf("Created control for file: %s\n", new_control->filename); // Debug print
+    pthread_mutex_unlock(&shard->mutex);
+    log_debug("Created control for file: %s", new_control->filename);
     return new_control;
 }
 
+FileAccessControl* get_or_create_file_control(const char* filename) {
+    if (filename == NULL) return get_or_create_file_control_hashed(filename, 0);
+    return get_or_create_file_control_hashed(filename, filename_hash(filename));
+}
+
 // Releases a reference to a file control struct.
 // Cleans up if this was the last user.
 void release_file_control(FileAccessControl* control) {
     if (control == NULL) return;
-    bool should_destroy = false;
 
-    pthread_mutex_lock(&g_file_list_mutex);
-
-    control->users--;
-    printf("Released control for file: %s, users remaining: %d\n", control->filename, control->users); // Debug print
-
-    // Cleanup if no longer in use
-    if (control->users == 0) {
-        should_destroy = true;
-        // Remove from list
-        FileAccessControl *prev = NULL;
-        FileAccessControl *current = g_file_list_head;
-        while (current != NULL) {
-            if (current == control) {
-                if (prev == NULL) { // It's the head
-                    g_file_list_head = current->next;
-                } else {
-                    prev->next = current->next;
-                }
-                 printf("Removing control for file: %s from list\n", control->filename); // Debug print
-                break; // Found and logically removed
-            }
-            prev = current;
-            current = current->next;
+    // Fast path: not the last user, so the entry stays in the registry and no lock is needed
+    int users = atomic_load(&control->users);
+    while (users > 1) {
+        if (atomic_compare_exchange_weak(&control->users, &users, users - 1)) {
+            return;
         }
-         if (current == NULL) {
-             // This case should ideally not happen if release is called correctly
-             fprintf(stderr, "Error: Tried to remove control for %s, but not found in list!\n", control->filename);
-             should_destroy = false; // Don't destroy if not found
-         }
     }
 
-    pthread_mutex_unlock(&g_file_list_mutex);
+    // Possibly the last user. Decide under the shard lock so that a concurrent
+    // get_or_create_file_control either revives the entry first or finds it gone.
+    FileRegistryShard *shard = file_registry_shard(control->hash);
+    bool should_destroy = false;
+
+    pthread_mutex_lock(&shard->mutex);
+    if (atomic_fetch_sub(&control->users, 1) == 1) {
+        FileAccessControl **link = &shard->buckets[control->hash & (shard->bucket_count - 1)];
+        while (*link != NULL && *link != control) {
+            link = &(*link)->next;
+        }
+        if (*link != NULL) {
+            *link = control->next; // Unlink
+            shard->count--;
+            should_destroy = true;
+        } else {
+            // This case should ideally not happen if release is called correctly
+            fprintf(stderr, "Error: Tried to remove control for %s, but not found in registry!\n", control->filename);
+        }
+    }
+    pthread_mutex_unlock(&shard->mutex);
 
-    // Destroy mutex/cond vars and free memory *outside* the global list lock
+    // Destroy mutex/cond vars and free memory *outside* the shard lock
     if (should_destroy) {
-        printf("Destroying control for file: %s\n", control->filename); // Debug print
+        log_debug("Destroying control for file: %s", control->filename);
+        lock_profile_retire(control->filename, control->hash, &control->profile);
         pthread_mutex_destroy(&control->mutex);
         pthread_cond_destroy(&control->can_read);
         pthread_cond_destroy(&control->can_write);
@@ -193,6 +1108,8 @@ void release_file_control(FileAccessControl* control) {
     }
 }
 
+// --- End File Control Registry ---
+
 
 // --- Locking Functions ---
 
@@ -202,36 +1119,33 @@ void acquire_read_lock(FileAccessControl* control) {
         fprintf(stderr, "Error: acquire_read_lock called with NULL control\n");
         return;
     }
-    
-    time_t now;
-    char timestamp[26];
-    time(&now);
-    ctime_r(&now, timestamp);
-    timestamp[24] = '\0';  // Remove newline
-    
-    pthread_t tid = pthread_self();
-    printf("\n[%s] Reader Thread %lu: Attempting to acquire read lock for file: %s\n", timestamp, (unsigned long)tid, control->filename);
-    
+
+    log_debug("Reader: Attempting to acquire read lock for file: %s", control->filename);
+
+    uint64_t start = monotonic_ns();
     pthread_mutex_lock(&control->mutex);
-    printf("[%s] Reader Thread %lu: Acquired mutex, checking conditions\n", timestamp, (unsigned long)tid);
-    
+    LockSideProfile *profile = &control->profile.read;
+    if (control->active_writer || control->waiting_writers > 0) profile->contended++;
+
     // Wait while there's an active writer OR waiting writers (preference to writers)
     while (control->active_writer || control->waiting_writers > 0) {
-        printf("[%s] Reader Thread %lu: Waiting - Active writer: %d, Waiting writers: %d\n", 
-               timestamp, (unsigned long)tid, control->active_writer, control->waiting_writers);
+        log_debug("Reader: Waiting for %s - Active writer: %d, Waiting writers: %d",
+                  control->filename, control->active_writer, control->waiting_writers);
         pthread_cond_wait(&control->can_read, &control->mutex);
-        time(&now);
-        ctime_r(&now, timestamp);
-        timestamp[24] = '\0';
-        printf("[%s] Reader Thread %lu: Woke up from wait, rechecking conditions\n", timestamp, (unsigned long)tid);
-    }
-    
-    control->active_readers++;
-    printf("[%s] Reader Thread %lu: Successfully acquired read lock. Active readers: %d\n", 
-           timestamp, (unsigned long)tid, control->active_readers);
-    
+        profile->wakeups++;
+    }
+
+    uint64_t now = monotonic_ns();
+    if (control->active_readers++ == 0) control->read_locked_ns = now;
+    if (control->active_readers > control->profile.max_active_readers) {
+        control->profile.max_active_readers = control->active_readers;
+    }
+    profile->acquired++;
+    lock_hist_record(&profile->wait, now - start);
+    log_debug("Reader: Acquired read lock for %s. Active readers: %d", control->filename, control->active_readers);
+
     pthread_mutex_unlock(&control->mutex);
-    printf("[%s] Reader Thread %lu: Released mutex after acquiring read lock\n", timestamp, (unsigned long)tid);
+    metrics_record_latency(METRIC_LAT_LOCK_WAIT, now - start);
 }
 
 // Release read access
@@ -240,32 +1154,22 @@ void release_read_lock(FileAccessControl* control) {
         fprintf(stderr, "Error: release_read_lock called with NULL control\n");
         return;
     }
-    
-    time_t now;
-    char timestamp[26];
-    time(&now);
-    ctime_r(&now, timestamp);
-    timestamp[24] = '\0';  // Remove newline
-    
-    pthread_t tid = pthread_self();
-    printf("\n[%s] Reader Thread %lu: Attempting to release read lock for file: %s\n", timestamp, (unsigned long)tid, control->filename);
-    
+
     pthread_mutex_lock(&control->mutex);
-    printf("[%s] Reader Thread %lu: Acquired mutex for release\n", timestamp, (unsigned long)tid);
-    
-    control->active_readers--;
-    printf("[%s] Reader Thread %lu: Decremented active readers. New count: %d\n", 
-           timestamp, (unsigned long)tid, control->active_readers);
-    
+
+    if (--control->active_readers == 0) {
+        lock_hist_record(&control->profile.read.hold, monotonic_ns() - control->read_locked_ns);
+    }
+    log_debug("Reader: Released read lock for %s. Active readers: %d", control->filename, control->active_readers);
+
     // If I was the last reader AND writers are waiting, signal one writer
     if (control->active_readers == 0 && control->waiting_writers > 0) {
-        printf("[%s] Reader Thread %lu: Last reader out, signaling waiting writer. Writers waiting: %d\n", 
-               timestamp, (unsigned long)tid, control->waiting_writers);
+        log_debug("Reader: Last reader out of %s, signaling waiting writer. Writers waiting: %d",
+                  control->filename, control->waiting_writers);
         pthread_cond_signal(&control->can_write);
     }
-    
+
     pthread_mutex_unlock(&control->mutex);
-    printf("[%s] Reader Thread %lu: Released mutex after releasing read lock\n", timestamp, (unsigned long)tid);
 }
 
 // Acquire write access
@@ -274,41 +1178,38 @@ void acquire_write_lock(FileAccessControl* control) {
         fprintf(stderr, "Error: acquire_write_lock called with NULL control\n");
         return;
     }
-    
-    time_t now;
-    char timestamp[26];
-    time(&now);
-    ctime_r(&now, timestamp);
-    timestamp[24] = '\0';  // Remove newline
-    
-    pthread_t tid = pthread_self();
-    printf("\n[%s] Writer Thread %lu: Attempting to acquire write lock for file: %s\n", timestamp, (unsigned long)tid, control->filename);
-    
+
+    log_debug("Writer: Attempting to acquire write lock for file: %s", control->filename);
+
+    uint64_t start = monotonic_ns();
     pthread_mutex_lock(&control->mutex);
-    printf("[%s] Writer Thread %lu: Acquired mutex, checking conditions\n", timestamp, (unsigned long)tid);
-    
+
     control->waiting_writers++; // Indicate intention to write
-    printf("[%s] Writer Thread %lu: Registered as waiting writer. Total waiting writers: %d\n", 
-           timestamp, (unsigned long)tid, control->waiting_writers);
-    
+    LockSideProfile *profile = &control->profile.write;
+    if (control->waiting_writers > control->profile.max_waiting_writers) {
+        control->profile.max_waiting_writers = control->waiting_writers;
+    }
+    if (control->active_readers > 0 || control->active_writer) profile->contended++;
+
     // Wait while there are active readers OR an active writer
     while (control->active_readers > 0 || control->active_writer) {
-        printf("[%s] Writer Thread %lu: Waiting - Active readers: %d, Active writer: %d\n", 
-               timestamp, (unsigned long)tid, control->active_readers, control->active_writer);
+        log_debug("Writer: Waiting for %s - Active readers: %d, Active writer: %d",
+                  control->filename, control->active_readers, control->active_writer);
         pthread_cond_wait(&control->can_write, &control->mutex);
-        time(&now);
-        ctime_r(&now, timestamp);
-        timestamp[24] = '\0';
-        printf("[%s] Writer Thread %lu: Woke up from wait, rechecking conditions\n", timestamp, (unsigned long)tid);
+        profile->wakeups++;
     }
-    
+
     control->waiting_writers--; // No longer waiting
     control->active_writer = true; // I am the active writer now
-    printf("[%s] Writer Thread %lu: Successfully acquired write lock. Remaining waiting writers: %d\n", 
-           timestamp, (unsigned long)tid, control->waiting_writers);
-    
+    uint64_t now = monotonic_ns();
+    control->write_locked_ns = now;
+    profile->acquired++;
+    lock_hist_record(&profile->wait, now - start);
+    log_debug("Writer: Acquired write lock for %s. Remaining waiting writers: %d",
+              control->filename, control->waiting_writers);
+
     pthread_mutex_unlock(&control->mutex);
-    printf("[%s] Writer Thread %lu: Released mutex after acquiring write lock\n", timestamp, (unsigned long)tid);
+    metrics_record_latency(METRIC_LAT_LOCK_WAIT, now - start);
 }
 
 // Release write access
@@ -317,509 +1218,5555 @@ void release_write_lock(FileAccessControl* control) {
         fprintf(stderr, "Error: release_write_lock called with NULL control\n");
         return;
     }
-    
-    time_t now;
-    char timestamp[26];
-    time(&now);
-    ctime_r(&now, timestamp);
-    timestamp[24] = '\0';  // Remove newline
-    
-    pthread_t tid = pthread_self();
-    printf("\n[%s] Writer Thread %lu: Attempting to release write lock for file: %s\n", timestamp, (unsigned long)tid, control->filename);
-    
+
     pthread_mutex_lock(&control->mutex);
-    printf("[%s] Writer Thread %lu: Acquired mutex for release\n", timestamp, (unsigned long)tid);
-    
+
     control->active_writer = false; // No longer writing
-    printf("[%s] Writer Thread %lu: Marked as no longer active writer\n", timestamp, (unsigned long)tid);
-    
+    lock_hist_record(&control->profile.write.hold, monotonic_ns() - control->write_locked_ns);
+
     // Check if writers are waiting first (preference to writers)
     if (control->waiting_writers > 0) {
-        printf("[%s] Writer Thread %lu: Signaling next waiting writer. Writers waiting: %d\n", 
-               timestamp, (unsigned long)tid, control->waiting_writers);
+        log_debug("Writer: Released write lock for %s, signaling next waiting writer. Writers waiting: %d",
+                  control->filename, control->waiting_writers);
         pthread_cond_signal(&control->can_write); // Signal one waiting writer
     } else {
         // Otherwise, signal all waiting readers (broadcast needed as multiple readers can proceed)
-        printf("[%s] Writer Thread %lu: No waiting writers, broadcasting to all waiting readers\n", timestamp, (unsigned long)tid);
+        log_debug("Writer: Released write lock for %s, broadcasting to all waiting readers", control->filename);
         pthread_cond_broadcast(&control->can_read);
     }
-    
+
     pthread_mutex_unlock(&control->mutex);
-    printf("[%s] Writer Thread %lu: Released mutex after releasing write lock\n", timestamp, (unsigned long)tid);
 }
 
 // --- End Reader/Writer Lock Implementation ---
 
 
+// --- Lock Contention Report ---
 
-void* ReadFromFile(void *arg){
-    thread_shared_data *sh_data = (thread_shared_data*) arg;
+static void lock_write_hist(FILE* out, const char* name, const LockHistogram* h) {
+    fprintf(out, "\"%s\": {\"total\": %.1f, \"mean\": %.1f, \"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f}",
+            name, h->sum_ns / 1000.0, h->count ? (double) h->sum_ns / h->count / 1000 : 0.0,
+            lock_hist_percentile(h, 0.50) / 1000.0, lock_hist_percentile(h, 0.99) / 1000.0, h->max_ns / 1000.0);
+}
 
-    while (1)
-    {
-        pthread_mutex_lock(&sh_data->mutex);
-        while (sh_data->count == BUFFER_CAPACITY && sh_data->eof_reached == 0)
-        {
-            pthread_cond_wait(&sh_data->not_full , &sh_data->mutex);
-        }
-        int bytes_read = read(sh_data->file , sh_data->buffer[sh_data->in].data, CHUNK_SIZE);
-        sh_data->buffer[sh_data->in].bytes_read = bytes_read;
-        (sh_data->count)++;
-        sh_data->in = (sh_data->in +1) % BUFFER_CAPACITY;
-        
-        pthread_cond_signal(&sh_data->not_empty);
-        pthread_mutex_unlock(&sh_data->mutex);
-
-        if (bytes_read < CHUNK_SIZE)
-        {
-            sh_data->eof_reached = 1;
-            break;
-        }
-        
-    }
-    
-};
+static void lock_write_side(FILE* out, const char* name, const LockSideProfile* side) {
+    fprintf(out, "\"%s\": {\"acquired\": %llu, \"contended\": %llu, \"wakeups\": %llu, ", name,
+            (unsigned long long) side->acquired, (unsigned long long) side->contended,
+            (unsigned long long) side->wakeups);
+    lock_write_hist(out, "wait_us", &side->wait);
+    fprintf(out, ", ");
+    lock_write_hist(out, "hold_us", &side->hold);
+    fprintf(out, "}");
+}
 
-void* SendOverANetwork(void *arg){
+static int lock_entry_by_name(const void* a, const void* b) {
+    const LockProfileEntry *x = a, *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return strcmp(x->filename, y->filename);
+}
+
+static int lock_entry_by_wait(const void* a, const void* b) {
+    uint64_t x = lock_profile_wait_ns(&((const LockProfileEntry*) a)->profile);
+    uint64_t y = lock_profile_wait_ns(&((const LockProfileEntry*) b)->profile);
+    return x == y ? 0 : x > y ? -1 : 1;
+}
+
+// Appends a copy of a profile to the growing array *entries. Returns -1 if out of memory.
+static int lock_collect(LockProfileEntry** entries, size_t* count, size_t* cap, const char* filename,
+                        uint64_t hash, const LockProfile* profile) {
+    if (*count == *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 64;
+        LockProfileEntry *grown = realloc(*entries, new_cap * sizeof(LockProfileEntry));
+        if (grown == NULL) return -1;
+        *entries = grown;
+        *cap = new_cap;
+    }
+    LockProfileEntry *entry = &(*entries)[(*count)++];
+    snprintf(entry->filename, sizeof(entry->filename), "%s", filename);
+    entry->hash = hash;
+    entry->profile = *profile;
+    return 0;
+}
+
+// Writes the n files whose locks were waited on longest, as JSON: every live control
+// whose lock was ever contended, merged with the archived profile of the same file.
+// Times are in microseconds. Returns 0 on success, -1 if out of memory.
+static int lock_write_top(FILE* out, int n) {
+    LockProfileEntry *entries = NULL;
+    size_t count = 0, cap = 0;
+    int rc = 0;
+
+    pthread_once(&g_file_registry_once, file_registry_init);
+    for (int i = 0; i < FILE_REGISTRY_SHARDS && rc == 0; i++) {
+        FileRegistryShard *shard = &g_file_registry[i];
+        pthread_mutex_lock(&shard->mutex);
+        for (size_t b = 0; b < shard->bucket_count && rc == 0; b++) {
+            for (FileAccessControl *control = shard->buckets[b]; control != NULL && rc == 0; control = control->next) {
+                pthread_mutex_lock(&control->mutex);
+                if (control->profile.read.contended + control->profile.write.contended > 0) {
+                    rc = lock_collect(&entries, &count, &cap, control->filename, control->hash, &control->profile);
+                }
+                pthread_mutex_unlock(&control->mutex);
+            }
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    pthread_mutex_lock(&g_lock_archive_mutex);
+    for (int i = 0; i < g_lock_archive_count && rc == 0; i++) {
+        rc = lock_collect(&entries, &count, &cap, g_lock_archive[i]->filename, g_lock_archive[i]->hash,
+                          &g_lock_archive[i]->profile);
+    }
+    pthread_mutex_unlock(&g_lock_archive_mutex);
+    if (rc != 0) {
+        free(entries);
+        return -1;
+    }
+
+    // A file can be both live and archived; fold its entries together
+    qsort(entries, count, sizeof(LockProfileEntry), lock_entry_by_name);
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unique > 0 && lock_entry_by_name(&entries[unique - 1], &entries[i]) == 0) {
+            lock_profile_merge(&entries[unique - 1].profile, &entries[i].profile);
+        } else {
+            if (unique != i) entries[unique] = entries[i];
+            unique++;
+        }
+    }
+    qsort(entries, unique, sizeof(LockProfileEntry), lock_entry_by_wait);
+
+    fprintf(out, "{\n  \"contended_files\": %zu,\n  \"files\": [", unique);
+    for (size_t i = 0; i < unique && i < (size_t) n; i++) {
+        const LockProfile *profile = &entries[i].profile;
+        fprintf(out, "%s\n    {\"file\": \"", i ? "," : "");
+        for (const char *p = entries[i].filename; *p; p++) {
+            if (*p == '"' || *p == '\\') fputc('\\', out);
+            if ((unsigned char) *p >= 0x20) fputc(*p, out);
+        }
+        fprintf(out, "\", \"wait_us\": %.1f, \"max_waiting_writers\": %d, \"max_active_readers\": %d,\n     ",
+                lock_profile_wait_ns(profile) / 1000.0, profile->max_waiting_writers, profile->max_active_readers);
+        lock_write_side(out, "read", &profile->read);
+        fprintf(out, ",\n     ");
+        lock_write_side(out, "write", &profile->write);
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n  ]\n}\n");
+    free(entries);
+    return 0;
+}
+
+// --- End Lock Contention Report ---
+
+
+
+void* ReadFromFile(void *arg){
+    thread_shared_data *sh_data = (thread_shared_data*) arg;
+    unsigned free_until = BUFFER_CAPACITY;
+
+    for (unsigned next = 0; ; next++) {
+        buffer_item *item = ring_slot_to_fill(sh_data, next, &free_until);
+        size_t wanted = sh_data->remaining < (off_t)sh_data->frame_size ? (size_t)sh_data->remaining : sh_data->frame_size;
+        ssize_t bytes_read = 0;
+        while ((size_t)bytes_read < wanted) {
+            ssize_t n = pread(sh_data->file, item->data + bytes_read, wanted - bytes_read, sh_data->offset + bytes_read);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                // Read error, or the file was truncated under us: the consumer must not end the stream normally
+                if (n < 0) perror("ReadFromFile: pread failed");
+                else fprintf(stderr, "ReadFromFile: file truncated during transfer\n");
+                sh_data->read_failed = true;
+                break;
+            }
+            bytes_read += n;
+        }
+        sh_data->offset += bytes_read;
+        sh_data->remaining -= bytes_read;
+        item->bytes_read = bytes_read;
+        item->is_last_chunk = (size_t)bytes_read < wanted || sh_data->remaining == 0;
+
+        bool done = item->is_last_chunk;
+        ring_advance(&sh_data->filled, next + 1);
+        if (done) break;
+    }
+    return NULL;
+};
+
+// Middle stage of a compressed download: compresses the frames ReadFromFile filled, in
+// order, while the frame before is on the wire and the one after is being read.
+void* CompressFrames(void *arg){
+    thread_shared_data *sh_data = (thread_shared_data*) arg;
+    FssCompressor compressor;
+    bool usable = fss_compressor_init(&compressor) == 0; // Without it, frames go out raw
+    unsigned available = 0;
+
+    for (unsigned next = 0; ; next++) {
+        buffer_item *item = ring_slot_to_take(sh_data, &sh_data->filled, next, &available);
+        item->packed_len = usable ? fss_compress_frame(&compressor, sh_data->compression, item->data,
+                                                       item->bytes_read, (uint8_t*) item->packed) : 0;
+        if (sh_data->digest != NULL) {
+            item->crc = file_digest_add(sh_data->digest, item->data, item->bytes_read);
+            if (item->packed_len > 0) item->packed_crc = fss_crc32c(0, item->packed, item->packed_len);
+        }
+
+        bool done = item->is_last_chunk;
+        ring_advance(&sh_data->packed, next + 1);
+        if (done) break;
+    }
+
+    if (usable) fss_compressor_end(&compressor);
+    return NULL;
+}
+
+static int send_end_frame(int client_sock, const FileDigest* digest);
+
+void* SendOverANetwork(void *arg){
     thread_shared_data *sh_data = (thread_shared_data*) arg;
+    RingCursor *upstream = sh_data->compression != FSS_COMPRESS_NONE ? &sh_data->packed : &sh_data->filled;
+    unsigned available = 0;
+
+    for (unsigned next = 0; ; next++) {
+        // Send straight from the slot; the producer does not reuse it before it is consumed
+        buffer_item *item = ring_slot_to_take(sh_data, upstream, next, &available);
+
+        // After a send error keep draining so the producer can reach EOF and exit. The read
+        // at EOF leaves an empty slot; the end frame goes out after the loop.
+        uint32_t flags = item->packed_len > 0 ? FSS_FRAME_COMPRESSED : 0;
+        const char *payload = flags ? item->packed : item->data;
+        uint32_t len = flags ? item->packed_len : item->bytes_read;
+        if (!sh_data->send_failed && item->bytes_read > 0) {
+            int rc;
+            if (sh_data->digest != NULL) {
+                // The compressor already fed compressed frames into the digest
+                if (sh_data->compression == FSS_COMPRESS_NONE) {
+                    item->crc = file_digest_add(sh_data->digest, item->data, item->bytes_read);
+                }
+                rc = fss_send_frame_crc(sh_data->client_sock, payload, len, flags, flags ? item->packed_crc : item->crc);
+            } else {
+                rc = fss_send_frame_flagged(sh_data->client_sock, payload, len, flags);
+            }
+            if (rc < 0) {
+                perror("SendOverANetwork: send frame failed");
+                sh_data->send_failed = true;
+            }
+        }
+
+        bool done = item->is_last_chunk;
+        ring_advance(&sh_data->consumed, next + 1);
+        if (done) break;
+    }
+
+    // A download the producer could not finish gets no end frame, so the client cannot take it for complete
+    if (!sh_data->send_failed && !sh_data->read_failed && send_end_frame(sh_data->client_sock, sh_data->digest) < 0) {
+        perror("SendOverANetwork: send end signal failed");
+        sh_data->send_failed = true;
+    }
+    return NULL;
+};
+
+// Sends the whole buffer, retrying on short writes. Returns 0 on success, -1 on error.
+int send_all(int socket, const void* buf, size_t len, int flags) {
+    const char *p = (const char*) buf;
+    while (len > 0) {
+        ssize_t sent = send(socket, p, len, flags);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+// Sends the FssResponse for a request on a persistent connection; does nothing on other
+// connections. A failed send leaves the connection unusable for further requests.
+// Returns 0 on success, -1 on error.
+static int send_response(ClientTaskArgs* task_args, uint32_t status, int flags) {
+    if (!task_args->persistent) return 0;
+
+    FssResponse response;
+    response.status = htonl(status);
+    response.request_id = htonl(task_args->request_id);
+    if (send_all(task_args->client_socket, &response, sizeof(response), flags) < 0) {
+        perror("send response status failed");
+        task_args->keep_alive = false;
+        return -1;
+    }
+    if (task_args->first_byte_pending) {
+        metrics_record_latency(METRIC_LAT_FIRST_BYTE, monotonic_ns() - task_args->dispatched_ns);
+        task_args->first_byte_pending = false;
+    }
+    return 0;
+}
+
+// Sends one raw frame of a download. With digest set (a checksummed transfer) the frame
+// carries its CRC32C, which also goes into the file's digest. Returns 0 on success, -1 on error.
+static int send_file_frame(int client_sock, const void* data, uint32_t len, FileDigest* digest) {
+    if (digest == NULL) return fss_send_frame(client_sock, data, len);
+    return fss_send_frame_crc(client_sock, data, len, 0, file_digest_add(digest, data, len));
+}
+
+// Sends the end frame of a download; a checksummed one carries the file's digest, the
+// stored one if there is one. Returns 0 on success, -1 on error.
+static int send_end_frame(int client_sock, const FileDigest* digest) {
+    if (digest == NULL) return fss_send_frame(client_sock, NULL, 0);
+    return fss_send_frame_crc(client_sock, NULL, 0, 0, digest->has_stored ? digest->stored : digest->computed);
+}
+
+// Streams a file with sendfile(): data goes from the page cache to the socket without
+// passing through userspace. The framing is unchanged (4-byte length, then payload,
+// zero length at the end), with the header corked onto the payload via MSG_MORE.
+// Falls back to pread()+send() if the file system does not support sendfile.
+// A checksummed download (digest set) needs the stored block CRCs of the file
+// (digest->has_blocks, offset a block multiple): frames then cover whole blocks and their
+// trailers are combined from the stored CRCs, so the data still never reaches userspace.
+// Sends length bytes starting at offset. Returns 0 on success, -1 on error.
+int SendFileZeroCopy(int client_sock, int file_fd, off_t offset, off_t length, uint32_t frame_size,
+                     FileDigest* digest) {
+    off_t remaining = length;
+    bool use_sendfile = true;
+    char fallback_buff[64 * 1024];
+    if (digest != NULL) frame_size = file_blocks_frame_size(frame_size);
+
+    while (remaining > 0) {
+        int frame_len = remaining < frame_size ? (int)remaining : (int)frame_size;
+        uint32_t frame_crc = 0;
+        if (digest != NULL) {
+            frame_crc = file_blocks_crc(digest->blocks, digest->size, offset, frame_len);
+            digest->computed = fss_crc32c_combine(digest->computed, frame_crc, frame_len);
+        }
+        int frame_len_n = htonl(frame_len);
+        if (send_all(client_sock, &frame_len_n, sizeof(int), MSG_MORE) < 0) {
+            perror("SendFileZeroCopy: send chunk size failed");
+            return -1;
+        }
+
+        int frame_sent = 0;
+        while (frame_sent < frame_len) {
+            ssize_t n;
+            if (use_sendfile) {
+                n = sendfile(client_sock, file_fd, &offset, frame_len - frame_sent);
+                if (n < 0 && (errno == EINVAL || errno == ENOSYS) && frame_sent == 0) {
+                    use_sendfile = false; // Not supported for this file, copy through userspace instead
+                    continue;
+                }
+            } else {
+                size_t want = frame_len - frame_sent;
+                if (want > sizeof(fallback_buff)) want = sizeof(fallback_buff);
+                n = pread(file_fd, fallback_buff, want, offset);
+                if (n > 0 && send_all(client_sock, fallback_buff, n, 0) < 0) n = -1;
+                if (n > 0) offset += n;
+            }
+
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("SendFileZeroCopy: sending file data failed");
+                return -1;
+            }
+            if (n == 0) {
+                // File shrank under us; the announced frame can no longer be completed
+                fprintf(stderr, "SendFileZeroCopy: file truncated during transfer\n");
+                return -1;
+            }
+            frame_sent += n;
+        }
+        remaining -= frame_len;
+        uint32_t frame_crc_n = htonl(frame_crc);
+        if (digest != NULL && send_all(client_sock, &frame_crc_n, sizeof(frame_crc_n), MSG_MORE) < 0) {
+            perror("SendFileZeroCopy: send frame CRC failed");
+            return -1;
+        }
+    }
+
+    if (digest != NULL) {
+        if (send_end_frame(client_sock, digest) < 0) {
+            perror("SendFileZeroCopy: send end signal failed");
+            return -1;
+        }
+        return 0;
+    }
+    int end_n = htonl(0); // End-of-download signal
+    if (send_all(client_sock, &end_n, sizeof(int), 0) < 0) {
+        perror("SendFileZeroCopy: send end signal failed");
+        return -1;
+    }
+    return 0;
+}
+
+// Streams a file through the thread_shared_data ring: a producer thread reads the file
+// while the calling thread sends. Used when sendfile is disabled, and for compressed
+// downloads, where a third thread compresses each frame between the two. With digest set
+// the frames carry CRC32Cs, computed by the compressor if there is one, by the sender otherwise.
+// Sends length bytes starting at offset.
+// Returns 0 on success, -1 if the pipeline could not be started, the file could not be read
+// to the end or the send failed.
+int SendFileThroughPipeline(int client_sock, int file_fd, off_t offset, off_t length, uint32_t frame_size,
+                            uint32_t compression, FileDigest* digest) {
+    pthread_t producer_thread;
+    pthread_t compressor_thread;
+    thread_shared_data shared;
+    memset(&shared, 0, sizeof(shared));
+
+    shared.frame_size = frame_size;
+    shared.compression = compression;
+    shared.digest = digest;
+    shared.slab = ring_alloc_slots(&shared, frame_size, false);
+    if (compression != FSS_COMPRESS_NONE) shared.packed_slab = ring_alloc_slots(&shared, frame_size, true);
+    if (shared.slab == NULL || (compression != FSS_COMPRESS_NONE && shared.packed_slab == NULL)) {
+        perror("Failed to allocate download buffer");
+        free(shared.slab);
+        free(shared.packed_slab);
+        return -1;
+    }
+
+    shared.file = file_fd; // Use the opened file descriptor
+    shared.offset = offset;
+    shared.remaining = length;
+    shared.client_sock = client_sock; // Use the client socket from args
+
+    // --- Start Producer (and compressor); this thread is the consumer ---
+    int rc = -1;
+    if (compression != FSS_COMPRESS_NONE &&
+        pthread_create(&compressor_thread, NULL, CompressFrames, &shared) != 0) {
+        perror("pthread_create compressor failed");
+    } else if (pthread_create(&producer_thread, NULL, ReadFromFile, &shared) != 0) {
+        perror("pthread_create producer failed");
+        if (compression != FSS_COMPRESS_NONE) {
+            // Let the compressor see an empty, finished stream
+            shared.buffer[0].bytes_read = 0;
+            shared.buffer[0].is_last_chunk = 1;
+            ring_advance(&shared.filled, 1);
+            pthread_join(compressor_thread, NULL);
+        }
+    } else {
+        SendOverANetwork(&shared);
+        pthread_join(producer_thread, NULL);
+        if (compression != FSS_COMPRESS_NONE) pthread_join(compressor_thread, NULL);
+        rc = shared.send_failed || shared.read_failed ? -1 : 0;
+    }
+
+    free(shared.slab);
+    free(shared.packed_slab);
+    return rc;
+}
+
+// Streams a file by mapping it and sending frames straight from the mapping: one copy
+// (page cache to socket) and no read() calls. The file is mapped a window at a time so
+// huge files do not need huge mappings, and the kernel is told the whole transfer is
+// sequential, with an explicit WILLNEED prefetch running MMAP_READAHEAD ahead of the socket.
+//
+// A file truncated while mapped (by another process; the server itself never truncates
+// a file that is being downloaded) turns the missing pages into faults: writev() reports
+// them as EFAULT. Only a checksummed download (digest set) reads the mapping itself, to
+// compute the frames' CRC32Cs; a fault there raises SIGBUS, which the guard below turns
+// into an error return instead of a crash. The guard is armed for those transfers only.
+// Sends length bytes starting at offset. Returns 0 on success, -1 on error.
+
+#define MMAP_WINDOW (64 * 1024 * 1024)      // Bytes mapped at a time (multiple of the page size)
+#define MMAP_READAHEAD (8 * 1024 * 1024)    // How far ahead of the socket to prefetch
+
+static __thread sigjmp_buf t_sigbus_jmp;
+static __thread volatile sig_atomic_t t_sigbus_armed;
+static __thread const char *t_sigbus_lo, *t_sigbus_hi;
+
+// SIGBUS is delivered to the faulting thread, so the thread-local guard is the right one.
+static void mapped_sigbus_handler(int sig, siginfo_t* info, void* ucontext) {
+    (void) ucontext;
+    const char *addr = (const char*) info->si_addr;
+    if (t_sigbus_armed && addr >= t_sigbus_lo && addr < t_sigbus_hi) {
+        t_sigbus_armed = 0;
+        siglongjmp(t_sigbus_jmp, 1);
+    }
+    // Not a fault on a guarded mapping: crash as usual
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+int install_sigbus_guard(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = mapped_sigbus_handler;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    return sigaction(SIGBUS, &sa, NULL);
+}
+
+int SendFileMapped(int client_sock, int file_fd, off_t offset, off_t length, uint32_t frame_size,
+                   FileDigest* digest) {
+    posix_fadvise(file_fd, offset, length, POSIX_FADV_SEQUENTIAL);
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    off_t end = offset + length;
+
+    // volatile: read after a siglongjmp back into this frame
+    char * volatile map = NULL;
+    volatile size_t map_len = 0;
+    volatile off_t position = offset;
+    volatile int rc = 0;
+
+    bool guarded = digest != NULL; // Plain frames never touch the mapping from userspace
+    if (guarded) {
+        if (sigsetjmp(t_sigbus_jmp, 1) != 0) {
+            fprintf(stderr, "SendFileMapped: file truncated while mapped\n");
+            if (map != NULL) munmap(map, map_len);
+            return -1;
+        }
+    }
+
+    while (position < end) {
+        off_t window_off = position & ~(off_t)(page_size - 1); // mmap() offsets must be page-aligned
+        map_len = end - window_off < MMAP_WINDOW ? (size_t)(end - window_off) : MMAP_WINDOW;
+        map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, file_fd, window_off);
+        if (map == MAP_FAILED) {
+            perror("SendFileMapped: mmap failed");
+            map = NULL;
+            return -1;
+        }
+        madvise(map, map_len, MADV_SEQUENTIAL);
+
+        t_sigbus_lo = map;
+        t_sigbus_hi = map + map_len;
+        t_sigbus_armed = guarded;
+
+        size_t pos = position - window_off;
+        size_t prefetched = 0;
+        while (pos < map_len) {
+            if (pos >= prefetched) {
+                size_t start = pos & ~(page_size - 1); // madvise() wants a page-aligned address
+                size_t ahead = map_len - start < MMAP_READAHEAD ? map_len - start : MMAP_READAHEAD;
+                madvise(map + start, ahead, MADV_WILLNEED);
+                prefetched = start + ahead;
+            }
+            uint32_t frame_len = map_len - pos < frame_size ? (uint32_t)(map_len - pos) : frame_size;
+            if (send_file_frame(client_sock, map + pos, frame_len, digest) < 0) {
+                if (errno == EFAULT) {
+                    fprintf(stderr, "SendFileMapped: file truncated while mapped\n");
+                } else {
+                    perror("SendFileMapped: send frame failed");
+                }
+                rc = -1;
+                break;
+            }
+            pos += frame_len;
+        }
+
+        t_sigbus_armed = 0;
+        munmap(map, map_len);
+        map = NULL;
+        if (rc != 0) return rc;
+        position = window_off + map_len;
+    }
+
+    if (send_end_frame(client_sock, digest) < 0) { // End-of-download signal
+        perror("SendFileMapped: send end signal failed");
+        return -1;
+    }
+    return 0;
+}
+
+// --- io_uring Engine ---
+//
+// Optional transfer engine (-i uring). Workers do the request setup (file control, locks,
+// open) and then hand the byte shuffling to an engine thread that drives many transfers
+// at once through a single io_uring: file reads/writes and socket sends/receives are
+// queued as SQEs, batched into one io_uring_enter() per loop iteration, and each transfer
+// advances when its CQE arrives. Data moves through a pool of registered buffers, so the
+// worker thread is free again as soon as the transfer has been handed over.
+//
+// Uses the raw syscalls from <linux/io_uring.h>; if the kernel refuses io_uring_setup
+// (old kernel, seccomp) the server logs it and keeps the thread-based paths.
+//
+// io_uring ignores the sockets' -T timeouts, so a timer wakes the engine once a second and
+// it shuts down the socket of any transfer whose send or receive has waited that long; the
+// pending op then fails and the transfer ends like any broken one.
+
+#define URING_ENTRIES 256
+#define URING_SLOTS 128                     // Registered buffers; a transfer holding one has one op in flight,
+                                            // so these plus the wake read and the timer stay below URING_ENTRIES
+#define URING_SLOT_PAYLOAD (256 * 1024)
+#define URING_SLOT_SIZE (URING_SLOT_PAYLOAD + 2 * sizeof(uint32_t)) // Room for the frame header in front
+                                                                 // and a CRC trailer behind
+#define URING_WAKE_TAG 1ULL                 // user_data of the eventfd read; transfers use their address
+#define URING_TICK_TAG 2ULL                 // user_data of the stall check timer
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned to_submit;                     // SQEs queued since the last io_uring_enter()
+
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+} UringQueue;
+
+typedef enum {
+    URING_DL_READ,          // Reading the next chunk of the file into the slot
+    URING_DL_SEND,          // Sending header + chunk from the slot
+    URING_DL_SEND_END,      // Sending the zero-length end frame
+    URING_UL_RECV_HEADER,   // Receiving a 4-byte frame length
+    URING_UL_RECV_PAYLOAD,  // Receiving (part of) a frame payload into the slot
+    URING_UL_WRITE,         // Writing the received bytes to the file
+} UringTransferState;
+
+typedef struct UringTransfer {
+    bool is_upload;
+    int client_sock;
+    int file_fd;
+    uint32_t frame_size;
+    UringTransferState state;
+
+    int slot;                   // Registered buffer index, -1 while waiting for one
+    char *buf;                  // Start of the slot
+
+    off_t file_offset;          // Next file offset to read (download) or write (upload)
+    time_t op_since;            // When the pending op was queued (stall check)
+    uint64_t remaining;         // Download: file bytes not yet read
+    size_t chunk_len;           // Bytes in the current chunk
+    size_t done;                // Progress within the current operation (short reads/writes)
+
+    uint32_t *crc_blocks;       // Checksummed download: stored block CRCs of the file (owned), else NULL
+    uint64_t crc_size;          // Size of the file they describe
+    uint32_t file_crc;          // Stored digest of the file, for the end frame
+    size_t trailer_len;         // Bytes of CRC trailer behind each frame, 0 or 4
+
+    uint32_t header_n;          // Upload: frame header being received
+    uint64_t payload_remaining; // Upload: bytes of the current frame not yet received
+
+    void (*on_done)(struct UringTransfer*, int status); // status 0 = success, -1 = failure
+    void *owner;                // Handler state (ClientTaskArgs etc.)
+    void *owner_ctx;
+    int status;                 // Kept by on_done for handlers that finish on another thread
+
+    struct UringTransfer *next;
+} UringTransfer;
+
+typedef struct {
+    UringQueue ring;
+    pthread_t thread;
+    bool fixed_buffers;         // Buffers registered with the kernel
+
+    int wake_fd;                // eventfd kicked by uring_submit_transfer()
+    uint64_t wake_value;
+    bool wake_armed;            // A read of wake_fd is queued or in flight
+    struct __kernel_timespec tick;
+    bool tick_armed;            // The stall check timer is queued or running
+    pthread_mutex_t mutex;
+    UringTransfer *incoming;    // Handed over by workers, protected by mutex
+
+    char *buffers;
+    int free_slots[URING_SLOTS];
+    int free_count;
+    UringTransfer *slot_owners[URING_SLOTS]; // Transfer holding each slot, NULL if free
+    UringTransfer *slot_waiters_head, *slot_waiters_tail; // FIFO of transfers waiting for a slot
+} UringEngine;
+
+UringEngine *g_uring_engine = NULL; // NULL when io_uring is disabled or unavailable
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int uring_queue_init(UringQueue* q, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(q, 0, sizeof(*q));
+
+    q->fd = sys_io_uring_setup(entries, &p);
+    if (q->fd < 0) return -1;
+
+    q->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    q->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (q->cq_ring_size > q->sq_ring_size) q->sq_ring_size = q->cq_ring_size;
+        q->cq_ring_size = q->sq_ring_size;
+    }
+
+    q->sq_ring = mmap(NULL, q->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQ_RING);
+    if (q->sq_ring == MAP_FAILED) goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        q->cq_ring = q->sq_ring;
+    } else {
+        q->cq_ring = mmap(NULL, q->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_CQ_RING);
+        if (q->cq_ring == MAP_FAILED) goto fail;
+    }
+    q->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    q->sqes = mmap(NULL, q->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQES);
+    if (q->sqes == MAP_FAILED) goto fail;
+
+    q->sq_head = (unsigned*)((char*)q->sq_ring + p.sq_off.head);
+    q->sq_tail = (unsigned*)((char*)q->sq_ring + p.sq_off.tail);
+    q->sq_mask = (unsigned*)((char*)q->sq_ring + p.sq_off.ring_mask);
+    q->sq_array = (unsigned*)((char*)q->sq_ring + p.sq_off.array);
+    q->cq_head = (unsigned*)((char*)q->cq_ring + p.cq_off.head);
+    q->cq_tail = (unsigned*)((char*)q->cq_ring + p.cq_off.tail);
+    q->cq_mask = (unsigned*)((char*)q->cq_ring + p.cq_off.ring_mask);
+    q->cqes = (struct io_uring_cqe*)((char*)q->cq_ring + p.cq_off.cqes);
+    q->sq_entries = p.sq_entries;
+    return 0;
+
+fail:
+    close(q->fd);
+    q->fd = -1;
+    return -1;
+}
+
+// Returns a zeroed SQE, flushing queued ones to the kernel first if the ring is full.
+static struct io_uring_sqe* uring_get_sqe(UringQueue* q) {
+    unsigned head = __atomic_load_n(q->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *q->sq_tail;
+
+    if (tail - head >= q->sq_entries) {
+        int ret = sys_io_uring_enter(q->fd, q->to_submit, 0, 0);
+        if (ret > 0) q->to_submit -= ret;
+        head = __atomic_load_n(q->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= q->sq_entries) return NULL;
+    }
+
+    unsigned index = tail & *q->sq_mask;
+    struct io_uring_sqe *sqe = &q->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    q->sq_array[index] = index;
+    __atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    q->to_submit++;
+    return sqe;
+}
+
+static void uring_prep_rw(UringEngine* engine, struct io_uring_sqe* sqe, int op, int fd,
+                          void* addr, unsigned len, uint64_t offset, int slot, uint64_t user_data) {
+    if (engine->fixed_buffers && slot >= 0) {
+        op = (op == IORING_OP_READ) ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+        sqe->buf_index = slot;
+    }
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t) addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+}
+
+// Queues the next operation for a transfer based on its state. Returns -1 if no SQE was available.
+static int uring_queue_transfer_op(UringEngine* engine, UringTransfer* t) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&engine->ring);
+    if (sqe == NULL) return -1;
+    uint64_t tag = (uint64_t)(uintptr_t) t;
+    char *payload = t->buf + sizeof(uint32_t);
+    t->op_since = time(NULL);
+
+    switch (t->state) {
+    case URING_DL_READ:
+        uring_prep_rw(engine, sqe, IORING_OP_READ, t->file_fd, payload + t->done,
+                      t->chunk_len - t->done, t->file_offset + t->done, t->slot, tag);
+        break;
+    case URING_DL_SEND:
+    case URING_DL_SEND_END:
+        // Sockets are streams: offset -1 means "current position", i.e. ignored
+        uring_prep_rw(engine, sqe, IORING_OP_WRITE, t->client_sock, t->buf + t->done,
+                      t->chunk_len + sizeof(uint32_t) + t->trailer_len - t->done, (uint64_t)-1, t->slot, tag);
+        break;
+    case URING_UL_RECV_HEADER:
+        uring_prep_rw(engine, sqe, IORING_OP_READ, t->client_sock, (char*)&t->header_n + t->done,
+                      sizeof(uint32_t) - t->done, (uint64_t)-1, -1, tag);
+        break;
+    case URING_UL_RECV_PAYLOAD:
+        uring_prep_rw(engine, sqe, IORING_OP_READ, t->client_sock, payload + t->done,
+                      t->chunk_len - t->done, (uint64_t)-1, t->slot, tag);
+        break;
+    case URING_UL_WRITE:
+        uring_prep_rw(engine, sqe, IORING_OP_WRITE, t->file_fd, payload + t->done,
+                      t->chunk_len - t->done, t->file_offset + t->done, t->slot, tag);
+        break;
+    }
+    return 0;
+}
+
+// Sets up the next download chunk, or the end frame once the file has been read.
+static void uring_download_next(UringTransfer* t) {
+    uint32_t max_chunk = t->frame_size < URING_SLOT_PAYLOAD ? t->frame_size : URING_SLOT_PAYLOAD;
+    if (t->trailer_len > 0) max_chunk = file_blocks_frame_size(max_chunk);
+    t->done = 0;
+    if (t->remaining == 0) {
+        uint32_t end_n = htonl(0);
+        uint32_t crc_n = htonl(t->file_crc);
+        memcpy(t->buf, &end_n, sizeof(end_n));
+        memcpy(t->buf + sizeof(end_n), &crc_n, sizeof(crc_n)); // Sent only with a trailer
+        t->chunk_len = 0;
+        t->state = URING_DL_SEND_END;
+    } else {
+        t->chunk_len = t->remaining < max_chunk ? t->remaining : max_chunk;
+        t->state = URING_DL_READ;
+    }
+}
+
+// Sets up receipt of the next piece of the current upload frame, or of the next header.
+static void uring_upload_next(UringTransfer* t) {
+    t->done = 0;
+    if (t->payload_remaining == 0) {
+        t->state = URING_UL_RECV_HEADER;
+    } else {
+        t->chunk_len = t->payload_remaining < URING_SLOT_PAYLOAD ? t->payload_remaining : URING_SLOT_PAYLOAD;
+        t->state = URING_UL_RECV_PAYLOAD;
+    }
+}
+
+static void uring_release_slot(UringEngine* engine, UringTransfer* t);
+
+static void uring_finish_transfer(UringEngine* engine, UringTransfer* t, int status) {
+    uring_release_slot(engine, t);
+    t->on_done(t, status);
+}
+
+// Applies a completion to its transfer. Returns 1 if the transfer needs another op queued,
+// 0 if it finished (and was handed to on_done).
+static int uring_advance(UringEngine* engine, UringTransfer* t, int res) {
+    if (res < 0) {
+        fprintf(stderr, "io_uring transfer failed: %s\n", strerror(-res));
+        uring_finish_transfer(engine, t, -1);
+        return 0;
+    }
+
+    switch (t->state) {
+    case URING_DL_READ:
+        if (res == 0) {
+            fprintf(stderr, "io_uring download: file truncated during transfer\n");
+            uring_finish_transfer(engine, t, -1);
+            return 0;
+        }
+        t->done += res;
+        if (t->done < t->chunk_len) return 1; // Short read, fetch the rest
+        uint32_t len_n = htonl((uint32_t) t->chunk_len);
+        memcpy(t->buf, &len_n, sizeof(len_n));
+        if (t->trailer_len > 0) {
+            uint32_t crc_n = htonl(file_blocks_crc(t->crc_blocks, t->crc_size, t->file_offset, t->chunk_len));
+            memcpy(t->buf + sizeof(len_n) + t->chunk_len, &crc_n, sizeof(crc_n));
+        }
+        t->done = 0;
+        t->state = URING_DL_SEND;
+        return 1;
+
+    case URING_DL_SEND:
+    case URING_DL_SEND_END:
+        t->done += res;
+        if (t->done < t->chunk_len + sizeof(uint32_t) + t->trailer_len) return 1; // Short send, push the rest
+        if (t->state == URING_DL_SEND_END) {
+            uring_finish_transfer(engine, t, 0);
+            return 0;
+        }
+        t->file_offset += t->chunk_len;
+        t->remaining -= t->chunk_len;
+        uring_download_next(t);
+        return 1;
+
+    case URING_UL_RECV_HEADER:
+        if (res == 0) { // Client disconnected
+            uring_finish_transfer(engine, t, -1);
+            return 0;
+        }
+        t->done += res;
+        if (t->done < sizeof(uint32_t)) return 1;
+        uint32_t frame_len = ntohl(t->header_n);
+        if (frame_len == 0) { // End-of-upload signal
+            uring_finish_transfer(engine, t, 0);
+            return 0;
+        }
+        if (frame_len > t->frame_size) {
+            fprintf(stderr, "io_uring upload: Invalid chunk size received: %u\n", frame_len);
+            uring_finish_transfer(engine, t, -1);
+            return 0;
+        }
+        t->payload_remaining = frame_len;
+        uring_upload_next(t);
+        return 1;
+
+    case URING_UL_RECV_PAYLOAD:
+        if (res == 0) {
+            uring_finish_transfer(engine, t, -1);
+            return 0;
+        }
+        t->done += res;
+        if (t->done < t->chunk_len) return 1;
+        t->done = 0;
+        t->state = URING_UL_WRITE;
+        return 1;
+
+    case URING_UL_WRITE:
+        t->done += res;
+        if (t->done < t->chunk_len) return 1;
+        t->file_offset += t->chunk_len;
+        t->payload_remaining -= t->chunk_len;
+        uring_upload_next(t);
+        return 1;
+    }
+    return 0;
+}
+
+// Gives a transfer a buffer slot and queues its first operation.
+static void uring_start_transfer(UringEngine* engine, UringTransfer* t, int slot) {
+    t->slot = slot;
+    t->buf = engine->buffers + (size_t)slot * URING_SLOT_SIZE;
+    engine->slot_owners[slot] = t;
+    if (t->is_upload) {
+        t->payload_remaining = 0;
+        uring_upload_next(t);
+    } else {
+        uring_download_next(t);
+    }
+    if (uring_queue_transfer_op(engine, t) < 0) {
+        uring_finish_transfer(engine, t, -1);
+    }
+}
+
+static void uring_release_slot(UringEngine* engine, UringTransfer* t) {
+    if (t->slot < 0) return;
+    int slot = t->slot;
+    t->slot = -1;
+    engine->slot_owners[slot] = NULL;
+
+    UringTransfer *waiter = engine->slot_waiters_head;
+    if (waiter != NULL) {
+        engine->slot_waiters_head = waiter->next;
+        if (engine->slot_waiters_head == NULL) engine->slot_waiters_tail = NULL;
+        uring_start_transfer(engine, waiter, slot);
+    } else {
+        engine->free_slots[engine->free_count++] = slot;
+    }
+}
+
+static void uring_accept_transfer(UringEngine* engine, UringTransfer* t) {
+    t->slot = -1;
+    t->next = NULL;
+    if (engine->free_count > 0) {
+        uring_start_transfer(engine, t, engine->free_slots[--engine->free_count]);
+    } else if (engine->slot_waiters_tail != NULL) {
+        engine->slot_waiters_tail->next = t;
+        engine->slot_waiters_tail = t;
+    } else {
+        engine->slot_waiters_head = engine->slot_waiters_tail = t;
+    }
+}
+
+// Queues the read that tells the engine about new transfers. Only a completed read re-arms
+// it, so if no SQE is free now the engine loop tries again before it next waits.
+static void uring_arm_wake(UringEngine* engine) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&engine->ring);
+    if (sqe == NULL) return;
+    uring_prep_rw(engine, sqe, IORING_OP_READ, engine->wake_fd, &engine->wake_value,
+                  sizeof(engine->wake_value), (uint64_t)-1, -1, URING_WAKE_TAG);
+    engine->wake_armed = true;
+}
+
+// Queues the timer that wakes the engine once a second to look for stalled transfers.
+static void uring_arm_tick(UringEngine* engine) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&engine->ring);
+    if (sqe == NULL) return;
+    engine->tick.tv_sec = 1;
+    engine->tick.tv_nsec = 0;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t) &engine->tick;
+    sqe->len = 1;
+    sqe->user_data = URING_TICK_TAG;
+    engine->tick_armed = true;
+}
+
+// Shuts down the sockets of transfers whose send or receive has waited -T seconds. File
+// reads and writes are left alone: they wait for the disk, not for the client.
+static void uring_drop_stalled(UringEngine* engine) {
+    time_t now = time(NULL);
+    for (int i = 0; i < URING_SLOTS; i++) {
+        UringTransfer *t = engine->slot_owners[i];
+        if (t == NULL || t->state == URING_DL_READ || t->state == URING_UL_WRITE ||
+            now - t->op_since < g_config.transfer_timeout_sec) {
+            continue;
+        }
+        log_warn("io_uring %s made no progress for %d s, dropping the connection (socket: %d)",
+                 t->is_upload ? "upload" : "download", g_config.transfer_timeout_sec, t->client_sock);
+        shutdown(t->client_sock, SHUT_RDWR);
+        t->op_since = now; // The pending op now fails; do not shut it down again meanwhile
+    }
+}
+
+void* UringEngineThread(void* arg) {
+    UringEngine *engine = (UringEngine*) arg;
+    UringQueue *q = &engine->ring;
+
+    while (1) {
+        if (!engine->wake_armed) uring_arm_wake(engine);
+        if (!engine->tick_armed && g_config.transfer_timeout_sec > 0) uring_arm_tick(engine);
+        // Submit everything queued during the last pass and wait for at least one completion
+        int ret = sys_io_uring_enter(q->fd, q->to_submit, 1, IORING_ENTER_GETEVENTS);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            perror("io_uring_enter failed");
+            break;
+        }
+        q->to_submit -= ret;
+
+        unsigned head = *q->cq_head;
+        unsigned tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &q->cqes[head & *q->cq_mask];
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            head++;
+            __atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+
+            if (user_data == URING_WAKE_TAG) {
+                engine->wake_armed = false;
+                pthread_mutex_lock(&engine->mutex);
+                UringTransfer *list = engine->incoming;
+                engine->incoming = NULL;
+                pthread_mutex_unlock(&engine->mutex);
+                while (list != NULL) {
+                    UringTransfer *t = list;
+                    list = list->next;
+                    uring_accept_transfer(engine, t);
+                }
+                uring_arm_wake(engine);
+                continue;
+            }
+            if (user_data == URING_TICK_TAG) {
+                engine->tick_armed = false; // Re-armed at the top of the loop
+                uring_drop_stalled(engine);
+                continue;
+            }
+
+            UringTransfer *t = (UringTransfer*)(uintptr_t) user_data;
+            if (uring_advance(engine, t, res) && uring_queue_transfer_op(engine, t) < 0) {
+                uring_finish_transfer(engine, t, -1);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Starts the io_uring engine. Returns -1 (and leaves g_uring_engine NULL) if io_uring
+// cannot be used, in which case transfers stay on the thread-based paths.
+int uring_engine_start(void) {
+    UringEngine *engine = calloc(1, sizeof(UringEngine));
+    if (engine == NULL) return -1;
+
+    if (uring_queue_init(&engine->ring, URING_ENTRIES) != 0) {
+        perror("io_uring_setup failed, using thread-based transfers");
+        free(engine);
+        return -1;
+    }
+
+    engine->buffers = mmap(NULL, (size_t)URING_SLOTS * URING_SLOT_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    engine->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (engine->buffers == MAP_FAILED || engine->wake_fd < 0) {
+        perror("io_uring engine setup failed, using thread-based transfers");
+        close(engine->ring.fd);
+        free(engine);
+        return -1;
+    }
+
+    struct iovec iovs[URING_SLOTS];
+    for (int i = 0; i < URING_SLOTS; i++) {
+        iovs[i].iov_base = engine->buffers + (size_t)i * URING_SLOT_SIZE;
+        iovs[i].iov_len = URING_SLOT_SIZE;
+        engine->free_slots[i] = URING_SLOTS - 1 - i;
+    }
+    engine->free_count = URING_SLOTS;
+    // Registration pins the pages; without enough RLIMIT_MEMLOCK plain READ/WRITE ops are used instead
+    engine->fixed_buffers = sys_io_uring_register(engine->ring.fd, IORING_REGISTER_BUFFERS, iovs, URING_SLOTS) == 0;
+    if (!engine->fixed_buffers) {
+        perror("io_uring buffer registration failed, using unregistered buffers");
+    }
+
+    pthread_mutex_init(&engine->mutex, NULL);
+    if (pthread_create(&engine->thread, NULL, UringEngineThread, engine) != 0) {
+        perror("pthread_create for io_uring engine failed");
+        close(engine->ring.fd);
+        free(engine);
+        return -1;
+    }
+    pthread_detach(engine->thread);
+
+    g_uring_engine = engine;
+    return 0;
+}
+
+// Hands a prepared transfer to the engine; on_done runs on the engine thread.
+void uring_submit_transfer(UringTransfer* t) {
+    UringEngine *engine = g_uring_engine;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&engine->mutex);
+    t->next = engine->incoming;
+    engine->incoming = t;
+    pthread_mutex_unlock(&engine->mutex);
+
+    if (write(engine->wake_fd, &one, sizeof(one)) < 0) {
+        perror("uring_submit_transfer: eventfd write failed");
+    }
+}
+
+// --- End io_uring Engine ---
+
+
+// --- Content Cache ---
+//
+// Whole-file copies of recently downloaded files, kept within a memory budget (-c).
+// Entries are immutable and reference counted: a download takes a reference and streams
+// straight from the shared buffer with writev(), so any number of concurrent downloads of
+// a hot file share one copy and never touch the disk. The index is split into shards,
+// each with its own mutex, LRU list and share of the budget.
+//
+// Uploads invalidate a file's entry when they commit. A download that read the old
+// version concurrently must not re-insert it afterwards, so each shard carries a
+// generation that invalidation bumps; a fill only enters the cache if the generation
+// seen before the file was opened is still current. Files changed behind the server's
+// back are not noticed until their entry is evicted.
+
+#define CONTENT_CACHE_SHARDS 16
+#define CONTENT_CACHE_BUCKETS 256           // Per shard (power of two)
+
+typedef struct CacheEntry {
+    char filename[256];
+    uint64_t hash;
+    char *data;
+    size_t size;
+    uint64_t version;                       // file_version() of the copy
+    atomic_int refs;                        // One held by the index, one per download streaming it
+    struct CacheEntry *lru_prev, *lru_next; // Shard LRU list, most recently used first
+    struct CacheEntry *hash_next;           // Bucket chain, reused as a free list after unlinking
+} CacheEntry;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    CacheEntry *buckets[CONTENT_CACHE_BUCKETS];
+    CacheEntry *lru_head, *lru_tail;
+    size_t bytes;
+    int entries;
+    uint64_t generation;                    // Bumped by every invalidation in this shard
+
+    // Counters, protected by mutex
+    unsigned long long hits, misses, inserts, evictions, invalidations;
+} CacheShard;
+
+typedef struct {
+    CacheShard shards[CONTENT_CACHE_SHARDS];
+    size_t shard_budget;
+    size_t max_entry_size;                  // Larger files bypass the cache
+} ContentCache;
+
+typedef struct {
+    size_t bytes;
+    size_t budget;
+    int entries;
+    unsigned long long hits, misses, inserts, evictions, invalidations;
+} ContentCacheStats;
+
+ContentCache *g_content_cache = NULL;       // NULL when the cache is disabled (-c 0)
+
+static inline CacheShard* content_cache_shard(uint64_t hash) {
+    return &g_content_cache->shards[(hash >> 32) % CONTENT_CACHE_SHARDS];
+}
+
+// Sets up g_content_cache with the given budget in bytes. Returns 0 on success.
+int content_cache_init(size_t budget) {
+    ContentCache *cache = calloc(1, sizeof(ContentCache));
+    if (cache == NULL) {
+        perror("Failed to allocate content cache");
+        return -1;
+    }
+    for (int i = 0; i < CONTENT_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&cache->shards[i].mutex, NULL);
+    }
+    cache->shard_budget = budget / CONTENT_CACHE_SHARDS;
+    cache->max_entry_size = cache->shard_budget / 4; // Keep room for several hot files per shard
+    g_content_cache = cache;
+    return 0;
+}
+
+// Drops a reference; the last one frees the buffer.
+void content_cache_release(CacheEntry* entry) {
+    if (atomic_fetch_sub(&entry->refs, 1) == 1) {
+        free(entry->data);
+        free(entry);
+    }
+}
+
+// Removes an entry from its shard's index and LRU list and chains it onto *unlinked so
+// the caller can drop the index's reference after unlocking. Shard mutex must be held.
+static void content_cache_unlink(CacheShard* shard, CacheEntry* entry, CacheEntry** unlinked) {
+    CacheEntry **link = &shard->buckets[entry->hash & (CONTENT_CACHE_BUCKETS - 1)];
+    while (*link != entry) link = &(*link)->hash_next;
+    *link = entry->hash_next;
+
+    if (entry->lru_prev != NULL) entry->lru_prev->lru_next = entry->lru_next;
+    else shard->lru_head = entry->lru_next;
+    if (entry->lru_next != NULL) entry->lru_next->lru_prev = entry->lru_prev;
+    else shard->lru_tail = entry->lru_prev;
+
+    shard->bytes -= entry->size;
+    shard->entries--;
+    entry->hash_next = *unlinked;
+    *unlinked = entry;
+}
+
+static void content_cache_release_list(CacheEntry* list) {
+    while (list != NULL) {
+        CacheEntry *next = list->hash_next;
+        content_cache_release(list);
+        list = next;
+    }
+}
+
+static CacheEntry* content_cache_find(CacheShard* shard, const char* filename, uint64_t hash) {
+    CacheEntry *entry = shard->buckets[hash & (CONTENT_CACHE_BUCKETS - 1)];
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->filename, filename) != 0)) {
+        entry = entry->hash_next;
+    }
+    return entry;
+}
+
+// Looks a file up. On a hit returns the entry with a reference the caller must release.
+// On a miss returns NULL and stores the shard generation to pass to content_cache_fill().
+CacheEntry* content_cache_acquire(const char* filename, uint64_t hash, uint64_t* generation) {
+    CacheShard *shard = content_cache_shard(hash);
+
+    pthread_mutex_lock(&shard->mutex);
+    CacheEntry *entry = content_cache_find(shard, filename, hash);
+    if (entry != NULL) {
+        // Move to the front of the LRU list
+        if (entry != shard->lru_head) {
+            entry->lru_prev->lru_next = entry->lru_next;
+            if (entry->lru_next != NULL) entry->lru_next->lru_prev = entry->lru_prev;
+            else shard->lru_tail = entry->lru_prev;
+            entry->lru_prev = NULL;
+            entry->lru_next = shard->lru_head;
+            shard->lru_head->lru_prev = entry;
+            shard->lru_head = entry;
+        }
+        atomic_fetch_add(&entry->refs, 1);
+        shard->hits++;
+    } else {
+        *generation = shard->generation;
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return entry;
+}
+
+// Reads an opened file of the given size into a new entry and, if nothing invalidated the
+// shard since the lookup, inserts it, evicting least recently used entries to stay within
+// budget. Returns the entry with a reference for the caller (also when it was not
+// inserted), or NULL if the file could not be read or is too large to cache.
+CacheEntry* content_cache_fill(const char* filename, uint64_t hash, uint64_t generation, int file_fd,
+                               size_t size, uint64_t version) {
+    if (size > g_content_cache->max_entry_size) return NULL;
+
+    CacheEntry *entry = calloc(1, sizeof(CacheEntry));
+    if (entry == NULL) return NULL;
+    entry->data = malloc(size > 0 ? size : 1);
+    if (entry->data == NULL) {
+        free(entry);
+        return NULL;
+    }
+
+    size_t filled = 0;
+    while (filled < size) {
+        ssize_t n = pread(file_fd, entry->data + filled, size - filled, filled);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { // Read error or the file shrank since fstat()
+            free(entry->data);
+            free(entry);
+            return NULL;
+        }
+        filled += n;
+    }
+
+    strncpy(entry->filename, filename, sizeof(entry->filename) - 1);
+    entry->hash = hash;
+    entry->size = size;
+    entry->version = version;
+    atomic_init(&entry->refs, 1);
+
+    CacheShard *shard = content_cache_shard(hash);
+    CacheEntry *evicted = NULL;
+
+    pthread_mutex_lock(&shard->mutex);
+    // A concurrent fill of the same file may have won; keep ours private in that case
+    if (shard->generation == generation && content_cache_find(shard, filename, hash) == NULL) {
+        while (shard->lru_tail != NULL && shard->bytes + size > g_content_cache->shard_budget) {
+            content_cache_unlink(shard, shard->lru_tail, &evicted);
+            shard->evictions++;
+        }
+        size_t b = hash & (CONTENT_CACHE_BUCKETS - 1);
+        entry->hash_next = shard->buckets[b];
+        shard->buckets[b] = entry;
+        entry->lru_next = shard->lru_head;
+        if (shard->lru_head != NULL) shard->lru_head->lru_prev = entry;
+        else shard->lru_tail = entry;
+        shard->lru_head = entry;
+        shard->bytes += size;
+        shard->entries++;
+        shard->inserts++;
+        atomic_fetch_add(&entry->refs, 1); // The index's reference
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    content_cache_release_list(evicted);
+    return entry;
+}
+
+// Drops the cached copy of a file after a new version was stored. Downloads streaming
+// the old copy keep their reference until they finish.
+void content_cache_invalidate(const char* filename, uint64_t hash) {
+    if (g_content_cache == NULL) return;
+    CacheShard *shard = content_cache_shard(hash);
+    CacheEntry *unlinked = NULL;
+
+    pthread_mutex_lock(&shard->mutex);
+    shard->generation++;
+    CacheEntry *entry = content_cache_find(shard, filename, hash);
+    if (entry != NULL) {
+        content_cache_unlink(shard, entry, &unlinked);
+        shard->invalidations++;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    content_cache_release_list(unlinked);
+}
+
+void content_cache_get_stats(ContentCacheStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->budget = g_content_cache->shard_budget * CONTENT_CACHE_SHARDS;
+    for (int i = 0; i < CONTENT_CACHE_SHARDS; i++) {
+        CacheShard *shard = &g_content_cache->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        stats->bytes += shard->bytes;
+        stats->entries += shard->entries;
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->inserts += shard->inserts;
+        stats->evictions += shard->evictions;
+        stats->invalidations += shard->invalidations;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+// Streams length bytes of a cached file, starting at offset, as frames straight from the
+// shared buffer. Returns 0 on success, -1 on error.
+int SendCachedFile(int client_sock, CacheEntry* entry, size_t offset, size_t length, uint32_t frame_size,
+                   FileDigest* digest) {
+    size_t end = offset + length;
+    while (offset < end) {
+        uint32_t frame_len = end - offset < frame_size ? (uint32_t)(end - offset) : frame_size;
+        if (send_file_frame(client_sock, entry->data + offset, frame_len, digest) < 0) {
+            perror("SendCachedFile: send frame failed");
+            return -1;
+        }
+        offset += frame_len;
+    }
+    if (send_end_frame(client_sock, digest) < 0) { // End-of-download signal
+        perror("SendCachedFile: send end signal failed");
+        return -1;
+    }
+    return 0;
+}
+
+// --- End Content Cache ---
+
+// Releases whatever DownLoadingFile acquired. control is NULL in snapshot mode,
+// where downloads never touch the file's lock.
+static void download_release(ClientTaskArgs* task_args, FileAccessControl* control, int file_fd) {
+    if (file_fd >= 0) close(file_fd); // Close the file descriptor
+    if (control != NULL) {
+        release_read_lock(control); // Release the file read lock
+        release_file_control(control); // Release the reference to the control struct
+    }
+    finish_client_task(task_args); // Hand the connection back to its event loop
+}
+
+// Completion for downloads run by the io_uring engine.
+static void UringDownloadDone(UringTransfer* t, int status) {
+    if (status != 0) {
+        ((ClientTaskArgs*) t->owner)->keep_alive = false; // Client holds a truncated stream
+    }
+    download_release((ClientTaskArgs*) t->owner, (FileAccessControl*) t->owner_ctx, t->file_fd);
+    free(t->crc_blocks);
+    free(t);
+}
+
+// Hands an opened download of length bytes at offset to the io_uring engine. A checksummed
+// one (digest set) needs the file's stored block CRCs; the engine takes them over.
+// Returns 0 if the engine took it, -1 if the caller should stream it itself.
+static int StartUringDownload(ClientTaskArgs* task_args, FileAccessControl* control, int file_fd,
+                              off_t offset, off_t length, FileDigest* digest) {
+    UringTransfer *t = calloc(1, sizeof(UringTransfer));
+    if (t == NULL) return -1;
+    if (digest != NULL) {
+        t->crc_blocks = digest->blocks;
+        t->crc_size = digest->size;
+        t->file_crc = digest->stored;
+        t->trailer_len = sizeof(uint32_t);
+        digest->blocks = NULL;
+    }
+    t->is_upload = false;
+    t->client_sock = task_args->client_socket;
+    t->file_fd = file_fd;
+    t->frame_size = task_args->frame_size;
+    t->file_offset = offset;
+    t->remaining = length;
+    t->on_done = UringDownloadDone;
+    t->owner = task_args;
+    t->owner_ctx = control;
+    uring_submit_transfer(t);
+    return 0;
+}
+
+// Identifies a stored version of a file: a snapshot commit brings a new inode and mtime,
+// an in-place rewrite a new mtime.
+static uint64_t file_version(const struct stat* st) {
+    return ((uint64_t) st->st_ino << 32) ^ ((uint64_t) st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec);
+}
+
+void meta_index_note_digest(const char* filename, uint64_t version, uint64_t size, uint32_t crc);
+
+// The server keeps its own files next to each published one, named "<dir>/.<name>"
+// followed by one of these markers: staging files of uploads, chunk manifests and file
+// digests. The server trusts what they say, so clients may neither upload nor fetch them.
+static const char* const sidecar_markers[] = { ".fss-tmp.", ".fss-manifest", ".fss-crc" };
+
+// Whether filename names one of the server's own files.
+static bool is_sidecar_name(const char* filename) {
+    const char *base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
+    if (base[0] != '.') return false;
+    for (size_t i = 0; i < sizeof(sidecar_markers) / sizeof(sidecar_markers[0]); i++) {
+        if (strstr(base, sidecar_markers[i]) != NULL) return true;
+    }
+    return false;
+}
+
+// --- File Digests ---
+// The CRC32C of a stored file is kept next to it in "<dir>/.<name>.fss-crc", together
+// with the version and size it describes. A checksummed upload writes it from the data the
+// client sent; a checksummed download of a file without one writes the digest it
+// assembled from the frames. Downloads hand out the stored digest, so a file that changed
+// on disk without a new upload fails the client's check. A record for another version is
+// ignored and eventually overwritten.
+//
+// The record is followed by the CRC32C of every FILE_DIGEST_BLOCK of the file, which lets
+// checksummed downloads go out with sendfile() or io_uring. Records without them (written
+// with block_size 0, or when collecting them ran out of memory) still provide the file's
+// digest, and get their blocks on the next checksummed download of the whole file.
+
+#define FILE_DIGEST_MAGIC "FSSCRC1"
+
+// On disk, 64-bit fields big-endian, 32-bit ones in network byte order.
+typedef struct {
+    char magic[8];
+    uint64_t version;
+    uint64_t size;
+    uint32_t crc;
+    uint32_t block_size;        // FILE_DIGEST_BLOCK if the block CRCs follow, 0 if not
+} FileDigestRecord;
+
+static uint64_t file_digest_block_count(uint64_t size) {
+    return (size + FILE_DIGEST_BLOCK - 1) / FILE_DIGEST_BLOCK;
+}
+
+// Builds "<dir>/.<name>.fss-crc" for filename.
+static void file_digest_path(const char* filename, char* out, size_t out_size) {
+    const char *slash = strrchr(filename, '/');
+    int dir_len = slash ? (int)(slash - filename + 1) : 0;
+    snprintf(out, out_size, "%.*s.%s.fss-crc", dir_len, filename, filename + dir_len);
+}
+
+// Reads the block CRCs following a record into digest. Returns true if they were all there.
+static bool file_digest_read_blocks(int fd, uint64_t size, FileDigest* digest) {
+    uint64_t count = file_digest_block_count(size);
+    uint32_t *blocks = count > 0 ? malloc(count * sizeof(uint32_t)) : NULL;
+    if (count > 0 && blocks == NULL) return false;
+    size_t want = count * sizeof(uint32_t);
+    for (size_t got = 0; got < want; ) {
+        ssize_t n = read(fd, (char*) blocks + got, want - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            free(blocks);
+            return false;
+        }
+        got += n;
+    }
+    for (uint64_t i = 0; i < count; i++) blocks[i] = ntohl(blocks[i]);
+    digest->blocks = blocks;
+    digest->block_count = count;
+    digest->has_blocks = true;
+    return true;
+}
+
+// Looks up the stored digest of the given version of filename. Returns true with *crc set
+// if there is one. With blocks set, the block CRCs are loaded into it too if the record
+// has them (blocks->has_blocks).
+static bool file_digest_load(const char* filename, uint64_t version, uint64_t size, uint32_t* crc,
+                             FileDigest* blocks) {
+    char path[320];
+    file_digest_path(filename, path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    FileDigestRecord record;
+    bool found = read(fd, &record, sizeof(record)) == sizeof(record) &&
+                 memcmp(record.magic, FILE_DIGEST_MAGIC, sizeof(record.magic)) == 0 &&
+                 be64toh(record.version) == version && be64toh(record.size) == size;
+    if (found) *crc = ntohl(record.crc);
+    if (found && blocks != NULL && ntohl(record.block_size) == FILE_DIGEST_BLOCK) {
+        file_digest_read_blocks(fd, size, blocks);
+    }
+    close(fd);
+    return found;
+}
+
+// Hands out the block CRCs collected over a whole file of size bytes, NULL if they are
+// incomplete.
+static const uint32_t* file_digest_collected(FileDigest* digest, uint64_t size) {
+    if (!digest->collect_blocks || digest->blocks_lost) return NULL;
+    if (digest->open_len > 0) file_digest_close_block(digest);
+    if (digest->blocks_lost || digest->block_count != file_digest_block_count(size)) return NULL;
+    static const uint32_t none[1];
+    return digest->blocks != NULL ? digest->blocks : none; // An empty file has no blocks
+}
+
+// Writes count block CRCs in network byte order. Returns true on success.
+static bool file_digest_write_blocks(int fd, const uint32_t* blocks, uint64_t count) {
+    uint32_t chunk[1024];
+    for (uint64_t i = 0; i < count; ) {
+        size_t n = count - i < 1024 ? (size_t)(count - i) : 1024;
+        for (size_t j = 0; j < n; j++) chunk[j] = htonl(blocks[i + j]);
+        if (write(fd, chunk, n * sizeof(uint32_t)) != (ssize_t)(n * sizeof(uint32_t))) return false;
+        i += n;
+    }
+    return true;
+}
+
+// Stores the digest of the given version of filename, replacing the old record atomically.
+// blocks holds the CRC of each FILE_DIGEST_BLOCK of the file, or is NULL.
+static void file_digest_store(const char* filename, uint64_t version, uint64_t size, uint32_t crc,
+                              const uint32_t* blocks) {
+    static atomic_uint counter;
+    char path[320], temp_path[340];
+    file_digest_path(filename, path, sizeof(path));
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp.%d.%u", path, (int) getpid(), atomic_fetch_add(&counter, 1));
+
+    FileDigestRecord record;
+    memset(&record, 0, sizeof(record));
+    memcpy(record.magic, FILE_DIGEST_MAGIC, sizeof(record.magic));
+    record.version = htobe64(version);
+    record.size = htobe64(size);
+    record.crc = htonl(crc);
+    record.block_size = htonl(blocks != NULL ? FILE_DIGEST_BLOCK : 0);
+
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        log_warn("Cannot store the digest of %s: %s", filename, strerror(errno));
+        return;
+    }
+    bool ok = write(fd, &record, sizeof(record)) == sizeof(record) &&
+              (blocks == NULL || file_digest_write_blocks(fd, blocks, file_digest_block_count(size)));
+    if (close(fd) != 0) ok = false;
+    if (!ok || rename(temp_path, path) != 0) {
+        log_warn("Cannot store the digest of %s: %s", filename, strerror(errno));
+        unlink(temp_path);
+        return;
+    }
+    meta_index_note_digest(filename, version, size, crc);
+}
+
+// Sets up the digest of a checksummed download of the given version of filename. Without
+// stored block CRCs the download collects them.
+static void download_digest_start(FileDigest* digest, const char* filename, uint64_t version, uint64_t size) {
+    memset(digest, 0, sizeof(*digest));
+    digest->size = size;
+    digest->has_stored = file_digest_load(filename, version, size, &digest->stored, digest);
+    digest->collect_blocks = !digest->has_blocks;
+}
+
+// After a complete checksummed download of the whole file: stores the digest and block
+// CRCs if they were missing, and reports a stored digest the data no longer matches.
+static void download_digest_finish(FileDigest* digest, const char* filename, uint64_t version, uint64_t size) {
+    if (digest->has_stored && digest->stored != digest->computed) {
+        log_warn("%s does not match its stored digest: the file changed on disk since it was stored", filename);
+    } else if (!digest->has_stored || !digest->has_blocks) {
+        file_digest_store(filename, version, size, digest->computed, file_digest_collected(digest, size));
+    }
+}
+
+// --- End File Digests ---
+
+// Works out which bytes of a file of total_size a download sends and sends the response
+// header: the status, plus an FssRangeInfo for ranged requests, both corked onto the
+// first frame. Returns 0 to go ahead with *offset/*length, 1 if the request was answered
+// with an error status, -1 if the connection failed.
+static int send_download_header(ClientTaskArgs* task_args, uint64_t total_size, uint64_t version,
+                                off_t* offset, off_t* length) {
+    if (!task_args->is_range) {
+        *offset = 0;
+        *length = total_size;
+        return send_response(task_args, FSS_STATUS_OK, MSG_MORE);
+    }
+
+    if (task_args->range_offset > total_size) {
+        return send_response(task_args, FSS_STATUS_BAD_RANGE, 0) < 0 ? -1 : 1;
+    }
+    uint64_t available = total_size - task_args->range_offset;
+    uint64_t granted = task_args->range_length < available ? task_args->range_length : available;
+    if (send_response(task_args, FSS_STATUS_OK, MSG_MORE) < 0) return -1;
+
+    FssRangeInfo info;
+    info.total_size = htobe64(total_size);
+    info.offset = htobe64(task_args->range_offset);
+    info.length = htobe64(granted);
+    info.version = htobe64(version);
+    if (send_all(task_args->client_socket, &info, sizeof(info), MSG_MORE) < 0) {
+        perror("send range info failed");
+        task_args->keep_alive = false;
+        return -1;
+    }
+    *offset = task_args->range_offset;
+    *length = granted;
+    return 0;
+}
+
+// Worker thread function for handling download requests
+void* DownLoadingFile(void *arg){
+    ClientTaskArgs* task_args = (ClientTaskArgs*) arg;
+    if (task_args == NULL) {
+        fprintf(stderr, "DownLoadingFile received NULL arguments\n");
+        return NULL;
+    }
+
+    // Removed: printf("Download thread started...")
+
+    // In snapshot mode uploads never modify a published file: they commit by renaming a
+    // new inode over the name. open() therefore always lands on a complete version and
+    // the descriptor keeps that version alive for the whole transfer, so no lock is needed.
+    FileAccessControl* control = NULL;
+    if (g_config.storage_mode == STORAGE_MODE_INPLACE) {
+        control = get_or_create_file_control_hashed(task_args->filename, task_args->filename_hash);
+        if (control == NULL) {
+            fprintf(stderr, "Failed to get file control for %s\n", task_args->filename);
+            // Send error to client?
+            finish_client_task(task_args);
+            return NULL;
+        }
+
+        // Acquire read lock for the file
+        acquire_read_lock(control);
+    }
+
+    // Compressed downloads need every frame in userspace: they always take the pipeline.
+    // Checksummed ones read every frame too, unless the file's block CRCs are stored: the
+    // frames' CRCs are then combined from those, so sendfile() and io_uring remain usable.
+    bool compress = task_args->compression != FSS_COMPRESS_NONE;
+    FileDigest digest_state;
+    FileDigest *digest = task_args->checksum ? &digest_state : NULL;
+    CacheEntry *cached = NULL;
+    uint64_t cache_generation = 0;
+    off_t offset, length;
+    if (g_content_cache != NULL && !compress) {
+        cached = content_cache_acquire(task_args->filename, task_args->filename_hash, &cache_generation);
+        if (cached != NULL) {
+            if (digest != NULL) download_digest_start(digest, task_args->filename, cached->version, cached->size);
+            if (send_download_header(task_args, cached->size, cached->version, &offset, &length) == 0) {
+                if (SendCachedFile(task_args->client_socket, cached, offset, length, task_args->frame_size, digest) < 0) {
+                    task_args->keep_alive = false; // Client holds a truncated stream
+                } else if (digest != NULL) {
+                    download_digest_finish(digest, task_args->filename, cached->version, cached->size);
+                }
+            }
+            file_digest_free(digest);
+            content_cache_release(cached);
+            download_release(task_args, control, -1);
+            return NULL;
+        }
+    }
+
+    int file_fd = open(task_args->filename, O_RDONLY);
+    if (file_fd < 0) {
+        uint32_t status = errno == ENOENT ? FSS_STATUS_NOT_FOUND : FSS_STATUS_IO_ERROR;
+        perror("open failed in DownLoadingFile");
+        send_response(task_args, status, 0);
+        download_release(task_args, control, file_fd);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(file_fd, &st) < 0) {
+        perror("fstat failed in DownLoadingFile");
+        send_response(task_args, FSS_STATUS_IO_ERROR, 0);
+        download_release(task_args, control, file_fd);
+        return NULL;
+    }
+
+    // Small enough files are read into the cache once and then served from memory
+    if (g_content_cache != NULL && !compress) {
+        cached = content_cache_fill(task_args->filename, task_args->filename_hash, cache_generation, file_fd,
+                                    st.st_size, file_version(&st));
+    }
+
+    if (digest != NULL) download_digest_start(digest, task_args->filename, file_version(&st), st.st_size);
+    if (send_download_header(task_args, st.st_size, file_version(&st), &offset, &length) != 0) {
+        file_digest_free(digest);
+        if (cached != NULL) content_cache_release(cached);
+        download_release(task_args, control, file_fd);
+        return NULL;
+    }
+
+    if (cached != NULL) {
+        if (SendCachedFile(task_args->client_socket, cached, offset, length, task_args->frame_size, digest) < 0) {
+            task_args->keep_alive = false; // Client holds a truncated stream
+        } else if (digest != NULL) {
+            download_digest_finish(digest, task_args->filename, file_version(&st), st.st_size);
+        }
+        file_digest_free(digest);
+        content_cache_release(cached);
+        download_release(task_args, control, file_fd);
+        return NULL;
+    }
+
+    bool zero_copy = !compress && (digest == NULL || digest->has_blocks);
+    if (zero_copy && g_uring_engine != NULL &&
+        StartUringDownload(task_args, control, file_fd, offset, length, digest) == 0) {
+        return NULL; // The engine finishes the request and releases everything
+    }
+
+    int rc;
+    if (compress) {
+        rc = SendFileThroughPipeline(task_args->client_socket, file_fd, offset, length, task_args->frame_size,
+                                     task_args->compression, digest);
+    } else if (g_config.download_mode == DOWNLOAD_MODE_SENDFILE && zero_copy) {
+        rc = SendFileZeroCopy(task_args->client_socket, file_fd, offset, length, task_args->frame_size, digest);
+    } else if (g_config.download_mode != DOWNLOAD_MODE_PIPELINE) {
+        rc = SendFileMapped(task_args->client_socket, file_fd, offset, length, task_args->frame_size, digest);
+    } else {
+        rc = SendFileThroughPipeline(task_args->client_socket, file_fd, offset, length, task_args->frame_size,
+                                     FSS_COMPRESS_NONE, digest);
+    }
+    if (rc < 0) {
+        task_args->keep_alive = false; // Client holds a truncated stream
+    } else if (digest != NULL) {
+        download_digest_finish(digest, task_args->filename, file_version(&st), st.st_size);
+    }
+    file_digest_free(digest);
+
+    // --- Cleanup ---
+    download_release(task_args, control, file_fd);
+    // Removed: printf("Download thread finished...")
+    return NULL; // Indicate success
+};
+
+void chunk_store_schedule(const char* filename);
+void meta_index_refresh(const char* filename);
+
+// Where an upload is being written and how it gets published.
+typedef struct {
+    int fd;
+    char temp_path[320];        // Snapshot mode: new version being written, empty in in-place mode
+    FileAccessControl *control;
+} UploadTarget;
+
+// Builds "<dir>/.<name>.fss-tmp.<pid>.<n>" next to the target, so the final rename()
+// stays within one file system and is atomic.
+static void upload_temp_path(const char* filename, char* out, size_t out_size) {
+    static atomic_uint counter;
+    const char *slash = strrchr(filename, '/');
+    int dir_len = slash ? (int)(slash - filename + 1) : 0;
+    snprintf(out, out_size, "%.*s.%s.fss-tmp.%d.%u", dir_len, filename, filename + dir_len,
+             (int) getpid(), atomic_fetch_add(&counter, 1));
+}
+
+// Opens a fresh temp file next to filename that upload_finish_target() renames over it.
+// Returns 0 on success, -1 on failure.
+static int upload_open_staging(const char* filename, UploadTarget* target) {
+    upload_temp_path(filename, target->temp_path, sizeof(target->temp_path));
+    // Readable too: upload-dedup checks the chunks it copies in
+    target->fd = open(target->temp_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (target->fd < 0) {
+        perror("open temp file failed in UploadFile");
+        target->temp_path[0] = '\0';
+        return -1;
+    }
+
+    // The new version replaces the old inode, so carry its permissions over
+    struct stat st;
+    if (stat(filename, &st) == 0) {
+        fchmod(target->fd, st.st_mode & 07777);
+    }
+    return 0;
+}
+
+// Opens the file an upload writes into. In snapshot mode that is a fresh temp file
+// (readers keep streaming the published version); in in-place mode it is the file
+// itself, truncated under the write lock. Returns 0 on success, -1 on failure.
+static int upload_open_target(ClientTaskArgs* task_args, UploadTarget* target) {
+    target->temp_path[0] = '\0';
+
+    if (g_config.storage_mode == STORAGE_MODE_INPLACE) {
+        acquire_write_lock(target->control);
+        content_cache_invalidate(task_args->filename, task_args->filename_hash); // The file changes from here on
+        // Open file for writing (create if not exists, truncate if exists)
+        target->fd = open(task_args->filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (target->fd < 0) {
+            perror("open failed in UploadFile");
+            release_write_lock(target->control); // Release lock before exiting
+            return -1;
+        }
+        return 0;
+    }
+
+    return upload_open_staging(task_args->filename, target);
+}
+
+// Publishes (success) or discards (failure) the upload and releases the target.
+// In snapshot mode the new version becomes visible with a single rename() under the
+// write lock, which only serializes concurrent commits of the same file.
+// Returns 0 if the new version was published.
+static int upload_finish_target(ClientTaskArgs* task_args, UploadTarget* target, bool success) {
+    int rc = success ? 0 : -1;
+
+    if (target->temp_path[0] == '\0') {
+        close(target->fd);
+        content_cache_invalidate(task_args->filename, task_args->filename_hash);
+        meta_index_refresh(task_args->filename);
+        release_write_lock(target->control);
+        return rc;
+    }
+
+    if (success && fdatasync(target->fd) < 0) {
+        perror("UploadFile: fdatasync failed");
+        rc = -1;
+    }
+    close(target->fd);
+
+    if (rc == 0) {
+        acquire_write_lock(target->control);
+        if (rename(target->temp_path, task_args->filename) < 0) {
+            perror("UploadFile: rename to publish new version failed");
+            rc = -1;
+        } else {
+            content_cache_invalidate(task_args->filename, task_args->filename_hash);
+            chunk_store_schedule(task_args->filename);
+            meta_index_refresh(task_args->filename);
+        }
+        release_write_lock(target->control);
+    }
+    if (rc != 0) {
+        unlink(target->temp_path);
+    }
+    return rc;
+}
+
+// Creates the pipe used to splice upload payload from the socket into the file, sized to
+// hold a whole frame where the system allows it. Returns 0 if the file accepts splice
+// writes, -1 if the caller should fall back to recv()+write().
+static int SetupUploadSplice(int pipe_fds[2], int file_fd, uint32_t frame_size) {
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+        perror("UploadFile: pipe2 failed");
+        return -1;
+    }
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, frame_size); // Best effort, capped by fs.pipe-max-size
+
+    // Probe with an empty pipe: EAGAIN means the file system implements splice writes
+    if (splice(pipe_fds[0], NULL, file_fd, NULL, 1, SPLICE_F_NONBLOCK) < 0 && errno == EAGAIN) {
+        return 0;
+    }
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    pipe_fds[0] = pipe_fds[1] = -1;
+    return -1;
+}
+
+// Moves one frame payload from the socket into the file through the pipe. Only the
+// frame header was parsed in userspace; the payload stays in kernel pages. Writes at
+// *file_offset (advancing it) if given, else at the file position.
+// Returns 0 on success, -1 on error or disconnect.
+static int SpliceFrameToFile(int client_sock, int pipe_fds[2], int file_fd, loff_t* file_offset, size_t len) {
+    while (len > 0) {
+        ssize_t in_pipe = splice(client_sock, NULL, pipe_fds[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in_pipe < 0) {
+            if (errno == EINTR) continue;
+            perror("UploadFile: splice from socket failed");
+            return -1;
+        }
+        if (in_pipe == 0) return -1; // Client disconnected mid-frame
+        len -= in_pipe;
+
+        while (in_pipe > 0) {
+            ssize_t written = splice(pipe_fds[0], NULL, file_fd, file_offset, in_pipe, SPLICE_F_MOVE);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                perror("UploadFile: splice to file failed");
+                return -1;
+            }
+            in_pipe -= written;
+        }
+    }
+    return 0;
+}
+
+// Reads and drops len bytes from the socket. Returns 0 on success, -1 if the stream broke off.
+static int DiscardBytes(int client_sock, size_t len) {
+    char discard_buff[64 * 1024];
+    while (len > 0) {
+        size_t want = len < sizeof(discard_buff) ? len : sizeof(discard_buff);
+        ssize_t n = recv(client_sock, discard_buff, want, MSG_WAITALL);
+        if (n <= 0) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+// Reads and drops the frames of an upload that cannot be stored, up to its end frame.
+// Returns 0 once the end frame was read, -1 if the stream broke off.
+static int DiscardUploadFrames(ClientTaskArgs* task_args) {
+    int chunk_size_n;
+    size_t trailer = task_args->checksum ? sizeof(uint32_t) : 0;
+
+    while (true) {
+        if (recv(task_args->client_socket, &chunk_size_n, sizeof(int), MSG_WAITALL) != sizeof(int)) return -1;
+        uint32_t len = ntohl(chunk_size_n);
+        if (task_args->compression != FSS_COMPRESS_NONE) len &= ~FSS_FRAME_COMPRESSED;
+        if (len > task_args->frame_size || DiscardBytes(task_args->client_socket, len + trailer) < 0) return -1;
+        if (len == 0) return 0;
+    }
+}
+
+// Reads a list of item_size-byte items sent as frames, up to its end frame. Returns the
+// number of items with *items set (NULL for an empty list), -2 if the list is longer than
+// max_bytes or not a whole number of items but was read to its end frame, -1 if the
+// stream broke off.
+static ssize_t ReceiveFrameList(ClientTaskArgs* task_args, size_t item_size, size_t max_bytes, void** items) {
+    size_t capacity = 0, received = 0;
+    char *list = NULL;
+
+    *items = NULL;
+    while (true) {
+        int chunk_size_n;
+        if (recv(task_args->client_socket, &chunk_size_n, sizeof(int), MSG_WAITALL) != sizeof(int)) break;
+        uint32_t chunk_size = ntohl(chunk_size_n);
+        if (chunk_size == 0) {
+            if (received % item_size != 0) {
+                free(list);
+                return -2;
+            }
+            *items = list;
+            return received / item_size;
+        }
+        if (chunk_size > task_args->frame_size) break;
+
+        if (received + chunk_size > max_bytes) {
+            // More items than the request allows: skip the rest of the list
+            free(list);
+            return DiscardBytes(task_args->client_socket, chunk_size) == 0 &&
+                   DiscardUploadFrames(task_args) == 0 ? -2 : -1;
+        }
+        if (received + chunk_size > capacity) {
+            size_t grown_capacity = capacity ? capacity * 2 : 64 * 1024;
+            while (grown_capacity < received + chunk_size) grown_capacity *= 2;
+            char *grown = realloc(list, grown_capacity);
+            if (grown == NULL) break;
+            list = grown;
+            capacity = grown_capacity;
+        }
+        if (recv(task_args->client_socket, list + received, chunk_size, MSG_WAITALL) != (ssize_t) chunk_size) break;
+        received += chunk_size;
+    }
+    free(list);
+    return -1;
+}
+
+// Consumer of a compressed or checksummed upload: checks the frames' CRCs, expands the
+// compressed ones and writes everything to the file in order, so this work and the disk
+// writes overlap with receiving.
+void* WriteToFile(void *arg){
+    thread_shared_data *sh_data = (thread_shared_data*) arg;
+    FssDecompressor decompressor;
+    bool usable = fss_decompressor_init(&decompressor) == 0;
+    char *expanded = malloc(sh_data->frame_size);
+    if (!usable || expanded == NULL) {
+        fprintf(stderr, "WriteToFile: cannot set up decompression\n");
+        sh_data->write_failed = true;
+    }
+
+    unsigned available = 0;
+    for (unsigned next = 0; ; next++) {
+        buffer_item *item = ring_slot_to_take(sh_data, &sh_data->filled, next, &available);
+        if (item->is_last_chunk) break; // The receiver's closing slot carries no data
+
+        // After a failure keep draining so the receiver can reach the end frame
+        FileDigest *digest = sh_data->digest;
+        const char *data = item->data;
+        ssize_t len = item->bytes_read;
+        if (digest != NULL && !digest->frame_mismatch) {
+            // A raw frame is checked by the same pass that feeds it into the digest
+            uint32_t crc = item->compressed ? fss_crc32c(0, item->data, item->bytes_read)
+                                            : file_digest_add(digest, item->data, item->bytes_read);
+            if (crc != item->crc) digest->frame_mismatch = true; // Nothing more is stored, the upload gets discarded
+        }
+        bool skip = sh_data->write_failed || (digest != NULL && digest->frame_mismatch);
+        if (!skip && item->compressed) {
+            len = fss_decompress_frame(&decompressor, (const uint8_t*) item->data, item->bytes_read,
+                                       (uint8_t*) expanded, sh_data->frame_size);
+            data = expanded;
+            if (len < 0) {
+                fprintf(stderr, "WriteToFile: corrupt compressed frame\n");
+                sh_data->write_failed = true;
+            }
+        }
+        if (!skip && digest != NULL && item->compressed && len >= 0) file_digest_add(digest, data, len);
+        for (ssize_t written = 0; !skip && !sh_data->write_failed && written < len; ) {
+            ssize_t n = write(sh_data->file, data + written, len - written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                perror("WriteToFile: write to file failed");
+                sh_data->write_failed = true;
+                break;
+            }
+            written += n;
+        }
+
+        ring_advance(&sh_data->consumed, next + 1);
+    }
+
+    if (usable) fss_decompressor_end(&decompressor);
+    free(expanded);
+    return NULL;
+}
+
+// Receives the frames of a compressed or checksummed upload into the thread_shared_data
+// ring while WriteToFile checks, expands and stores them. digest is NULL unless the upload
+// is checksummed. Returns 0 once the end frame arrived and every frame was written, 1 if
+// the whole upload arrived but failed its checksums, -1 otherwise.
+static int ReceiveUploadThroughPipeline(ClientTaskArgs* task_args, int file_fd, FileDigest* digest) {
+    pthread_t writer_thread;
+    thread_shared_data shared;
+    memset(&shared, 0, sizeof(shared));
+
+    shared.frame_size = task_args->frame_size;
+    shared.file = file_fd;
+    shared.digest = digest;
+    shared.slab = ring_alloc_slots(&shared, shared.frame_size, false);
+    if (shared.slab == NULL) {
+        perror("Failed to allocate upload buffer");
+        return -1;
+    }
+
+    bool complete = false;
+    unsigned next = 0, free_until = BUFFER_CAPACITY;
+    if (pthread_create(&writer_thread, NULL, WriteToFile, &shared) != 0) {
+        perror("pthread_create writer failed");
+        free(shared.slab);
+        return -1;
+    }
+
+    while (true) {
+        int chunk_size_n;
+        if (recv(task_args->client_socket, &chunk_size_n, sizeof(int), MSG_WAITALL) != sizeof(int)) break;
+        uint32_t header = ntohl(chunk_size_n);
+        uint32_t chunk_size = task_args->compression != FSS_COMPRESS_NONE ? header & ~FSS_FRAME_COMPRESSED : header;
+        if (header == 0) {
+            uint32_t crc_n;
+            if (digest == NULL) {
+                complete = true;
+            } else if (recv(task_args->client_socket, &crc_n, sizeof(crc_n), MSG_WAITALL) == sizeof(crc_n)) {
+                digest->stored = ntohl(crc_n);
+                digest->has_stored = true;
+                complete = true;
+            }
+            break;
+        }
+        if (chunk_size == 0 || chunk_size > task_args->frame_size) {
+            fprintf(stderr, "UploadFile: Invalid chunk size received: %u for %s\n", chunk_size, task_args->filename);
+            break;
+        }
+
+        buffer_item *item = ring_slot_to_fill(&shared, next, &free_until);
+
+        if (recv(task_args->client_socket, item->data, chunk_size, MSG_WAITALL) != (ssize_t) chunk_size) break;
+        uint32_t crc_n;
+        if (digest != NULL) {
+            if (recv(task_args->client_socket, &crc_n, sizeof(crc_n), MSG_WAITALL) != sizeof(crc_n)) break;
+            item->crc = ntohl(crc_n);
+        }
+        item->bytes_read = chunk_size;
+        item->compressed = chunk_size != header;
+        item->is_last_chunk = 0;
+        ring_advance(&shared.filled, ++next);
+    }
+
+    // Whether or not the upload arrived whole, an empty closing slot stops the writer
+    buffer_item *closing = ring_slot_to_fill(&shared, next, &free_until);
+    closing->bytes_read = 0;
+    closing->is_last_chunk = 1;
+    ring_advance(&shared.filled, ++next);
+    pthread_join(writer_thread, NULL);
+
+    free(shared.slab);
+    if (!complete || shared.write_failed) return -1;
+    if (digest != NULL && (digest->frame_mismatch || digest->computed != digest->stored)) return 1;
+    return 0;
+}
+
+// Uploads the io_uring engine has received, waiting for UploadCommitThread to publish
+// them. Publishing means fdatasync(), the file's write lock and the metadata index, none
+// of which the engine thread may wait for while it drives every other transfer.
+pthread_mutex_t g_upload_commit_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_upload_commit_ready = PTHREAD_COND_INITIALIZER;
+UringTransfer *g_upload_commit_head = NULL, *g_upload_commit_tail = NULL;
+bool g_upload_commit_running = false;
+
+// Publishes (or discards) an upload the engine finished and answers the client.
+static void upload_commit_finish(UringTransfer* t) {
+    ClientTaskArgs *task_args = (ClientTaskArgs*) t->owner;
+    UploadTarget *target = (UploadTarget*) t->owner_ctx;
+
+    if (upload_finish_target(task_args, target, t->status == 0) != 0) {
+        fprintf(stderr, "UploadFile: Upload failed for %s.\n", task_args->filename);
+        if (t->status == 0) {
+            send_response(task_args, FSS_STATUS_IO_ERROR, 0);
+        } else {
+            task_args->keep_alive = false; // Frames of unknown length may still be in flight
+        }
+    } else {
+        send_response(task_args, FSS_STATUS_OK, 0);
+    }
+    release_file_control(target->control);
+    finish_client_task(task_args);
+    free(target);
+    free(t);
+}
+
+void* UploadCommitThread(void* arg) {
+    (void) arg;
+    while (1) {
+        pthread_mutex_lock(&g_upload_commit_mutex);
+        while (g_upload_commit_head == NULL) pthread_cond_wait(&g_upload_commit_ready, &g_upload_commit_mutex);
+        UringTransfer *t = g_upload_commit_head;
+        g_upload_commit_head = t->next;
+        if (g_upload_commit_head == NULL) g_upload_commit_tail = NULL;
+        pthread_mutex_unlock(&g_upload_commit_mutex);
+
+        upload_commit_finish(t);
+    }
+    return NULL;
+}
+
+// Starts the thread that publishes io_uring uploads. Returns 0 on success; without it
+// uploads are received by the worker threads.
+int upload_commit_start(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, UploadCommitThread, NULL) != 0) {
+        perror("pthread_create for upload commits failed, uploads stay on the worker threads");
+        return -1;
+    }
+    pthread_detach(thread);
+    g_upload_commit_running = true;
+    return 0;
+}
+
+// Completion for uploads run by the io_uring engine: queues them for UploadCommitThread.
+static void UringUploadDone(UringTransfer* t, int status) {
+    t->status = status;
+    t->next = NULL;
+    pthread_mutex_lock(&g_upload_commit_mutex);
+    if (g_upload_commit_tail != NULL) {
+        g_upload_commit_tail->next = t;
+    } else {
+        g_upload_commit_head = t;
+    }
+    g_upload_commit_tail = t;
+    pthread_cond_signal(&g_upload_commit_ready);
+    pthread_mutex_unlock(&g_upload_commit_mutex);
+}
+
+// Hands an upload with an open target to the io_uring engine.
+// Returns 0 if the engine took it, -1 if the caller should receive it itself.
+static int StartUringUpload(ClientTaskArgs* task_args, UploadTarget* target) {
+    if (!g_upload_commit_running) return -1;
+    UringTransfer *t = calloc(1, sizeof(UringTransfer));
+    UploadTarget *owned_target = malloc(sizeof(UploadTarget));
+    if (t == NULL || owned_target == NULL) {
+        free(t);
+        free(owned_target);
+        return -1;
+    }
+    *owned_target = *target;
+
+    t->is_upload = true;
+    t->client_sock = task_args->client_socket;
+    t->file_fd = target->fd;
+    t->frame_size = task_args->frame_size;
+    t->on_done = UringUploadDone;
+    t->owner = task_args;
+    t->owner_ctx = owned_target;
+    uring_submit_transfer(t);
+    return 0;
+}
+
+// Worker thread function for handling upload requests
+void* UploadFile(void* arg){
+    ClientTaskArgs* task_args = (ClientTaskArgs*) arg;
+     if (task_args == NULL) {
+        fprintf(stderr, "UploadFile received NULL arguments\n");
+        return NULL;
+    }
+
+    // Removed: printf("Upload thread started...")
+
+    FileAccessControl* control = get_or_create_file_control_hashed(task_args->filename, task_args->filename_hash);
+    if (control == NULL) {
+        fprintf(stderr, "Failed to get file control for %s\n", task_args->filename);
+        // Send error to client?
+        finish_client_task(task_args);
+        return NULL;
+    }
+
+    UploadTarget target;
+    target.control = control;
+    if (upload_open_target(task_args, &target) != 0) {
+        release_file_control(control); // Release control struct reference
+        // Consume the frames the client is already sending so the connection stays in sync
+        if (DiscardUploadFrames(task_args) == 0) {
+            send_response(task_args, FSS_STATUS_IO_ERROR, 0);
+        } else {
+            task_args->keep_alive = false;
+        }
+        finish_client_task(task_args);
+        return NULL;
+    }
+    int file_fd = target.fd;
+
+    // --- Receive data from client and write to file ---
+    char *recv_buff = NULL;
+    int pipe_fds[2] = {-1, -1};
+    FileDigest digest;
+    memset(&digest, 0, sizeof(digest));
+    digest.collect_blocks = true; // Stored with the digest, for downloads that use sendfile()
+    struct stat st;
+
+    // Compressed frames are expanded, and checksummed ones checked, on a stage of their
+    // own, overlapping the receive
+    if (task_args->compression != FSS_COMPRESS_NONE || task_args->checksum) {
+        int rc = ReceiveUploadThroughPipeline(task_args, file_fd, task_args->checksum ? &digest : NULL);
+        if (rc < 0) goto upload_error_cleanup;
+        if (rc > 0) goto upload_corrupt;
+        goto upload_received;
+    }
+
+    if (g_uring_engine != NULL && StartUringUpload(task_args, &target) == 0) {
+        return NULL; // The engine finishes the request and releases everything
+    }
+    int chunk_size_n;          // Network byte order size
+    ssize_t chunk_size;        // Host byte order size
+    ssize_t bytes_received_net; // Return value from network recv
+    ssize_t bytes_written_total;
+    ssize_t bytes_written_now;
+
+    bool use_splice = g_config.upload_mode == UPLOAD_MODE_SPLICE &&
+                      SetupUploadSplice(pipe_fds, file_fd, task_args->frame_size) == 0;
+    if (!use_splice) {
+        recv_buff = malloc(task_args->frame_size);
+        if (recv_buff == NULL) {
+            perror("UploadFile: malloc receive buffer failed");
+            goto upload_error_cleanup;
+        }
+    }
+
+    while (true) {
+        // 1. Receive chunk size
+        bytes_received_net = recv(task_args->client_socket, &chunk_size_n, sizeof(int), MSG_WAITALL);
+        if (bytes_received_net <= 0) { // Handles disconnect (0) or error (<0)
+            if (bytes_received_net != 0) { // Only print perror on actual error
+                 perror("UploadFile: recv chunk size failed");
+            }
+            // Removed: printf for disconnect
+            goto upload_error_cleanup; // Jump to error cleanup section
+        }
+        // Note: Check for bytes_received != sizeof(int) is less critical with MSG_WAITALL
+
+        chunk_size = ntohl(chunk_size_n);
+
+        // Check for end-of-upload signal (size 0)
+        if (chunk_size == 0) {
+            // Removed: printf("Received end-of-upload signal...")
+            break; // Normal end of upload, proceed to normal cleanup outside loop
+        }
+
+        // Validate chunk size
+        if (chunk_size < 0 || chunk_size > task_args->frame_size) {
+            fprintf(stderr, "UploadFile: Invalid chunk size received: %zd for %s\n", chunk_size, task_args->filename);
+            goto upload_error_cleanup;
+        }
+
+        // 2. Move chunk data straight into the file
+        if (use_splice) {
+            if (SpliceFrameToFile(task_args->client_socket, pipe_fds, file_fd, NULL, chunk_size) < 0) {
+                goto upload_error_cleanup;
+            }
+            continue;
+        }
+
+        // 2. Receive chunk data
+        bytes_received_net = recv(task_args->client_socket, recv_buff, chunk_size, MSG_WAITALL);
+         if (bytes_received_net <= 0) { // Handles disconnect (0) or error (<0)
+             if (bytes_received_net != 0) { // Only print perror on actual error
+                 perror("UploadFile: recv chunk data failed");
+             }
+             // Removed: printf for disconnect
+            goto upload_error_cleanup;
+        }
+        // Note: Check for bytes_received != chunk_size is less critical with MSG_WAITALL
+
+        // 3. Write chunk data to file
+        bytes_written_total = 0;
+        while (bytes_written_total < bytes_received_net) {
+            bytes_written_now = write(file_fd, recv_buff + bytes_written_total, bytes_received_net - bytes_written_total);
+            if (bytes_written_now < 0) {
+                perror("UploadFile: write to file failed");
+                goto upload_error_cleanup; // Critical error, jump to error cleanup
+            }
+            bytes_written_total += bytes_written_now;
+        }
+         // Optional: printf("Written %zd bytes to %s\n", bytes_written_total, task_args->filename);
+    } // End while(true) loop
+
+// Normal cleanup path (after loop breaks successfully on chunk_size == 0)
+upload_received:
+    // Removed: printf("Upload completed successfully...")
+    free(recv_buff);
+    if (pipe_fds[0] >= 0) { close(pipe_fds[0]); close(pipe_fds[1]); }
+    // Publishing keeps the inode and mtime, so this is the version the digest describes
+    bool keep_digest = task_args->checksum && fstat(file_fd, &st) == 0;
+    if (upload_finish_target(task_args, &target, true) != 0) {
+        fprintf(stderr, "UploadFile: Upload failed for %s.\n", task_args->filename);
+        send_response(task_args, FSS_STATUS_IO_ERROR, 0);
+    } else {
+        if (keep_digest) file_digest_store(task_args->filename, file_version(&st), st.st_size, digest.computed,
+                                         file_digest_collected(&digest, st.st_size));
+        send_response(task_args, FSS_STATUS_OK, 0);
+    }
+    file_digest_free(&digest);
+    release_file_control(control);
+    finish_client_task(task_args);
+    return NULL; // Indicate success
+
+// The upload arrived complete, so the connection is still in sync
+upload_corrupt:
+    log_warn("UploadFile: %s failed its checksums and was discarded", task_args->filename);
+    upload_finish_target(task_args, &target, false);
+    send_response(task_args, FSS_STATUS_CORRUPT, 0);
+    file_digest_free(&digest);
+    release_file_control(control);
+    finish_client_task(task_args);
+    return NULL;
+
+// Error cleanup path (jumped to on error via goto)
+upload_error_cleanup:
+    fprintf(stderr, "UploadFile: Upload failed for %s.\n", task_args->filename);
+    // Ensure file is closed even on error before releasing lock/control
+    free(recv_buff);
+    if (pipe_fds[0] >= 0) { close(pipe_fds[0]); close(pipe_fds[1]); }
+    upload_finish_target(task_args, &target, false); // Discards the partial version
+    file_digest_free(&digest);
+    release_file_control(control);
+    task_args->keep_alive = false; // The request stream is out of sync, drop the connection
+    finish_client_task(task_args);
+    return NULL; // Indicate failure (or return specific error code)
+}
+
+// --- Upload Sessions ---
+//
+// An upload session receives one file in parts, possibly over several connections at
+// once. "upload-open" preallocates a staging file of the announced size, each
+// "upload-part" writes its bytes at their offset with pwrite/splice, and "upload-commit"
+// publishes the staging file with the same atomic rename as a snapshot upload once
+// every byte has arrived. Parts touch only the private staging file, so they take no
+// file lock; sessions stage even in in-place storage mode.
+
+#define UPLOAD_SESSIONS_MAX 256
+#define UPLOAD_SESSION_TIMEOUT_SEC 600  // Idle sessions are discarded after this long
+#define UPLOAD_SESSION_SWEEP_SEC 60     // How often the reaper looks for idle sessions
+
+typedef struct {
+    uint64_t start, end;
+} UploadExtent;
+
+typedef struct UploadSession {
+    uint64_t id;
+    char filename[256];
+    uint64_t filename_hash;
+    uint64_t total_size;
+    UploadTarget target;            // Staging file
+    int base_fd;                    // upload-delta: the copy the signature was sent for, -1 if none
+    uint64_t base_size;
+    uint64_t base_version;
+
+    pthread_mutex_t mutex;          // Guards everything below
+    pthread_cond_t parts_done;      // Signalled when active_parts drops to 0
+    int active_parts;               // Parts being written right now
+    UploadExtent *extents;          // Bytes received so far: sorted, disjoint, non-adjacent
+    int extent_count;
+    int extent_capacity;
+    time_t last_used;
+
+    struct UploadSession *next;
+} UploadSession;
+
+static pthread_mutex_t g_upload_sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static UploadSession *g_upload_sessions = NULL;  // Open sessions, guarded by g_upload_sessions_lock
+static int g_upload_session_count = 0;
+static uint64_t g_next_upload_session_id = 1;
+
+// Frees a session that is no longer in the table, discarding its staging file unless
+// upload_finish_target() already took care of it.
+static void upload_session_destroy(UploadSession* session, bool target_finished) {
+    if (!target_finished) {
+        close(session->target.fd);
+        unlink(session->target.temp_path);
+    }
+    if (session->base_fd >= 0) close(session->base_fd);
+    pthread_mutex_destroy(&session->mutex);
+    pthread_cond_destroy(&session->parts_done);
+    free(session->extents);
+    free(session);
+}
+
+// Records that [start, end) of the staging file was written. Called with session->mutex held.
+static int upload_session_mark(UploadSession* session, uint64_t start, uint64_t end) {
+    if (start == end) return 0;
+
+    // Find the extents that overlap or touch [start, end) and merge them into one
+    int first = 0;
+    while (first < session->extent_count && session->extents[first].end < start) first++;
+    int last = first;
+    while (last < session->extent_count && session->extents[last].start <= end) {
+        if (session->extents[last].start < start) start = session->extents[last].start;
+        if (session->extents[last].end > end) end = session->extents[last].end;
+        last++;
+    }
+
+    if (first == last) {
+        if (session->extent_count == session->extent_capacity) {
+            int capacity = session->extent_capacity ? session->extent_capacity * 2 : 8;
+            UploadExtent *grown = realloc(session->extents, capacity * sizeof(UploadExtent));
+            if (grown == NULL) return -1;
+            session->extents = grown;
+            session->extent_capacity = capacity;
+        }
+        memmove(&session->extents[first + 1], &session->extents[first],
+                (session->extent_count - first) * sizeof(UploadExtent));
+        session->extent_count++;
+    } else {
+        memmove(&session->extents[first + 1], &session->extents[last],
+                (session->extent_count - last) * sizeof(UploadExtent));
+        session->extent_count -= last - first - 1;
+    }
+    session->extents[first].start = start;
+    session->extents[first].end = end;
+    return 0;
+}
+
+// Called with session->mutex held.
+static bool upload_session_complete(UploadSession* session) {
+    return session->total_size == 0 ||
+           (session->extent_count == 1 && session->extents[0].start == 0 &&
+            session->extents[0].end == session->total_size);
+}
+
+// Looks up an open session of filename. With take_part, registers an active part that
+// keeps the session from committing until upload_session_part_done(); otherwise removes
+// the session from the table for the caller to commit or discard.
+static UploadSession* upload_session_take(const char* filename, uint64_t id, bool take_part) {
+    pthread_mutex_lock(&g_upload_sessions_lock);
+    UploadSession **link = &g_upload_sessions;
+    while (*link != NULL && (*link)->id != id) link = &(*link)->next;
+    UploadSession *session = *link;
+    if (session != NULL && strcmp(session->filename, filename) != 0) session = NULL;
+    if (session != NULL) {
+        if (take_part) {
+            pthread_mutex_lock(&session->mutex);
+            session->active_parts++;
+            pthread_mutex_unlock(&session->mutex);
+        } else {
+            *link = session->next;
+            g_upload_session_count--;
+        }
+    }
+    pthread_mutex_unlock(&g_upload_sessions_lock);
+    return session;
+}
+
+// Ends a part registered by upload_session_take(), recording its bytes if it was stored.
+static int upload_session_part_done(UploadSession* session, uint64_t start, uint64_t end) {
+    pthread_mutex_lock(&session->mutex);
+    int rc = upload_session_mark(session, start, end);
+    session->last_used = time(NULL);
+    if (--session->active_parts == 0) pthread_cond_broadcast(&session->parts_done);
+    pthread_mutex_unlock(&session->mutex);
+    return rc;
+}
+
+// Adds a session to the table, giving new sessions (id 0) an id.
+// Returns -1 if UPLOAD_SESSIONS_MAX new sessions are already open.
+static int upload_session_insert(UploadSession* session) {
+    pthread_mutex_lock(&g_upload_sessions_lock);
+    if (session->id == 0) {
+        if (g_upload_session_count >= UPLOAD_SESSIONS_MAX) {
+            pthread_mutex_unlock(&g_upload_sessions_lock);
+            return -1;
+        }
+        session->id = g_next_upload_session_id++;
+    }
+    session->next = g_upload_sessions;
+    g_upload_sessions = session;
+    g_upload_session_count++;
+    pthread_mutex_unlock(&g_upload_sessions_lock);
+    return 0;
+}
+
+// Drops sessions nobody has used for UPLOAD_SESSION_TIMEOUT_SEC.
+static void upload_session_expire(void) {
+    UploadSession *expired = NULL;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&g_upload_sessions_lock);
+    UploadSession **link = &g_upload_sessions;
+    while (*link != NULL) {
+        UploadSession *session = *link;
+        pthread_mutex_lock(&session->mutex);
+        bool idle = session->active_parts == 0 && now - session->last_used > UPLOAD_SESSION_TIMEOUT_SEC;
+        pthread_mutex_unlock(&session->mutex);
+        if (idle) {
+            *link = session->next;
+            g_upload_session_count--;
+            session->next = expired;
+            expired = session;
+        } else {
+            link = &session->next;
+        }
+    }
+    pthread_mutex_unlock(&g_upload_sessions_lock);
+
+    while (expired != NULL) {
+        UploadSession *next = expired->next;
+        log_info("Upload session %llu for %s expired", (unsigned long long) expired->id, expired->filename);
+        upload_session_destroy(expired, false);
+        expired = next;
+    }
+}
+
+// Expires idle sessions even when no new ones are being opened.
+void* UploadSessionReaper(void* arg) {
+    (void) arg;
+    while (1) {
+        sleep(UPLOAD_SESSION_SWEEP_SEC);
+        upload_session_expire();
+    }
+    return NULL;
+}
+
+// Creates a session for an upload of total_size bytes to task_args->filename, with its
+// staging file at its final size. Returns FSS_STATUS_OK with *out set, or the status to
+// answer with.
+static uint32_t upload_session_create(ClientTaskArgs* task_args, uint64_t total_size, UploadSession** out) {
+    upload_session_expire();
+
+    UploadSession *session = calloc(1, sizeof(UploadSession));
+    if (session == NULL) {
+        perror("upload_session_create: malloc failed");
+        return FSS_STATUS_IO_ERROR;
+    }
+    strcpy(session->filename, task_args->filename);
+    session->filename_hash = task_args->filename_hash;
+    session->total_size = total_size;
+    session->base_fd = -1;
+    session->last_used = time(NULL);
+    pthread_mutex_init(&session->mutex, NULL);
+    pthread_cond_init(&session->parts_done, NULL);
+
+    if (upload_open_staging(task_args->filename, &session->target) != 0) {
+        free(session);
+        return FSS_STATUS_IO_ERROR;
+    }
+
+    // Reserve the blocks up front: parts arrive out of order, and a file grown by scattered
+    // writes ends up fragmented (or out of space halfway through)
+    int rc = total_size > 0 ? fallocate(session->target.fd, 0, 0, total_size) : 0;
+    if (rc < 0 && errno == EOPNOTSUPP) rc = ftruncate(session->target.fd, total_size);
+    if (rc < 0) {
+        perror("upload_session_create: fallocate failed");
+        upload_session_destroy(session, false);
+        return FSS_STATUS_IO_ERROR;
+    }
+    *out = session;
+    return FSS_STATUS_OK;
+}
+
+// Answers OK with the id of a new session, corked onto what follows if more is set.
+// Returns 0 on success, -1 if the connection failed.
+static int upload_session_reply(ClientTaskArgs* task_args, UploadSession* session, bool more) {
+    FssUploadSession reply;
+    reply.session_id = htobe64(session->id);
+    if (send_response(task_args, FSS_STATUS_OK, MSG_MORE) < 0) return -1;
+    if (send_all(task_args->client_socket, &reply, sizeof(reply), more ? MSG_MORE : 0) < 0) {
+        perror("send upload session failed");
+        task_args->keep_alive = false;
+        return -1;
+    }
+    return 0;
+}
+
+// Worker thread function for "upload-open": creates the staging file at its final size.
+void* UploadSessionOpen(void* arg) {
+    ClientTaskArgs* task_args = (ClientTaskArgs*) arg;
+    uint64_t total_size = be64toh(task_args->body.upload_open.total_size);
+
+    UploadSession *session;
+    uint32_t status = upload_session_create(task_args, total_size, &session);
+    if (status == FSS_STATUS_OK && upload_session_insert(session) != 0) {
+        upload_session_destroy(session, false);
+        status = FSS_STATUS_BUSY;
+    }
+    if (status != FSS_STATUS_OK) {
+        send_response(task_args, status, 0);
+        finish_client_task(task_args);
+        return NULL;
+    }
+
+    log_debug("UploadSessionOpen: session %llu for %s, %llu bytes", (unsigned long long) session->id,
+              task_args->filename, (unsigned long long) total_size);
+    upload_session_reply(task_args, session, false);
+    finish_client_task(task_args);
+    return NULL;
+}
+
+// Receives the frames of one part and writes them at their offsets in the staging file.
+// Returns the number of bytes stored, or -1 if the stream broke off or was malformed.
+static ssize_t ReceiveUploadPart(ClientTaskArgs* task_args, int file_fd, uint64_t offset, uint64_t length) {
+    int pipe_fds[2] = {-1, -1};
+    char *recv_buff = NULL;
+    uint64_t received = 0;
+    ssize_t rc = -1;
+
+    bool use_splice = g_config.upload_mode == UPLOAD_MODE_SPLICE &&
+                      SetupUploadSplice(pipe_fds, file_fd, task_args->frame_size) == 0;
+    if (!use_splice && (recv_buff = malloc(task_args->frame_size)) == NULL) {
+        perror("UploadSessionPart: malloc receive buffer failed");
+        return -1;
+    }
+
+    while (true) {
+        int chunk_size_n;
+        if (recv(task_args->client_socket, &chunk_size_n, sizeof(int), MSG_WAITALL) != sizeof(int)) goto out;
+        uint32_t chunk_size = ntohl(chunk_size_n);
+        if (chunk_size == 0) break;
+        if (chunk_size > task_args->frame_size || chunk_size > length - received) {
+            fprintf(stderr, "UploadSessionPart: Invalid chunk size received: %u for %s\n", chunk_size,
+                    task_args->filename);
+            goto out;
+        }
+
+        loff_t position = offset + received;
+        if (use_splice) {
+            if (SpliceFrameToFile(task_args->client_socket, pipe_fds, file_fd, &position, chunk_size) < 0) goto out;
+        } else {
+            if (recv(task_args->client_socket, recv_buff, chunk_size, MSG_WAITALL) != (ssize_t) chunk_size) goto out;
+            for (uint32_t written = 0; written < chunk_size; ) {
+                ssize_t n = pwrite(file_fd, recv_buff + written, chunk_size - written, position + written);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    perror("UploadSessionPart: pwrite failed");
+                    goto out;
+                }
+                written += n;
+            }
+        }
+        received += chunk_size;
+    }
+    rc = received;
+
+out:
+    free(recv_buff);
+    if (pipe_fds[0] >= 0) { close(pipe_fds[0]); close(pipe_fds[1]); }
+    return rc;
+}
+
+// Worker thread function for "upload-part".
+void* UploadSessionPart(void* arg) {
+    ClientTaskArgs* task_args = (ClientTaskArgs*) arg;
+    uint64_t id = be64toh(task_args->body.upload_part.session_id);
+    uint64_t offset = be64toh(task_args->body.upload_part.offset);
+    uint64_t length = be64toh(task_args->body.upload_part.length);
+
+    UploadSession *session = upload_session_take(task_args->filename, id, true);
+    uint32_t status = FSS_STATUS_OK;
+    if (session == NULL) {
+        status = FSS_STATUS_NOT_FOUND;
+    } else if (offset > session->total_size || length > session->total_size - offset) {
+        upload_session_part_done(session, 0, 0);
+        status = FSS_STATUS_BAD_RANGE;
+    }
+    if (status != FSS_STATUS_OK) {
+        // Consume the frames the client is already sending so the connection stays in sync
+        if (DiscardUploadFrames(task_args) == 0) {
+            send_response(task_args, status, 0);
+        } else {
+            task_args->keep_alive = false;
+        }
+        finish_client_task(task_args);
+        return NULL;
+    }
+
+    ssize_t received = ReceiveUploadPart(task_args, session->target.fd, offset, length);
+    if (received < 0) {
+        fprintf(stderr, "UploadSessionPart: part of %s broke off\n", task_args->filename);
+        upload_session_part_done(session, 0, 0);
+        task_args->keep_alive = false; // The request stream is out of sync, drop the connection
+    } else if ((uint64_t) received != length) {
+        upload_session_part_done(session, 0, 0);
+        send_response(task_args, FSS_STATUS_BAD_RANGE, 0); // Ended early; the client must send it again
+    } else if (upload_session_part_done(session, offset, offset + length) < 0) {
+        send_response(task_args, FSS_STATUS_IO_ERROR, 0);
+    } else {
+        send_response(task_args, FSS_STATUS_OK, 0);
+    }
+
+    finish_client_task(task_args);
+    return NULL;
+}
+
+// Worker thread function for "upload-commit" and "upload-abort".
+static void* FinishUploadSession(ClientTaskArgs* task_args, bool commit) {
+    uint64_t id = be64toh(task_args->body.upload_session.session_id);
+    UploadSession *session = upload_session_take(task_args->filename, id, false);
+    if (session == NULL) {
+        send_response(task_args, FSS_STATUS_NOT_FOUND, 0);
+        finish_client_task(task_args);
+        return NULL;
+    }
+
+    // Parts that found the session before it left the table finish first
+    pthread_mutex_lock(&session->mutex);
+    while (session->active_parts > 0) pthread_cond_wait(&session->parts_done, &session->mutex);
+    bool complete = upload_session_complete(session);
+    pthread_mutex_unlock(&session->mutex);
+
+    if (!commit) {
+        upload_session_destroy(session, false);
+        send_response(task_args, FSS_STATUS_OK, 0);
+        finish_client_task(task_args);
+        return NULL;
+    }
+    if (!complete) {
+        upload_session_insert(session); // Keeps its id; the client may still send the missing parts
+        send_response(task_args, FSS_STATUS_INCOMPLETE, 0);
+        finish_client_task(task_args);
+        return NULL;
+    }
+
+    uint32_t status = FSS_STATUS_OK;
+    session->target.control = get_or_create_file_control_hashed(task_args->filename, task_args->filename_hash);
+    if (session->target.control == NULL) {
+        fprintf(stderr, "Failed to get file control for %s\n", task_args->filename);
+        upload_session_destroy(session, false);
+        status = FSS_STATUS_IO_ERROR;
+    } else {
+        // Closes the staging file and renames it into place, or removes it
+        FileAccessControl *control = session->target.control;
+        if (upload_finish_target(task_args, &session->target, true) != 0) {
+            fprintf(stderr, "UploadSessionCommit: Upload failed for %s.\n", task_args->filename);
+            status = FSS_STATUS_IO_ERROR;
+        }
+        release_file_control(control);
+        upload_session_destroy(session, true);
+    }
+    send_response(task_args, status, 0);
+    finish_client_task(task_args);
+    return NULL;
+}
+
+void* UploadSessionCommit(void* arg) {
+    return FinishUploadSession((ClientTaskArgs*) arg, true);
+}
+
+void* UploadSessionAbort(void* arg) {
+    return FinishUploadSession((ClientTaskArgs*) arg, false);
+}
+
+void* UploadSessionDedup(void* arg);
+void* UploadSessionDelta(void* arg);
+void* UploadSessionPatch(void* arg);
+
+// Handler for an "upload-*" session command, NULL if there is none.
+static void* (*upload_session_handler(const char* command))(void*) {
+    if (strcmp(command, "upload-open") == 0) return UploadSessionOpen;
+    if (strcmp(command, "upload-part") == 0) return UploadSessionPart;
+    if (strcmp(command, "upload-commit") == 0) return UploadSessionCommit;
+    if (strcmp(command, "upload-abort") == 0) return UploadSessionAbort;
+    if (strcmp(command, "upload-dedup") == 0) return UploadSessionDedup;
+    if (strcmp(command, "upload-delta") == 0) return UploadSessionDelta;
+    if (strcmp(command, "upload-patch") == 0) return UploadSessionPatch;
+    return NULL;
+}
+
+// --- End Upload Sessions ---
+
+// --- Chunk Store ---
+//
+// In chunked storage mode (-m chunked) the server keeps a content-addressed index of
+// what it stores: every published file is cut into content-defined chunks (chunker.h),
+// and each chunk's SHA-256 maps to where those bytes live. Files themselves stay plain
+// files published exactly as in snapshot mode, so every download path works unchanged;
+// the chunk list of each file is also kept in a manifest next to it
+// ("<dir>/.<name>.fss-manifest"), from which the index is rebuilt at startup.
+//
+// "upload-dedup" uses the index: the client sends its chunk list first, the server copies
+// every chunk it already has into a new upload session's staging file (copy_file_range,
+// which shares blocks on file systems with reflinks) and asks only for the rest.
+// Index entries are only ever computed by the server from published bytes, never taken
+// from a client's chunk list. Each use checks that the source file is still the version
+// that was indexed, and hashes the copied bytes again before counting them as uploaded.
+
+#define CHUNK_INDEX_SHARDS 16
+#define CHUNK_INDEX_BUCKETS 65536       // Per shard (power of two)
+#define CHUNK_FILE_BUCKETS 4096         // Power of two
+#define CHUNK_INDEX_COPIES 4            // Files indexed per distinct chunk
+#define CHUNK_MANIFEST_MAGIC "FSSMANI1"
+
+// An indexed version of a published file and its chunk list. Immutable once published;
+// freed when a newer version replaces it and its entries are gone.
+typedef struct IndexedFile {
+    char filename[256];
+    uint64_t filename_hash;
+    uint64_t version;               // file_version() of the indexed bytes
+    uint64_t size;
+    uint32_t chunk_count;
+    FssChunkRef *chunks;            // In file order, lengths in network byte order
+    struct IndexedFile *next;       // Files table chain
+} IndexedFile;
+
+typedef struct ChunkEntry {
+    uint8_t hash[FSS_CHUNK_HASH_SIZE];
+    IndexedFile *file;
+    uint64_t offset;
+    uint32_t length;
+    struct ChunkEntry *next;
+} ChunkEntry;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    ChunkEntry **buckets;
+    size_t entries;
+} ChunkShard;
+
+// Where a chunk can be copied from, copied out of the index under the shard lock
+typedef struct {
+    char filename[256];
+    uint64_t version;
+    uint64_t offset;
+} ChunkLocation;
+
+typedef struct IndexJob {
+    char filename[256];
+    struct IndexJob *next;
+} IndexJob;
+
+typedef struct {
+    ChunkShard shards[CHUNK_INDEX_SHARDS];
+
+    pthread_mutex_t files_lock;     // Guards files[] and serializes index updates
+    IndexedFile *files[CHUNK_FILE_BUCKETS];
+    int file_count;
+
+    pthread_mutex_t queue_lock;     // Files waiting for the indexer thread
+    pthread_cond_t queue_ready;
+    IndexJob *queue_head, *queue_tail;
+
+    atomic_ullong dedup_bytes_offered; // Bytes announced by upload-dedup requests
+    atomic_ullong dedup_bytes_reused;  // ... of which were already stored
+} ChunkStore;
+
+typedef struct {
+    int files;
+    size_t chunks;
+    unsigned long long bytes_offered;
+    unsigned long long bytes_reused;
+} ChunkStoreStats;
+
+ChunkStore *g_chunk_store = NULL;   // NULL unless -m chunked
+
+static inline ChunkShard* chunk_store_shard(const uint8_t* hash) {
+    return &g_chunk_store->shards[hash[0] % CHUNK_INDEX_SHARDS];
+}
+
+// SHA-256 output is uniform, so its bytes index the table directly
+static inline size_t chunk_bucket(const uint8_t* hash) {
+    uint32_t bits;
+    memcpy(&bits, hash + 1, sizeof(bits));
+    return bits & (CHUNK_INDEX_BUCKETS - 1);
+}
+
+static void indexed_file_free(IndexedFile* file) {
+    free(file->chunks);
+    free(file);
+}
+
+// Builds "<dir>/.<name>.fss-manifest" for filename.
+static void chunk_manifest_path(const char* filename, char* out, size_t out_size) {
+    const char *slash = strrchr(filename, '/');
+    int dir_len = slash ? (int)(slash - filename + 1) : 0;
+    snprintf(out, out_size, "%.*s.%s.fss-manifest", dir_len, filename, filename + dir_len);
+}
+
+// Makes file the indexed version of its filename, dropping the entries of the version it
+// replaces. Takes ownership of file.
+static void chunk_store_publish(IndexedFile* file) {
+    pthread_mutex_lock(&g_chunk_store->files_lock);
+
+    IndexedFile **link = &g_chunk_store->files[file->filename_hash & (CHUNK_FILE_BUCKETS - 1)];
+    while (*link != NULL && strcmp((*link)->filename, file->filename) != 0) link = &(*link)->next;
+    IndexedFile *old = *link;
+    if (old != NULL) {
+        *link = old->next;
+    } else {
+        g_chunk_store->file_count++;
+    }
+    file->next = g_chunk_store->files[file->filename_hash & (CHUNK_FILE_BUCKETS - 1)];
+    g_chunk_store->files[file->filename_hash & (CHUNK_FILE_BUCKETS - 1)] = file;
+
+    uint64_t offset = 0;
+    for (uint32_t i = 0; i < file->chunk_count; i++) {
+        const uint8_t *hash = file->chunks[i].hash;
+        uint32_t length = ntohl(file->chunks[i].length);
+        ChunkShard *shard = chunk_store_shard(hash);
+        pthread_mutex_lock(&shard->mutex);
+        ChunkEntry **bucket = &shard->buckets[chunk_bucket(hash)];
+        int copies = 0;
+        for (ChunkEntry *e = *bucket; e != NULL; e = e->next) {
+            if (memcmp(e->hash, hash, FSS_CHUNK_HASH_SIZE) == 0 && (e->file == file || ++copies >= CHUNK_INDEX_COPIES)) {
+                copies = -1;
+                break;
+            }
+        }
+        ChunkEntry *entry = copies >= 0 ? malloc(sizeof(ChunkEntry)) : NULL;
+        if (entry != NULL) {
+            memcpy(entry->hash, hash, FSS_CHUNK_HASH_SIZE);
+            entry->file = file;
+            entry->offset = offset;
+            entry->length = length;
+            entry->next = *bucket;
+            *bucket = entry;
+            shard->entries++;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+        offset += length;
+    }
+
+    if (old != NULL) {
+        for (uint32_t i = 0; i < old->chunk_count; i++) {
+            ChunkShard *shard = chunk_store_shard(old->chunks[i].hash);
+            pthread_mutex_lock(&shard->mutex);
+            ChunkEntry **entry = &shard->buckets[chunk_bucket(old->chunks[i].hash)];
+            while (*entry != NULL) {
+                if ((*entry)->file == old) {
+                    ChunkEntry *dead = *entry;
+                    *entry = dead->next;
+                    free(dead);
+                    shard->entries--;
+                } else {
+                    entry = &(*entry)->next;
+                }
+            }
+            pthread_mutex_unlock(&shard->mutex);
+        }
+        indexed_file_free(old); // Lookups copy what they need under the shard lock
+    }
+    pthread_mutex_unlock(&g_chunk_store->files_lock);
+}
+
+// Returns the version under which filename is indexed, 0 if it is not.
+static uint64_t chunk_store_indexed_version(const char* filename, uint64_t hash) {
+    uint64_t version = 0;
+    pthread_mutex_lock(&g_chunk_store->files_lock);
+    for (IndexedFile *f = g_chunk_store->files[hash & (CHUNK_FILE_BUCKETS - 1)]; f != NULL; f = f->next) {
+        if (strcmp(f->filename, filename) == 0) {
+            version = f->version;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_chunk_store->files_lock);
+    return version;
+}
+
+// Finds a stored copy of the chunk with this hash and length. Returns true with *location set.
+static bool chunk_store_lookup(const uint8_t* hash, uint32_t length, ChunkLocation* location) {
+    ChunkShard *shard = chunk_store_shard(hash);
+    bool found = false;
+    pthread_mutex_lock(&shard->mutex);
+    for (ChunkEntry *e = shard->buckets[chunk_bucket(hash)]; e != NULL; e = e->next) {
+        if (e->length == length && memcmp(e->hash, hash, FSS_CHUNK_HASH_SIZE) == 0) {
+            strcpy(location->filename, e->file->filename);
+            location->version = e->file->version;
+            location->offset = e->offset;
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return found;
+}
+
+// Writes the manifest of an indexed file next to it, replacing the old one atomically.
+static int chunk_manifest_write(const IndexedFile* file) {
+    static atomic_uint counter;
+    char path[320], temp_path[340];
+    chunk_manifest_path(file->filename, path, sizeof(path));
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp.%d.%u", path, (int) getpid(), atomic_fetch_add(&counter, 1));
+
+    FILE *f = fopen(temp_path, "wb");
+    if (f == NULL) {
+        perror("chunk_manifest_write: fopen failed");
+        return -1;
+    }
+    uint64_t header[3] = { htobe64(file->version), htobe64(file->size), htobe64(file->chunk_count) };
+    bool ok = fwrite(CHUNK_MANIFEST_MAGIC, 8, 1, f) == 1 && fwrite(header, sizeof(header), 1, f) == 1 &&
+              fwrite(file->chunks, sizeof(FssChunkRef), file->chunk_count, f) == file->chunk_count;
+    if (fclose(f) != 0) ok = false;
+    if (!ok || rename(temp_path, path) != 0) {
+        perror("chunk_manifest_write: write failed");
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Reads the manifest of filename if it still describes the file's current version.
+static IndexedFile* chunk_manifest_read(const char* filename) {
+    char path[320];
+    chunk_manifest_path(filename, path, sizeof(path));
+    struct stat st;
+    if (stat(filename, &st) != 0) return NULL;
+
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return NULL;
+    IndexedFile *file = calloc(1, sizeof(IndexedFile));
+    char magic[8];
+    uint64_t header[3];
+    if (file == NULL || fread(magic, 8, 1, f) != 1 || memcmp(magic, CHUNK_MANIFEST_MAGIC, 8) != 0 ||
+        fread(header, sizeof(header), 1, f) != 1 || be64toh(header[0]) != file_version(&st) ||
+        be64toh(header[1]) != (uint64_t) st.st_size || be64toh(header[2]) > (uint64_t) st.st_size / FSS_CHUNK_MIN + 1) {
+        goto fail;
+    }
+    file->version = be64toh(header[0]);
+    file->size = be64toh(header[1]);
+    file->chunk_count = be64toh(header[2]);
+    file->chunks = malloc((file->chunk_count ? file->chunk_count : 1) * sizeof(FssChunkRef));
+    if (file->chunks == NULL || fread(file->chunks, sizeof(FssChunkRef), file->chunk_count, f) != file->chunk_count) {
+        goto fail;
+    }
+    fclose(f);
+    strcpy(file->filename, filename);
+    file->filename_hash = filename_hash(filename);
+    return file;
+
+fail:
+    fclose(f);
+    if (file != NULL) free(file->chunks);
+    free(file);
+    return NULL;
+}
+
+typedef struct {
+    IndexedFile *file;
+    uint32_t capacity;
+} ChunkListBuilder;
+
+static int chunk_list_append(void* ctx, size_t len, const uint8_t* hash) {
+    ChunkListBuilder *builder = ctx;
+    IndexedFile *file = builder->file;
+    if (file->chunk_count == builder->capacity) {
+        uint32_t capacity = builder->capacity ? builder->capacity * 2 : 64;
+        FssChunkRef *grown = realloc(file->chunks, capacity * sizeof(FssChunkRef));
+        if (grown == NULL) return -1;
+        file->chunks = grown;
+        builder->capacity = capacity;
+    }
+    memcpy(file->chunks[file->chunk_count].hash, hash, FSS_CHUNK_HASH_SIZE);
+    file->chunks[file->chunk_count].length = htonl(len);
+    file->chunk_count++;
+    return 0;
+}
+
+// Chunks the current version of filename, indexes it and writes its manifest.
+// Does nothing if that version is already indexed. Returns 0 on success.
+static int chunk_store_index_file(const char* filename) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1; // Gone again, nothing to index
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+    uint64_t hash = filename_hash(filename);
+    if (chunk_store_indexed_version(filename, hash) == file_version(&st)) {
+        close(fd);
+        return 0;
+    }
+
+    ChunkListBuilder builder = { calloc(1, sizeof(IndexedFile)), 0 };
+    if (builder.file == NULL) {
+        close(fd);
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    int rc = fss_chunk_file(fd, chunk_list_append, &builder);
+    close(fd);
+    if (rc != 0) {
+        perror("chunk_store_index_file: chunking failed");
+        indexed_file_free(builder.file);
+        return -1;
+    }
+
+    // A newer version published while this one was being chunked is queued behind this
+    // job; the older index must not replace its entry or its manifest
+    struct stat current;
+    if (stat(filename, &current) != 0 || file_version(&current) != file_version(&st)) {
+        indexed_file_free(builder.file);
+        return 0;
+    }
+
+    IndexedFile *file = builder.file;
+    strcpy(file->filename, filename);
+    file->filename_hash = hash;
+    file->version = file_version(&st);
+    file->size = st.st_size;
+    chunk_manifest_write(file);
+    chunk_store_publish(file);
+    log_debug("Chunk store: indexed %s (%u chunks)", filename, file->chunk_count);
+    return 0;
+}
+
+// Queues a newly published file for the indexer thread.
+void chunk_store_schedule(const char* filename) {
+    if (g_chunk_store == NULL) return;
+    IndexJob *job = malloc(sizeof(IndexJob));
+    if (job == NULL) return; // The file just does not take part in dedup
+    strcpy(job->filename, filename);
+    job->next = NULL;
+
+    pthread_mutex_lock(&g_chunk_store->queue_lock);
+    if (g_chunk_store->queue_tail != NULL) {
+        g_chunk_store->queue_tail->next = job;
+    } else {
+        g_chunk_store->queue_head = job;
+    }
+    g_chunk_store->queue_tail = job;
+    pthread_cond_signal(&g_chunk_store->queue_ready);
+    pthread_mutex_unlock(&g_chunk_store->queue_lock);
+}
+
+// Indexes published files off the request path, so commits do not wait for hashing.
+void* ChunkIndexerThread(void* arg) {
+    (void) arg;
+    while (1) {
+        pthread_mutex_lock(&g_chunk_store->queue_lock);
+        while (g_chunk_store->queue_head == NULL) {
+            pthread_cond_wait(&g_chunk_store->queue_ready, &g_chunk_store->queue_lock);
+        }
+        IndexJob *job = g_chunk_store->queue_head;
+        g_chunk_store->queue_head = job->next;
+        if (g_chunk_store->queue_head == NULL) g_chunk_store->queue_tail = NULL;
+        pthread_mutex_unlock(&g_chunk_store->queue_lock);
+
+        chunk_store_index_file(job->filename); // Skips versions that are already indexed
+        free(job);
+    }
+    return NULL;
+}
+
+static int chunk_manifest_load(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void) st;
+    const char *name = path + ftw->base;
+    size_t name_len = strlen(name);
+    size_t suffix_len = strlen(".fss-manifest");
+    if (type != FTW_F || name[0] != '.' || name_len <= suffix_len + 1 ||
+        strcmp(name + name_len - suffix_len, ".fss-manifest") != 0) {
+        return 0;
+    }
+
+    // "./dir/.name.fss-manifest" describes "dir/name", as clients name it
+    char filename[256];
+    const char *dir = strncmp(path, "./", 2) == 0 ? path + 2 : path;
+    int dir_len = (int)(name - dir);
+    int written = snprintf(filename, sizeof(filename), "%.*s%.*s", dir_len, dir,
+                           (int)(name_len - suffix_len - 1), name + 1);
+    if (written < 0 || written >= (int) sizeof(filename)) return 0;
+
+    IndexedFile *file = chunk_manifest_read(filename);
+    if (file == NULL) {
+        log_info("Chunk store: dropping stale manifest %s", path);
+        unlink(path);
+        return 0;
+    }
+    chunk_store_publish(file);
+    return 0;
+}
+
+// Creates the chunk store, loads the manifests under the working directory and starts the
+// indexer thread. Returns 0 on success, -1 on failure.
+int chunk_store_init(void) {
+    fss_chunker_init();
+    ChunkStore *store = calloc(1, sizeof(ChunkStore));
+    if (store == NULL) {
+        perror("Failed to allocate chunk store");
+        return -1;
+    }
+    for (int i = 0; i < CHUNK_INDEX_SHARDS; i++) {
+        pthread_mutex_init(&store->shards[i].mutex, NULL);
+        store->shards[i].buckets = calloc(CHUNK_INDEX_BUCKETS, sizeof(ChunkEntry*));
+        if (store->shards[i].buckets == NULL) {
+            perror("Failed to allocate chunk store");
+            return -1;
+        }
+    }
+    pthread_mutex_init(&store->files_lock, NULL);
+    pthread_mutex_init(&store->queue_lock, NULL);
+    pthread_cond_init(&store->queue_ready, NULL);
+    g_chunk_store = store;
+
+    if (nftw(".", chunk_manifest_load, 16, FTW_PHYS) != 0) {
+        perror("Chunk store: scanning for manifests failed");
+    }
+    log_info("Chunk store: %d files indexed", g_chunk_store->file_count);
+
+    pthread_t indexer;
+    if (pthread_create(&indexer, NULL, ChunkIndexerThread, NULL) != 0) {
+        perror("pthread_create for chunk indexer failed");
+        return -1;
+    }
+    pthread_detach(indexer);
+    return 0;
+}
+
+void chunk_store_get_stats(ChunkStoreStats* stats) {
+    pthread_mutex_lock(&g_chunk_store->files_lock);
+    stats->files = g_chunk_store->file_count;
+    pthread_mutex_unlock(&g_chunk_store->files_lock);
+    stats->chunks = 0;
+    for (int i = 0; i < CHUNK_INDEX_SHARDS; i++) {
+        pthread_mutex_lock(&g_chunk_store->shards[i].mutex);
+        stats->chunks += g_chunk_store->shards[i].entries;
+        pthread_mutex_unlock(&g_chunk_store->shards[i].mutex);
+    }
+    stats->bytes_offered = atomic_load(&g_chunk_store->dedup_bytes_offered);
+    stats->bytes_reused = atomic_load(&g_chunk_store->dedup_bytes_reused);
+}
+
+// Sends the byte ranges a dedup upload still needs as frames of FssByteRange.
+static int SendMissingRanges(ClientTaskArgs* task_args, const FssByteRange* ranges, size_t count) {
+    size_t per_frame = task_args->frame_size / sizeof(FssByteRange);
+    for (size_t i = 0; i < count; i += per_frame) {
+        size_t n = count - i < per_frame ? count - i : per_frame;
+        if (fss_send_frame(task_args->client_socket, &ranges[i], n * sizeof(FssByteRange)) < 0) return -1;
+    }
+    return fss_send_frame(task_args->client_socket, NULL, 0);
+}
+
+// Worker thread function for "upload-dedup": opens an upload session, fills in the chunks
+// the store already has and tells the client which bytes are still missing.
+void* UploadSessionDedup(void* arg) {
+    ClientTaskArgs* task_args = (ClientTaskArgs*) arg;
+    uint64_t total_size = be64toh(task_args->body.upload_open.total_size);
+    FssByteRange *missing = NULL;
+    size_t missing_count = 0, missing_capacity = 0;
+    int source_fd = -1;
+    char source_name[256] = "";
+    uint64_t source_version = 0;
+    uint64_t reused = 0;
+
+    FssChunkRef *chunks = NULL;
+    ssize_t chunk_count;
+    if (g_chunk_store == NULL) {
+        // Not granted FSS_FLAG_DEDUP; drop the list so the connection stays in sync
+        chunk_count = DiscardUploadFrames(task_args) == 0 ? -2 : -1;
+    } else {
+        size_t max_bytes = (total_size / FSS_CHUNK_MIN + 1) * sizeof(FssChunkRef);
+        chunk_count = ReceiveFrameList(task_args, sizeof(FssChunkRef), max_bytes, (void**) &chunks);
+    }
+    if (chunk_count < 0) {
+        if (chunk_count == -2) {
+            send_response(task_args, FSS_STATUS_BAD_REQUEST, 0);
+        } else {
+            task_args->keep_alive = false;
+        }
+        finish_client_task(task_args);
+        return NULL;
+    }
+
+    uint64_t listed = 0;
+    for (ssize_t i = 0; i < chunk_count; i++) listed += ntohl(chunks[i].length);
+    UploadSession *session = NULL;
+    uint32_t status = listed == total_size ? upload_session_create(task_args, total_size, &session)
+                                           : FSS_STATUS_BAD_REQUEST;
+    if (status != FSS_STATUS_OK) {
+        free(chunks);
+        send_response(task_args, status, 0);
+        finish_client_task(task_args);
+        return NULL;
+    }
+
+    // A re-upload mostly matches the version it replaces. If that one is not indexed (it
+    // predates the store), have the indexer pick it up for the next upload
+    if (chunk_store_indexed_version(task_args->filename, task_args->filename_hash) == 0) {
+        chunk_store_schedule(task_args->filename);
+    }
+
+    // Copied chunks are hashed again in the staging file before they count: the index
+    // only says where the bytes were, and whatever is there now has to match the client's hash
+    uint8_t *check = malloc(FSS_CHUNK_MAX);
+    if (check == NULL) {
+        perror("UploadSessionDedup: malloc failed");
+        status = FSS_STATUS_IO_ERROR;
+        chunk_count = 0;
+    }
+
+    uint64_t offset = 0;
+    for (ssize_t i = 0; i < chunk_count; i++) {
+        uint32_t length = ntohl(chunks[i].length);
+        ChunkLocation location;
+        bool copied = false;
+        if (length <= FSS_CHUNK_MAX && chunk_store_lookup(chunks[i].hash, length, &location)) {
+            if (source_fd < 0 || strcmp(source_name, location.filename) != 0) {
+                if (source_fd >= 0) close(source_fd);
+                strcpy(source_name, location.filename);
+                source_fd = open(source_name, O_RDONLY | O_CLOEXEC);
+                struct stat st;
+                source_version = source_fd >= 0 && fstat(source_fd, &st) == 0 ? file_version(&st) : 0;
+            }
+            // The open fd pins the version it was checked against, even if a commit replaces it
+            copied = source_fd >= 0 && source_version == location.version &&
+                     fss_copy_file_bytes(source_fd, location.offset, session->target.fd, offset, length) == 0;
+            if (copied) {
+                uint8_t hash[FSS_CHUNK_HASH_SIZE];
+                copied = pread(session->target.fd, check, length, offset) == (ssize_t) length;
+                if (copied) fss_chunk_hash(check, length, hash);
+                if (copied && memcmp(hash, chunks[i].hash, FSS_CHUNK_HASH_SIZE) != 0) {
+                    log_warn("UploadSessionDedup: %s changed since it was indexed, not reusing its chunk", source_name);
+                    copied = false;
+                }
+            }
+        }
+        if (copied) {
+            upload_session_mark(session, offset, offset + length); // Not visible to other threads yet
+            reused += length;
+        } else if (missing_count > 0 && be64toh(missing[missing_count - 1].offset) +
+                                        be64toh(missing[missing_count - 1].length) == offset) {
+            missing[missing_count - 1].length = htobe64(be64toh(missing[missing_count - 1].length) + length);
+        } else {
+            if (missing_count == missing_capacity) {
+                missing_capacity = missing_capacity ? missing_capacity * 2 : 64;
+                FssByteRange *grown = realloc(missing, missing_capacity * sizeof(FssByteRange));
+                if (grown == NULL) {
+                    status = FSS_STATUS_IO_ERROR;
+                    break;
+                }
+                missing = grown;
+            }
+            missing[missing_count].offset = htobe64(offset);
+            missing[missing_count].length = htobe64(length);
+            missing_count++;
+        }
+        offset += length;
+    }
+    if (source_fd >= 0) close(source_fd);
+    free(check);
+    free(chunks);
+
+    if (status == FSS_STATUS_OK && upload_session_insert(session) != 0) status = FSS_STATUS_BUSY;
+    if (status != FSS_STATUS_OK) {
+        upload_session_destroy(session, false);
+        free(missing);
+        send_response(task_args, status, 0);
+        finish_client_task(task_args);
+        return NULL;
+    }
+
+    atomic_fetch_add(&g_chunk_store->dedup_bytes_offered, total_size);
+    atomic_fetch_add(&g_chunk_store->dedup_bytes_reused, reused);
+    log_debug("UploadSessionDedup: session %llu for %s, %llu of %llu bytes already stored",
+              (unsigned long long) session->id, task_args->filename, (unsigned long long) reused,
+              (unsigned long long) total_size);
+    if (upload_session_reply(task_args, session, true) == 0 &&
+        SendMissingRanges(task_args, missing, missing_count) < 0) {
+        perror("UploadSessionDedup: send missing ranges failed");
+        task_args->keep_alive = false;
+    }
+    free(missing);
+    finish_client_task(task_args);
+    return NULL;
+}
+
+// --- End Chunk Store ---
+
+// --- Delta Transfers ---
+//
+// rsync-style updates of a file one side already has an older copy of (see delta.h).
+// "download-delta" receives the block signatures of the client's copy and streams back
+// a delta of the current version. "upload-delta" opens an upload session and sends the
+// signatures of the server's copy, keeping that copy open as the session's base;
+// "upload-patch" then rebuilds the new version in the staging file from the base and
+// the client's delta, and upload-commit publishes it as usual.
+
+// Sends the FssDeltaSignature of the first size bytes of fd and its FssBlockSig list as
+// frames. Returns 0 on success, -1 if reading the file or the connection failed.
+static int SendDeltaSignature(ClientTaskArgs* task_args, int fd, uint64_t size, uint32_t block_size) {
+    uint64_t count = fss_delta_block_count(size, block_size);
+    FssBlockSig *sigs = malloc((count ? count : 1) * sizeof(FssBlockSig));
+    if (sigs == NULL || fss_delta_signature(fd, size, block_size, sigs) != 0) {
+        perror("SendDeltaSignature: computing the signature failed");
+        free(sigs);
+        return -1;
+    }
+
+    FssDeltaSignature header;
+    header.file_size = htobe64(size);
+    header.block_size = htonl(block_size);
+    header.reserved = 0;
+    FssFrameWriter writer = { task_args->client_socket, malloc(task_args->frame_size), task_args->frame_size, 0 };
+    int rc = writer.buff != NULL &&
+             send_all(task_args->client_socket, &header, sizeof(header), MSG_MORE) == 0 &&
+             fss_frame_put(&writer, sigs, count * sizeof(FssBlockSig)) == 0 &&
+             fss_frame_finish(&writer) == 0 ? 0 : -1;
+    free(writer.buff);
+    free(sigs);
+    return rc;
+}
+
+// Worker thread function for "download-delta".
+void* DownloadDelta(void* arg) {
+    ClientTaskArgs* task_args = (ClientTaskArgs*) arg;
+    uint64_t base_size = be64toh(task_args->body.delta_signature.file_size);
+    uint32_t block_size = ntohl(task_args->body.delta_signature.block_size);
+    uint64_t count = block_size >= FSS_DELTA_MIN_BLOCK && block_size <= FSS_DELTA_MAX_BLOCK ?
+                     fss_delta_block_count(base_size, block_size) : UINT64_MAX;
+
+    FssBlockSig *sigs = NULL;
+    ssize_t received;
+    if (count > FSS_DELTA_MAX_BLOCKS) {
+        received = DiscardUploadFrames(task_args) == 0 ? -2 : -1;
+    } else {
+        received = ReceiveFrameList(task_args, sizeof(FssBlockSig), count * sizeof(FssBlockSig), (void**) &sigs);
+        if (received >= 0 && (uint64_t) received != count) received = -2;
+    }
+    if (received < 0) {
+        if (received == -2) {
+            send_response(task_args, FSS_STATUS_BAD_REQUEST, 0);
+        } else {
+            task_args->keep_alive = false;
+        }
+        free(sigs);
+        finish_client_task(task_args);
+        return NULL;
+    }
+
+    // Same locking as DownLoadingFile: none in snapshot mode, the read lock in place
+    FileAccessControl* control = NULL;
+    if (g_config.storage_mode == STORAGE_MODE_INPLACE) {
+        control = get_or_create_file_control_hashed(task_args->filename, task_args->filename_hash);
+        if (control == NULL) {
+            fprintf(stderr, "Failed to get file control for %s\n", task_args->filename);
+            send_response(task_args, FSS_STATUS_IO_ERROR, 0);
+            free(sigs);
+            finish_client_task(task_args);
+            return NULL;
+        }
+        acquire_read_lock(control);
+    }
+
+    FssDeltaIndex index;
+    struct stat st;
+    off_t offset, length;
+    int file_fd = open(task_args->filename, O_RDONLY);
+    if (file_fd < 0) {
+        uint32_t status = errno == ENOENT ? FSS_STATUS_NOT_FOUND : FSS_STATUS_IO_ERROR;
+        perror("open failed in DownloadDelta");
+        send_response(task_args, status, 0);
+    } else if (fstat(file_fd, &st) < 0 || fss_delta_index_init(&index, sigs, count, block_size, base_size) != 0) {
+        perror("DownloadDelta: fstat or index failed");
+        send_response(task_args, FSS_STATUS_IO_ERROR, 0);
+    } else {
+        if (send_download_header(task_args, st.st_size, file_version(&st), &offset, &length) == 0) {
+            FssFrameWriter writer = { task_args->client_socket, malloc(task_args->frame_size), task_args->frame_size, 0 };
+            if (writer.buff == NULL || fss_delta_generate(file_fd, &index, fss_delta_send_op, &writer) != 0 ||
+                fss_frame_finish(&writer) != 0) {
+                perror("DownloadDelta: sending the delta failed");
+                task_args->keep_alive = false; // Client holds a truncated stream
+            }
+            free(writer.buff);
+        }
+        fss_delta_index_free(&index);
+    }
+
+    free(sigs);
+    download_release(task_args, control, file_fd);
+    return NULL;
+}
+
+// Worker thread function for "upload-delta": opens an upload session whose base is the
+// current version of the file and sends the client that version's signature.
+void* UploadSessionDelta(void* arg) {
+    ClientTaskArgs* task_args = (ClientTaskArgs*) arg;
+    uint64_t total_size = be64toh(task_args->body.upload_open.total_size);
+    uint32_t block_size = FSS_DELTA_MIN_BLOCK;
+
+    UploadSession *session;
+    uint32_t status = upload_session_create(task_args, total_size, &session);
+    if (status == FSS_STATUS_OK) {
+        // Without a usable old copy the signature is empty and the client sends everything
+        session->base_fd = open(task_args->filename, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (session->base_fd >= 0 && fstat(session->base_fd, &st) == 0 &&
+            (block_size = fss_delta_block_size(st.st_size)) != 0) {
+            session->base_size = st.st_size;
+            session->base_version = file_version(&st);
+        } else {
+            if (session->base_fd >= 0) close(session->base_fd);
+            session->base_fd = -1;
+            block_size = FSS_DELTA_MIN_BLOCK;
+        }
+        if (upload_session_insert(session) != 0) {
+            upload_session_destroy(session, false);
+            status = FSS_STATUS_BUSY;
+        }
+    }
+    if (status != FSS_STATUS_OK) {
+        send_response(task_args, status, 0);
+        finish_client_task(task_args);
+        return NULL;
+    }
+
+    log_debug("UploadSessionDelta: session %llu for %s, %llu bytes over a base of %llu",
+              (unsigned long long) session->id, task_args->filename, (unsigned long long) total_size,
+              (unsigned long long) session->base_size);
+    // The session is in the table but its id not yet known to anyone, so it is ours alone
+    if (upload_session_reply(task_args, session, true) == 0 &&
+        SendDeltaSignature(task_args, session->base_fd, session->base_size, block_size) < 0) {
+        task_args->keep_alive = false; // Signature cut short
+    }
+    finish_client_task(task_args);
+    return NULL;
+}
+
+// Worker thread function for "upload-patch": rebuilds the whole file in the staging file
+// from the session's base and the client's delta.
+void* UploadSessionPatch(void* arg) {
+    ClientTaskArgs* task_args = (ClientTaskArgs*) arg;
+    uint64_t id = be64toh(task_args->body.upload_session.session_id);
+
+    UploadSession *session = upload_session_take(task_args->filename, id, true);
+    uint32_t status = session == NULL ? FSS_STATUS_NOT_FOUND : FSS_STATUS_OK;
+
+    // An in-place upload rewrites the base itself: hold it still, and refuse the patch if
+    // it already changed since the signature
+    FileAccessControl *control = NULL;
+    if (status == FSS_STATUS_OK && session->base_fd >= 0 && g_config.storage_mode == STORAGE_MODE_INPLACE) {
+        control = get_or_create_file_control_hashed(task_args->filename, task_args->filename_hash);
+        struct stat st;
+        if (control == NULL) {
+            status = FSS_STATUS_IO_ERROR;
+        } else {
+            acquire_read_lock(control);
+            if (fstat(session->base_fd, &st) < 0 || file_version(&st) != session->base_version) {
+                status = FSS_STATUS_INCOMPLETE;
+            }
+        }
+    }
+    if (status != FSS_STATUS_OK) {
+        if (session != NULL) upload_session_part_done(session, 0, 0);
+        if (control != NULL) {
+            release_read_lock(control);
+            release_file_control(control);
+        }
+        // Consume the delta the client is already sending so the connection stays in sync
+        if (DiscardUploadFrames(task_args) == 0) {
+            send_response(task_args, status, 0);
+        } else {
+            task_args->keep_alive = false;
+        }
+        finish_client_task(task_args);
+        return NULL;
+    }
+
+    uint64_t literal_bytes;
+    int64_t written = fss_delta_receive(task_args->client_socket, task_args->frame_size, session->base_fd,
+                                        session->base_size, session->target.fd, session->total_size, &literal_bytes);
+    if (control != NULL) {
+        release_read_lock(control);
+        release_file_control(control);
+    }
+
+    if (written == FSS_DELTA_BROKEN) {
+        fprintf(stderr, "UploadSessionPatch: delta for %s broke off\n", task_args->filename);
+        upload_session_part_done(session, 0, 0);
+        task_args->keep_alive = false; // The request stream is out of sync, drop the connection
+    } else if (written == FSS_DELTA_IO_ERROR) {
+        upload_session_part_done(session, 0, 0);
+        send_response(task_args, FSS_STATUS_IO_ERROR, 0);
+    } else if (written < 0 || (uint64_t) written != session->total_size) {
+        upload_session_part_done(session, 0, 0);
+        send_response(task_args, FSS_STATUS_BAD_REQUEST, 0);
+    } else if (upload_session_part_done(session, 0, written) < 0) {
+        send_response(task_args, FSS_STATUS_IO_ERROR, 0);
+    } else {
+        log_debug("UploadSessionPatch: session %llu for %s, %llu of %llu bytes sent",
+                  (unsigned long long) id, task_args->filename, (unsigned long long) literal_bytes,
+                  (unsigned long long) written);
+        send_response(task_args, FSS_STATUS_OK, 0);
+    }
+
+    finish_client_task(task_args);
+    return NULL;
+}
+
+// --- End Delta Transfers ---
+
+// --- Metadata Index ---
+//
+// "list" and "stat" are answered from memory. At startup META_SCAN_THREADS threads walk
+// the working directory in parallel and record each regular file's size, mtime, version
+// and stored digest in a skip list ordered by name, so a listing is a seek to its prefix
+// followed by a walk along the bottom level. Dot files (the server's own digests,
+// manifests and temp files) and everything under dot directories are left out.
+//
+// Upload commits refresh their file directly, so a client finds its upload listed as
+// soon as it is acknowledged, and an inotify watch on every directory picks up changes
+// made by anyone else. If the kernel's event queue overflows, the tree is scanned again
+// and entries that scan did not see are dropped.
+
+#define META_SCAN_THREADS 8
+#define META_SCAN_BATCH 256             // Files a scan thread collects before taking the write lock
+#define META_MAX_HEIGHT 16              // Skip list levels; one entry in four moves up a level
+#define META_WATCH_MASK (IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+typedef struct MetaEntry {
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint64_t version;                   // file_version() of what was indexed
+    uint32_t crc;                       // Stored digest of that version, if has_crc
+    bool has_crc;
+    uint8_t height;
+    unsigned scan;                      // Last full scan that saw the file, or the current one
+    char *name;                         // Stored right after next[]
+    struct MetaEntry *next[];           // height links
+} MetaEntry;
+
+typedef struct {
+    pthread_rwlock_t lock;              // Readers list and stat; updates take it exclusively
+    MetaEntry *head;                    // Sentinel with META_MAX_HEIGHT links
+    size_t count;
+    uint64_t random;                    // Height generator state, under lock
+    unsigned scan;                      // Number of the current (or last) full scan
+
+    int inotify_fd;                     // -1 without inotify
+    pthread_mutex_t watch_lock;
+    char **watch_dirs;                  // Directory ("" or "dir/") of each watch descriptor
+    int watch_cap;
+} MetaIndex;
+
+MetaIndex *g_meta_index = NULL;
+
+// Directories waiting for a scan thread
+typedef struct MetaScanDir {
+    char path[256];                     // "" or "dir/"
+    struct MetaScanDir *next;
+} MetaScanDir;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    MetaScanDir *dirs;
+    int busy;                           // Threads reading a directory, which may queue more
+} MetaScan;
+
+typedef struct {
+    char name[256];
+    struct stat st;
+    bool has_crc;
+    uint32_t crc;
+} MetaScanFile;
+
+// Whether a client-visible name: relative, no empty components, none starting with '.'.
+static bool meta_index_visible(const char* name) {
+    if (name[0] == '\0' || strlen(name) >= 256) return false;
+    for (const char *part = name; ; ) {
+        if (*part == '\0' || *part == '/' || *part == '.') return false;
+        const char *slash = strchr(part, '/');
+        if (slash == NULL) return true;
+        part = slash + 1;
+    }
+}
+
+// First entry whose name is not below key. With update set, also the last entry below
+// key on every level. Needs the lock.
+static MetaEntry* meta_index_seek(const char* key, MetaEntry** update) {
+    MetaEntry *node = g_meta_index->head;
+    for (int level = META_MAX_HEIGHT - 1; level >= 0; level--) {
+        while (node->next[level] != NULL && strcmp(node->next[level]->name, key) < 0) node = node->next[level];
+        if (update != NULL) update[level] = node;
+    }
+    return node->next[0];
+}
+
+// Looks up name. Needs the lock.
+static MetaEntry* meta_index_find(const char* name) {
+    MetaEntry *entry = meta_index_seek(name, NULL);
+    return entry != NULL && strcmp(entry->name, name) == 0 ? entry : NULL;
+}
+
+static int meta_index_height(void) {
+    uint64_t x = g_meta_index->random; // xorshift64
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    g_meta_index->random = x;
+    int height = 1;
+    while (height < META_MAX_HEIGHT && (x & 3) == 0) {
+        height++;
+        x >>= 2;
+    }
+    return height;
+}
+
+// Adds or updates the entry for name. Needs the write lock.
+static void meta_index_put(const char* name, const struct stat* st, bool has_crc, uint32_t crc) {
+    MetaEntry *update[META_MAX_HEIGHT];
+    MetaEntry *entry = meta_index_seek(name, update);
+    if (entry == NULL || strcmp(entry->name, name) != 0) {
+        int height = meta_index_height();
+        size_t name_len = strlen(name);
+        entry = malloc(sizeof(MetaEntry) + height * sizeof(MetaEntry*) + name_len + 1);
+        if (entry == NULL) return; // The file just stays unlisted
+        entry->height = height;
+        entry->name = (char*) &entry->next[height];
+        memcpy(entry->name, name, name_len + 1);
+        for (int level = 0; level < height; level++) {
+            entry->next[level] = update[level]->next[level];
+            update[level]->next[level] = entry;
+        }
+        g_meta_index->count++;
+    }
+    entry->size = st->st_size;
+    entry->mtime_ns = (uint64_t) st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+    entry->version = file_version(st);
+    entry->has_crc = has_crc;
+    entry->crc = crc;
+    entry->scan = g_meta_index->scan;
+}
+
+// Removes name, or with prefix set every name that starts with it. Needs the write lock.
+static void meta_index_remove(const char* name, bool prefix) {
+    MetaEntry *update[META_MAX_HEIGHT];
+    MetaEntry *entry = meta_index_seek(name, update);
+    size_t len = strlen(name);
+    while (entry != NULL && (prefix ? strncmp(entry->name, name, len) == 0 : strcmp(entry->name, name) == 0)) {
+        MetaEntry *next = entry->next[0];
+        for (int level = 0; level < entry->height; level++) update[level]->next[level] = entry->next[level];
+        free(entry);
+        g_meta_index->count--;
+        if (!prefix) break;
+        entry = next;
+    }
+}
+
+// Drops the entries the last full scan did not see. Needs the write lock.
+static void meta_index_sweep(void) {
+    MetaEntry *update[META_MAX_HEIGHT];
+    for (int level = 0; level < META_MAX_HEIGHT; level++) update[level] = g_meta_index->head;
+    for (MetaEntry *entry = g_meta_index->head->next[0], *next; entry != NULL; entry = next) {
+        next = entry->next[0];
+        if (entry->scan == g_meta_index->scan) {
+            for (int level = 0; level < entry->height; level++) update[level] = entry;
+            continue;
+        }
+        for (int level = 0; level < entry->height; level++) update[level]->next[level] = entry->next[level];
+        free(entry);
+        g_meta_index->count--;
+    }
+}
+
+static void meta_entry_info(const MetaEntry* entry, FssFileInfo* info) {
+    info->size = htobe64(entry->size);
+    info->mtime_ns = htobe64(entry->mtime_ns);
+    info->version = htobe64(entry->version);
+    info->crc = htonl(entry->has_crc ? entry->crc : 0);
+    info->flags = htons(entry->has_crc ? FSS_INFO_HAS_CRC : 0);
+    info->name_len = htons((uint16_t) strlen(entry->name));
+}
+
+// Brings the entry for filename in line with the file on disk: adds, updates or removes it.
+void meta_index_refresh(const char* filename) {
+    if (g_meta_index == NULL || !meta_index_visible(filename)) return;
+    struct stat st;
+    bool exists = lstat(filename, &st) == 0 && S_ISREG(st.st_mode);
+    uint32_t crc = 0;
+    bool has_crc = exists && file_digest_load(filename, file_version(&st), st.st_size, &crc, NULL);
+
+    pthread_rwlock_wrlock(&g_meta_index->lock);
+    if (exists) {
+        meta_index_put(filename, &st, has_crc, crc);
+    } else {
+        meta_index_remove(filename, false);
+    }
+    pthread_rwlock_unlock(&g_meta_index->lock);
+}
+
+// Records a digest just stored for the given version of filename, if that is the version indexed.
+void meta_index_note_digest(const char* filename, uint64_t version, uint64_t size, uint32_t crc) {
+    if (g_meta_index == NULL) return;
+    pthread_rwlock_wrlock(&g_meta_index->lock);
+    MetaEntry *entry = meta_index_find(filename);
+    if (entry != NULL && entry->version == version && entry->size == size) {
+        entry->has_crc = true;
+        entry->crc = crc;
+    }
+    pthread_rwlock_unlock(&g_meta_index->lock);
+}
+
+// Watches directory dir ("" or "dir/") for changes.
+static void meta_index_watch(const char* dir) {
+    static atomic_bool warned;
+    if (g_meta_index->inotify_fd < 0) return;
+    int wd = inotify_add_watch(g_meta_index->inotify_fd, dir[0] ? dir : ".", META_WATCH_MASK | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd < 0) {
+        if (!atomic_exchange(&warned, true)) {
+            log_warn("Metadata index: cannot watch %s (%s); changes other programs make there are not seen",
+                     dir[0] ? dir : ".", strerror(errno));
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&g_meta_index->watch_lock);
+    if (wd >= g_meta_index->watch_cap) {
+        int cap = g_meta_index->watch_cap ? g_meta_index->watch_cap : 64;
+        while (cap <= wd) cap *= 2;
+        char **grown = realloc(g_meta_index->watch_dirs, cap * sizeof(char*));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&g_meta_index->watch_lock);
+            inotify_rm_watch(g_meta_index->inotify_fd, wd);
+            return;
+        }
+        memset(grown + g_meta_index->watch_cap, 0, (cap - g_meta_index->watch_cap) * sizeof(char*));
+        g_meta_index->watch_dirs = grown;
+        g_meta_index->watch_cap = cap;
+    }
+    free(g_meta_index->watch_dirs[wd]);
+    g_meta_index->watch_dirs[wd] = strdup(dir);
+    pthread_mutex_unlock(&g_meta_index->watch_lock);
+}
+
+// Stops watching the directories under prefix ("dir/"), which moved away or are gone.
+static void meta_index_unwatch(const char* prefix) {
+    size_t len = strlen(prefix);
+    pthread_mutex_lock(&g_meta_index->watch_lock);
+    for (int wd = 0; wd < g_meta_index->watch_cap; wd++) {
+        char *dir = g_meta_index->watch_dirs[wd];
+        if (dir != NULL && strncmp(dir, prefix, len) == 0) {
+            inotify_rm_watch(g_meta_index->inotify_fd, wd);
+            free(dir);
+            g_meta_index->watch_dirs[wd] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&g_meta_index->watch_lock);
+}
+
+static void meta_scan_push(MetaScan* scan, const char* path) {
+    MetaScanDir *dir = malloc(sizeof(MetaScanDir));
+    if (dir == NULL) return; // The directory just stays unlisted
+    strcpy(dir->path, path);
+    pthread_mutex_lock(&scan->mutex);
+    dir->next = scan->dirs;
+    scan->dirs = dir;
+    pthread_cond_signal(&scan->changed);
+    pthread_mutex_unlock(&scan->mutex);
+}
+
+static void meta_scan_flush(MetaScanFile* files, int count) {
+    pthread_rwlock_wrlock(&g_meta_index->lock);
+    for (int i = 0; i < count; i++) meta_index_put(files[i].name, &files[i].st, files[i].has_crc, files[i].crc);
+    pthread_rwlock_unlock(&g_meta_index->lock);
+}
+
+// Indexes the files of one directory and queues its subdirectories.
+static void meta_scan_dir(MetaScan* scan, const char* path, MetaScanFile* files) {
+    meta_index_watch(path); // First, so nothing created while reading is missed
+    DIR *dir = opendir(path[0] ? path : ".");
+    if (dir == NULL) {
+        log_warn("Metadata index: cannot read %s: %s", path[0] ? path : ".", strerror(errno));
+        return;
+    }
+
+    int count = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        MetaScanFile *file = &files[count];
+        int written = snprintf(file->name, sizeof(file->name), "%s%s", path, de->d_name);
+        if (written < 0 || written >= (int) sizeof(file->name) - 1) continue; // Too long to request anyway
+        if (fstatat(dirfd(dir), de->d_name, &file->st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+        if (S_ISDIR(file->st.st_mode)) {
+            strcat(file->name, "/");
+            meta_scan_push(scan, file->name);
+        } else if (S_ISREG(file->st.st_mode)) {
+            file->has_crc = file_digest_load(file->name, file_version(&file->st), file->st.st_size, &file->crc, NULL);
+            if (++count == META_SCAN_BATCH) {
+                meta_scan_flush(files, count);
+                count = 0;
+            }
+        }
+    }
+    closedir(dir);
+    meta_scan_flush(files, count);
+}
+
+static void* MetaScanThread(void* arg) {
+    MetaScan *scan = (MetaScan*) arg;
+    MetaScanFile *files = malloc(META_SCAN_BATCH * sizeof(MetaScanFile));
+    if (files == NULL) return NULL; // The other threads do the work
+
+    pthread_mutex_lock(&scan->mutex);
+    while (true) {
+        // Done once nothing is queued and no thread is still reading a directory
+        while (scan->dirs == NULL && scan->busy > 0) pthread_cond_wait(&scan->changed, &scan->mutex);
+        if (scan->dirs == NULL) break;
+        MetaScanDir *dir = scan->dirs;
+        scan->dirs = dir->next;
+        scan->busy++;
+        pthread_mutex_unlock(&scan->mutex);
+
+        meta_scan_dir(scan, dir->path, files);
+        free(dir);
+
+        pthread_mutex_lock(&scan->mutex);
+        if (--scan->busy == 0 && scan->dirs == NULL) pthread_cond_broadcast(&scan->changed);
+    }
+    pthread_mutex_unlock(&scan->mutex);
+    free(files);
+    return NULL;
+}
+
+// Indexes every file under root ("" or "dir/") with the given number of threads.
+static void meta_scan(const char* root, int threads) {
+    MetaScan scan;
+    memset(&scan, 0, sizeof(scan));
+    pthread_mutex_init(&scan.mutex, NULL);
+    pthread_cond_init(&scan.changed, NULL);
+    meta_scan_push(&scan, root);
+
+    pthread_t helpers[META_SCAN_THREADS];
+    int started = 0;
+    while (started < threads - 1 && started < META_SCAN_THREADS &&
+           pthread_create(&helpers[started], NULL, MetaScanThread, &scan) == 0) {
+        started++;
+    }
+    MetaScanThread(&scan);
+    for (int i = 0; i < started; i++) pthread_join(helpers[i], NULL);
+
+    pthread_mutex_destroy(&scan.mutex);
+    pthread_cond_destroy(&scan.changed);
+}
+
+// Scans the whole tree and drops what it did not find.
+static void meta_index_rescan(void) {
+    pthread_rwlock_wrlock(&g_meta_index->lock);
+    g_meta_index->scan++;
+    pthread_rwlock_unlock(&g_meta_index->lock);
+
+    meta_scan("", META_SCAN_THREADS);
+
+    pthread_rwlock_wrlock(&g_meta_index->lock);
+    meta_index_sweep();
+    pthread_rwlock_unlock(&g_meta_index->lock);
+}
+
+static void meta_watch_event(const struct inotify_event* event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        log_warn("Metadata index: change notifications were lost, scanning again");
+        meta_index_rescan();
+        return;
+    }
+
+    char name[256];
+    bool known = false;
+    pthread_mutex_lock(&g_meta_index->watch_lock);
+    if (event->wd >= 0 && event->wd < g_meta_index->watch_cap && g_meta_index->watch_dirs[event->wd] != NULL) {
+        known = true;
+        int written = snprintf(name, sizeof(name), "%s%s", g_meta_index->watch_dirs[event->wd],
+                               event->len > 0 ? event->name : "");
+        if (written < 0 || written >= (int) sizeof(name) - 1) known = false;
+        if (event->mask & IN_IGNORED) {
+            free(g_meta_index->watch_dirs[event->wd]); // The directory is gone
+            g_meta_index->watch_dirs[event->wd] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&g_meta_index->watch_lock);
+    if (!known || event->len == 0 || event->name[0] == '.') return;
+
+    if (event->mask & IN_ISDIR) {
+        strcat(name, "/");
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            meta_scan(name, 1);
+        } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            meta_index_unwatch(name);
+            pthread_rwlock_wrlock(&g_meta_index->lock);
+            meta_index_remove(name, true);
+            pthread_rwlock_unlock(&g_meta_index->lock);
+        }
+        return;
+    }
+    meta_index_refresh(name);
+}
+
+// Applies the changes inotify reports to the index.
+void* MetaWatchThread(void* arg) {
+    (void) arg;
+    char buff[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t len = read(g_meta_index->inotify_fd, buff, sizeof(buff));
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            perror("Metadata index: reading change notifications failed");
+            return NULL;
+        }
+        for (char *p = buff; p < buff + len; ) {
+            const struct inotify_event *event = (const struct inotify_event*) p;
+            meta_watch_event(event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return NULL;
+}
+
+// Builds the index of the working directory and starts watching it for changes.
+// Returns 0 on success, -1 on failure.
+int meta_index_init(void) {
+    MetaIndex *index = calloc(1, sizeof(MetaIndex));
+    if (index != NULL) index->head = calloc(1, sizeof(MetaEntry) + META_MAX_HEIGHT * sizeof(MetaEntry*) + 1);
+    if (index == NULL || index->head == NULL) {
+        perror("Failed to allocate metadata index");
+        free(index);
+        return -1;
+    }
+    index->head->height = META_MAX_HEIGHT;
+    index->head->name = (char*) &index->head->next[META_MAX_HEIGHT]; // ""
+    index->random = monotonic_ns() | 1;
+    pthread_rwlock_init(&index->lock, NULL);
+    pthread_mutex_init(&index->watch_lock, NULL);
+    index->inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (index->inotify_fd < 0) {
+        log_warn("Metadata index: inotify unavailable (%s); only uploads keep it current", strerror(errno));
+    }
+    g_meta_index = index;
+
+    uint64_t start = monotonic_ns();
+    meta_index_rescan();
+    log_info("Metadata index: %zu files in %.2f s", g_meta_index->count, (monotonic_ns() - start) / 1e9);
+
+    if (index->inotify_fd >= 0) {
+        pthread_t watcher;
+        if (pthread_create(&watcher, NULL, MetaWatchThread, NULL) != 0) {
+            perror("pthread_create for metadata watcher failed");
+            return -1;
+        }
+        pthread_detach(watcher);
+    }
+    return 0;
+}
+
+// Answers a "list" request: the files whose names start with the filename (less a trailing
+// '*') and come after body.list.after, at most body.list.limit of them.
+void* SendListing(void* arg) {
+    ClientTaskArgs *task_args = (ClientTaskArgs*) arg;
+    FssListRequest *request = &task_args->body.list;
+    char prefix[256];
+    snprintf(prefix, sizeof(prefix), "%s", task_args->filename);
+    size_t prefix_len = strlen(prefix);
+    if (prefix_len > 0 && prefix[prefix_len - 1] == '*') prefix[--prefix_len] = '\0';
+    request->after[sizeof(request->after) - 1] = '\0';
+    uint32_t limit = ntohl(request->limit);
+    if (limit == 0) limit = FSS_LIST_DEFAULT_LIMIT;
+    if (limit > FSS_LIST_MAX_LIMIT) limit = FSS_LIST_MAX_LIMIT;
+
+    // Copy the page out under the read lock; it goes out after the lock is released
+    char *page = NULL;
+    size_t page_len = 0;
+    FssListInfo info = { 0, 0 };
+    FILE *out = open_memstream(&page, &page_len);
+    if (out != NULL) {
+        pthread_rwlock_rdlock(&g_meta_index->lock);
+        bool resume = strcmp(request->after, prefix) >= 0;
+        MetaEntry *entry = meta_index_seek(resume ? request->after : prefix, NULL);
+        if (resume && entry != NULL && strcmp(entry->name, request->after) == 0) entry = entry->next[0];
+        for (; entry != NULL && strncmp(entry->name, prefix, prefix_len) == 0; entry = entry->next[0]) {
+            if (info.count == limit) {
+                info.more = 1;
+                break;
+            }
+            FssFileInfo file;
+            meta_entry_info(entry, &file);
+            fwrite(&file, sizeof(file), 1, out);
+            fwrite(entry->name, 1, strlen(entry->name), out);
+            info.count++;
+        }
+        pthread_rwlock_unlock(&g_meta_index->lock);
+        if (fclose(out) != 0) out = NULL;
+    }
+
+    FssFrameWriter writer = { task_args->client_socket, malloc(task_args->frame_size), task_args->frame_size, 0 };
+    if (out == NULL || writer.buff == NULL) {
+        perror("SendListing: building the listing failed");
+        send_response(task_args, FSS_STATUS_IO_ERROR, 0);
+    } else if (send_response(task_args, FSS_STATUS_OK, MSG_MORE) == 0) {
+        info.count = htonl(info.count);
+        info.more = htonl(info.more);
+        if (send_all(task_args->client_socket, &info, sizeof(info), MSG_MORE) < 0 ||
+            fss_frame_put(&writer, page, page_len) < 0 || fss_frame_finish(&writer) < 0) {
+            perror("SendListing: send failed");
+            task_args->keep_alive = false;
+        }
+    }
+    free(writer.buff);
+    free(page);
+    finish_client_task(task_args);
+    return NULL;
+}
+
+// Answers a "stat" request with the file's FssFileInfo.
+void* SendFileInfo(void* arg) {
+    ClientTaskArgs *task_args = (ClientTaskArgs*) arg;
+    FssFileInfo info;
+    pthread_rwlock_rdlock(&g_meta_index->lock);
+    MetaEntry *entry = meta_index_find(task_args->filename);
+    if (entry != NULL) meta_entry_info(entry, &info);
+    pthread_rwlock_unlock(&g_meta_index->lock);
+
+    if (entry == NULL) {
+        send_response(task_args, FSS_STATUS_NOT_FOUND, 0);
+    } else if (send_response(task_args, FSS_STATUS_OK, MSG_MORE) == 0) {
+        info.name_len = 0;
+        if (send_all(task_args->client_socket, &info, sizeof(info), 0) < 0) {
+            perror("SendFileInfo: send failed");
+            task_args->keep_alive = false;
+        }
+    }
+    finish_client_task(task_args);
+    return NULL;
+}
+
+// --- End Metadata Index ---
+
+// --- Batch Downloads ---
+//
+// "batch" sends a whole set of files in one response, so fetching many small files costs
+// one request instead of one per file. A prefetch thread opens the files up to BATCH_AHEAD
+// ahead of the one being sent, looks up their size and digest, and asks the kernel to
+// start reading them (POSIX_FADV_WILLNEED, the first BATCH_READAHEAD bytes of each), so the
+// opens and the disk reads overlap with sending. The sending thread streams each file with
+// sendfile(). The two hand files over through a pair of transfer ring cursors.
+//
+// In snapshot mode the descriptor the prefetcher opened pins a complete version and no
+// lock is taken. In in-place mode each file is read-locked while it is sent, and its size
+// and digest are taken under the lock.
+
+#define BATCH_AHEAD 16                      // Files opened ahead of the one being sent
+#define BATCH_READAHEAD (4 * 1024 * 1024)   // Bytes of each opened file the kernel is asked to read
+
+typedef struct {
+    const char *name;
+    int fd;                             // -1 if the file could not be opened
+    uint32_t status;                    // FSS_STATUS_* of its entry
+    struct stat st;                     // Valid with status FSS_STATUS_OK
+    bool has_crc;
+    uint32_t crc;
+} BatchFile;
+
+typedef struct {
+    BatchFile *files;
+    unsigned count;
+    RingCursor opened;                  // Prefetcher: files opened, or found missing
+    RingCursor sent;                    // Sender: files sent and closed
+    atomic_bool stop;                   // The connection failed: open no more files
+} Batch;
+
+// Gathers the names a "batch" request asks for into *names, NUL-separated, and their number
+// into *count. Returns FSS_STATUS_OK, the status to refuse the request with, or -1 if the
+// connection broke while the names were arriving.
+static int batch_names(ClientTaskArgs* task_args, char** names, uint32_t* count) {
+    *names = NULL;
+    *count = ntohl(task_args->body.batch.count);
+    if (*count > 0) {
+        // Explicit names, in frames after the request
+        size_t max_bytes = *count <= FSS_BATCH_MAX_FILES ? (size_t) *count * 256 : 0;
+        void *list;
+        ssize_t len = ReceiveFrameList(task_args, 1, max_bytes, &list);
+        if (len == -1) return -1;
+        if (len < 0) return FSS_STATUS_BAD_REQUEST;
+
+        size_t pos = 0;
+        uint32_t seen = 0;
+        while (pos < (size_t) len) {
+            size_t name_len = strnlen((char*) list + pos, len - pos);
+            if (name_len == 0 || name_len >= 256 || pos + name_len == (size_t) len) break;
+            pos += name_len + 1;
+            seen++;
+        }
+        if (pos != (size_t) len || seen != *count) {
+            free(list);
+            return FSS_STATUS_BAD_REQUEST;
+        }
+        *names = list;
+        return FSS_STATUS_OK;
+    }
+
+    // Every indexed file under the prefix, as "list" would show them
+    char prefix[256];
+    snprintf(prefix, sizeof(prefix), "%s", task_args->filename);
+    size_t prefix_len = strlen(prefix);
+    if (prefix_len > 0 && prefix[prefix_len - 1] == '*') prefix[--prefix_len] = '\0';
+    size_t names_len = 0;
+    FILE *out = open_memstream(names, &names_len);
+    if (out == NULL) return FSS_STATUS_IO_ERROR;
+    bool too_many = false;
+    pthread_rwlock_rdlock(&g_meta_index->lock);
+    for (MetaEntry *entry = meta_index_seek(prefix, NULL);
+         entry != NULL && strncmp(entry->name, prefix, prefix_len) == 0; entry = entry->next[0]) {
+        if (*count == FSS_BATCH_MAX_FILES) {
+            too_many = true;
+            break;
+        }
+        fwrite(entry->name, 1, strlen(entry->name) + 1, out);
+        (*count)++;
+    }
+    pthread_rwlock_unlock(&g_meta_index->lock);
+    if (fclose(out) != 0 || too_many) {
+        free(*names);
+        *names = NULL;
+        return too_many ? FSS_STATUS_BAD_REQUEST : FSS_STATUS_IO_ERROR;
+    }
+    return FSS_STATUS_OK;
+}
+
+// Takes the size, version and digest of an opened batch file and sets its status.
+static void batch_file_describe(BatchFile* file) {
+    if (fstat(file->fd, &file->st) < 0) {
+        file->status = FSS_STATUS_IO_ERROR;
+        return;
+    }
+    if (!S_ISREG(file->st.st_mode)) {
+        file->status = FSS_STATUS_NOT_FOUND;
+        return;
+    }
+    file->status = FSS_STATUS_OK;
+
+    // The index usually knows the digest already, which saves opening the digest file
+    uint64_t version = file_version(&file->st);
+    bool indexed = false;
+    pthread_rwlock_rdlock(&g_meta_index->lock);
+    MetaEntry *entry = meta_index_find(file->name);
+    if (entry != NULL && entry->version == version && entry->size == (uint64_t) file->st.st_size) {
+        indexed = true;
+        file->has_crc = entry->has_crc;
+        file->crc = entry->crc;
+    }
+    pthread_rwlock_unlock(&g_meta_index->lock);
+    if (!indexed) file->has_crc = file_digest_load(file->name, version, file->st.st_size, &file->crc, NULL);
+}
+
+// Opens the batch's files ahead of the sender, never more than BATCH_AHEAD of them at once.
+void* BatchPrefetch(void* arg) {
+    Batch *batch = (Batch*) arg;
+    unsigned free_until = BATCH_AHEAD;
+    for (unsigned i = 0; i < batch->count; i++) {
+        if (i == free_until) free_until = ring_wait(&batch->sent, i - BATCH_AHEAD + 1) + BATCH_AHEAD;
+        BatchFile *file = &batch->files[i];
+        file->fd = -1;
+        file->status = FSS_STATUS_IO_ERROR;
+        if (is_sidecar_name(file->name)) {
+            file->status = FSS_STATUS_NOT_FOUND;
+        } else if (!atomic_load_explicit(&batch->stop, memory_order_relaxed)) {
+            file->fd = open(file->name, O_RDONLY | O_CLOEXEC);
+            if (file->fd < 0) {
+                file->status = errno == ENOENT || errno == ENOTDIR ? FSS_STATUS_NOT_FOUND : FSS_STATUS_IO_ERROR;
+            } else {
+                posix_fadvise(file->fd, 0, BATCH_READAHEAD, POSIX_FADV_WILLNEED);
+                if (g_config.storage_mode != STORAGE_MODE_INPLACE) batch_file_describe(file);
+            }
+        }
+        ring_advance(&batch->opened, i + 1);
+    }
+    return NULL;
+}
+
+// Sends one file's FssBatchEntry and, if it could be read, its frames.
+// Returns 0 on success, -1 if the connection failed.
+static int batch_send_file(ClientTaskArgs* task_args, BatchFile* file) {
+    FileAccessControl *control = NULL;
+    if (file->fd >= 0 && g_config.storage_mode == STORAGE_MODE_INPLACE) {
+        control = get_or_create_file_control(file->name);
+        if (control == NULL) {
+            file->status = FSS_STATUS_IO_ERROR;
+        } else {
+            acquire_read_lock(control);
+            batch_file_describe(file);
+        }
+    }
+
+    struct {
+        FssBatchEntry entry;
+        char name[256];
+    } header;
+    size_t name_len = strlen(file->name);
+    memset(&header.entry, 0, sizeof(header.entry));
+    header.entry.status = htonl(file->status);
+    header.entry.name_len = htons((uint16_t) name_len);
+    if (file->status == FSS_STATUS_OK) {
+        header.entry.size = htobe64(file->st.st_size);
+        header.entry.version = htobe64(file_version(&file->st));
+        header.entry.crc = htonl(file->has_crc ? file->crc : 0);
+        header.entry.flags = htons(file->has_crc ? FSS_INFO_HAS_CRC : 0);
+    }
+    memcpy(header.name, file->name, name_len);
+
+    int rc = send_all(task_args->client_socket, &header, sizeof(header.entry) + name_len, MSG_MORE);
+    if (rc < 0) {
+        perror("SendBatch: send entry failed");
+    } else if (file->status == FSS_STATUS_OK) {
+        rc = SendFileZeroCopy(task_args->client_socket, file->fd, 0, file->st.st_size, task_args->frame_size, NULL);
+    }
+
+    if (control != NULL) {
+        release_read_lock(control);
+        release_file_control(control);
+    }
+    return rc < 0 ? -1 : 0;
+}
+
+// Answers a "batch" request: every file in turn, then the entry that ends the batch.
+void* SendBatch(void* arg) {
+    ClientTaskArgs *task_args = (ClientTaskArgs*) arg;
+    char *names;
+    uint32_t count;
+    BatchFile *files = NULL;
+    int status = batch_names(task_args, &names, &count);
+    if (status < 0) {
+        task_args->keep_alive = false; // The rest of the names is still on the way
+        goto cleanup;
+    }
+    if (status == FSS_STATUS_OK && (files = calloc(count ? count : 1, sizeof(BatchFile))) == NULL) {
+        perror("SendBatch: malloc failed");
+        status = FSS_STATUS_IO_ERROR;
+    }
+    if (status != FSS_STATUS_OK) {
+        send_response(task_args, status, 0);
+        goto cleanup;
+    }
+
+    Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.files = files;
+    batch.count = count;
+    const char *name = names;
+    for (uint32_t i = 0; i < count; i++) {
+        files[i].name = name;
+        name += strlen(name) + 1;
+    }
+
+    pthread_t prefetcher;
+    if (count > 0 && pthread_create(&prefetcher, NULL, BatchPrefetch, &batch) != 0) {
+        perror("pthread_create for batch prefetch failed");
+        send_response(task_args, FSS_STATUS_IO_ERROR, 0);
+        goto cleanup;
+    }
+
+    bool failed = send_response(task_args, FSS_STATUS_OK, MSG_MORE) < 0;
+    unsigned available = 0;
+    for (unsigned i = 0; i < count; i++) {
+        if (i == available) available = ring_wait(&batch.opened, i + 1);
+        BatchFile *file = &files[i];
+        if (!failed && batch_send_file(task_args, file) < 0) {
+            failed = true;
+            atomic_store(&batch.stop, true);
+        }
+        if (file->fd >= 0) close(file->fd);
+        ring_advance(&batch.sent, i + 1);
+    }
+    if (count > 0) pthread_join(prefetcher, NULL);
+
+    FssBatchEntry end;
+    memset(&end, 0, sizeof(end));
+    if (!failed && send_all(task_args->client_socket, &end, sizeof(end), 0) < 0) {
+        perror("SendBatch: send end entry failed");
+        failed = true;
+    }
+    if (failed) task_args->keep_alive = false; // Client holds a truncated stream
+
+cleanup:
+    free(files);
+    free(names);
+    finish_client_task(task_args);
+    return NULL;
+}
+
+// --- End Batch Downloads ---
+
+// --- Worker Pool ---
+//
+// A fixed set of worker threads runs DownLoadingFile/UploadFile tasks taken from a
+// bounded queue. Event loops are the producers and must never block, so a full queue
+// rejects the request instead of waiting.
+
+typedef struct {
+    void* (*function)(void*);   // DownLoadingFile or UploadFile
+    ClientTaskArgs *args;
+    uint64_t enqueued_ns;       // For queue wait time stats
+} PoolTask;
+
+typedef struct {
+    pthread_t *threads;
+    int num_workers;
+
+    PoolTask *queue;            // Circular buffer of pending tasks
+    int capacity;
+    int head, tail, count;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+
+    // Stats, protected by mutex
+    int active_workers;
+    int peak_active_workers;
+    int peak_queue_depth;
+    unsigned long long submitted;
+    unsigned long long rejected;
+    unsigned long long completed;
+    uint64_t total_wait_ns;
+    uint64_t max_wait_ns;
+} WorkerPool;
+
+typedef struct {
+    int num_workers;
+    int capacity;
+    int queue_depth;
+    int peak_queue_depth;
+    int active_workers;
+    int peak_active_workers;
+    unsigned long long submitted;
+    unsigned long long rejected;
+    unsigned long long completed;
+    double avg_wait_ms;
+    double max_wait_ms;
+} WorkerPoolStats;
+
+WorkerPool g_worker_pool;
+
+void* WorkerThread(void* arg) {
+    WorkerPool *pool = (WorkerPool*) arg;
+
+    while (1) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->count == 0) {
+            pthread_cond_wait(&pool->not_empty, &pool->mutex);
+        }
+
+        PoolTask task = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->capacity;
+        pool->count--;
+
+        uint64_t waited = monotonic_ns() - task.enqueued_ns;
+        pool->total_wait_ns += waited;
+        if (waited > pool->max_wait_ns) pool->max_wait_ns = waited;
+        pool->active_workers++;
+        if (pool->active_workers > pool->peak_active_workers) pool->peak_active_workers = pool->active_workers;
+        pthread_mutex_unlock(&pool->mutex);
+
+        task.function(task.args); // Hands the connection back and frees args itself
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->active_workers--;
+        pool->completed++;
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    return NULL;
+}
+
+int worker_pool_init(WorkerPool* pool, int num_workers, int capacity) {
+    memset(pool, 0, sizeof(*pool));
+    pool->num_workers = num_workers;
+    pool->capacity = capacity;
+    pool->queue = calloc(capacity, sizeof(PoolTask));
+    pool->threads = calloc(num_workers, sizeof(pthread_t));
+    if (pool->queue == NULL || pool->threads == NULL) {
+        perror("Failed to allocate worker pool");
+        return -1;
+    }
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0 ||
+        pthread_cond_init(&pool->not_empty, NULL) != 0) {
+        perror("Failed to initialize worker pool mutex/cond vars");
+        return -1;
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&pool->threads[i], NULL, WorkerThread, pool) != 0) {
+            perror("pthread_create for worker failed");
+            return -1;
+        }
+        pthread_detach(pool->threads[i]);
+    }
+    return 0;
+}
+
+// Queues a task without blocking. Returns -1 if the queue is full.
+int worker_pool_submit(WorkerPool* pool, void* (*function)(void*), ClientTaskArgs* args) {
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->count == pool->capacity) {
+        pool->rejected++;
+        pthread_mutex_unlock(&pool->mutex);
+        return -1;
+    }
+
+    PoolTask *task = &pool->queue[pool->tail];
+    task->function = function;
+    task->args = args;
+    task->enqueued_ns = monotonic_ns();
+    pool->tail = (pool->tail + 1) % pool->capacity;
+    pool->count++;
+    pool->submitted++;
+    if (pool->count > pool->peak_queue_depth) pool->peak_queue_depth = pool->count;
+
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->mutex);
+    return 0;
+}
+
+void worker_pool_get_stats(WorkerPool* pool, WorkerPoolStats* stats) {
+    pthread_mutex_lock(&pool->mutex);
+    stats->num_workers = pool->num_workers;
+    stats->capacity = pool->capacity;
+    stats->queue_depth = pool->count;
+    stats->peak_queue_depth = pool->peak_queue_depth;
+    stats->active_workers = pool->active_workers;
+    stats->peak_active_workers = pool->peak_active_workers;
+    stats->submitted = pool->submitted;
+    stats->rejected = pool->rejected;
+    stats->completed = pool->completed;
+    unsigned long long started = pool->submitted - pool->count;
+    stats->avg_wait_ms = started ? (double)pool->total_wait_ns / started / 1e6 : 0.0;
+    stats->max_wait_ms = (double)pool->max_wait_ns / 1e6;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static void metrics_write_latency(FILE* out, const char* name, const FssHistogram* h, bool last) {
+    fprintf(out, "    \"%s\": {\"count\": %llu, \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+                 "\"p999\": %.1f, \"max\": %.1f}%s\n",
+            name, (unsigned long long) h->total, fss_hist_mean(h) / 1000, fss_hist_percentile(h, 0.50) / 1000.0,
+            fss_hist_percentile(h, 0.90) / 1000.0, fss_hist_percentile(h, 0.99) / 1000.0,
+            fss_hist_percentile(h, 0.999) / 1000.0, h->max / 1000.0, last ? "" : ",");
+}
+
+// Writes the metrics, the worker pool and the caches as one JSON object. Latencies are in
+// microseconds. Returns 0 on success, -1 if out of memory.
+static int metrics_write_json(FILE* out) {
+    MetricsCounters *m = calloc(1, sizeof(MetricsCounters));
+    if (m == NULL) return -1;
+    metrics_snapshot(m);
+
+    fprintf(out, "{\n  \"uptime_sec\": %lld,\n", (long long)(time(NULL) - g_metrics_start));
+    fprintf(out, "  \"connections\": {\"active\": %llu, \"opened\": %llu},\n",
+            (unsigned long long)(m->connections_opened - m->connections_closed),
+            (unsigned long long) m->connections_opened);
+    fprintf(out, "  \"bytes\": {\"in\": %llu, \"out\": %llu},\n",
+            (unsigned long long) m->bytes_in, (unsigned long long) m->bytes_out);
+    fprintf(out, "  \"requests\": {");
+    for (int i = 0; i < METRIC_COMMANDS; i++) {
+        fprintf(out, "%s\"%s\": %llu", i ? ", " : "", metric_command_names[i], (unsigned long long) m->requests[i]);
+    }
+    fprintf(out, ", \"rejected\": %llu},\n  \"latency_us\": {\n", (unsigned long long) m->rejected);
+    for (int i = 0; i < METRIC_LATENCIES; i++) {
+        metrics_write_latency(out, metric_latency_names[i], &m->latency[i], i == METRIC_LATENCIES - 1);
+    }
+    fprintf(out, "  },\n");
+
+    WorkerPoolStats pool;
+    worker_pool_get_stats(&g_worker_pool, &pool);
+    fprintf(out, "  \"pool\": {\"workers\": %d, \"active\": %d, \"queued\": %d, \"capacity\": %d, "
+                 "\"completed\": %llu, \"rejected\": %llu, \"wait_avg_ms\": %.3f, \"wait_max_ms\": %.3f}",
+            pool.num_workers, pool.active_workers, pool.queue_depth, pool.capacity, pool.completed, pool.rejected,
+            pool.avg_wait_ms, pool.max_wait_ms);
+    if (g_content_cache != NULL) {
+        ContentCacheStats cache;
+        content_cache_get_stats(&cache);
+        fprintf(out, ",\n  \"cache\": {\"entries\": %d, \"bytes\": %zu, \"budget\": %zu, \"hits\": %llu, "
+                     "\"misses\": %llu, \"evictions\": %llu}",
+                cache.entries, cache.bytes, cache.budget, cache.hits, cache.misses, cache.evictions);
+    }
+    fprintf(out, "\n}\n");
+    free(m);
+    return 0;
+}
+
+// Rewrites g_config.metrics_file through a temporary file, so readers never see half of it.
+static void metrics_dump(void) {
+    char temp[PATH_MAX];
+    snprintf(temp, sizeof(temp), "%s.tmp", g_config.metrics_file);
+    FILE *out = fopen(temp, "w");
+    if (out == NULL) {
+        log_warn("Metrics: cannot write %s: %s", temp, strerror(errno));
+        return;
+    }
+    int rc = metrics_write_json(out);
+    if (fclose(out) != 0 || rc != 0 || rename(temp, g_config.metrics_file) != 0) {
+        log_warn("Metrics: cannot update %s", g_config.metrics_file);
+        unlink(temp);
+    }
+}
+
+// Answers a request with the JSON write() produces, as frames followed by the end frame.
+static void send_json_reply(ClientTaskArgs* task_args, int (*write)(FILE*, int), int arg) {
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    int rc = out != NULL ? write(out, arg) : -1;
+    if (out != NULL) fclose(out);
+
+    if (rc != 0) {
+        perror("send_json_reply: building the reply failed");
+        send_response(task_args, FSS_STATUS_IO_ERROR, 0);
+    } else if (send_response(task_args, FSS_STATUS_OK, 0) == 0) {
+        for (size_t sent = 0; rc == 0 && sent < len; sent += task_args->frame_size) {
+            size_t n = len - sent < task_args->frame_size ? len - sent : task_args->frame_size;
+            rc = fss_send_frame(task_args->client_socket, text + sent, n);
+        }
+        if (rc < 0 || fss_send_frame(task_args->client_socket, NULL, 0) < 0) {
+            perror("send_json_reply: send failed");
+            task_args->keep_alive = false;
+        }
+    }
+    free(text);
+}
+
+static int metrics_write_reply(FILE* out, int unused) {
+    (void) unused;
+    return metrics_write_json(out);
+}
+
+// Answers a "stats" request with metrics_write_json().
+void* SendStats(void* arg) {
+    ClientTaskArgs *task_args = (ClientTaskArgs*) arg;
+    send_json_reply(task_args, metrics_write_reply, 0);
+    finish_client_task(task_args);
+    return NULL;
+}
+
+#define LOCK_REPORT_DEFAULT_FILES 10
+#define LOCK_REPORT_MAX_FILES 1000
+
+// Answers a "locks" request, whose filename is the number of files to list, with the
+// most contended files from lock_write_top().
+void* SendLockStats(void* arg) {
+    ClientTaskArgs *task_args = (ClientTaskArgs*) arg;
+    int n = atoi(task_args->filename);
+    if (n <= 0) n = LOCK_REPORT_DEFAULT_FILES;
+    if (n > LOCK_REPORT_MAX_FILES) n = LOCK_REPORT_MAX_FILES;
+    send_json_reply(task_args, lock_write_top, n);
+    finish_client_task(task_args);
+    return NULL;
+}
+
+#define METRICS_DUMP_INTERVAL_SEC 10 // With -o but without -s
+
+void* StatsReporterThread(void* arg) {
+    (void) arg;
+    WorkerPoolStats stats;
+    int interval = g_config.stats_interval_sec > 0 ? g_config.stats_interval_sec : METRICS_DUMP_INTERVAL_SEC;
+
+    while (1) {
+        sleep(interval);
+        if (g_config.metrics_file != NULL) metrics_dump();
+        if (g_config.stats_interval_sec <= 0) continue;
+
+        worker_pool_get_stats(&g_worker_pool, &stats);
+        log_info("Pool stats: workers=%d active=%d (peak %d) queue=%d/%d (peak %d) "
+                 "submitted=%llu completed=%llu rejected=%llu wait_avg=%.3fms wait_max=%.3fms",
+                 stats.num_workers, stats.active_workers, stats.peak_active_workers,
+                 stats.queue_depth, stats.capacity, stats.peak_queue_depth,
+                 stats.submitted, stats.completed, stats.rejected,
+                 stats.avg_wait_ms, stats.max_wait_ms);
+        if (g_content_cache != NULL) {
+            ContentCacheStats cache_stats;
+            content_cache_get_stats(&cache_stats);
+            log_info("Cache stats: entries=%d bytes=%zu/%zu hits=%llu misses=%llu inserts=%llu evictions=%llu invalidations=%llu",
+                     cache_stats.entries, cache_stats.bytes, cache_stats.budget, cache_stats.hits, cache_stats.misses,
+                     cache_stats.inserts, cache_stats.evictions, cache_stats.invalidations);
+        }
+        if (g_chunk_store != NULL) {
+            ChunkStoreStats chunk_stats;
+            chunk_store_get_stats(&chunk_stats);
+            log_info("Chunk store stats: files=%d chunks=%zu dedup_offered=%llu dedup_reused=%llu",
+                     chunk_stats.files, chunk_stats.chunks, chunk_stats.bytes_offered, chunk_stats.bytes_reused);
+        }
+    }
+    return NULL;
+}
+
+// --- End Worker Pool ---
+
+
+// --- Event Loop / Connection Engine ---
+//
+// Connections are accepted and parsed by a small, fixed number of epoll event loop
+// threads. Each connection walks a state machine over the length-prefixed request
+// header (CommandLen, Command, FilenameLen, Filename) using non-blocking reads, so an
+// idle or slow client costs a few hundred bytes instead of a thread. Once the header is
+// complete the connection enters the transfer phase and is queued for the worker pool;
+// when the transfer ends the worker returns the connection to the loop that owns it.
+//
+// Only the header phase is event driven. A transfer runs on a worker with blocking sends
+// and receives (or on the io_uring engine), so -w bounds how many move at once, however
+// many connections the loops hold. A connection in the transfer phase is off epoll and
+// outside the -t idle sweep; the -T transfer timeout bounds it instead.
+
+typedef enum {
+    CONN_READ_COMMAND_LEN,
+    CONN_READ_COMMAND,
+    CONN_READ_FILENAME_LEN,
+    CONN_READ_FILENAME,
+    CONN_READ_HANDSHAKE,        // Rest of a v2 Handshake after its magic
+    CONN_READ_BODY,             // Fixed-size body following the filename (see request_body_size)
+    CONN_TRANSFER,              // Owned by a transfer handler, not watched by epoll
+} ConnectionState;
+
+struct EventLoop;
 
-    while(1){
-        pthread_mutex_lock(&sh_data->mutex);
-        while(sh_data->count == 0 &&(sh_data->eof_reached == 0)){
-            pthread_cond_wait(&(sh_data->not_empty) , &(sh_data->mutex) );
-        }
+typedef struct Connection {
+    int socket;
+    ConnectionState state;
+    struct EventLoop *loop;     // Loop that owns this connection for its whole lifetime
 
-        if (sh_data->count == 0 && sh_data->eof_reached == 1) {
-            pthread_mutex_unlock(&sh_data->mutex);
-            break;
-        }
+    // Request header being assembled
+    char command[32];
+    char filename[256];         // Ensure matches ClientTaskArgs/FileAccessControl
+    int command_len;
+    int filename_len;
+    int len_n;                  // Length prefix being received (network byte order)
+    size_t field_received;      // Bytes of the current field received so far
+
+    int protocol_version;       // 1 until the client completes a v2 handshake
+    uint32_t frame_size;        // Max frame payload in either direction
+    FssHandshake handshake;     // v2 handshake being received
+    RequestBody body;           // Body of the request being received
+    size_t body_len;            // Its size for this command
+    uint32_t flags;             // FSS_FLAG_* granted in the handshake
+    uint32_t request_count;     // Requests received so far, numbers the responses
+    bool keep_alive;            // Set when a request ends: wait for the next one instead of closing
+
+    time_t last_active;         // Last time the client made progress (idle sweep)
+    uint64_t request_start_ns;  // First byte of the request being received arrived
+    uint64_t dispatched_ns;     // The request header was complete
+    uint64_t bytes_in_seen;     // tcp_info byte counters already added to the metrics
+    uint64_t bytes_out_seen;
+
+    struct Connection *prev, *next;   // Loop's connection list
+    struct Connection *returned_next; // Loop's queue of connections handed back by handlers
+} Connection;
+
+typedef struct EventLoop {
+    int id;
+    int epoll_fd;
+    int wake_fd;                // eventfd used by handlers to hand connections back
+    pthread_t thread;
+
+    Connection *connections;    // Only touched by the loop thread
+    int connection_count;
 
-        char buff[CHUNK_SIZE];
-        int bytes_to_send = sh_data->buffer[sh_data->out].bytes_read;
-        memcpy(buff, sh_data->buffer[sh_data->out].data, bytes_to_send); // Use . operator and actual size
+    pthread_mutex_t returned_mutex;
+    Connection *returned;       // Connections whose transfer finished
+} EventLoop;
 
-        int bytes_to_send_n;
-        bytes_to_send_n = htonl(bytes_to_send);
-         // Update shared buffer state
-        sh_data->out = (sh_data->out + 1) % BUFFER_CAPACITY; // Update out index
-        sh_data->count--;                                // Decrement count
-        pthread_cond_signal(&sh_data->not_full);
-        pthread_mutex_unlock(&sh_data->mutex);
+EventLoop *g_event_loops = NULL;
+int g_listen_fd = -1;
 
-        send(sh_data->client_sock , &bytes_to_send_n , sizeof(int) , 0);
-        send(sh_data->client_sock , buff , bytes_to_send, 0); // Send the actual bytes copied
+#define EPOLL_BATCH 256
+#define IDLE_SWEEP_INTERVAL_SEC 1
+
+void* RequestHandler(Connection* conn);
+
+// Adds the bytes the kernel counted on the connection since the last call to the metrics.
+// Called by whichever thread owns the connection: its handler when a request ends, its
+// loop when it closes. Bytes out are those the client acknowledged.
+static void connection_account_bytes(Connection* conn) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(conn->socket, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) return;
+    metrics_count_bytes(info.tcpi_bytes_received - conn->bytes_in_seen, info.tcpi_bytes_acked - conn->bytes_out_seen);
+    conn->bytes_in_seen = info.tcpi_bytes_received;
+    conn->bytes_out_seen = info.tcpi_bytes_acked;
+}
+
+static void connection_close(Connection* conn) {
+    EventLoop *loop = conn->loop;
+
+    connection_account_bytes(conn);
+    metrics_count_connection(false);
+
+    if (conn->state != CONN_TRANSFER) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
     }
-};
+    close(conn->socket);
 
-// Worker thread function for handling download requests
-void* DownLoadingFile(void *arg){
-    ClientTaskArgs* task_args = (ClientTaskArgs*) arg;
-    if (task_args == NULL) {
-        fprintf(stderr, "DownLoadingFile received NULL arguments\n");
-        return NULL;
+    if (conn->prev != NULL) conn->prev->next = conn->next;
+    else loop->connections = conn->next;
+    if (conn->next != NULL) conn->next->prev = conn->prev;
+    loop->connection_count--;
+
+    free(conn);
+}
+
+// Resets the header state machine so the connection waits for a new request.
+static void connection_reset_request(Connection* conn) {
+    conn->state = CONN_READ_COMMAND_LEN;
+    conn->field_received = 0;
+    conn->command_len = 0;
+    conn->filename_len = 0;
+}
+
+// Puts a connection whose request is finished back under epoll to wait for the next one.
+// Requests the client pipelined are already in the socket buffer and show up as readable
+// right away. Returns false if the connection was closed.
+static bool connection_resume(Connection* conn) {
+    struct epoll_event ev;
+
+    connection_reset_request(conn);
+    conn->last_active = time(NULL);
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = conn;
+    if (epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_ADD, conn->socket, &ev) < 0) {
+        perror("epoll_ctl re-add client failed");
+        conn->state = CONN_TRANSFER; // Not registered, nothing to remove
+        connection_close(conn);
+        return false;
     }
+    return true;
+}
 
-    // Removed: printf("Download thread started...")
+// Called from a transfer handler (any thread) when it is done with the connection.
+// The loop thread performs the actual close so that all list bookkeeping stays single-threaded.
+void connection_return(Connection* conn) {
+    EventLoop *loop = conn->loop;
+    uint64_t one = 1;
 
-    FileAccessControl* control = get_or_create_file_control(task_args->filename);
-    if (control == NULL) {
-        fprintf(stderr, "Failed to get file control for %s\n", task_args->filename);
-        // Send error to client?
-        close(task_args->client_socket);
-        free(task_args);
-        return NULL;
+    pthread_mutex_lock(&loop->returned_mutex);
+    conn->returned_next = loop->returned;
+    loop->returned = conn;
+    pthread_mutex_unlock(&loop->returned_mutex);
+
+    if (write(loop->wake_fd, &one, sizeof(one)) < 0) {
+        perror("connection_return: eventfd write failed");
     }
+}
 
-    // Acquire read lock for the file
-    acquire_read_lock(control);
+void finish_client_task(ClientTaskArgs* task_args) {
+    metrics_record_latency(METRIC_LAT_TRANSFER, monotonic_ns() - task_args->dispatched_ns);
+    connection_account_bytes(task_args->conn);
+    task_args->conn->keep_alive = task_args->keep_alive;
+    connection_return(task_args->conn);
+    free(task_args);
+}
 
-    int file_fd = open(task_args->filename, O_RDONLY);
-    if (file_fd < 0) {
-        perror("open failed in DownLoadingFile");
-        release_read_lock(control); // Release lock before exiting
-        release_file_control(control); // Release control struct reference
-        // Send error to client?
-        close(task_args->client_socket);
-        free(task_args);
-        return NULL;
+static void loop_drain_returned(EventLoop* loop) {
+    uint64_t count;
+    Connection *list;
+
+    if (read(loop->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("eventfd read failed");
     }
 
-    // --- Producer-Consumer Setup ---
-    pthread_t producer_thread;
-    pthread_t consumer_thread;
-    thread_shared_data shared;
-    memset(&shared, 0, sizeof(shared));
+    pthread_mutex_lock(&loop->returned_mutex);
+    list = loop->returned;
+    loop->returned = NULL;
+    pthread_mutex_unlock(&loop->returned_mutex);
 
-    // Initialize mutex and cond vars for the buffer
-    // TODO: Check return values of init functions
-    pthread_mutex_init(&shared.mutex, NULL);
-    pthread_cond_init(&shared.not_empty, NULL);
-    pthread_cond_init(&shared.not_full, NULL);
+    while (list != NULL) {
+        Connection *conn = list;
+        list = list->returned_next;
+        // Protocol v1 (and v2 without FSS_FLAG_PERSISTENT) carries a single request per connection
+        if (conn->keep_alive) {
+            connection_resume(conn);
+        } else {
+            connection_close(conn);
+        }
+    }
+}
 
-    shared.file = file_fd; // Use the opened file descriptor
-    shared.client_sock = task_args->client_socket; // Use the client socket from args
-
-    // --- Start Producer and Consumer ---
-    // TODO: Check return values of pthread_create
-    if (pthread_create(&producer_thread, NULL, ReadFromFile, &shared) != 0) {
-         perror("pthread_create producer failed");
-         close(file_fd);
-         release_read_lock(control);
-         release_file_control(control);
-         close(task_args->client_socket);
-         free(task_args);
-         // Destroy shared mutex/cond?
-         return NULL;
-    }
-     if (pthread_create(&consumer_thread, NULL, SendOverANetwork, &shared) != 0) {
-         perror("pthread_create consumer failed");
-         // Need to cancel/join producer? Difficult state.
-         close(file_fd);
-         release_read_lock(control);
-         release_file_control(control);
-         close(task_args->client_socket);
-         free(task_args);
-         // Destroy shared mutex/cond?
-         return NULL;
-     }
-
-
-    // --- Wait for threads to finish ---
-    pthread_join(producer_thread , NULL);
-    pthread_join(consumer_thread , NULL);
+// Bounds every blocking send and receive the transfer handlers make on the socket. A client
+// that stops reading or sending mid-transfer for -T seconds makes the call fail, and the
+// handler drops the connection, so it cannot keep a worker (or an in-place file lock) forever.
+static void connection_set_transfer_timeout(int socket) {
+    if (g_config.transfer_timeout_sec <= 0) return;
+    struct timeval timeout = { .tv_sec = g_config.transfer_timeout_sec, .tv_usec = 0 };
+    if (setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+        setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+        perror("setsockopt transfer timeout failed");
+    }
+}
 
-    // --- Cleanup ---
-    close(file_fd); // Close the file descriptor
-    pthread_mutex_destroy(&shared.mutex); // Destroy buffer mutex
-    pthread_cond_destroy(&shared.not_empty); // Destroy buffer cond vars
-    pthread_cond_destroy(&shared.not_full);
+static void loop_accept(EventLoop* loop) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
 
-    release_read_lock(control); // Release the file read lock
-    release_file_control(control); // Release the reference to the control struct
-// Removed: printf("Download thread finished...")
-close(task_args->client_socket); // Close the client socket
-free(task_args); // Free the arguments struct
+        // The client socket stays blocking for the transfer handlers, which -T bounds; the
+        // loop itself only ever reads from it with MSG_DONTWAIT.
+        int client_socket = accept4(g_listen_fd, (struct sockaddr *)&client_addr, &client_addr_len, SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break; // Another loop took it, or backlog empty
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("Accept failed"); // EMFILE/ENFILE: leave it in the backlog and retry later
+            break;
+        }
 
+        Connection *conn = calloc(1, sizeof(Connection));
+        if (conn == NULL) {
+            perror("Failed to allocate connection");
+            close(client_socket);
+            continue;
+        }
+        conn->socket = client_socket;
+        conn->loop = loop;
+        connection_set_transfer_timeout(client_socket); // Set once; the loop's own reads never block
+        conn->protocol_version = 1;
+        conn->frame_size = CHUNK_SIZE;
+        conn->last_active = time(NULL);
+        connection_reset_request(conn);
 
-    return NULL; // Indicate success
-};
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+            perror("epoll_ctl add client failed");
+            close(client_socket);
+            free(conn);
+            continue;
+        }
 
-// Worker thread function for handling upload requests
-void* UploadFile(void* arg){
-    ClientTaskArgs* task_args = (ClientTaskArgs*) arg;
-     if (task_args == NULL) {
-        fprintf(stderr, "UploadFile received NULL arguments\n");
-        return NULL;
+        conn->next = loop->connections;
+        if (loop->connections != NULL) loop->connections->prev = conn;
+        loop->connections = conn;
+        loop->connection_count++;
+        metrics_count_connection(true);
+
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+        log_debug("Accepted connection from %s:%d (socket: %d, loop: %d)", client_ip, ntohs(client_addr.sin_port), client_socket, loop->id);
     }
+}
 
-    // Removed: printf("Upload thread started...")
+// Agrees on a protocol version and frame size with a v2 client and sends the reply.
+// Returns -1 if the connection should be dropped.
+static int connection_complete_handshake(Connection* conn) {
+    FssHandshake *hello = &conn->handshake;
+    uint32_t version = ntohl(hello->version);
+    uint32_t frame_size = fss_clamp_frame_size(ntohl(hello->frame_size));
 
-    FileAccessControl* control = get_or_create_file_control(task_args->filename);
-    if (control == NULL) {
-        fprintf(stderr, "Failed to get file control for %s\n", task_args->filename);
-        // Send error to client?
-        close(task_args->client_socket);
-        free(task_args);
-        return NULL;
+    if (version < FSS_PROTOCOL_VERSION) {
+        fprintf(stderr, "RequestHandler: Unsupported handshake version %u\n", version);
+        return -1;
     }
+    if (frame_size > g_config.max_frame_size) frame_size = g_config.max_frame_size;
 
-    // Acquire write lock for the file
-    acquire_write_lock(control);
+    conn->protocol_version = FSS_PROTOCOL_VERSION;
+    conn->frame_size = frame_size;
+    conn->flags = ntohl(hello->flags) & FSS_FLAG_PERSISTENT;
+    if (conn->flags & FSS_FLAG_PERSISTENT) conn->flags |= ntohl(hello->flags) & FSS_FLAG_DELTA;
+    conn->flags |= ntohl(hello->flags) & (FSS_FLAG_COMPRESS | FSS_FLAG_CHECKSUM);
+    if ((conn->flags & FSS_FLAG_PERSISTENT) && g_chunk_store != NULL) {
+        conn->flags |= ntohl(hello->flags) & FSS_FLAG_DEDUP;
+    }
 
-    // Open file for writing (create if not exists, truncate if exists)
-    int file_fd = open(task_args->filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (file_fd < 0) {
-        perror("open failed in UploadFile");
-        release_write_lock(control); // Release lock before exiting
-        release_file_control(control); // Release control struct reference
-        // Send error to client?
-        close(task_args->client_socket);
-        free(task_args);
-        return NULL;
+    FssHandshake reply;
+    reply.magic = htonl(FSS_V2_MAGIC);
+    reply.version = htonl(FSS_PROTOCOL_VERSION);
+    reply.frame_size = htonl(frame_size);
+    reply.flags = htonl(conn->flags);
+
+    // The send buffer of a fresh connection is empty, so this never blocks in practice
+    if (send(conn->socket, &reply, sizeof(reply), MSG_DONTWAIT) != sizeof(reply)) {
+        perror("send handshake reply failed");
+        return -1;
     }
 
-    // --- Receive data from client and write to file ---
-    char recv_buff[CHUNK_SIZE];
-    int chunk_size_n;          // Network byte order size
-    ssize_t chunk_size;        // Host byte order size
-    ssize_t bytes_received_net; // Return value from network recv
-    ssize_t bytes_received_data;// Return value from data recv
-    ssize_t bytes_written_total;
-    ssize_t bytes_written_now;
+    // Every frame now leaves in one writev(), so Nagle only delays the tail of a transfer
+    int one = 1;
+    setsockopt(conn->socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return 0;
+}
 
-    while (true) {
-        // 1. Receive chunk size
-        bytes_received_net = recv(task_args->client_socket, &chunk_size_n, sizeof(int), MSG_WAITALL);
-        if (bytes_received_net <= 0) { // Handles disconnect (0) or error (<0)
-            if (bytes_received_net != 0) { // Only print perror on actual error
-                 perror("UploadFile: recv chunk size failed");
-            }
-            // Removed: printf for disconnect
-            goto upload_error_cleanup; // Jump to error cleanup section
-        }
-        // Note: Check for bytes_received != sizeof(int) is less critical with MSG_WAITALL
+// Size of the body that follows the filename for commands that have one.
+static size_t request_body_size(const char* command, uint32_t flags) {
+    if (strcmp(command, "range") == 0) return sizeof(FssRangeRequest);
+    if ((flags & FSS_FLAG_COMPRESS) && (strcmp(command, "download") == 0 || strcmp(command, "upload") == 0)) {
+        return sizeof(FssTransferOptions);
+    }
+    if (strcmp(command, "upload-open") == 0 || strcmp(command, "upload-dedup") == 0 ||
+        strcmp(command, "upload-delta") == 0) {
+        return sizeof(FssUploadOpen);
+    }
+    if (strcmp(command, "upload-part") == 0) return sizeof(FssUploadPart);
+    if (strcmp(command, "list") == 0) return sizeof(FssListRequest);
+    if (strcmp(command, "batch") == 0) return sizeof(FssBatchRequest);
+    if (strcmp(command, "download-delta") == 0) return sizeof(FssDeltaSignature);
+    if (strcmp(command, "upload-commit") == 0 || strcmp(command, "upload-abort") == 0 ||
+        strcmp(command, "upload-patch") == 0) {
+        return sizeof(FssUploadSession);
+    }
+    return 0;
+}
 
-        chunk_size = ntohl(chunk_size_n);
+// Hands a complete request header to RequestHandler. Returns false if the connection was closed.
+static bool connection_dispatch(Connection* conn) {
+    // Stop watching the socket while a handler owns it
+    epoll_ctl(conn->loop->epoll_fd, EPOLL_CTL_DEL, conn->socket, NULL);
+    conn->state = CONN_TRANSFER;
+    conn->dispatched_ns = monotonic_ns();
+    metrics_record_latency(METRIC_LAT_PARSE, conn->dispatched_ns - conn->request_start_ns);
+    if (RequestHandler(conn) == NULL) {
+        // Request rejected, nothing was dispatched
+        if (conn->keep_alive) return connection_resume(conn);
+        connection_close(conn);
+        return false;
+    }
+    return true;
+}
 
-        // Check for end-of-upload signal (size 0)
-        if (chunk_size == 0) {
-            // Removed: printf("Received end-of-upload signal...")
-            break; // Normal end of upload, proceed to normal cleanup outside loop
-        }
+// Advances the request header state machine with whatever bytes are available.
+// Returns false if the connection was closed.
+static bool connection_on_readable(Connection* conn) {
+    while (conn->state != CONN_TRANSFER) {
+        char *target;
+        size_t wanted;
 
-        // Validate chunk size
-        if (chunk_size < 0 || chunk_size > CHUNK_SIZE) {
-            fprintf(stderr, "UploadFile: Invalid chunk size received: %zd for %s\n", chunk_size, task_args->filename);
-            goto upload_error_cleanup;
+        switch (conn->state) {
+        case CONN_READ_COMMAND_LEN:
+        case CONN_READ_FILENAME_LEN:
+            target = (char*)&conn->len_n;
+            wanted = sizeof(int);
+            break;
+        case CONN_READ_COMMAND:
+            target = conn->command;
+            wanted = conn->command_len;
+            break;
+        case CONN_READ_FILENAME:
+            target = conn->filename;
+            wanted = conn->filename_len;
+            break;
+        case CONN_READ_HANDSHAKE:
+            target = (char*)&conn->handshake;
+            wanted = sizeof(conn->handshake);
+            break;
+        case CONN_READ_BODY:
+            target = (char*)&conn->body;
+            wanted = conn->body_len;
+            break;
+        default:
+            return true;
         }
 
-        // 2. Receive chunk data
-        bytes_received_net = recv(task_args->client_socket, recv_buff, chunk_size, MSG_WAITALL);
-         if (bytes_received_net <= 0) { // Handles disconnect (0) or error (<0)
-             if (bytes_received_net != 0) { // Only print perror on actual error
-                 perror("UploadFile: recv chunk data failed");
-             }
-             // Removed: printf for disconnect
-            goto upload_error_cleanup;
+        ssize_t bytes_received = recv(conn->socket, target + conn->field_received, wanted - conn->field_received, MSG_DONTWAIT);
+        if (bytes_received == 0) {
+            if (conn->state != CONN_READ_COMMAND_LEN || conn->field_received != 0) {
+                log_info("RequestHandler: Client disconnected mid-request (socket: %d).", conn->socket);
+            }
+            connection_close(conn);
+            return false;
+        }
+        if (bytes_received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true; // Wait for more data
+            if (errno == EINTR) continue;
+            perror("recv request header failed");
+            connection_close(conn);
+            return false;
         }
-        // Note: Check for bytes_received != chunk_size is less critical with MSG_WAITALL
 
-        // 3. Write chunk data to file
-        bytes_written_total = 0;
-        while (bytes_written_total < bytes_received_net) {
-            bytes_written_now = write(file_fd, recv_buff + bytes_written_total, bytes_received_net - bytes_written_total);
-            if (bytes_written_now < 0) {
-                perror("UploadFile: write to file failed");
-                goto upload_error_cleanup; // Critical error, jump to error cleanup
+        conn->last_active = time(NULL);
+        if (conn->state == CONN_READ_COMMAND_LEN && conn->field_received == 0) conn->request_start_ns = monotonic_ns();
+        conn->field_received += bytes_received;
+        if (conn->field_received < wanted) continue;
+        conn->field_received = 0;
+
+        switch (conn->state) {
+        case CONN_READ_COMMAND_LEN:
+            if ((uint32_t)ntohl(conn->len_n) == FSS_V2_MAGIC && conn->protocol_version == 1) {
+                // A v2 client opening with its handshake; the magic was the first field
+                conn->handshake.magic = conn->len_n;
+                conn->field_received = sizeof(conn->len_n);
+                conn->state = CONN_READ_HANDSHAKE;
+                break;
             }
-            bytes_written_total += bytes_written_now;
+            conn->command_len = ntohl(conn->len_n);
+            if (conn->command_len <= 0 || conn->command_len >= sizeof(conn->command)) {
+                fprintf(stderr, "RequestHandler: Invalid command length received: %d\n", conn->command_len);
+                connection_close(conn);
+                return false;
+            }
+            conn->state = CONN_READ_COMMAND;
+            break;
+        case CONN_READ_COMMAND:
+            conn->command[conn->command_len] = '\0'; // Null-terminate
+            conn->state = CONN_READ_FILENAME_LEN;
+            break;
+        case CONN_READ_FILENAME_LEN:
+            conn->filename_len = ntohl(conn->len_n);
+            if (conn->filename_len <= 0 || conn->filename_len >= sizeof(conn->filename)) {
+                fprintf(stderr, "RequestHandler: Invalid filename length received: %d\n", conn->filename_len);
+                connection_close(conn);
+                return false;
+            }
+            conn->state = CONN_READ_FILENAME;
+            break;
+        case CONN_READ_HANDSHAKE:
+            if (connection_complete_handshake(conn) != 0) {
+                connection_close(conn);
+                return false;
+            }
+            conn->state = CONN_READ_COMMAND_LEN;
+            break;
+        case CONN_READ_FILENAME:
+            conn->filename[conn->filename_len] = '\0'; // Null-terminate
+            conn->body_len = request_body_size(conn->command, conn->flags);
+            if (conn->body_len > 0) {
+                conn->state = CONN_READ_BODY;
+                break;
+            }
+            return connection_dispatch(conn);
+        case CONN_READ_BODY:
+            return connection_dispatch(conn);
+        default:
+            break;
         }
-         // Optional: printf("Written %zd bytes to %s\n", bytes_written_total, task_args->filename);
-    } // End while(true) loop
+    }
+    return true;
+}
 
-// Normal cleanup path (after loop breaks successfully on chunk_size == 0)
-    // Removed: printf("Upload completed successfully...")
-    close(file_fd);
-    release_write_lock(control);
-    release_file_control(control);
-    close(task_args->client_socket);
-    free(task_args);
-    return NULL; // Indicate success
+// Closes connections that have sat in the header phase for -t seconds. Connections in the
+// transfer phase belong to their handler and are left to the -T timeout.
+static void loop_sweep_idle(EventLoop* loop, time_t now) {
+    if (g_config.idle_timeout_sec <= 0) return;
 
-// Error cleanup path (jumped to on error via goto)
-upload_error_cleanup:
-    fprintf(stderr, "UploadFile: Upload failed for %s.\n", task_args->filename);
-    // Ensure file is closed even on error before releasing lock/control
-    close(file_fd); // close() handles negative fd if open failed earlier
-    release_write_lock(control);
-    release_file_control(control);
-    close(task_args->client_socket);
-    free(task_args);
-    return NULL; // Indicate failure (or return specific error code)
+    Connection *conn = loop->connections;
+    while (conn != NULL) {
+        Connection *next = conn->next;
+        if (conn->state != CONN_TRANSFER && now - conn->last_active >= g_config.idle_timeout_sec) {
+            log_info("Closing idle connection (socket: %d, loop: %d)", conn->socket, loop->id);
+            connection_close(conn);
+        }
+        conn = next;
+    }
 }
 
-// Renamed parameter for clarity, now takes void* for pthread_create
-// Handles a single client connection: reads request, dispatches to worker thread.
-void* RequestHandler(void* p_client_socket){
-    int socket = *(int*)p_client_socket;
-    free(p_client_socket); // Free the dynamically allocated socket descriptor pointer passed from main
+void* EventLoopThread(void* arg) {
+    EventLoop *loop = (EventLoop*) arg;
+    struct epoll_event events[EPOLL_BATCH];
+    time_t last_sweep = time(NULL);
 
-    // Buffers for receiving command and filename parts
-    char command[32];        // Increased size
-    char filename_buff[256]; // Ensure matches ClientTaskArgs/FileAccessControl
-    int filename_len_n, filename_len;
-    int command_len_n, command_len;
-    ssize_t bytes_received; // Use ssize_t for recv return value
+    while (1) {
+        int n = epoll_wait(loop->epoll_fd, events, EPOLL_BATCH, IDLE_SWEEP_INTERVAL_SEC * 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
 
-    pthread_t worker_thread;
-    ClientTaskArgs *task_args = NULL;
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == NULL) {
+                loop_accept(loop);
+            } else if (ptr == loop) {
+                loop_drain_returned(loop);
+            } else {
+                Connection *conn = (Connection*) ptr;
+                if (events[i].events & EPOLLIN) {
+                    // Drain readable data first; recv() reports the disconnect
+                    connection_on_readable(conn);
+                } else if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+                    connection_close(conn);
+                }
+            }
+        }
+
+        time_t now = time(NULL);
+        if (now - last_sweep >= IDLE_SWEEP_INTERVAL_SEC) {
+            loop_sweep_idle(loop, now);
+            last_sweep = now;
+        }
+    }
+    return NULL;
+}
 
-    // Protocol: Receive CommandLen(int), Command(char*), FilenameLen(int), Filename(char*)
+static int event_loop_init(EventLoop* loop, int id) {
+    struct epoll_event ev;
 
-    // 1. Receive Command Length
-    bytes_received = recv(socket, &command_len_n, sizeof(int), MSG_WAITALL);
-    if (bytes_received <= 0) { // Check for error or closed connection
-        if (bytes_received == 0) printf("RequestHandler: Client disconnected before command length.\n");
-        else perror("recv command length failed");
-        close(socket);
-        return NULL;
+    memset(loop, 0, sizeof(*loop));
+    loop->id = id;
+    pthread_mutex_init(&loop->returned_mutex, NULL);
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        return -1;
     }
-    command_len = ntohl(command_len_n);
-    if (command_len <= 0 || command_len >= sizeof(command)) {
-         fprintf(stderr, "RequestHandler: Invalid command length received: %d\n", command_len);
-         close(socket);
-         return NULL;
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wake_fd < 0) {
+        perror("eventfd failed");
+        return -1;
     }
 
-    // 2. Receive Command
-    bytes_received = recv(socket, command, command_len, MSG_WAITALL);
-     if (bytes_received <= 0) {
-        if (bytes_received == 0) printf("RequestHandler: Client disconnected before command.\n");
-        else perror("recv command failed");
-        close(socket);
-        return NULL;
+    ev.events = EPOLLIN;
+    ev.data.ptr = loop;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0) {
+        perror("epoll_ctl add eventfd failed");
+        return -1;
     }
-    command[command_len] = '\0'; // Null-terminate
 
-    // 3. Receive Filename Length
-    bytes_received = recv(socket, &filename_len_n, sizeof(int), MSG_WAITALL);
-     if (bytes_received <= 0) {
-        if (bytes_received == 0) printf("RequestHandler: Client disconnected before filename length.\n");
-        else perror("recv filename length failed");
-        close(socket);
-        return NULL;
-    }
-    filename_len = ntohl(filename_len_n);
-     if (filename_len <= 0 || filename_len >= sizeof(filename_buff)) {
-         fprintf(stderr, "RequestHandler: Invalid filename length received: %d\n", filename_len);
-         close(socket);
-         return NULL;
+    // Every loop watches the shared listening socket; EPOLLEXCLUSIVE wakes only one of them per connection
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, g_listen_fd, &ev) < 0) {
+        perror("epoll_ctl add listener failed");
+        return -1;
     }
+    return 0;
+}
 
-    // 4. Receive Filename
-    bytes_received = recv(socket, filename_buff, filename_len, MSG_WAITALL);
-     if (bytes_received <= 0) {
-        if (bytes_received == 0) printf("RequestHandler: Client disconnected before filename.\n");
-        else perror("recv filename failed");
-        close(socket);
-        return NULL;
-    }
-    filename_buff[filename_len] = '\0'; // Null-terminate
+// --- End Event Loop / Connection Engine ---
+
+
+// Dispatches a fully parsed request to the worker pool.
+// Returns NULL if the request was rejected; the caller then closes the connection unless
+// conn->keep_alive says it can carry the next request.
+void* RequestHandler(Connection* conn){
+    ClientTaskArgs *task_args = NULL;
+
+    conn->keep_alive = false;
+    conn->request_count++;
 
-    printf("RequestHandler: Received request: Command='%s', Filename='%s'\n", command, filename_buff);
+    log_debug("RequestHandler: Received request: Command='%s', Filename='%s'", conn->command, conn->filename);
 
     // Prepare arguments for worker thread
     task_args = (ClientTaskArgs*)malloc(sizeof(ClientTaskArgs));
     if (task_args == NULL) {
         perror("RequestHandler: malloc ClientTaskArgs failed");
-        close(socket); // Close socket as we can't handle the request
         return NULL;
     }
-    task_args->client_socket = socket; // Pass the socket
-    strncpy(task_args->filename, filename_buff, sizeof(task_args->filename) - 1);
+    task_args->client_socket = conn->socket; // Pass the socket
+    task_args->conn = conn;
+    task_args->frame_size = conn->frame_size;
+    task_args->persistent = (conn->flags & FSS_FLAG_PERSISTENT) != 0;
+    task_args->request_id = conn->request_count;
+    task_args->keep_alive = task_args->persistent;
+    task_args->dispatched_ns = conn->dispatched_ns;
+    task_args->first_byte_pending = false;
+    task_args->is_range = false;
+    bool is_transfer = strcmp(conn->command, "download") == 0 || strcmp(conn->command, "upload") == 0;
+    task_args->compression = FSS_COMPRESS_NONE;
+    if ((conn->flags & FSS_FLAG_COMPRESS) && is_transfer) {
+        task_args->compression = ntohl(conn->body.transfer.compression);
+    }
+    task_args->checksum = (conn->flags & FSS_FLAG_CHECKSUM) && is_transfer;
+    strncpy(task_args->filename, conn->filename, sizeof(task_args->filename) - 1);
     task_args->filename[sizeof(task_args->filename) - 1] = '\0';
+    task_args->filename_hash = filename_hash(task_args->filename);
 
-
-    // 5. Dispatch based on command
-    if (strcmp(command, "download") == 0) {
-        printf("RequestHandler: Dispatching download task for %s\n", task_args->filename);
-        if (pthread_create(&worker_thread, NULL, DownLoadingFile, task_args) != 0) {
-            perror("RequestHandler: pthread_create for DownLoadingFile failed");
-            free(task_args); // Clean up allocated args
-            close(socket); // Close socket as we couldn't start handler
-        } else {
-            pthread_detach(worker_thread); // Detach thread, it will clean up itself (including task_args and socket)
-        }
-    } else if (strcmp(command, "upload") == 0) {
-         printf("RequestHandler: Dispatching upload task for %s\n", task_args->filename);
-         if (pthread_create(&worker_thread, NULL, UploadFile, task_args) != 0) {
-            perror("RequestHandler: pthread_create for UploadFile failed");
-            free(task_args);
-            close(socket);
-         } else {
-            pthread_detach(worker_thread);
-         }
+    // Dispatch based on command
+    void* (*handler)(void*);
+    if (strcmp(conn->command, "download") == 0) {
+        handler = DownLoadingFile;
+        task_args->first_byte_pending = task_args->persistent;
+    } else if (strcmp(conn->command, "range") == 0 && task_args->persistent) {
+        // Needs FSS_FLAG_PERSISTENT: without a status the client could not tell a refusal from data
+        handler = DownLoadingFile;
+        task_args->first_byte_pending = true;
+        task_args->is_range = true;
+        task_args->range_offset = be64toh(conn->body.range.offset);
+        task_args->range_length = be64toh(conn->body.range.length);
+    } else if (strcmp(conn->command, "download-delta") == 0 && task_args->persistent) {
+        // Answered like a ranged download of the whole file, so the client learns its size and version
+        handler = DownloadDelta;
+        task_args->first_byte_pending = true;
+        task_args->is_range = true;
+        task_args->range_offset = 0;
+        task_args->range_length = FSS_RANGE_TO_END;
+        task_args->body = conn->body;
+    } else if (strcmp(conn->command, "upload") == 0) {
+        handler = UploadFile;
+    } else if (strncmp(conn->command, "upload-", 7) == 0 && task_args->persistent &&
+               (handler = upload_session_handler(conn->command)) != NULL) {
+        task_args->body = conn->body;
+    } else if (strcmp(conn->command, "stats") == 0) {
+        handler = SendStats;
+    } else if (strcmp(conn->command, "locks") == 0) {
+        handler = SendLockStats;
+    } else if (strcmp(conn->command, "list") == 0 && task_args->persistent) {
+        handler = SendListing;
+        task_args->body = conn->body;
+    } else if (strcmp(conn->command, "stat") == 0 && task_args->persistent) {
+        handler = SendFileInfo;
+    } else if (strcmp(conn->command, "batch") == 0 && task_args->persistent) {
+        handler = SendBatch;
+        task_args->first_byte_pending = true;
+        task_args->body = conn->body;
     } else {
-        fprintf(stderr, "RequestHandler: Unknown command received: %s\n", command);
-        // Send error response to client?
+        fprintf(stderr, "RequestHandler: Unknown command received: %s\n", conn->command);
+        metrics_count_request(conn->command, false);
+        // Runs on the event loop, so the reply must not block; it only fails on a stuck client
+        send_response(task_args, FSS_STATUS_BAD_REQUEST, MSG_DONTWAIT);
+        conn->keep_alive = task_args->keep_alive;
         free(task_args); // Clean up allocated args
-        close(socket); // Close socket for unknown commands
+        return NULL;
     }
 
-    // RequestHandler thread finishes here. The socket and task_args are now managed
-    // by the worker thread (if created successfully) or closed/freed on error.
-    return NULL;
+    // A rejected upload's frames are already on the way; other requests leave the stream in sync
+    bool frames_follow = handler == UploadFile || handler == UploadSessionPart || handler == UploadSessionDedup ||
+                         handler == UploadSessionPatch || handler == DownloadDelta || handler == SendBatch;
+    bool names_file = handler != SendStats && handler != SendLockStats && handler != SendListing && handler != SendBatch;
+    const char *refusal = NULL;
+    if (task_args->compression != FSS_COMPRESS_NONE && task_args->compression != FSS_COMPRESS_DEFLATE &&
+        task_args->compression != FSS_COMPRESS_AUTO) {
+        refusal = "unknown compression";
+    } else if (names_file && is_sidecar_name(task_args->filename)) {
+        refusal = "a file the server keeps for itself";
+    }
+    if (refusal != NULL) {
+        log_warn("RequestHandler: refusing %s of %s: %s", conn->command, task_args->filename, refusal);
+        metrics_count_request(conn->command, false);
+        send_response(task_args, FSS_STATUS_BAD_REQUEST, MSG_DONTWAIT);
+        conn->keep_alive = task_args->keep_alive && !frames_follow;
+        free(task_args);
+        return NULL;
+    }
+
+    log_debug("RequestHandler: Queueing %s task for %s", conn->command, task_args->filename);
+    if (worker_pool_submit(&g_worker_pool, handler, task_args) != 0) {
+        fprintf(stderr, "RequestHandler: Worker queue full, rejecting %s of %s\n", conn->command, task_args->filename);
+        metrics_count_request(conn->command, true);
+        send_response(task_args, FSS_STATUS_BUSY, MSG_DONTWAIT);
+        conn->keep_alive = task_args->keep_alive && !frames_follow;
+        free(task_args);
+        return NULL;
+    }
+
+    metrics_count_request(conn->command, false);
+    return conn;
 };
 
-int main(){
-    int server_fd;
+static void print_usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [-p port] [-l event_loops] [-t idle_timeout_sec] [-T transfer_timeout_sec] [-w workers] [-q queue_capacity] [-s stats_interval_sec] [-d sendfile|pipeline|mmap] [-f max_frame_size] [-u splice|copy] [-i threads|uring] [-m snapshot|inplace|chunked] [-v error|warn|info|debug] [-c cache_mb] [-o metrics_file]\n"
+            "  -p port              TCP port to listen on (default 8080)\n"
+            "  -l event_loops       Number of epoll event loop threads (default 4)\n"
+            "  -t idle_timeout_sec  Close connections idle in the request phase (default 300, 0 = never)\n"
+            "  -T transfer_timeout  Drop a connection whose transfer makes no progress for this many seconds (default 60, 0 = never)\n"
+            "  -w workers           Transfer worker threads (default 16)\n"
+            "  -q queue_capacity    Requests that may wait for a worker before new ones are rejected (default 1024)\n"
+            "  -s stats_interval    Print worker pool stats every N seconds (default 0 = off)\n"
+            "  -d download_mode     sendfile (zero-copy, default), pipeline (reader thread + ring buffer) or mmap (send from a mapping)\n"
+            "  -f max_frame_size    Largest frame a v2 client may negotiate, 64KiB-4MiB (default 4MiB)\n"
+            "  -u upload_mode       splice (socket -> pipe -> file, default) or copy (recv + write)\n"
+            "  -i io_engine         threads (default) or uring (batched async I/O, falls back to threads if unavailable)\n"
+            "  -m storage_mode      snapshot (uploads publish a new version atomically, default), inplace (rewrite under lock)\n"
+            "                       or chunked (snapshot plus a chunk index for deduplicated uploads)\n"
+            "  -v log_level         error, warn, info (default) or debug; SIGUSR1/SIGUSR2 raise/lower it at runtime\n"
+            "  -c cache_mb          Memory for caching hot files, in MiB (default 256, 0 disables)\n"
+            "  -o metrics_file      Rewrite the metrics (as the stats command returns them) every -s seconds, 10 without -s\n",
+            prog);
+}
+
+int main(int argc, char* argv[]){
     struct sockaddr_in server_addr;
     int opt = 1;
-    int port = 8080;
+    int c;
+
+    while ((c = getopt(argc, argv, "p:l:t:T:w:q:s:d:f:u:i:m:v:c:o:h")) != -1) {
+        switch (c) {
+        case 'p': g_config.port = atoi(optarg); break;
+        case 'l': g_config.event_loops = atoi(optarg); break;
+        case 't': g_config.idle_timeout_sec = atoi(optarg); break;
+        case 'T': g_config.transfer_timeout_sec = atoi(optarg); break;
+        case 'w': g_config.workers = atoi(optarg); break;
+        case 'q': g_config.queue_capacity = atoi(optarg); break;
+        case 's': g_config.stats_interval_sec = atoi(optarg); break;
+        case 'd':
+            if (strcmp(optarg, "sendfile") == 0) g_config.download_mode = DOWNLOAD_MODE_SENDFILE;
+            else if (strcmp(optarg, "pipeline") == 0) g_config.download_mode = DOWNLOAD_MODE_PIPELINE;
+            else if (strcmp(optarg, "mmap") == 0) g_config.download_mode = DOWNLOAD_MODE_MMAP;
+            else { print_usage(argv[0]); exit(EXIT_FAILURE); }
+            break;
+        case 'u':
+            if (strcmp(optarg, "splice") == 0) g_config.upload_mode = UPLOAD_MODE_SPLICE;
+            else if (strcmp(optarg, "copy") == 0) g_config.upload_mode = UPLOAD_MODE_COPY;
+            else { print_usage(argv[0]); exit(EXIT_FAILURE); }
+            break;
+        case 'i':
+            if (strcmp(optarg, "threads") == 0) g_config.io_engine = IO_ENGINE_THREADS;
+            else if (strcmp(optarg, "uring") == 0) g_config.io_engine = IO_ENGINE_URING;
+            else { print_usage(argv[0]); exit(EXIT_FAILURE); }
+            break;
+        case 'm':
+            if (strcmp(optarg, "snapshot") == 0) g_config.storage_mode = STORAGE_MODE_SNAPSHOT;
+            else if (strcmp(optarg, "inplace") == 0) g_config.storage_mode = STORAGE_MODE_INPLACE;
+            else if (strcmp(optarg, "chunked") == 0) g_config.storage_mode = STORAGE_MODE_CHUNKED;
+            else { print_usage(argv[0]); exit(EXIT_FAILURE); }
+            break;
+        case 'v': {
+            int level = log_parse_level(optarg);
+            if (level < 0) { print_usage(argv[0]); exit(EXIT_FAILURE); }
+            atomic_store(&g_log_level, level);
+            break;
+        }
+        case 'c': g_config.cache_mb = strtoul(optarg, NULL, 10); break;
+        case 'o': g_config.metrics_file = optarg; break;
+        case 'f': g_config.max_frame_size = fss_clamp_frame_size(strtoul(optarg, NULL, 10)); break;
+        default:
+            print_usage(argv[0]);
+            exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (g_config.port <= 0 || g_config.port > 65535 || g_config.event_loops <= 0 ||
+        g_config.workers <= 0 || g_config.queue_capacity <= 0) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // A client that disconnects mid-download must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    if (install_sigbus_guard() != 0) {
+        perror("sigaction SIGBUS failed");
+    }
+    log_init();
+    fss_crc32c_init();
+
+    // Each connection holds a descriptor, so allow as many as the hard limit permits
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+        nofile.rlim_cur = nofile.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &nofile) != 0) {
+            perror("setrlimit RLIMIT_NOFILE failed");
+        }
+    }
 
     // Create server socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == -1) {
+    g_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (g_listen_fd == -1) {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
     }
 
      // Optional: Allow reuse of address
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) { // Removed SO_REUSEPORT for broader compatibility
+    if (setsockopt(g_listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) { // Removed SO_REUSEPORT for broader compatibility
         perror("setsockopt failed");
-        close(server_fd);
+        close(g_listen_fd);
         exit(EXIT_FAILURE);
     }
 
     // Prepare server address structure
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY; // Listen on all available interfaces
-    server_addr.sin_port = htons(port);
+    server_addr.sin_port = htons(g_config.port);
 
     // Bind socket to address and port
-    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+    if (bind(g_listen_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("Bind failed");
-        close(server_fd);
+        close(g_listen_fd);
         exit(EXIT_FAILURE);
     }
 
     // Listen for incoming connections
-    if (listen(server_fd, 10) < 0) { // Increased backlog queue size
+    if (listen(g_listen_fd, SOMAXCONN) < 0) {
         perror("Listen failed");
-        close(server_fd);
+        close(g_listen_fd);
         exit(EXIT_FAILURE);
     }
 
-    printf("Server listening on port %d\n", port);
+    if (g_config.io_engine == IO_ENGINE_URING && uring_engine_start() == 0) {
+        log_info("io_uring engine started (%d registered buffers of %d KiB)", URING_SLOTS, URING_SLOT_PAYLOAD / 1024);
+        upload_commit_start();
+    }
 
-    // Main accept loop
-    while(1) {
-        struct sockaddr_in client_addr;
-        socklen_t client_addr_len = sizeof(client_addr);
-        int client_socket;
+    if (g_config.cache_mb > 0 && content_cache_init(g_config.cache_mb * 1024 * 1024) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (g_config.storage_mode == STORAGE_MODE_CHUNKED && chunk_store_init() != 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (meta_index_init() != 0) {
+        exit(EXIT_FAILURE);
+    }
 
-        // Accept new connection
-        client_socket = accept(server_fd, (struct sockaddr *)&client_addr, &client_addr_len);
-        if (client_socket < 0) {
-            perror("Accept failed");
-            continue; // Continue listening for other connections
+    if (worker_pool_init(&g_worker_pool, g_config.workers, g_config.queue_capacity) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    pthread_t reaper_thread;
+    if (pthread_create(&reaper_thread, NULL, UploadSessionReaper, NULL) == 0) {
+        pthread_detach(reaper_thread);
+    }
+    g_metrics_start = time(NULL);
+    if (g_config.stats_interval_sec > 0 || g_config.metrics_file != NULL) {
+        pthread_t reporter_thread;
+        if (pthread_create(&reporter_thread, NULL, StatsReporterThread, NULL) == 0) {
+            pthread_detach(reporter_thread);
         }
+    }
 
-        // Convert client IP to string for logging
-        char client_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-        printf("Accepted connection from %s:%d (socket: %d)\n", client_ip, ntohs(client_addr.sin_port), client_socket);
-
-        // Create a thread to handle the client request
-        pthread_t handler_thread;
-        // Dynamically allocate memory for the client socket descriptor to pass to the thread
-        int *p_client_socket = malloc(sizeof(int));
-        if (p_client_socket == NULL) {
-            perror("Failed to allocate memory for client socket pointer");
-            close(client_socket); // Close the accepted socket
-            continue; // Continue listening
-        }
-        *p_client_socket = client_socket;
-
-        if (pthread_create(&handler_thread, NULL, RequestHandler, p_client_socket) != 0) {
-            perror("Failed to create handler thread");
-            free(p_client_socket); // Free the allocated memory
-            close(client_socket); // Close the accepted socket
-        } else {
-             // Detach the handler thread so it cleans up automatically on exit
-             // The RequestHandler is responsible for freeing p_client_socket
-             pthread_detach(handler_thread);
-             printf("Dispatched handler thread for socket %d\n", client_socket);
+    // Start the event loops; the main thread joins them
+    g_event_loops = calloc(g_config.event_loops, sizeof(EventLoop));
+    if (g_event_loops == NULL) {
+        perror("Failed to allocate event loops");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < g_config.event_loops; i++) {
+        if (event_loop_init(&g_event_loops[i], i) != 0 ||
+            pthread_create(&g_event_loops[i].thread, NULL, EventLoopThread, &g_event_loops[i]) != 0) {
+            fprintf(stderr, "Failed to start event loop %d\n", i);
+            exit(EXIT_FAILURE);
         }
-    } // End of while(1) accept loop
+    }
 
-    // --- Cleanup (won't be reached in this infinite loop) ---
+    log_info("Server listening on port %d (%d event loops, %d workers, queue capacity %d)",
+           g_config.port, g_config.event_loops, g_config.workers, g_config.queue_capacity);
+
+    for (int i = 0; i < g_config.event_loops; i++) {
+        pthread_join(g_event_loops[i].thread, NULL);
+    }
+
+    // --- Cleanup (only reached if every event loop fails) ---
     // TODO: Implement graceful shutdown (e.g., signal handling) to reach here
-    printf("Server shutting down.\n");
-    close(server_fd); // Close listening socket
-    // TODO: Clean up the global file list (destroy mutexes/conds, free nodes)
-    // pthread_mutex_destroy(&g_file_list_mutex);
-    // ... iterate g_file_list_head and destroy/free ...
+    log_info("Server shutting down.");
+    log_flush();
+    close(g_listen_fd); // Close listening socket
+    // TODO: Clean up the file control registry (destroy shard mutexes, free remaining entries)
 
     return 0;
-}
\ No newline at end of file
+}